@@ -0,0 +1,71 @@
+# Cold-start loading of a GPT-2-style checkpoint for one tensor-parallel rank: torch.load of the
+# whole checkpoint + remap + shard + load_state_dict, vs. memory-mapping the safetensors file and
+# remapping / sharding lazily (GPTPreTrainedModel.from_pretrained(..., use_mmap=True)).
+# Each load runs in a fresh process, after evicting the checkpoint from the page cache, and reports
+# the wall-clock time and the peak RSS of the process (which includes the model itself).
+import multiprocessing
+import os
+import resource
+import tempfile
+import time
+
+import torch
+
+from transformers import GPT2Config
+from transformers.models.gpt2.modeling_gpt2 import GPT2LMHeadModel as GPT2LMHeadModelHF
+
+from flash_attn.models.gpt import GPTLMHeadModel, remap_state_dict_hf_gpt2, shard_state_dict_tp
+from flash_attn.utils.pretrained import mmap_state_dict, save_safetensors, load_lazy_state_dict
+
+
+config = GPT2Config(n_embd=2048, n_head=16, n_layer=24, vocab_size=50257)
+config.pad_vocab_size_multiple = 8
+world_size = 8
+rank = 3
+dtype = torch.float16
+
+
+def drop_page_cache(path):
+    # Dirty pages (the file was just written) are not evicted: write them back first
+    with open(path, 'r+b') as f:
+        os.fsync(f.fileno())
+        os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+
+
+def load(path, use_mmap):
+    model = GPTLMHeadModel(config, dtype=dtype, device='meta').to_empty(device='cpu')
+    torch.set_num_threads(os.cpu_count())
+    start = time.time()
+    if use_mmap:
+        state_dict = remap_state_dict_hf_gpt2(mmap_state_dict(path), config)
+    else:
+        state_dict = {k: v.to(dtype) for k, v in torch.load(path, map_location='cpu').items()}
+        state_dict = remap_state_dict_hf_gpt2(state_dict, config)
+    if world_size > 1:
+        state_dict = shard_state_dict_tp(state_dict, config, world_size, rank)
+    if use_mmap:
+        load_lazy_state_dict(model, state_dict)
+    else:
+        model.load_state_dict(state_dict)
+    elapsed = time.time() - start
+    # ru_maxrss is in KB on Linux
+    return elapsed, resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 2 ** 20
+
+
+if __name__ == '__main__':
+    ctx = multiprocessing.get_context('spawn')
+    with tempfile.TemporaryDirectory() as tmpdir:
+        state_dict = GPT2LMHeadModelHF(config).transformer.state_dict()
+        bin_path = os.path.join(tmpdir, 'pytorch_model.bin')
+        safetensors_path = os.path.join(tmpdir, 'model.safetensors')
+        torch.save(state_dict, bin_path)
+        save_safetensors(state_dict, safetensors_path)
+        del state_dict
+        print(f'Checkpoint: {os.path.getsize(safetensors_path) / 2 ** 30:.2f}GB fp32, '
+              f'loading rank {rank} of {world_size} in {dtype}')
+        for name, path, use_mmap in [('torch.load', bin_path, False),
+                                     ('mmap', safetensors_path, True)]:
+            drop_page_cache(path)
+            with ctx.Pool(1) as pool:
+                elapsed, peak_rss = pool.apply(load, (path, use_mmap))
+            print(f'{name}: {elapsed:.2f}s, peak RSS {peak_rss:.2f}GB')
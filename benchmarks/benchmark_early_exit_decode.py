@@ -0,0 +1,76 @@
+# Decoding a batch whose sequences have different output lengths: the attention of every step runs
+# on all the rows, vs. skipping the finished rows with the `finished` flag, vs. also compacting the
+# batch (compact_batch) once half of the rows have finished.
+import time
+
+import torch
+
+from flash_attn.utils.generation import InferenceParams, allocate_kv_cache, compact_batch
+
+import ft_attention
+
+
+torch.manual_seed(0)
+device = 'cuda' if torch.cuda.is_available() else 'cpu'
+dtype = torch.float16 if device == 'cuda' else torch.float32
+batch_size = 32
+nheads = 32
+headdim = 128
+nlayers = 4
+prompt_len = 128
+max_new_tokens = 512
+# Geometric-ish output lengths: most sequences are short, a few run to max_new_tokens
+output_lengths = torch.clamp(torch.distributions.Exponential(1 / 128).sample((batch_size,)),
+                             1, max_new_tokens).long().tolist()
+
+
+def synchronize():
+    if device == 'cuda':
+        torch.cuda.synchronize()
+
+
+def run(use_finished, compaction_threshold=0.0):
+    inference_params = InferenceParams(max_sequence_len=prompt_len + max_new_tokens,
+                                       max_batch_size=batch_size, fused_ft_kernel=True)
+    inference_params.key_value_memory_dict = allocate_kv_cache(
+        batch_size, prompt_len + max_new_tokens, nheads, headdim, nlayers, device, dtype
+    )
+    inference_params.finished = torch.zeros(batch_size, dtype=torch.bool, device=device)
+    remaining = torch.tensor(output_lengths, device=device)
+    cur_batch_size = batch_size
+    synchronize()
+    start = time.time()
+    for step in range(max_new_tokens):
+        timestep = prompt_len + step
+        q, k, v = torch.randn(3, cur_batch_size, nheads, headdim, device=device,
+                              dtype=dtype).unbind(0)
+        for layer_idx in range(nlayers):
+            k_cache, v_cache = inference_params.key_value_memory_dict[layer_idx]
+            ft_attention.single_query_attention(
+                q, k, v, k_cache[:cur_batch_size], v_cache[:cur_batch_size], None, timestep,
+                finished_=inference_params.finished[:cur_batch_size] if use_finished else None
+            )
+        remaining -= 1
+        inference_params.finished[:cur_batch_size] = remaining <= 0
+        num_active = cur_batch_size - inference_params.finished[:cur_batch_size].sum().item()
+        if num_active == 0:
+            break
+        if num_active <= compaction_threshold * cur_batch_size:
+            keep = (~inference_params.finished[:cur_batch_size]).nonzero().squeeze(-1)
+            compact_batch(inference_params, keep)
+            remaining = remaining[keep]
+            cur_batch_size = num_active
+    synchronize()
+    return time.time() - start
+
+
+total_tokens = sum(output_lengths)
+print(f'batch_size={batch_size}, output lengths: min {min(output_lengths)}, '
+      f'max {max(output_lengths)}, mean {total_tokens / batch_size:.0f}')
+run(use_finished=False)  # Warmup
+for desc, kwargs in [('All rows', dict(use_finished=False)),
+                     ('Skip finished rows', dict(use_finished=True)),
+                     ('Skip finished rows + compaction', dict(use_finished=True,
+                                                              compaction_threshold=0.5))]:
+    t = run(**kwargs)
+    print(f'{desc}: {t * 1e3:.0f}ms, {total_tokens / t:.0f} tokens/s')
@@ -0,0 +1,85 @@
+# Run with:
+# torchrun --nproc_per_node=4 benchmarks/benchmark_grad_compression.py
+# Data-parallel training of a small GPT on CPU (gloo) with each DDP communication hook of
+# training/src/distributed/ddp_comm_hooks.py: bytes sent per rank per step vs. the loss reached
+# after the same number of steps. The data is sampled from a fixed random bigram distribution, so
+# that the loss can go down to its entropy.
+import os
+import sys
+import time
+
+import torch
+import torch.nn.functional as F
+from torch.nn.parallel import DistributedDataParallel as DDP
+
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'training'))
+from src.distributed.ddp_comm_hooks import (fp16_compress_hook, int8_compress_hook,
+                                            Int8CompressState, powersgd_hook, PowerSGDState,
+                                            _allreduce_bytes)
+
+
+torch.distributed.init_process_group(backend='gloo', init_method='env://')
+group = torch.distributed.group.WORLD
+world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+torch.set_num_threads(max(1, os.cpu_count() // world_size))
+
+config = GPT2Config(n_embd=256, n_head=4, n_layer=4, vocab_size=512, n_positions=128)
+batch_size, seqlen, num_steps = 8, 128, 200
+
+# Same bigram distribution on all ranks, different samples
+bigram_logits = torch.randn(config.vocab_size, config.vocab_size,
+                            generator=torch.Generator().manual_seed(0)) * 3
+bigram_probs = bigram_logits.softmax(dim=-1)
+entropy = -(bigram_probs * bigram_probs.log()).sum(dim=-1).mean().item()
+
+
+def sample_batch(generator):
+    tokens = [torch.randint(0, config.vocab_size, (batch_size,), generator=generator)]
+    for _ in range(seqlen):
+        tokens.append(torch.multinomial(bigram_probs[tokens[-1]], 1, generator=generator)[:, 0])
+    return torch.stack(tokens, dim=1)
+
+
+def train(hook_name):
+    torch.random.manual_seed(0)
+    model = DDP(GPTLMHeadModel(config), process_group=group)
+    numel = sum(p.numel() for p in model.parameters())
+    state = None
+    if hook_name == 'fp16':
+        model.register_comm_hook(group, fp16_compress_hook)
+    elif hook_name == 'int8':
+        state = Int8CompressState(group, block_size=256)
+        model.register_comm_hook(state, int8_compress_hook)
+    elif hook_name.startswith('powersgd'):
+        state = PowerSGDState(group, matrix_approximation_rank=int(hook_name.split('_')[1]),
+                              start_iter=10)
+        model.register_comm_hook(state, powersgd_hook)
+    optimizer = torch.optim.AdamW(model.parameters(), lr=1e-3)
+    generator = torch.Generator().manual_seed(rank + 1)
+    start = time.time()
+    for _ in range(num_steps):
+        batch = sample_batch(generator)
+        logits = model(batch[:, :-1]).logits
+        loss = F.cross_entropy(logits.flatten(0, 1), batch[:, 1:].flatten())
+        optimizer.zero_grad()
+        loss.backward()
+        optimizer.step()
+    elapsed = time.time() - start
+    loss = loss.detach()
+    torch.distributed.all_reduce(loss, group=group)
+    if state is not None:
+        bytes_per_step = state.bytes_sent / num_steps
+    else:
+        bytes_per_step = _allreduce_bytes(numel, 2 if hook_name == 'fp16' else 4, world_size)
+    if rank == 0:
+        print(f'{hook_name:>10}: {bytes_per_step / 2**20:.2f} MiB sent per rank per step, '
+              f'loss {loss.item() / world_size:.3f} after {num_steps} steps '
+              f'(entropy {entropy:.3f}), {elapsed / num_steps * 1000:.0f}ms / step')
+
+
+for hook_name in ['none', 'fp16', 'int8', 'powersgd_1', 'powersgd_4']:
+    train(hook_name)
@@ -0,0 +1,56 @@
+# Decoding with per-sample IA3 adapters: one batch mixing all the adapters vs. splitting the batch
+# by adapter (one single_query_attention call per adapter).
+import torch
+
+from flash_attn.utils.benchmark import benchmark_forward
+
+import ft_attention
+
+
+torch.manual_seed(0)
+repeats = 30
+device = 'cuda' if torch.cuda.is_available() else 'cpu'
+dtype = torch.float16 if device == 'cuda' else torch.float32
+nheads = 32
+headdim = 128
+max_seqlen = 2048
+seqlen = 1024
+num_tasks = 8
+packsize = 4 if dtype == torch.float32 else 8
+
+ia3_key_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+ia3_value_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+
+
+def decode_mixed(q, k, v, k_cache, v_cache, lengths, ia3_tasks):
+    return ft_attention.single_query_attention(
+        q, k, v, k_cache, v_cache, lengths, seqlen, ia3_tasks_=ia3_tasks,
+        ia3_key_weights_=ia3_key_weights, ia3_value_weights_=ia3_value_weights
+    )
+
+
+def decode_split(groups):
+    return [ft_attention.single_query_attention(
+        q, k, v, k_cache, v_cache, lengths, seqlen, ia3_tasks_=ia3_tasks,
+        ia3_key_weights_=ia3_key_weights, ia3_value_weights_=ia3_value_weights
+    ) for q, k, v, k_cache, v_cache, lengths, ia3_tasks in groups]
+
+
+for batch_size in [8, 16, 32, 64]:
+    q, k, v = torch.randn(3, batch_size, nheads, headdim, device=device, dtype=dtype).unbind(0)
+    k_cache = torch.randn(batch_size, nheads, headdim // packsize, max_seqlen, packsize,
+                          device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    lengths = torch.full((batch_size,), seqlen, dtype=torch.int32, device=device)
+    ia3_tasks = torch.arange(batch_size, dtype=torch.int32, device=device) % num_tasks
+    groups = []
+    for task in range(num_tasks):
+        idx = (ia3_tasks == task).nonzero().squeeze(-1)
+        groups.append((q[idx], k[idx], v[idx], k_cache[idx], v_cache[idx], lengths[idx],
+                       ia3_tasks[idx]))
+    _, m_mixed = benchmark_forward(decode_mixed, q, k, v, k_cache, v_cache, lengths, ia3_tasks,
+                                   repeats=repeats, verbose=False)
+    _, m_split = benchmark_forward(decode_split, groups, repeats=repeats, verbose=False)
+    print(f'batch_size={batch_size}, {num_tasks} adapters: '
+          f'mixed batch {m_mixed.mean * 1e3:.3f}ms ({batch_size / m_mixed.mean:.0f} tokens/s), '
+          f'split by adapter {m_split.mean * 1e3:.3f}ms ({batch_size / m_split.mean:.0f} tokens/s)')
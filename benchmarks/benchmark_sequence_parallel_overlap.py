@@ -0,0 +1,56 @@
+# Run with:
+# torchrun --nproc_per_node=4 benchmarks/benchmark_sequence_parallel_overlap.py
+# Forward + backward of a sequence-parallel ColumnParallelLinear -> RowParallelLinear pair (the
+# MLP of a tensor-parallel block) on CPU, with the collectives issued in one piece (num_chunks=1)
+# vs. split into chunks and overlapped with the GEMMs. The exposed communication time is the
+# total time minus the time of the same GEMMs without any communication.
+import os
+import time
+
+import torch
+import torch.nn.functional as F
+
+from flash_attn.ops.fused_dense import ColumnParallelLinear, RowParallelLinear
+from flash_attn.utils.distributed import init_shm_backend
+
+
+def benchmark(fn, repeats=10):
+    fn()
+    torch.distributed.barrier()
+    start = time.time()
+    for _ in range(repeats):
+        fn()
+    torch.distributed.barrier()
+    return (time.time() - start) / repeats
+
+
+torch.distributed.init_process_group(backend='gloo', init_method='env://')
+group = torch.distributed.group.WORLD
+world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+if os.environ.get('USE_SHM', '0') == '1':
+    init_shm_backend(group)
+torch.set_num_threads(max(1, os.cpu_count() // world_size))
+torch.random.manual_seed(0)
+
+batch_size, seqlen, hidden_dim = 4, 2048, 1024
+x = torch.randn(batch_size * seqlen // world_size, hidden_dim, requires_grad=True)
+x_full = torch.randn(batch_size * seqlen, hidden_dim, requires_grad=True)
+
+for num_chunks in [1, 4]:
+    fc1 = ColumnParallelLinear(hidden_dim, 4 * hidden_dim, group, num_chunks=num_chunks)
+    fc2 = RowParallelLinear(4 * hidden_dim, hidden_dim, group, num_chunks=num_chunks)
+
+    def parallel():
+        fc2(F.gelu(fc1(x), approximate='tanh')).sum().backward()
+
+    def compute_only():
+        # Same GEMMs on the already-gathered input, without any collective
+        out = F.linear(F.gelu(F.linear(x_full, fc1.weight, fc1.bias), approximate='tanh'),
+                       fc2.weight, fc2.bias)
+        out.sum().backward()
+
+    total = benchmark(parallel)
+    compute = benchmark(compute_only)
+    if rank == 0:
+        print(f'num_chunks={num_chunks}: total {total * 1000:.1f}ms, compute {compute * 1000:.1f}ms, '
+              f'exposed communication {(total - compute) * 1000:.1f}ms')
@@ -0,0 +1,53 @@
+# Verifying the draft tokens of speculative decoding: one multi_token_attention call for the
+# num_draft + 1 tokens of each sequence (one read of the KV cache), vs. one single_query_attention
+# call per token. Throughput is in accepted tokens/s, with each draft token accepted with
+# probability acceptance_rate (until the first rejection).
+import torch
+
+from flash_attn.utils.benchmark import benchmark_forward
+
+import ft_attention
+
+
+torch.manual_seed(0)
+repeats = 30
+device = 'cpu'
+dtype = torch.float32
+batch_size = 8
+nheads = 32
+headdim = 128
+max_seqlen = 2048
+seqlen = 1024
+acceptance_rate = 0.8
+packsize = 4 if dtype == torch.float32 else 8
+
+
+def verify_multi_token(q, k, v, k_cache, v_cache, lengths):
+    return ft_attention.multi_token_attention(q, k, v, k_cache, v_cache, lengths, 0)
+
+
+def verify_single_query(q, k, v, k_cache, v_cache, lengths):
+    return [ft_attention.single_query_attention(q[:, i], k[:, i], v[:, i], k_cache, v_cache,
+                                                lengths + i, 0)
+            for i in range(q.shape[1])]
+
+
+k_cache = torch.randn(batch_size, nheads, headdim // packsize, max_seqlen, packsize,
+                      device=device, dtype=dtype)
+v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+lengths = torch.full((batch_size,), seqlen, dtype=torch.int32, device=device)
+for num_draft in [1, 3, 7, 15]:
+    # Expected number of tokens per verification step: the accepted drafts + the token sampled
+    # from the target model
+    tokens_per_step = sum(acceptance_rate ** i for i in range(num_draft + 1))
+    q, k, v = torch.randn(3, batch_size, num_draft + 1, nheads, headdim, device=device,
+                          dtype=dtype).unbind(0)
+    _, m_multi = benchmark_forward(verify_multi_token, q, k, v, k_cache, v_cache, lengths,
+                                   repeats=repeats, verbose=False)
+    _, m_single = benchmark_forward(verify_single_query, q, k, v, k_cache, v_cache, lengths,
+                                    repeats=repeats, verbose=False)
+    print(f'{num_draft} draft tokens, {tokens_per_step:.2f} tokens/step: '
+          f'multi_token_attention {m_multi.mean * 1e3:.3f}ms '
+          f'({batch_size * tokens_per_step / m_multi.mean:.0f} accepted tokens/s), '
+          f'single_query_attention x {num_draft + 1} {m_single.mean * 1e3:.3f}ms '
+          f'({batch_size * tokens_per_step / m_single.mean:.0f} accepted tokens/s)')
@@ -0,0 +1,156 @@
+#include <torch/extension.h>
+#include <pybind11/stl.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "checkpoint_loader_cpu.h"
+#include "mmap_file.h"
+
+using checkpoint_loader::MmapFile;
+
+namespace {
+
+// Element type of a safetensors dtype code.
+at::ScalarType scalar_type_from_code(const std::string &code) {
+    if (code == "F64") { return at::kDouble; }
+    if (code == "F32") { return at::kFloat; }
+    if (code == "F16") { return at::kHalf; }
+    if (code == "BF16") { return at::kBFloat16; }
+    if (code == "I64") { return at::kLong; }
+    if (code == "I32") { return at::kInt; }
+    if (code == "I16") { return at::kShort; }
+    if (code == "I8") { return at::kChar; }
+    if (code == "U8") { return at::kByte; }
+    if (code == "BOOL") { return at::kBool; }
+    TORCH_CHECK(false, "checkpoint_loader: unsupported dtype ", code);
+}
+
+bool is_floating_16_32(at::ScalarType t) {
+    return t == at::kFloat || t == at::kHalf || t == at::kBFloat16;
+}
+
+// Calls f with a value of the C++ type of t, one of fp32, fp16 and bf16.
+template <typename F>
+void dispatch_floating_16_32(at::ScalarType t, const F &f) {
+    if (t == at::kFloat) {
+        f(float{});
+    } else if (t == at::kHalf) {
+        f(at::Half{});
+    } else {
+        f(at::BFloat16{});
+    }
+}
+
+// MADV_WILLNEED on the pages of the view at byte offset (sizes and strides in elements), whose
+// last byte is before end. The dimensions are taken in source order (by decreasing stride), so a
+// transposed view (e.g. the Conv1D weights of GPT-2, loaded through .t()) is handled like the
+// tensor it was taken from: the whole span if the view covers it, otherwise each contiguous run of
+// its innermost source dimensions (e.g. each row of a column shard), so that a rank doesn't read
+// ahead the shards of the other ranks. If the runs are smaller than a page, most of the pages of
+// the span are read anyway and the whole span is advised.
+void advise_view(const MmapFile &file, int64_t offset, int64_t end, int64_t element_size,
+                 const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides) {
+    std::vector<int> dims;
+    for (int d = 0; d < int(sizes.size()); ++d) {
+        if (sizes[d] != 1) { dims.push_back(d); }
+    }
+    std::stable_sort(dims.begin(), dims.end(),
+                     [&](int a, int b) { return strides[a] > strides[b]; });
+    int64_t run = 1;
+    int i = int(dims.size()) - 1;
+    for (; i >= 0; --i) {
+        if (strides[dims[i]] != run) { break; }
+        run *= sizes[dims[i]];
+    }
+    const int64_t run_bytes = run * element_size;
+    if (i < 0 || run_bytes < ::sysconf(_SC_PAGESIZE)) {
+        file.advise(offset, end - offset, MADV_WILLNEED);
+        return;
+    }
+    // Iterate over the indices of the outer source dimensions dims[0..i]
+    std::vector<int64_t> index(i + 1, 0);
+    while (true) {
+        int64_t start = 0;
+        for (int k = 0; k <= i; ++k) { start += index[k] * strides[dims[k]]; }
+        file.advise(offset + start * element_size, run_bytes, MADV_WILLNEED);
+        int k = i;
+        for (; k >= 0; --k) {
+            if (++index[k] < sizes[dims[k]]) { break; }
+            index[k] = 0;
+        }
+        if (k < 0) { return; }
+    }
+}
+
+}  // namespace
+
+// out = the tensor of dtype `dtype` (safetensors code) at byte `offset` of `file`, viewed with
+// sizes and strides (in elements), converted to out.dtype(). Only the pages of the view are read.
+void strided_copy(const MmapFile &file, int64_t offset, const std::string &dtype,
+                  std::vector<int64_t> sizes, std::vector<int64_t> strides, at::Tensor out) {
+    TORCH_CHECK(!file.closed(), "strided_copy: ", file.path(), " is closed");
+    TORCH_CHECK(!out.is_cuda(), "strided_copy only has a CPU implementation");
+    TORCH_CHECK(out.is_contiguous());
+    TORCH_CHECK(sizes.size() == strides.size(), "strided_copy: sizes and strides must have the same length");
+    const at::ScalarType src_type = scalar_type_from_code(dtype);
+    const at::ScalarType dst_type = out.scalar_type();
+    TORCH_CHECK(src_type == dst_type || (is_floating_16_32(src_type) && is_floating_16_32(dst_type)),
+                "strided_copy: cannot convert ", dtype, " to ", dst_type);
+    const int64_t element_size = c10::elementSize(src_type);
+    TORCH_CHECK(offset >= 0 && offset % element_size == 0, "strided_copy: misaligned offset");
+    int64_t numel = 1, last_element = 0;
+    for (size_t d = 0; d < sizes.size(); ++d) {
+        TORCH_CHECK(sizes[d] >= 0 && strides[d] >= 0, "strided_copy: negative size or stride");
+        numel *= sizes[d];
+        last_element += (sizes[d] - 1) * strides[d];
+    }
+    TORCH_CHECK(out.numel() == numel, "strided_copy: out must have prod(sizes) elements");
+    if (numel == 0) { return; }
+    const int64_t end = offset + (last_element + 1) * element_size;
+    TORCH_CHECK(end <= file.size(), "strided_copy: the view goes past the end of ", file.path());
+
+    advise_view(file, offset, end, element_size, sizes, strides);
+    const void *src = file.data() + offset;
+    py::gil_scoped_release release;
+    if (src_type == dst_type) {
+        switch (element_size) {
+            case 1: checkpoint_loader::strided_copy_raw_cpu<1>(src, sizes, strides, out.data_ptr()); break;
+            case 2: checkpoint_loader::strided_copy_raw_cpu<2>(src, sizes, strides, out.data_ptr()); break;
+            case 4: checkpoint_loader::strided_copy_raw_cpu<4>(src, sizes, strides, out.data_ptr()); break;
+            default: checkpoint_loader::strided_copy_raw_cpu<8>(src, sizes, strides, out.data_ptr()); break;
+        }
+        return;
+    }
+    dispatch_floating_16_32(src_type, [&](auto src_tag) {
+        using src_t = decltype(src_tag);
+        dispatch_floating_16_32(dst_type, [&](auto dst_tag) {
+            using dst_t = decltype(dst_tag);
+            checkpoint_loader::strided_copy_cpu<src_t, dst_t>(
+                static_cast<const src_t *>(src), sizes, strides, static_cast<dst_t *>(out.data_ptr()));
+        });
+    });
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<MmapFile, std::shared_ptr<MmapFile>>(m, "MmapFile")
+        .def(py::init<const std::string &>(), py::arg("path"))
+        .def_property_readonly("size", &MmapFile::size)
+        .def_property_readonly("path", &MmapFile::path)
+        .def_property_readonly("closed", &MmapFile::closed)
+        .def("read", [](const MmapFile &file, int64_t offset, int64_t length) {
+            TORCH_CHECK(!file.closed(), "MmapFile.read: ", file.path(), " is closed");
+            TORCH_CHECK(offset >= 0 && length >= 0 && offset + length <= file.size(),
+                        "MmapFile.read: out of bounds");
+            return py::bytes(reinterpret_cast<const char *>(file.data() + offset), length);
+        }, py::arg("offset"), py::arg("length"), "Copy bytes out of the mapping, e.g. the header")
+        .def("close", &MmapFile::close);
+    m.def("strided_copy", &strided_copy, py::arg("file"), py::arg("offset"), py::arg("dtype"),
+          py::arg("sizes"), py::arg("strides"), py::arg("out"),
+          "Copy a strided view of a tensor in a memory-mapped file, converting its dtype");
+}
@@ -0,0 +1,92 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "checkpoint_loader_cpu.h"
+
+namespace checkpoint_loader {
+
+namespace {
+
+template <int kSize> struct Bits;
+template <> struct Bits<1> { using type = uint8_t; };
+template <> struct Bits<2> { using type = uint16_t; };
+template <> struct Bits<4> { using type = uint32_t; };
+template <> struct Bits<8> { using type = uint64_t; };
+
+// Calls copy_row(src_offset, dst_offset, inner_size, inner_stride) for each row of the innermost
+// dimension, in parallel.
+template <typename CopyRow>
+void for_each_row(const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides,
+                  const CopyRow &copy_row) {
+    const int64_t ndim = sizes.size();
+    if (ndim == 0) {
+        copy_row(0, 0, 1, 1);
+        return;
+    }
+    int64_t num_rows = 1;
+    for (int64_t d = 0; d < ndim - 1; ++d) { num_rows *= sizes[d]; }
+    const int64_t inner_size = sizes[ndim - 1], inner_stride = strides[ndim - 1];
+    if (num_rows == 0 || inner_size == 0) { return; }
+    const int64_t grain = std::max<int64_t>(1, kChunkElements / inner_size);
+    at::parallel_for(0, num_rows, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; ++row) {
+            int64_t src_offset = 0;
+            for (int64_t d = ndim - 2, r = row; d >= 0; --d) {
+                src_offset += (r % sizes[d]) * strides[d];
+                r /= sizes[d];
+            }
+            copy_row(src_offset, row * inner_size, inner_size, inner_stride);
+        }
+    });
+}
+
+}  // namespace
+
+template <typename Tsrc, typename Tdst>
+void strided_copy_cpu(const Tsrc *src, const std::vector<int64_t> &sizes,
+                      const std::vector<int64_t> &strides, Tdst *dst) {
+    for_each_row(sizes, strides, [&](int64_t src_offset, int64_t dst_offset, int64_t n, int64_t stride) {
+        const Tsrc *s = src + src_offset;
+        Tdst *o = dst + dst_offset;
+        for (int64_t i = 0; i < n; ++i) { o[i] = static_cast<Tdst>(static_cast<float>(s[i * stride])); }
+    });
+}
+
+template <int kElementSize>
+void strided_copy_raw_cpu(const void *src, const std::vector<int64_t> &sizes,
+                          const std::vector<int64_t> &strides, void *dst) {
+    using T = typename Bits<kElementSize>::type;
+    for_each_row(sizes, strides, [&](int64_t src_offset, int64_t dst_offset, int64_t n, int64_t stride) {
+        const T *s = static_cast<const T *>(src) + src_offset;
+        T *o = static_cast<T *>(dst) + dst_offset;
+        if (stride == 1) {
+            std::memcpy(o, s, n * sizeof(T));
+        } else {
+            for (int64_t i = 0; i < n; ++i) { o[i] = s[i * stride]; }
+        }
+    });
+}
+
+#define INSTANTIATE_STRIDED_COPY(Tsrc, Tdst)                                                      \
+    template void strided_copy_cpu<Tsrc, Tdst>(const Tsrc *src, const std::vector<int64_t> &sizes, \
+                                               const std::vector<int64_t> &strides, Tdst *dst);
+
+INSTANTIATE_STRIDED_COPY(float, float)
+INSTANTIATE_STRIDED_COPY(float, at::Half)
+INSTANTIATE_STRIDED_COPY(float, at::BFloat16)
+INSTANTIATE_STRIDED_COPY(at::Half, float)
+INSTANTIATE_STRIDED_COPY(at::Half, at::Half)
+INSTANTIATE_STRIDED_COPY(at::Half, at::BFloat16)
+INSTANTIATE_STRIDED_COPY(at::BFloat16, float)
+INSTANTIATE_STRIDED_COPY(at::BFloat16, at::Half)
+INSTANTIATE_STRIDED_COPY(at::BFloat16, at::BFloat16)
+
+template void strided_copy_raw_cpu<1>(const void *src, const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides, void *dst);
+template void strided_copy_raw_cpu<2>(const void *src, const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides, void *dst);
+template void strided_copy_raw_cpu<4>(const void *src, const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides, void *dst);
+template void strided_copy_raw_cpu<8>(const void *src, const std::vector<int64_t> &sizes, const std::vector<int64_t> &strides, void *dst);
+
+}  // namespace checkpoint_loader
@@ -0,0 +1,27 @@
+// Copy of a strided view of a memory-mapped tensor into a contiguous tensor, with dtype conversion.
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace checkpoint_loader {
+
+// Number of elements converted per task. Large enough to amortize the scheduling, small enough
+// that the converted chunk is still in L2 when it's written out.
+constexpr int64_t kChunkElements = 1 << 16;
+
+// dst (contiguous, prod(sizes) elements) = src viewed with sizes and strides (in elements),
+// converted from Tsrc to Tdst through fp32. Rows of the innermost dimension are split across
+// threads in chunks of about kChunkElements, so the full tensor is never converted in one go.
+// The view is walked in output order: the source pages of a contiguous view are read in
+// streaming order, those of a transposed view are strided.
+template <typename Tsrc, typename Tdst>
+void strided_copy_cpu(const Tsrc *src, const std::vector<int64_t> &sizes,
+                      const std::vector<int64_t> &strides, Tdst *dst);
+
+// Same without conversion, for any element type of that size (e.g. int64 or bool tensors).
+template <int kElementSize>
+void strided_copy_raw_cpu(const void *src, const std::vector<int64_t> &sizes,
+                          const std::vector<int64_t> &strides, void *dst);
+
+}  // namespace checkpoint_loader
@@ -0,0 +1,60 @@
+#include "mmap_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace checkpoint_loader {
+
+MmapFile::MmapFile(const std::string &path) : path_(path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("MmapFile: cannot open " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::runtime_error("MmapFile: cannot stat " + path + ": " + std::strerror(err));
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+        void *ptr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            const int err = errno;
+            ::close(fd);
+            throw std::runtime_error("MmapFile: cannot map " + path + ": " + std::strerror(err));
+        }
+        data_ = static_cast<const uint8_t *>(ptr);
+    }
+    // The mapping keeps the file alive
+    ::close(fd);
+}
+
+MmapFile::~MmapFile() { close(); }
+
+void MmapFile::close() {
+    if (data_ != nullptr) {
+        ::munmap(const_cast<uint8_t *>(data_), size_);
+        data_ = nullptr;
+    }
+}
+
+void MmapFile::advise(int64_t offset, int64_t length, int advice) const {
+    if (data_ == nullptr || length <= 0) { return; }
+    // madvise needs a page-aligned address
+    const int64_t page_size = ::sysconf(_SC_PAGESIZE);
+    const int64_t start = offset / page_size * page_size;
+    const int64_t end = std::min(size_, offset + length);
+    if (end > start) {
+        ::madvise(const_cast<uint8_t *>(data_) + start, end - start, advice);
+    }
+}
+
+}  // namespace checkpoint_loader
@@ -0,0 +1,34 @@
+// Read-only memory mapping of a checkpoint file. Pages are only read from disk when touched, so
+// a rank that keeps a shard of a tensor only reads that shard.
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace checkpoint_loader {
+
+class MmapFile {
+public:
+    explicit MmapFile(const std::string &path);
+    ~MmapFile();
+    MmapFile(const MmapFile &) = delete;
+    MmapFile &operator=(const MmapFile &) = delete;
+
+    const uint8_t *data() const { return data_; }
+    int64_t size() const { return size_; }
+    const std::string &path() const { return path_; }
+
+    // madvise the pages of [offset, offset + length), e.g. MADV_WILLNEED before a sequential read.
+    void advise(int64_t offset, int64_t length, int advice) const;
+
+    // Unmap the file. Any access afterwards is an error.
+    void close();
+    bool closed() const { return data_ == nullptr; }
+
+private:
+    std::string path_;
+    const uint8_t *data_ = nullptr;
+    int64_t size_ = 0;
+};
+
+}  // namespace checkpoint_loader
@@ -0,0 +1,24 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="checkpoint_loader",
+    version="0.1",
+    description="Memory-mapped checkpoint loading",
+    ext_modules=[
+        CppExtension(
+            name="checkpoint_loader",
+            sources=["checkpoint_loader.cpp", "checkpoint_loader_cpu.cpp", "mmap_file.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
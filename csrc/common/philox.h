@@ -0,0 +1,55 @@
+// Philox4x32-10 counter-based random number generator, shared by the CPU extensions that draw
+// random numbers (fused_embedding, fused_sampling).
+#pragma once
+
+#include <cstdint>
+
+namespace common {
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"), the generator of
+// curand and of the CUDA generators of PyTorch.
+struct Philox {
+    uint32_t key[2];
+    uint32_t counter[4];
+
+    // The stream of (seed, subsequence), starting at offset (in blocks of 4 x 32 bits).
+    Philox(uint64_t seed, uint64_t subsequence, uint64_t offset) {
+        key[0] = uint32_t(seed);
+        key[1] = uint32_t(seed >> 32);
+        counter[0] = uint32_t(offset);
+        counter[1] = uint32_t(offset >> 32);
+        counter[2] = uint32_t(subsequence);
+        counter[3] = uint32_t(subsequence >> 32);
+    }
+
+    // Next block of 4 x 32 random bits.
+    void next(uint32_t out[4]) {
+        constexpr uint32_t kPhiloxM0 = 0xD2511F53, kPhiloxM1 = 0xCD9E8D57;
+        constexpr uint32_t kPhiloxW0 = 0x9E3779B9, kPhiloxW1 = 0xBB67AE85;
+        uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+        uint32_t k[2] = {key[0], key[1]};
+        for (int round = 0; round < 10; ++round) {
+            const uint64_t p0 = uint64_t(kPhiloxM0) * c[0];
+            const uint64_t p1 = uint64_t(kPhiloxM1) * c[2];
+            const uint32_t c0 = uint32_t(p1 >> 32) ^ c[1] ^ k[0];
+            const uint32_t c2 = uint32_t(p0 >> 32) ^ c[3] ^ k[1];
+            c[1] = uint32_t(p1);
+            c[3] = uint32_t(p0);
+            c[0] = c0;
+            c[2] = c2;
+            k[0] += kPhiloxW0;
+            k[1] += kPhiloxW1;
+        }
+        for (int i = 0; i < 4; ++i) { out[i] = c[i]; }
+        if (++counter[0] == 0) { ++counter[1]; }
+    }
+
+    // Uniform in [0, 1), with 53 random bits.
+    double uniform() {
+        uint32_t r[4];
+        next(r);
+        return ((uint64_t(r[0]) << 21) ^ r[1]) * (1.0 / 9007199254740992.0);  // 2^53
+    }
+};
+
+}  // namespace common
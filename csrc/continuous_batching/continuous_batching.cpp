@@ -0,0 +1,91 @@
+#include <torch/extension.h>
+#include <pybind11/functional.h>
+#include <pybind11/stl.h>
+
+#include <numeric>
+
+#include "scheduler.h"
+
+using namespace continuous_batching;
+
+namespace {
+
+torch::Tensor to_tensor(const std::vector<int>& x) {
+    return torch::from_blob(const_cast<int*>(x.data()), {int64_t(x.size())}, torch::kInt32).clone();
+}
+
+py::dict request_to_dict(const Request& r) {
+    py::dict d;
+    d["id"] = r.id;
+    d["prompt_len"] = r.prompt_len;
+    d["max_new_tokens"] = r.max_new_tokens;
+    d["num_generated"] = r.num_generated;
+    d["slot"] = r.slot;
+    d["arrival_time"] = r.arrival_time;
+    d["admit_time"] = r.admit_time;
+    d["first_token_time"] = r.first_token_time;
+    d["finish_time"] = r.finish_time;
+    return d;
+}
+
+}  // namespace
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<StepBatch>(m, "StepBatch")
+        .def_readonly("request_ids", &StepBatch::request_ids)
+        .def_readonly("total_tokens", &StepBatch::total_tokens)
+        .def_property_readonly("slots", [](const StepBatch& b) { return to_tensor(b.slots); })
+        .def_property_readonly("cache_seqlens", [](const StepBatch& b) { return to_tensor(b.cache_seqlens); })
+        .def_property_readonly("num_tokens", [](const StepBatch& b) { return to_tensor(b.num_tokens); })
+        // (batch_size + 1,) int32, the offsets of the entries in the packed (total_tokens, ...) inputs
+        .def_property_readonly("cu_seqlens", [](const StepBatch& b) {
+            std::vector<int> cu_seqlens(b.num_tokens.size() + 1, 0);
+            std::partial_sum(b.num_tokens.begin(), b.num_tokens.end(), cu_seqlens.begin() + 1);
+            return to_tensor(cu_seqlens);
+        })
+        .def_property_readonly("samples", [](const StepBatch& b) {
+            std::vector<int> samples(b.samples.begin(), b.samples.end());
+            return to_tensor(samples).to(torch::kBool);
+        });
+
+    py::class_<Metrics>(m, "Metrics")
+        .def_readonly("num_steps", &Metrics::num_steps)
+        .def_readonly("num_finished", &Metrics::num_finished)
+        .def_readonly("num_queued", &Metrics::num_queued)
+        .def_readonly("num_running", &Metrics::num_running)
+        .def_readonly("num_generated_tokens", &Metrics::num_generated_tokens)
+        .def_readonly("num_prompt_tokens", &Metrics::num_prompt_tokens)
+        .def_readonly("mean_step_tokens", &Metrics::mean_step_tokens)
+        .def_readonly("budget_utilization", &Metrics::budget_utilization)
+        .def_readonly("mean_queue_time", &Metrics::mean_queue_time)
+        .def_readonly("p99_queue_time", &Metrics::p99_queue_time)
+        .def_readonly("mean_time_to_first_token", &Metrics::mean_time_to_first_token)
+        .def_readonly("p99_time_to_first_token", &Metrics::p99_time_to_first_token)
+        .def_readonly("mean_latency", &Metrics::mean_latency)
+        .def_readonly("p99_latency", &Metrics::p99_latency)
+        .def_readonly("throughput", &Metrics::throughput);
+
+    py::class_<Scheduler>(m, "Scheduler")
+        .def(py::init<int, int, int, int>(), py::arg("num_slots"), py::arg("max_seqlen"),
+             py::arg("max_tokens_per_step"), py::arg("max_prefill_chunk"))
+        .def("add_request", &Scheduler::add_request, py::arg("id"), py::arg("prompt_len"),
+             py::arg("max_new_tokens"))
+        // model_step(batch) returns, for each entry of the batch, whether its sampled token ends the
+        // request: a list of bools or a bool tensor.
+        .def("step", [](Scheduler& s, py::function model_step) {
+            auto retired = s.step([&](const StepBatch& batch) {
+                py::object ends = model_step(batch);
+                if (py::hasattr(ends, "tolist")) { ends = ends.attr("tolist")(); }
+                return ends.cast<std::vector<bool>>();
+            });
+            py::list out;
+            for (const Request& r : retired) { out.append(request_to_dict(r)); }
+            return out;
+        }, py::arg("model_step"), "Run one step, return the requests that finished")
+        .def("has_work", &Scheduler::has_work)
+        .def("length_per_sample", [](const Scheduler& s) { return to_tensor(s.length_per_sample()); },
+             "(num_slots,) int32, the number of tokens in the KV cache of each slot")
+        .def("metrics", &Scheduler::metrics)
+        .def_property_readonly("num_slots", &Scheduler::num_slots)
+        .def_property_readonly("max_seqlen", &Scheduler::max_seqlen);
+}
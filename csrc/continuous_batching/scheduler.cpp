@@ -0,0 +1,166 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+namespace continuous_batching {
+
+namespace {
+
+double mean(const std::vector<double>& x) {
+    return x.empty() ? 0.0 : std::accumulate(x.begin(), x.end(), 0.0) / x.size();
+}
+
+// Nearest-rank percentile.
+double percentile(std::vector<double> x, double p) {
+    if (x.empty()) { return 0.0; }
+    std::sort(x.begin(), x.end());
+    const size_t rank = std::min(x.size() - 1, size_t(std::max(0.0, p / 100.0 * x.size() - 1e-9)));
+    return x[rank];
+}
+
+}  // namespace
+
+Scheduler::Scheduler(int num_slots, int max_seqlen, int max_tokens_per_step, int max_prefill_chunk)
+    : num_slots_(num_slots), max_seqlen_(max_seqlen), max_tokens_per_step_(max_tokens_per_step),
+      max_prefill_chunk_(max_prefill_chunk), start_(std::chrono::steady_clock::now()),
+      length_per_sample_(num_slots, 0) {
+    if (num_slots <= 0 || max_seqlen <= 0 || max_tokens_per_step <= 0 || max_prefill_chunk <= 0) {
+        throw std::invalid_argument("Scheduler: num_slots, max_seqlen, max_tokens_per_step and "
+                                    "max_prefill_chunk must be positive");
+    }
+    // Pop the lowest slots first
+    for (int slot = num_slots - 1; slot >= 0; --slot) { free_slots_.push_back(slot); }
+}
+
+double Scheduler::now() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+}
+
+void Scheduler::add_request(int64_t id, int prompt_len, int max_new_tokens) {
+    if (prompt_len <= 0 || max_new_tokens <= 0) {
+        throw std::invalid_argument("Scheduler: prompt_len and max_new_tokens must be positive");
+    }
+    // The last generated token is never fed back to the model
+    if (prompt_len + max_new_tokens - 1 > max_seqlen_) {
+        throw std::invalid_argument("Scheduler: request " + std::to_string(id) + " needs "
+                                    + std::to_string(prompt_len + max_new_tokens - 1)
+                                    + " KV-cache positions, max_seqlen is " + std::to_string(max_seqlen_));
+    }
+    Request request;
+    request.id = id;
+    request.prompt_len = prompt_len;
+    request.max_new_tokens = max_new_tokens;
+    request.arrival_time = now();
+    queue_.push_back(request);
+}
+
+std::vector<Request> Scheduler::step(const ModelStep& model_step) {
+    const double admit_time = now();
+    while (!queue_.empty() && !free_slots_.empty()) {
+        Request request = queue_.front();
+        queue_.pop_front();
+        request.slot = free_slots_.back();
+        free_slots_.pop_back();
+        request.admit_time = admit_time;
+        length_per_sample_[request.slot] = 0;
+        running_.push_back(request);
+    }
+    if (running_.empty()) { return {}; }
+
+    // Decode tokens first, so that the running requests keep their pace, then prefill chunks in
+    // admission order with what's left of the budget.
+    StepBatch batch;
+    std::vector<int> entry_request;  // Index into running_ of each entry
+    auto add_entry = [&](int i, int num_tokens, bool samples) {
+        batch.request_ids.push_back(running_[i].id);
+        batch.slots.push_back(running_[i].slot);
+        batch.cache_seqlens.push_back(running_[i].num_computed);
+        batch.num_tokens.push_back(num_tokens);
+        batch.samples.push_back(samples);
+        batch.total_tokens += num_tokens;
+        entry_request.push_back(i);
+    };
+    for (int i = 0; i < int(running_.size()) && batch.total_tokens < max_tokens_per_step_; ++i) {
+        if (running_[i].num_computed >= running_[i].prompt_len) { add_entry(i, 1, true); }
+    }
+    for (int i = 0; i < int(running_.size()) && batch.total_tokens < max_tokens_per_step_; ++i) {
+        const Request& request = running_[i];
+        if (request.num_computed >= request.prompt_len) { continue; }
+        const int chunk = std::min({request.prompt_len - request.num_computed, max_prefill_chunk_,
+                                    max_tokens_per_step_ - batch.total_tokens});
+        add_entry(i, chunk, request.num_computed + chunk == request.prompt_len);
+    }
+
+    const double step_start = now();
+    if (first_step_time_ < 0) { first_step_time_ = step_start; }
+    const std::vector<bool> ends = model_step(batch);
+    if (ends.size() != batch.request_ids.size()) {
+        throw std::runtime_error("Scheduler: the model step must return one flag per batch entry");
+    }
+    const double step_end = now();
+    last_step_time_ = step_end;
+    ++num_steps_;
+    num_step_tokens_ += batch.total_tokens;
+
+    std::vector<bool> done(running_.size(), false);
+    for (size_t e = 0; e < entry_request.size(); ++e) {
+        Request& request = running_[entry_request[e]];
+        request.num_computed += batch.num_tokens[e];
+        length_per_sample_[request.slot] = request.num_computed;
+        if (!batch.samples[e]) { continue; }
+        if (request.num_generated++ == 0) { request.first_token_time = step_end; }
+        if (ends[e] || request.num_generated == request.max_new_tokens) {
+            request.finish_time = step_end;
+            done[entry_request[e]] = true;
+        }
+    }
+    std::vector<Request> retired;
+    std::vector<Request> still_running;
+    for (size_t i = 0; i < running_.size(); ++i) {
+        if (done[i]) {
+            free_slots_.push_back(running_[i].slot);
+            retired.push_back(running_[i]);
+            finished_.push_back(running_[i]);
+        } else {
+            still_running.push_back(running_[i]);
+        }
+    }
+    running_.swap(still_running);
+    return retired;
+}
+
+Metrics Scheduler::metrics() const {
+    Metrics m;
+    m.num_steps = num_steps_;
+    m.num_finished = finished_.size();
+    m.num_queued = queue_.size();
+    m.num_running = running_.size();
+    std::vector<double> queue_times, ttfts, latencies;
+    for (const Request& r : finished_) {
+        m.num_generated_tokens += r.num_generated;
+        m.num_prompt_tokens += r.prompt_len;
+        queue_times.push_back(r.admit_time - r.arrival_time);
+        ttfts.push_back(r.first_token_time - r.arrival_time);
+        latencies.push_back(r.finish_time - r.arrival_time);
+    }
+    for (const Request& r : running_) { m.num_generated_tokens += r.num_generated; }
+    if (num_steps_ > 0) {
+        m.mean_step_tokens = double(num_step_tokens_) / num_steps_;
+        m.budget_utilization = m.mean_step_tokens / max_tokens_per_step_;
+    }
+    m.mean_queue_time = mean(queue_times);
+    m.p99_queue_time = percentile(queue_times, 99);
+    m.mean_time_to_first_token = mean(ttfts);
+    m.p99_time_to_first_token = percentile(ttfts, 99);
+    m.mean_latency = mean(latencies);
+    m.p99_latency = percentile(latencies, 99);
+    if (last_step_time_ > first_step_time_) {
+        m.throughput = m.num_generated_tokens / (last_step_time_ - first_step_time_);
+    }
+    return m;
+}
+
+}  // namespace continuous_batching
@@ -0,0 +1,105 @@
+// Continuous-batching scheduler for decoding: requests are admitted into KV-cache slots and retired
+// at every step, and each step mixes the decode tokens of the running requests with chunks of the
+// prompts being prefilled, within a token budget.
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace continuous_batching {
+
+struct Request {
+    int64_t id = 0;
+    int prompt_len = 0;
+    int max_new_tokens = 0;
+    // KV-cache slot, -1 while queued.
+    int slot = -1;
+    // Number of tokens whose K/V are in the cache (prompt, then generated tokens).
+    int num_computed = 0;
+    int num_generated = 0;
+    // In seconds since the scheduler was created, -1 if not reached yet.
+    double arrival_time = -1.0, admit_time = -1.0, first_token_time = -1.0, finish_time = -1.0;
+};
+
+// The work of one model step. Entry i runs num_tokens[i] tokens of request request_ids[i], whose
+// KV cache is slot slots[i] and already holds cache_seqlens[i] tokens: a chunk of the prompt, or
+// the last generated token (num_tokens[i] == 1) when decoding. Entry i samples the next token if
+// samples[i], i.e. for decode tokens and for the last chunk of a prompt.
+struct StepBatch {
+    std::vector<int64_t> request_ids;
+    std::vector<int> slots;
+    std::vector<int> cache_seqlens;
+    std::vector<int> num_tokens;
+    std::vector<bool> samples;
+    int total_tokens = 0;
+};
+
+// Runs the model on a batch. Returns, for each entry, whether the token it sampled ends the request
+// (e.g. EOS). Only read for the entries that sample.
+using ModelStep = std::function<std::vector<bool>(const StepBatch&)>;
+
+struct Metrics {
+    int64_t num_steps = 0;
+    int64_t num_finished = 0;
+    int64_t num_queued = 0;
+    int64_t num_running = 0;
+    int64_t num_generated_tokens = 0;
+    int64_t num_prompt_tokens = 0;
+    // Average number of tokens per step, and its ratio to the token budget.
+    double mean_step_tokens = 0.0;
+    double budget_utilization = 0.0;
+    // Over the finished requests, in seconds: from arrival to admission into a slot, to the first
+    // generated token, and to the last one.
+    double mean_queue_time = 0.0, p99_queue_time = 0.0;
+    double mean_time_to_first_token = 0.0, p99_time_to_first_token = 0.0;
+    double mean_latency = 0.0, p99_latency = 0.0;
+    // Generated tokens per second, from the first step to the last one.
+    double throughput = 0.0;
+};
+
+class Scheduler {
+public:
+    // num_slots: number of KV-cache slots (the max batch size).
+    // max_seqlen: KV-cache length of each slot.
+    // max_tokens_per_step: token budget of a step, decode tokens first then prefill chunks.
+    // max_prefill_chunk: max number of prompt tokens of a request per step.
+    Scheduler(int num_slots, int max_seqlen, int max_tokens_per_step, int max_prefill_chunk);
+
+    // Queue a request, admitted first-come first-served when a slot is free.
+    void add_request(int64_t id, int prompt_len, int max_new_tokens);
+
+    // Admit requests, run one model step, and retire the finished requests (returned, with their
+    // slots freed). Returns an empty vector without calling model_step if there's no work.
+    std::vector<Request> step(const ModelStep& model_step);
+
+    bool has_work() const { return !queue_.empty() || !running_.empty(); }
+
+    // Number of tokens in the KV cache of each slot, the length_per_sample of the decode kernel.
+    const std::vector<int>& length_per_sample() const { return length_per_sample_; }
+
+    Metrics metrics() const;
+
+    int num_slots() const { return num_slots_; }
+    int max_seqlen() const { return max_seqlen_; }
+
+private:
+    double now() const;
+
+    const int num_slots_, max_seqlen_, max_tokens_per_step_, max_prefill_chunk_;
+    const std::chrono::steady_clock::time_point start_;
+    std::deque<Request> queue_;
+    // In admission order.
+    std::vector<Request> running_;
+    std::vector<int> free_slots_;
+    std::vector<int> length_per_sample_;
+    std::vector<Request> finished_;
+
+    int64_t num_steps_ = 0;
+    int64_t num_step_tokens_ = 0;
+    double first_step_time_ = -1.0, last_step_time_ = -1.0;
+};
+
+}  // namespace continuous_batching
@@ -0,0 +1,24 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="continuous_batching",
+    version="0.1",
+    description="Continuous-batching decode scheduler",
+    ext_modules=[
+        CppExtension(
+            name="continuous_batching",
+            sources=["continuous_batching.cpp", "scheduler.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
@@ -1,11 +1,14 @@
 #include <torch/extension.h>
+#ifdef WITH_CUDA
 #include "ATen/cuda/CUDAContext.h"
 #include <c10/cuda/CUDAGuard.h>
 
 
 #include "decoder_masked_multihead_attention.h"
+#endif
+#include "ft_attention_cpu.h"
 
-#define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
+#define CHECK_DEVICE(x, device) TORCH_CHECK(x.device() == device, #x " must be on the same device as q")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
 #define CHECK_CONTIGUOUS(x) TORCH_CHECK(x.is_contiguous(), #x " must be contiguous")
 
@@ -23,12 +26,13 @@
     AT_ERROR(#NAME, " not implemented for type '", toString(TYPE), "'"); \
   }
 
+#ifdef WITH_CUDA
 template<typename T>
 void masked_multihead_attention(const Masked_multihead_attention_params<T>& params,
                                 const cudaStream_t& stream);
 
 template<typename T>
-void cross_multihead_attention(const Masked_multihead_attention_params<T>& params,
+void cross_multihead_attention(const Cross_multihead_attention_params<T>& params,
                                const cudaStream_t& stream);
 
 template<typename T>
@@ -45,9 +49,11 @@ template<>
 struct SATypeConverter<at::BFloat16> {
     using Type = __nv_bfloat16;
 };
+#endif
 
-template <typename T>
-void set_params(Masked_multihead_attention_params<T> &params,
+// Params is either Masked_multihead_attention_params<T> or Multihead_attention_params_cpu<T>
+template <typename Params, typename T>
+void set_params(Params &params,
                 const size_t batch_size,
                 const size_t nheads,
                 const size_t memory_max_seqlen,
@@ -97,6 +103,66 @@ void set_params(Masked_multihead_attention_params<T> &params,
     params.finished = nullptr;
     params.memory_length_per_sample = nullptr;
     params.length_per_sample = length_per_sample;
+    params.ia3_tasks = nullptr;
+    params.ia3_key_weights = nullptr;
+    params.ia3_value_weights = nullptr;
+}
+
+// finished: (batch_size,) bool. The rows of the finished sequences are skipped: their KV cache
+// isn't updated and their output is zero.
+template <typename Params>
+void set_finished_params(Params &params, bool *finished) {
+    params.finished = finished;
+}
+
+// ia3_tasks: (batch_size,) int32, the adapter of each sample.
+// ia3_key_weights, ia3_value_weights: (num_tasks, nheads, headdim), stacked adapter vectors.
+template <typename Params, typename T>
+void set_ia3_params(Params &params, int *ia3_tasks, T *ia3_key_weights, T *ia3_value_weights) {
+    params.ia3_tasks = ia3_tasks;
+    params.ia3_key_weights = ia3_key_weights;
+    params.ia3_value_weights = ia3_value_weights;
+}
+
+void check_ia3_args(const torch::Tensor &q,
+                    const c10::optional<const torch::Tensor> &ia3_tasks_,
+                    const c10::optional<const torch::Tensor> &ia3_key_weights_,
+                    const c10::optional<const torch::Tensor> &ia3_value_weights_,
+                    int batch_size, int nheads, int headdim) {
+    auto device = q.device();
+    const bool has_ia3 = ia3_tasks_.has_value();
+    TORCH_CHECK(has_ia3 == ia3_key_weights_.has_value() && has_ia3 == ia3_value_weights_.has_value(),
+                "ia3_tasks, ia3_key_weights and ia3_value_weights must be passed together");
+    if (has_ia3) {
+        auto ia3_tasks = ia3_tasks_.value();
+        auto ia3_key_weights = ia3_key_weights_.value();
+        auto ia3_value_weights = ia3_value_weights_.value();
+        CHECK_DEVICE(ia3_tasks, device); CHECK_DEVICE(ia3_key_weights, device); CHECK_DEVICE(ia3_value_weights, device);
+        TORCH_CHECK(ia3_tasks.dtype() == torch::kInt32);
+        TORCH_CHECK(ia3_key_weights.dtype() == q.dtype() && ia3_value_weights.dtype() == q.dtype());
+        int num_tasks = ia3_key_weights.size(0);
+        CHECK_SHAPE(ia3_tasks, batch_size);
+        CHECK_SHAPE(ia3_key_weights, num_tasks, nheads, headdim);
+        CHECK_SHAPE(ia3_value_weights, num_tasks, nheads, headdim);
+        CHECK_CONTIGUOUS(ia3_tasks); CHECK_CONTIGUOUS(ia3_key_weights); CHECK_CONTIGUOUS(ia3_value_weights);
+        // The CPU kernel indexes the adapter weights with the task ids: a bad id would read out
+        // of bounds.
+        if (!ia3_tasks.is_cuda() && batch_size > 0) {
+            TORCH_CHECK(ia3_tasks.min().item<int>() >= 0 && ia3_tasks.max().item<int>() < num_tasks,
+                        "ia3_tasks must be in [0, num_tasks)");
+        }
+    }
+}
+
+void check_finished_arg(const torch::Tensor &q, const c10::optional<const torch::Tensor> &finished_,
+                        int batch_size) {
+    if (finished_.has_value()) {
+        auto finished = finished_.value();
+        CHECK_DEVICE(finished, q.device());
+        TORCH_CHECK(finished.dtype() == torch::kBool);
+        CHECK_SHAPE(finished, batch_size);
+        CHECK_CONTIGUOUS(finished);
+    }
 }
 
 torch::Tensor single_query_attention(const torch::Tensor q,
@@ -107,8 +173,16 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      c10::optional<const torch::Tensor> length_per_sample_,
                                      const int timestep,
                                      const int rotary_embedding_dim = 0,
-                                     const bool neox_rotary_style=true) {
-    CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); CHECK_DEVICE(k_cache); CHECK_DEVICE(v_cache);
+                                     const bool neox_rotary_style=true,
+                                     c10::optional<const torch::Tensor> ia3_tasks_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> ia3_key_weights_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> ia3_value_weights_=c10::nullopt,
+                                     c10::optional<const torch::Tensor> finished_=c10::nullopt) {
+    auto device = q.device();
+    CHECK_DEVICE(k, device); CHECK_DEVICE(v, device); CHECK_DEVICE(k_cache, device); CHECK_DEVICE(v_cache, device);
+#ifndef WITH_CUDA
+    TORCH_CHECK(!q.is_cuda(), "ft_attention was built without CUDA");
+#endif
     int batch_size = v_cache.size(0);
     int nheads = v_cache.size(1);
     int memory_max_seqlen = v_cache.size(2);
@@ -128,18 +202,45 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 
     if (length_per_sample_.has_value()) {
         auto length_per_sample = length_per_sample_.value();
-        CHECK_DEVICE(length_per_sample);
+        CHECK_DEVICE(length_per_sample, device);
         CHECK_SHAPE(length_per_sample, batch_size);
         CHECK_CONTIGUOUS(length_per_sample);
         TORCH_CHECK(length_per_sample.dtype() == torch::kInt32);
     }
 
+    const bool has_ia3 = ia3_tasks_.has_value();
+    check_ia3_args(q, ia3_tasks_, ia3_key_weights_, ia3_value_weights_, batch_size, nheads, headdim);
+    check_finished_arg(q, finished_, batch_size);
+
+    // The kernel doesn't write the output of the finished rows
+    torch::Tensor out = finished_.has_value() ? torch::zeros_like(q) : torch::empty_like(q);
+
+    if (!q.is_cuda()) {
+        DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "single_query_attention", [&] {
+            Multihead_attention_params_cpu<scalar_t> params;
+            set_params(params, batch_size, nheads, memory_max_seqlen, headdim, timestep,
+                       rotary_embedding_dim, neox_rotary_style, q.stride(0),
+                       q.data_ptr<scalar_t>(), k.data_ptr<scalar_t>(), v.data_ptr<scalar_t>(),
+                       k_cache.data_ptr<scalar_t>(), v_cache.data_ptr<scalar_t>(),
+                       length_per_sample_.has_value()
+                           ? length_per_sample_.value().data_ptr<int>() : nullptr,
+                       out.data_ptr<scalar_t>());
+            if (has_ia3) {
+                set_ia3_params(params, ia3_tasks_.value().data_ptr<int>(),
+                               ia3_key_weights_.value().data_ptr<scalar_t>(),
+                               ia3_value_weights_.value().data_ptr<scalar_t>());
+            }
+            if (finished_.has_value()) { set_finished_params(params, finished_.value().data_ptr<bool>()); }
+            masked_multihead_attention_cpu(params);
+        });
+        return out;
+    }
+
+#ifdef WITH_CUDA
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
     at::cuda::CUDAGuard device_guard{(char)q.get_device()};
 
-    torch::Tensor out = torch::empty_like(q);
-
     DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "single_query_attention", [&] {
         using DataType = typename SATypeConverter<scalar_t>::Type;
         Masked_multihead_attention_params<DataType> params;
@@ -153,15 +254,326 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    length_per_sample_.has_value()
                        ? length_per_sample_.value().data_ptr<int>() : nullptr,
                    reinterpret_cast<DataType*>(out.data_ptr()));
+        if (has_ia3) {
+            set_ia3_params(params, ia3_tasks_.value().data_ptr<int>(),
+                           reinterpret_cast<DataType*>(ia3_key_weights_.value().data_ptr()),
+                           reinterpret_cast<DataType*>(ia3_value_weights_.value().data_ptr()));
+        }
+        if (finished_.has_value()) { set_finished_params(params, finished_.value().data_ptr<bool>()); }
         auto stream = at::cuda::getCurrentCUDAStream();
         masked_multihead_attention(params, stream);
     });
+#endif
+    return out;
+}
+
+// Single-query cross attention over a fixed encoder memory, e.g. for encoder-decoder decoding.
+// k_memory: (batch_size, nheads, headdim / x, memory_max_seqlen, x), the encoder keys, packed once
+// in the same layout as the K cache of single_query_attention.
+// v_memory: (batch_size, nheads, memory_max_seqlen, headdim).
+// memory_length_per_sample: (batch_size,) int32, sample i attends to its first
+// memory_length_per_sample[i] memory positions.
+// At timestep 0, the IA3 scaling (if any) is applied to the memory in place.
+torch::Tensor single_query_cross_attention(const torch::Tensor q,
+                                           torch::Tensor k_memory,
+                                           torch::Tensor v_memory,
+                                           const torch::Tensor memory_length_per_sample,
+                                           const int timestep,
+                                           c10::optional<const torch::Tensor> ia3_tasks_=c10::nullopt,
+                                           c10::optional<const torch::Tensor> ia3_key_weights_=c10::nullopt,
+                                           c10::optional<const torch::Tensor> ia3_value_weights_=c10::nullopt,
+                                           c10::optional<const torch::Tensor> finished_=c10::nullopt) {
+    auto device = q.device();
+    CHECK_DEVICE(k_memory, device); CHECK_DEVICE(v_memory, device); CHECK_DEVICE(memory_length_per_sample, device);
+#ifndef WITH_CUDA
+    TORCH_CHECK(!q.is_cuda(), "ft_attention was built without CUDA");
+#endif
+    int batch_size = v_memory.size(0);
+    int nheads = v_memory.size(1);
+    int memory_max_seqlen = v_memory.size(2);
+    int headdim = v_memory.size(3);
+    CHECK_SHAPE(q, batch_size, nheads, headdim);
+    CHECK_SHAPE(v_memory, batch_size, nheads, memory_max_seqlen, headdim);
+    int packsize = k_memory.dtype() == torch::kFloat32 ? 4 : 8;
+    CHECK_SHAPE(k_memory, batch_size, nheads, headdim / packsize, memory_max_seqlen, packsize);
+    TORCH_CHECK(k_memory.dtype() == q.dtype() && v_memory.dtype() == q.dtype());
+    TORCH_CHECK(q.stride(2) == 1 && q.stride(1) == headdim);
+    CHECK_CONTIGUOUS(v_memory); CHECK_CONTIGUOUS(k_memory);
+    CHECK_SHAPE(memory_length_per_sample, batch_size);
+    CHECK_CONTIGUOUS(memory_length_per_sample);
+    TORCH_CHECK(memory_length_per_sample.dtype() == torch::kInt32);
+
+    const bool has_ia3 = ia3_tasks_.has_value();
+    check_ia3_args(q, ia3_tasks_, ia3_key_weights_, ia3_value_weights_, batch_size, nheads, headdim);
+    check_finished_arg(q, finished_, batch_size);
+
+    // The kernel doesn't write the output of the finished rows
+    torch::Tensor out = finished_.has_value() ? torch::zeros_like(q) : torch::empty_like(q);
+
+    if (!q.is_cuda()) {
+        DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "single_query_cross_attention", [&] {
+            Multihead_attention_params_cpu<scalar_t> params;
+            set_params(params, batch_size, nheads, memory_max_seqlen, headdim, timestep,
+                       0, false, q.stride(0),
+                       q.data_ptr<scalar_t>(), static_cast<scalar_t*>(nullptr),
+                       static_cast<scalar_t*>(nullptr),
+                       k_memory.data_ptr<scalar_t>(), v_memory.data_ptr<scalar_t>(),
+                       nullptr, out.data_ptr<scalar_t>());
+            params.memory_length_per_sample = memory_length_per_sample.data_ptr<int>();
+            if (has_ia3) {
+                set_ia3_params(params, ia3_tasks_.value().data_ptr<int>(),
+                               ia3_key_weights_.value().data_ptr<scalar_t>(),
+                               ia3_value_weights_.value().data_ptr<scalar_t>());
+            }
+            if (finished_.has_value()) { set_finished_params(params, finished_.value().data_ptr<bool>()); }
+            cross_multihead_attention_cpu(params);
+        });
+        return out;
+    }
+
+#ifdef WITH_CUDA
+    // Otherwise the kernel will be launched from cuda:0 device
+    // Cast to char to avoid compiler warning about narrowing
+    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "single_query_cross_attention", [&] {
+        using DataType = typename SATypeConverter<scalar_t>::Type;
+        Cross_multihead_attention_params<DataType> params;
+        set_params(params, batch_size, nheads, memory_max_seqlen, headdim, timestep,
+                   0, false, q.stride(0),
+                   reinterpret_cast<DataType*>(q.data_ptr()), static_cast<DataType*>(nullptr),
+                   static_cast<DataType*>(nullptr),
+                   reinterpret_cast<DataType*>(k_memory.data_ptr()),
+                   reinterpret_cast<DataType*>(v_memory.data_ptr()),
+                   nullptr, reinterpret_cast<DataType*>(out.data_ptr()));
+        params.memory_length_per_sample = memory_length_per_sample.data_ptr<int>();
+        if (has_ia3) {
+            set_ia3_params(params, ia3_tasks_.value().data_ptr<int>(),
+                           reinterpret_cast<DataType*>(ia3_key_weights_.value().data_ptr()),
+                           reinterpret_cast<DataType*>(ia3_value_weights_.value().data_ptr()));
+        }
+        if (finished_.has_value()) { set_finished_params(params, finished_.value().data_ptr<bool>()); }
+        auto stream = at::cuda::getCurrentCUDAStream();
+        cross_multihead_attention(params, stream);
+    });
+#endif
     return out;
 }
 
+// k, v: (total, nheads, headdim), the new tokens of all the sequences, packed.
+// cu_seqlens_q: (batch_size + 1,) int32, the new tokens of sequence i are
+// cu_seqlens_q[i] .. cu_seqlens_q[i + 1] - 1.
+// cache_seqlens: (batch_size,) int32, the number of tokens already in the cache of each sequence.
+// Without block_table, k_cache and v_cache have the layout of single_query_attention:
+// (batch_size, nheads, headdim / x, memory_max_seqlen, x) and (batch_size, nheads, memory_max_seqlen, headdim).
+// With block_table (batch_size, max_num_blocks_per_seq) int32, the caches are paged:
+// (num_blocks, nheads, headdim / x, block_size, x) and (num_blocks, nheads, block_size, headdim), and
+// position j of sequence i is in block block_table[i, j / block_size].
+void check_kv_cache_args(const torch::Tensor &k,
+                         const torch::Tensor &v,
+                         const torch::Tensor &k_cache,
+                         const torch::Tensor &v_cache,
+                         const torch::Tensor &cu_seqlens_q,
+                         const torch::Tensor &cache_seqlens,
+                         const c10::optional<const torch::Tensor> &block_table_) {
+    auto device = k.device();
+    CHECK_DEVICE(v, device); CHECK_DEVICE(k_cache, device); CHECK_DEVICE(v_cache, device);
+    CHECK_DEVICE(cu_seqlens_q, device); CHECK_DEVICE(cache_seqlens, device);
+    const bool paged = block_table_.has_value();
+    TORCH_CHECK(cu_seqlens_q.dim() == 1 && cu_seqlens_q.numel() >= 1,
+                "cu_seqlens_q must have batch_size + 1 elements");
+    int total = k.size(0);
+    int batch_size = cu_seqlens_q.numel() - 1;
+    int num_blocks = v_cache.size(0);
+    int nheads = v_cache.size(1);
+    int block_size = v_cache.size(2);
+    int headdim = v_cache.size(3);
+    CHECK_SHAPE(k, total, nheads, headdim);
+    CHECK_SHAPE(v, total, nheads, headdim);
+    TORCH_CHECK(k.stride(2) == 1 && k.stride(1) == headdim);
+    TORCH_CHECK(v.stride(2) == 1 && v.stride(1) == headdim);
+    TORCH_CHECK(v.dtype() == k.dtype() && k_cache.dtype() == k.dtype() && v_cache.dtype() == k.dtype());
+    int packsize = k_cache.dtype() == torch::kFloat32 ? 4 : 8;
+    CHECK_SHAPE(k_cache, num_blocks, nheads, headdim / packsize, block_size, packsize);
+    CHECK_CONTIGUOUS(v_cache); CHECK_CONTIGUOUS(k_cache);
+    TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32 && cache_seqlens.dtype() == torch::kInt32);
+    CHECK_SHAPE(cache_seqlens, batch_size);
+    CHECK_CONTIGUOUS(cu_seqlens_q); CHECK_CONTIGUOUS(cache_seqlens);
+    if (!paged) { TORCH_CHECK(num_blocks == batch_size, "k_cache and v_cache must have batch_size rows"); }
+    int max_num_blocks_per_seq = 1;
+    if (paged) {
+        auto block_table = block_table_.value();
+        CHECK_DEVICE(block_table, device);
+        TORCH_CHECK(block_table.dtype() == torch::kInt32);
+        TORCH_CHECK(block_table.dim() == 2 && block_table.size(0) == batch_size);
+        CHECK_CONTIGUOUS(block_table);
+        max_num_blocks_per_seq = block_table.size(1);
+    }
+
+    // The kernels index the cache without bound checks
+    const int *cu_seqlens_q_ptr = cu_seqlens_q.data_ptr<int>();
+    const int *cache_seqlens_ptr = cache_seqlens.data_ptr<int>();
+    TORCH_CHECK(cu_seqlens_q_ptr[0] == 0 && cu_seqlens_q_ptr[batch_size] == total,
+                "cu_seqlens_q must start at 0 and end at total");
+    for (int bi = 0; bi < batch_size; ++bi) {
+        const int seqlen_q = cu_seqlens_q_ptr[bi + 1] - cu_seqlens_q_ptr[bi];
+        const int seqlen_k = cache_seqlens_ptr[bi] + seqlen_q;
+        TORCH_CHECK(seqlen_q >= 0 && cache_seqlens_ptr[bi] >= 0, "cu_seqlens_q must be non-decreasing");
+        TORCH_CHECK(seqlen_k <= max_num_blocks_per_seq * block_size,
+                    "The new tokens of sequence ", bi, " don't fit in the KV cache");
+        if (paged) {
+            const int *blocks = block_table_.value().data_ptr<int>() + bi * max_num_blocks_per_seq;
+            for (int j = 0; j < (seqlen_k + block_size - 1) / block_size; ++j) {
+                TORCH_CHECK(blocks[j] >= 0 && blocks[j] < num_blocks, "block_table entry out of range");
+            }
+        }
+    }
+}
+
+// Fills everything but q and out, the arguments must have been checked by check_kv_cache_args.
+template <typename T>
+void set_kv_cache_params(Kv_cache_attention_params_cpu<T> &params,
+                         const torch::Tensor &k,
+                         const torch::Tensor &v,
+                         torch::Tensor &k_cache,
+                         torch::Tensor &v_cache,
+                         const torch::Tensor &cu_seqlens_q,
+                         const torch::Tensor &cache_seqlens,
+                         const c10::optional<const torch::Tensor> &block_table_) {
+    params.k = k.data_ptr<T>();
+    params.v = v.data_ptr<T>();
+    params.k_row_stride = k.stride(0);
+    params.v_row_stride = v.stride(0);
+    params.k_cache = k_cache.data_ptr<T>();
+    params.v_cache = v_cache.data_ptr<T>();
+    params.block_table = block_table_.has_value() ? block_table_.value().data_ptr<int>() : nullptr;
+    params.block_size = v_cache.size(2);
+    params.max_num_blocks_per_seq = block_table_.has_value() ? block_table_.value().size(1) : 1;
+    params.cu_seqlens_q = cu_seqlens_q.data_ptr<int>();
+    params.cache_seqlens = cache_seqlens.data_ptr<int>();
+    params.batch_size = cu_seqlens_q.numel() - 1;
+    params.num_heads = v_cache.size(1);
+    params.hidden_size_per_head = v_cache.size(3);
+}
+
+// Writes the new K/V of each sequence to its cache after the first cache_seqlens[i] positions,
+// e.g. the K/V of the prompt straight from the QKV projection into the decode layout (see
+// check_kv_cache_args for the arguments). cache_seqlens isn't updated.
+void append_kv_cache(const torch::Tensor k,
+                     const torch::Tensor v,
+                     torch::Tensor k_cache,
+                     torch::Tensor v_cache,
+                     const torch::Tensor cu_seqlens_q,
+                     const torch::Tensor cache_seqlens,
+                     c10::optional<const torch::Tensor> block_table_) {
+    TORCH_CHECK(!k.is_cuda(), "append_kv_cache only has a CPU implementation");
+    check_kv_cache_args(k, v, k_cache, v_cache, cu_seqlens_q, cache_seqlens, block_table_);
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(k.scalar_type(), "append_kv_cache", [&] {
+        Kv_cache_attention_params_cpu<scalar_t> params;
+        set_kv_cache_params(params, k, v, k_cache, v_cache, cu_seqlens_q, cache_seqlens, block_table_);
+        append_kv_cache_cpu(params);
+    });
+}
+
+// Attention of a chunk of new tokens per sequence against the KV cache (chunked prefill, or a
+// multi-token turn appended to a conversation). The new K/V are appended to the cache in the same
+// call, as in append_kv_cache.
+// q: (total, nheads, headdim).
+// With is_causal, new token j of sequence i attends to cache positions 0 .. cache_seqlens[i] + j.
+// softmax_scale defaults (0) to 1 / sqrt(headdim).
+torch::Tensor varlen_attention_with_kv_cache(const torch::Tensor q,
+                                             const torch::Tensor k,
+                                             const torch::Tensor v,
+                                             torch::Tensor k_cache,
+                                             torch::Tensor v_cache,
+                                             const torch::Tensor cu_seqlens_q,
+                                             const torch::Tensor cache_seqlens,
+                                             c10::optional<const torch::Tensor> block_table_,
+                                             const float softmax_scale,
+                                             const bool is_causal) {
+    CHECK_DEVICE(k, q.device());
+    TORCH_CHECK(!q.is_cuda(), "varlen_attention_with_kv_cache only has a CPU implementation");
+    check_kv_cache_args(k, v, k_cache, v_cache, cu_seqlens_q, cache_seqlens, block_table_);
+    int total = k.size(0);
+    int nheads = k.size(1);
+    int headdim = k.size(2);
+    CHECK_SHAPE(q, total, nheads, headdim);
+    TORCH_CHECK(q.stride(2) == 1 && q.stride(1) == headdim);
+    TORCH_CHECK(q.dtype() == k.dtype());
+
+    torch::Tensor out = torch::empty({total, nheads, headdim}, q.options());
+
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(q.scalar_type(), "varlen_attention_with_kv_cache", [&] {
+        Kv_cache_attention_params_cpu<scalar_t> params;
+        set_kv_cache_params(params, k, v, k_cache, v_cache, cu_seqlens_q, cache_seqlens, block_table_);
+        params.out = out.data_ptr<scalar_t>();
+        params.q = q.data_ptr<scalar_t>();
+        params.q_row_stride = q.stride(0);
+        params.softmax_scale = softmax_scale > 0.f ? softmax_scale : 1.f / sqrt(float(headdim));
+        params.is_causal = is_causal;
+        kv_cache_attention_cpu(params);
+    });
+    return out;
+}
+
+// Decoding with a few new tokens per sequence, e.g. to verify the draft tokens of speculative
+// decoding: the counterpart of single_query_attention for num_queries tokens per sequence, causal
+// among the new tokens. Up to 16 queries per sequence share a single read of the KV cache.
+// q, k, v: (batch_size, num_queries, nheads, headdim).
+// k_cache, v_cache: as in single_query_attention. The new K/V go to positions
+// length_per_sample[i] (or timestep) onwards, length_per_sample isn't updated.
+torch::Tensor multi_token_attention(const torch::Tensor q,
+                                    const torch::Tensor k,
+                                    const torch::Tensor v,
+                                    torch::Tensor k_cache,
+                                    torch::Tensor v_cache,
+                                    c10::optional<const torch::Tensor> length_per_sample_,
+                                    const int timestep,
+                                    const float softmax_scale) {
+    TORCH_CHECK(!q.is_cuda(), "multi_token_attention only has a CPU implementation");
+    TORCH_CHECK(q.dim() == 4, "q must have shape (batch_size, num_queries, nheads, headdim)");
+    int batch_size = q.size(0);
+    int num_queries = q.size(1);
+    int nheads = q.size(2);
+    int headdim = q.size(3);
+    TORCH_CHECK(num_queries > 0);
+    CHECK_SHAPE(k, batch_size, num_queries, nheads, headdim);
+    CHECK_SHAPE(v, batch_size, num_queries, nheads, headdim);
+    // The varlen layout of varlen_attention_with_kv_cache, with num_queries tokens per sequence
+    auto cu_seqlens_q = torch::arange(0, (batch_size + 1) * num_queries, num_queries,
+                                      torch::dtype(torch::kInt32));
+    auto cache_seqlens = length_per_sample_.has_value()
+        ? length_per_sample_.value() : torch::full({batch_size}, timestep, torch::dtype(torch::kInt32));
+    auto out = varlen_attention_with_kv_cache(q.flatten(0, 1), k.flatten(0, 1), v.flatten(0, 1),
+                                              k_cache, v_cache, cu_seqlens_q, cache_seqlens,
+                                              c10::nullopt, softmax_scale, /*is_causal=*/true);
+    return out.view({batch_size, num_queries, nheads, headdim});
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.def("single_query_attention", &single_query_attention, "Attention with a single query",
           py::arg("q"), py::arg("k"), py::arg("v"), py::arg("k_cache"), py::arg("v_cache"),
           py::arg("length_per_sample_"), py::arg("timestep"), py::arg("rotary_embedding_dim")=0,
-          py::arg("neox_rotary_style")=true);
+          py::arg("neox_rotary_style")=true, py::arg("ia3_tasks_")=py::none(),
+          py::arg("ia3_key_weights_")=py::none(), py::arg("ia3_value_weights_")=py::none(),
+          py::arg("finished_")=py::none());
+    m.def("single_query_cross_attention", &single_query_cross_attention,
+          "Cross attention with a single query over a fixed encoder memory",
+          py::arg("q"), py::arg("k_memory"), py::arg("v_memory"),
+          py::arg("memory_length_per_sample"), py::arg("timestep"),
+          py::arg("ia3_tasks_")=py::none(), py::arg("ia3_key_weights_")=py::none(),
+          py::arg("ia3_value_weights_")=py::none(), py::arg("finished_")=py::none());
+    m.def("append_kv_cache", &append_kv_cache,
+          "Write new K/V (varlen) to the KV cache, in the layout of single_query_attention or paged",
+          py::arg("k"), py::arg("v"), py::arg("k_cache"), py::arg("v_cache"),
+          py::arg("cu_seqlens_q"), py::arg("cache_seqlens"), py::arg("block_table_")=py::none());
+    m.def("varlen_attention_with_kv_cache", &varlen_attention_with_kv_cache,
+          "Attention of new tokens (varlen) against the KV cache, appending them to the cache",
+          py::arg("q"), py::arg("k"), py::arg("v"), py::arg("k_cache"), py::arg("v_cache"),
+          py::arg("cu_seqlens_q"), py::arg("cache_seqlens"), py::arg("block_table_")=py::none(),
+          py::arg("softmax_scale")=0.0f, py::arg("is_causal")=true);
+    m.def("multi_token_attention", &multi_token_attention,
+          "Attention with a few new queries per sequence, causal among them",
+          py::arg("q"), py::arg("k"), py::arg("v"), py::arg("k_cache"), py::arg("v_cache"),
+          py::arg("length_per_sample_"), py::arg("timestep"), py::arg("softmax_scale")=0.0f);
 }
@@ -0,0 +1,292 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "ft_attention_cpu.h"
+
+namespace {
+
+// Same coefficients as mmha::rotary_embedding_coefficient: the pair (x, y) with pair index zid / 2
+// is rotated by t_step / 10000^(zid / rot_embed_dim).
+inline void apply_rotary_embedding(float *x, int rot_embed_dim, bool neox_rotary_style, int t_step) {
+    const int half_rotary_dim = rot_embed_dim / 2;
+    for (int i = 0; i < half_rotary_dim; ++i) {
+        const float inv_freq = t_step / std::pow(10000.0f, 2 * i / float(rot_embed_dim));
+        const float cos_ = std::cos(inv_freq), sin_ = std::sin(inv_freq);
+        // GPT-NeoX rotates dimensions i and i + rot_embed_dim / 2, GPT-J rotates 2i and 2i + 1.
+        float &x0 = neox_rotary_style ? x[i] : x[2 * i];
+        float &x1 = neox_rotary_style ? x[i + half_rotary_dim] : x[2 * i + 1];
+        const float x0_ = x0;
+        x0 = cos_ * x0_ - sin_ * x1;
+        x1 = cos_ * x1 + sin_ * x0_;
+    }
+}
+
+// Round to T, as the CUDA kernel keeps q, k and v in T.
+template<typename T>
+inline void round_to(float *x, int n) {
+    for (int i = 0; i < n; ++i) { x[i] = static_cast<float>(static_cast<T>(x[i])); }
+}
+
+}  // namespace
+
+// Same structure as mmha::masked_multihead_attention_kernel. With DO_CROSS_ATTENTION, the K/V caches
+// hold the encoder memory, of length memory_length_per_sample[bi], and there's no new K/V: at
+// timestep 0 the biases and the IA3 scaling are applied to the memory in place.
+template<typename T, bool DO_CROSS_ATTENTION>
+void multihead_attention_cpu_(const Multihead_attention_params_cpu<T>& params) {
+    const int Dh = params.hidden_size_per_head;
+    const int L = params.memory_max_len;
+    // The number of elements in a chunk of 16B (that's the x of the K cache layout).
+    constexpr int QK_ELTS_IN_16B = 16 / sizeof(T);
+    auto k_idx = [&](int ti, int d) {
+        return (d / QK_ELTS_IN_16B) * L * QK_ELTS_IN_16B + ti * QK_ELTS_IN_16B + d % QK_ELTS_IN_16B;
+    };
+    at::parallel_for(0, int64_t(params.batch_size) * params.num_heads, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> q(Dh), k(Dh), v(Dh), out(Dh), qk(L);
+        for (int64_t bhi = begin; bhi < end; ++bhi) {
+            const int bi = bhi / params.num_heads;
+            const int hi = bhi % params.num_heads;
+            if (params.finished != nullptr && params.finished[bi] == true) { continue; }
+            const int tlength = DO_CROSS_ATTENTION ? params.memory_length_per_sample[bi] - 1
+                : (params.length_per_sample == nullptr ? params.timestep : params.length_per_sample[bi]);
+            const int first_step = std::max(0, tlength + 1 - L);
+            const int tlength_circ = tlength % L;
+            const int qkv_base_offset = params.stride == 0 ? bhi * Dh : bi * params.stride + hi * Dh;
+            const int ia3_task_id = params.ia3_tasks != nullptr ? params.ia3_tasks[bi / params.beam_width] : 0;
+            const int ia3_offset = (ia3_task_id * params.num_heads + hi) * Dh;
+            T *k_cache = params.k_cache + bhi * L * Dh;
+            T *v_cache = params.v_cache + bhi * L * Dh;
+
+            for (int d = 0; d < Dh; ++d) {
+                q[d] = static_cast<float>(params.q[qkv_base_offset + d]);
+                if (params.q_bias != nullptr) { q[d] += static_cast<float>(params.q_bias[hi * Dh + d]); }
+            }
+            round_to<T>(q.data(), Dh);
+            if (DO_CROSS_ATTENTION) {
+                if (params.timestep == 0
+                    && (params.k_bias != nullptr || params.v_bias != nullptr || params.ia3_tasks != nullptr)) {
+                    for (int ti = first_step; ti <= tlength; ++ti) {
+                        const int ti_circ = ti % L;
+                        for (int d = 0; d < Dh; ++d) {
+                            k[d] = static_cast<float>(k_cache[k_idx(ti_circ, d)]);
+                            v[d] = static_cast<float>(v_cache[ti_circ * Dh + d]);
+                            if (params.k_bias != nullptr) { k[d] += static_cast<float>(params.k_bias[hi * Dh + d]); }
+                            if (params.v_bias != nullptr) { v[d] += static_cast<float>(params.v_bias[hi * Dh + d]); }
+                        }
+                        round_to<T>(k.data(), Dh); round_to<T>(v.data(), Dh);
+                        for (int d = 0; d < Dh; ++d) {
+                            if (params.ia3_tasks != nullptr) {
+                                k[d] *= static_cast<float>(params.ia3_key_weights[ia3_offset + d]);
+                                v[d] *= static_cast<float>(params.ia3_value_weights[ia3_offset + d]);
+                            }
+                            k_cache[k_idx(ti_circ, d)] = static_cast<T>(k[d]);
+                            v_cache[ti_circ * Dh + d] = static_cast<T>(v[d]);
+                        }
+                    }
+                }
+            } else {
+                for (int d = 0; d < Dh; ++d) {
+                    k[d] = static_cast<float>(params.k[qkv_base_offset + d]);
+                    v[d] = static_cast<float>(params.v[qkv_base_offset + d]);
+                    if (params.k_bias != nullptr) { k[d] += static_cast<float>(params.k_bias[hi * Dh + d]); }
+                    if (params.v_bias != nullptr) { v[d] += static_cast<float>(params.v_bias[hi * Dh + d]); }
+                }
+                round_to<T>(k.data(), Dh); round_to<T>(v.data(), Dh);
+                if (params.ia3_tasks != nullptr) {
+                    for (int d = 0; d < Dh; ++d) {
+                        k[d] *= static_cast<float>(params.ia3_key_weights[ia3_offset + d]);
+                        v[d] *= static_cast<float>(params.ia3_value_weights[ia3_offset + d]);
+                    }
+                    round_to<T>(k.data(), Dh); round_to<T>(v.data(), Dh);
+                }
+                if (params.rotary_embedding_dim > 0) {
+                    apply_rotary_embedding(q.data(), params.rotary_embedding_dim, params.neox_rotary_style, tlength);
+                    apply_rotary_embedding(k.data(), params.rotary_embedding_dim, params.neox_rotary_style, tlength);
+                    round_to<T>(q.data(), Dh); round_to<T>(k.data(), Dh);
+                }
+                // Store the new K and V to the cache.
+                for (int d = 0; d < Dh; ++d) {
+                    k_cache[k_idx(tlength_circ, d)] = static_cast<T>(k[d]);
+                    v_cache[tlength_circ * Dh + d] = static_cast<T>(v[d]);
+                }
+            }
+
+            float qk_max = -FLT_MAX;
+            for (int ti = first_step; ti <= tlength; ++ti) {
+                const int ti_circ = ti % L;
+                float acc = 0.f;
+                for (int d = 0; d < Dh; ++d) { acc += q[d] * static_cast<float>(k_cache[k_idx(ti_circ, d)]); }
+                qk[ti - first_step] = acc * params.inv_sqrt_dh;
+                qk_max = std::max(qk_max, qk[ti - first_step]);
+            }
+            float sum = 0.f;
+            for (int ti = first_step; ti <= tlength; ++ti) {
+                qk[ti - first_step] = std::exp(qk[ti - first_step] - qk_max);
+                sum += qk[ti - first_step];
+            }
+            const float inv_sum = 1.f / (sum + 1.e-6f);
+            std::fill(out.begin(), out.end(), 0.f);
+            for (int ti = first_step; ti <= tlength; ++ti) {
+                const T *v_row = v_cache + (ti % L) * Dh;
+                const float p = qk[ti - first_step] * inv_sum;
+                for (int d = 0; d < Dh; ++d) { out[d] += p * static_cast<float>(v_row[d]); }
+            }
+            for (int d = 0; d < Dh; ++d) { params.out[bhi * Dh + d] = static_cast<T>(out[d]); }
+        }
+    });
+}
+
+template<typename T>
+void masked_multihead_attention_cpu(const Multihead_attention_params_cpu<T>& params) {
+    multihead_attention_cpu_<T, false>(params);
+}
+
+template<typename T>
+void cross_multihead_attention_cpu(const Multihead_attention_params_cpu<T>& params) {
+    multihead_attention_cpu_<T, true>(params);
+}
+
+template void masked_multihead_attention_cpu<float>(const Multihead_attention_params_cpu<float>& params);
+template void masked_multihead_attention_cpu<at::Half>(const Multihead_attention_params_cpu<at::Half>& params);
+template void masked_multihead_attention_cpu<at::BFloat16>(const Multihead_attention_params_cpu<at::BFloat16>& params);
+
+template void cross_multihead_attention_cpu<float>(const Multihead_attention_params_cpu<float>& params);
+template void cross_multihead_attention_cpu<at::Half>(const Multihead_attention_params_cpu<at::Half>& params);
+template void cross_multihead_attention_cpu<at::BFloat16>(const Multihead_attention_params_cpu<at::BFloat16>& params);
+
+// Offsets in the K and V caches of Kv_cache_attention_params_cpu.
+template<typename T>
+struct KvCacheLayout {
+    const Kv_cache_attention_params_cpu<T>& params;
+    static constexpr int QK_ELTS_IN_16B = 16 / sizeof(T);
+
+    int64_t block_of(int bi, int ti) const {
+        const int S = params.block_size;
+        return params.block_table == nullptr ? bi : params.block_table[bi * params.max_num_blocks_per_seq + ti / S];
+    }
+    // Position ti of sequence bi and head hi. Element d of that K row is at k_elt(d) from there.
+    int64_t k_offset(int bi, int hi, int ti) const {
+        const int S = params.block_size;
+        return (block_of(bi, ti) * params.num_heads + hi) * params.hidden_size_per_head * S + (ti % S) * QK_ELTS_IN_16B;
+    }
+    int64_t v_offset(int bi, int hi, int ti) const {
+        const int S = params.block_size;
+        return ((block_of(bi, ti) * params.num_heads + hi) * S + ti % S) * params.hidden_size_per_head;
+    }
+    int k_elt(int d) const {
+        return (d / QK_ELTS_IN_16B) * params.block_size * QK_ELTS_IN_16B + d % QK_ELTS_IN_16B;
+    }
+};
+
+template<typename T>
+void append_kv_cache_cpu(const Kv_cache_attention_params_cpu<T>& params) {
+    const int H = params.num_heads;
+    const int Dh = params.hidden_size_per_head;
+    const KvCacheLayout<T> layout{params};
+    at::parallel_for(0, int64_t(params.batch_size) * H, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t bhi = begin; bhi < end; ++bhi) {
+            const int bi = bhi / H;
+            const int hi = bhi % H;
+            const int q_start = params.cu_seqlens_q[bi];
+            const int seqlen_q = params.cu_seqlens_q[bi + 1] - q_start;
+            for (int i = 0; i < seqlen_q; ++i) {
+                const int ti = params.cache_seqlens[bi] + i;
+                const T *k = params.k + int64_t(q_start + i) * params.k_row_stride + hi * Dh;
+                const T *v = params.v + int64_t(q_start + i) * params.v_row_stride + hi * Dh;
+                T *k_cache = params.k_cache + layout.k_offset(bi, hi, ti);
+                for (int d = 0; d < Dh; ++d) { k_cache[layout.k_elt(d)] = k[d]; }
+                std::copy(v, v + Dh, params.v_cache + layout.v_offset(bi, hi, ti));
+            }
+        }
+    });
+}
+
+// Queries are processed in tiles of kQueriesPerTile rows, so that each K/V row read from the cache
+// is used by all the queries of the tile.
+constexpr int kQueriesPerTile = 16;
+
+template<typename T>
+void kv_cache_attention_cpu(const Kv_cache_attention_params_cpu<T>& params) {
+    const int H = params.num_heads;
+    const int Dh = params.hidden_size_per_head;
+    const KvCacheLayout<T> layout{params};
+
+    append_kv_cache_cpu(params);
+
+    // (bi, first query) of each tile, so that the work is balanced across sequences of different
+    // lengths.
+    std::vector<std::pair<int, int>> tiles;
+    for (int bi = 0; bi < params.batch_size; ++bi) {
+        const int seqlen_q = params.cu_seqlens_q[bi + 1] - params.cu_seqlens_q[bi];
+        for (int i = 0; i < seqlen_q; i += kQueriesPerTile) { tiles.emplace_back(bi, i); }
+    }
+    at::parallel_for(0, int64_t(tiles.size()) * H, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> q(kQueriesPerTile * Dh), kv(Dh), out(kQueriesPerTile * Dh), scores;
+        for (int64_t thi = begin; thi < end; ++thi) {
+            const int bi = tiles[thi / H].first;
+            const int q_tile_start = tiles[thi / H].second;
+            const int hi = thi % H;
+            const int q_start = params.cu_seqlens_q[bi];
+            const int seqlen_q = params.cu_seqlens_q[bi + 1] - q_start;
+            const int cache_seqlen = params.cache_seqlens[bi];
+            const int num_q = std::min(kQueriesPerTile, seqlen_q - q_tile_start);
+            // Query r of the tile attends to positions 0 .. seqlen_k(r) - 1.
+            auto seqlen_k = [&](int r) {
+                return cache_seqlen + (params.is_causal ? q_tile_start + r + 1 : seqlen_q);
+            };
+            const int max_seqlen_k = seqlen_k(num_q - 1);
+            scores.resize(int64_t(num_q) * max_seqlen_k);
+
+            for (int r = 0; r < num_q; ++r) {
+                const T *q_row = params.q + int64_t(q_start + q_tile_start + r) * params.q_row_stride + hi * Dh;
+                for (int d = 0; d < Dh; ++d) { q[r * Dh + d] = static_cast<float>(q_row[d]) * params.softmax_scale; }
+            }
+            for (int ti = 0; ti < max_seqlen_k; ++ti) {
+                const T *k_cache = params.k_cache + layout.k_offset(bi, hi, ti);
+                for (int d = 0; d < Dh; ++d) { kv[d] = static_cast<float>(k_cache[layout.k_elt(d)]); }
+                for (int r = 0; r < num_q; ++r) {
+                    if (ti >= seqlen_k(r)) { continue; }
+                    float acc = 0.f;
+                    for (int d = 0; d < Dh; ++d) { acc += q[r * Dh + d] * kv[d]; }
+                    scores[r * max_seqlen_k + ti] = acc;
+                }
+            }
+            for (int r = 0; r < num_q; ++r) {
+                float *s = scores.data() + r * max_seqlen_k;
+                const int n = seqlen_k(r);
+                const float s_max = *std::max_element(s, s + n);
+                float sum = 0.f;
+                for (int ti = 0; ti < n; ++ti) { s[ti] = std::exp(s[ti] - s_max); sum += s[ti]; }
+                const float inv_sum = 1.f / sum;
+                for (int ti = 0; ti < n; ++ti) { s[ti] *= inv_sum; }
+            }
+            std::fill(out.begin(), out.end(), 0.f);
+            for (int ti = 0; ti < max_seqlen_k; ++ti) {
+                const T *v_cache = params.v_cache + layout.v_offset(bi, hi, ti);
+                for (int d = 0; d < Dh; ++d) { kv[d] = static_cast<float>(v_cache[d]); }
+                for (int r = 0; r < num_q; ++r) {
+                    if (ti >= seqlen_k(r)) { continue; }
+                    const float p = scores[r * max_seqlen_k + ti];
+                    for (int d = 0; d < Dh; ++d) { out[r * Dh + d] += p * kv[d]; }
+                }
+            }
+            for (int r = 0; r < num_q; ++r) {
+                T *out_row = params.out + (int64_t(q_start + q_tile_start + r) * H + hi) * Dh;
+                for (int d = 0; d < Dh; ++d) { out_row[d] = static_cast<T>(out[r * Dh + d]); }
+            }
+        }
+    });
+}
+
+template void append_kv_cache_cpu<float>(const Kv_cache_attention_params_cpu<float>& params);
+template void append_kv_cache_cpu<at::Half>(const Kv_cache_attention_params_cpu<at::Half>& params);
+template void append_kv_cache_cpu<at::BFloat16>(const Kv_cache_attention_params_cpu<at::BFloat16>& params);
+
+template void kv_cache_attention_cpu<float>(const Kv_cache_attention_params_cpu<float>& params);
+template void kv_cache_attention_cpu<at::Half>(const Kv_cache_attention_params_cpu<at::Half>& params);
+template void kv_cache_attention_cpu<at::BFloat16>(const Kv_cache_attention_params_cpu<at::BFloat16>& params);
@@ -0,0 +1,120 @@
+// CPU implementation of the single-query attention kernel, with the same semantics and the same
+// KV cache layout as the FasterTransformer kernel in decoder_masked_multihead_attention_template.hpp.
+#pragma once
+
+#include <cstdint>
+
+// Mirrors the fields of Masked_multihead_attention_params that the CPU implementation supports,
+// so that set_params in ft_attention.cpp fills both.
+//
+// B:  Batch size (number of sequences),
+// L:  Sequence length,
+// H:  Number of heads,
+// Dh: Hidden dimension per head.
+template<typename T>
+struct Multihead_attention_params_cpu {
+    // The output buffer. Dimensions B x H x Dh.
+    T* out = nullptr;
+
+    // The input Qs, Ks, Vs and the associated biases. Dimensions B x H x Dh (with batch stride
+    // `stride`) and H x Dh.
+    const T *q = nullptr, *q_bias = nullptr;
+    const T *k = nullptr, *k_bias = nullptr;
+    const T *v = nullptr, *v_bias = nullptr;
+
+    // The K cache is [B, H, Dh/x, L, x] with x == 16 / sizeof(T), the V cache is [B, H, L, Dh].
+    T* k_cache = nullptr;
+    T* v_cache = nullptr;
+    const int* cache_indir = nullptr;
+
+    int stride = 0;
+    int batch_size = 0;
+    int beam_width = 0;
+    int memory_max_len = 0;
+    int num_heads = 0;
+    int hidden_size_per_head = 0;
+    int  rotary_embedding_dim = 0;
+    bool neox_rotary_style    = false;
+    int timestep = 0;
+    float inv_sqrt_dh = 0.0f;
+
+    // Per-sample adapters: the new K and V of sample bi and head hi are scaled by
+    // ia3_key_weights[ia3_tasks[bi], hi] and ia3_value_weights[ia3_tasks[bi], hi] (each Dh)
+    // before they're written to the cache (for cross attention, the memory is scaled in place at
+    // timestep 0).
+    const T*   ia3_key_weights   = nullptr;
+    const T*   ia3_value_weights = nullptr;
+    const int* ia3_tasks         = nullptr;
+
+    bool* finished = nullptr;
+    // Cross attention only: the length of the encoder memory of each sample.
+    int* memory_length_per_sample = nullptr;
+    const int* length_per_sample = nullptr;
+
+    // Not supported on CPU, must be nullptr / 0.
+    const int*  total_padding_tokens           = nullptr;
+    const bool* masked_tokens                  = nullptr;
+    const int*  prefix_prompt_lengths          = nullptr;
+    int         max_prefix_prompt_length       = 0;
+    const T*    relative_attention_bias        = nullptr;
+    int         relative_attention_bias_stride = 0;
+    float*      cross_attention_out            = nullptr;
+    int         max_decoder_seq_len            = 0;
+    bool        is_return_cross_attentions     = false;
+};
+
+template<typename T>
+void masked_multihead_attention_cpu(const Multihead_attention_params_cpu<T>& params);
+
+// The K/V caches hold the encoder memory, of length memory_length_per_sample[bi].
+template<typename T>
+void cross_multihead_attention_cpu(const Multihead_attention_params_cpu<T>& params);
+
+// Attention of a chunk of new tokens per sequence (varlen) against the KV cache, e.g. to prefill a
+// long prompt in chunks, or to append a multi-turn conversation to its cache. The new K/V are
+// appended to the cache first.
+//
+// B:     Batch size (number of sequences),
+// H:     Number of heads,
+// Dh:    Hidden dimension per head,
+// S:     Number of cache positions per block (memory_max_len if the cache isn't paged),
+// total: Total number of new tokens.
+template<typename T>
+struct Kv_cache_attention_params_cpu {
+    // The output buffer. Dimensions total x H x Dh.
+    T* out = nullptr;
+
+    // The new Qs, Ks, Vs. Dimensions total x H x Dh, with token strides q/k/v_row_stride.
+    const T *q = nullptr, *k = nullptr, *v = nullptr;
+    int q_row_stride = 0, k_row_stride = 0, v_row_stride = 0;
+
+    // The K cache is [num_blocks, H, Dh/x, S, x] with x == 16 / sizeof(T), the V cache is
+    // [num_blocks, H, S, Dh]. Position ti of sequence bi is in block
+    // block_table[bi * max_num_blocks_per_seq + ti / S], or in block bi if block_table is nullptr
+    // (then S == memory_max_len and the layout is the one of masked_multihead_attention_cpu).
+    T* k_cache = nullptr;
+    T* v_cache = nullptr;
+    const int* block_table = nullptr;
+    int block_size = 0;
+    int max_num_blocks_per_seq = 0;
+
+    // The new tokens of sequence bi are cu_seqlens_q[bi] .. cu_seqlens_q[bi + 1] - 1, they go to
+    // cache positions cache_seqlens[bi] onwards.
+    const int* cu_seqlens_q = nullptr;
+    const int* cache_seqlens = nullptr;
+
+    int batch_size = 0;
+    int num_heads = 0;
+    int hidden_size_per_head = 0;
+    float softmax_scale = 0.0f;
+    // New token i of sequence bi attends to cache positions 0 .. cache_seqlens[bi] + i, instead of
+    // all the cache and all the new tokens.
+    bool is_causal = false;
+};
+
+// Only writes the new K/V to the cache (q, out and the softmax parameters are unused).
+template<typename T>
+void append_kv_cache_cpu(const Kv_cache_attention_params_cpu<T>& params);
+
+template<typename T>
+void kv_cache_attention_cpu(const Kv_cache_attention_params_cpu<T>& params);
@@ -98,50 +98,61 @@ torch_dir = torch.__path__[0]
 if os.path.exists(os.path.join(torch_dir, "include", "ATen", "CUDAGeneratorImpl.h")):
     generator_flag = ["-DOLD_GENERATOR_PATH"]
 
-raise_if_cuda_home_none("--ft_attention")
-# Check, if CUDA11 is installed for compute capability 8.0
-cc_flag = []
-_, bare_metal_version = get_cuda_bare_metal_version(CUDA_HOME)
-if bare_metal_version < Version("11.0"):
-    raise RuntimeError("ft_attention is only supported on CUDA 11 and above")
-cc_flag.append("-gencode")
-cc_flag.append("arch=compute_70,code=sm_70")
-cc_flag.append("-gencode")
-cc_flag.append("arch=compute_80,code=sm_80")
-if bare_metal_version >= Version("11.8"):
+if CUDA_HOME is not None:
+    # Check, if CUDA11 is installed for compute capability 8.0
+    cc_flag = []
+    _, bare_metal_version = get_cuda_bare_metal_version(CUDA_HOME)
+    if bare_metal_version < Version("11.0"):
+        raise RuntimeError("ft_attention is only supported on CUDA 11 and above")
+    cc_flag.append("-gencode")
+    cc_flag.append("arch=compute_70,code=sm_70")
     cc_flag.append("-gencode")
-    cc_flag.append("arch=compute_90,code=sm_90")
-
-ext_modules.append(
-    CUDAExtension(
-        name="ft_attention",
-        sources=[
-            "ft_attention.cpp",
-            "decoder_masked_multihead_attention.cu",
-        ],
-        extra_compile_args={
-            "cxx": ["-O3", "-DENABLE_BF16"] + generator_flag,
-            "nvcc": append_nvcc_threads(
-                [
-                    "-DENABLE_BF16",  # TODO
-                    "-O3",
-                    "-U__CUDA_NO_HALF_OPERATORS__",
-                    "-U__CUDA_NO_HALF_CONVERSIONS__",
-                    "-U__CUDA_NO_BFLOAT16_OPERATORS__",
-                    "-U__CUDA_NO_BFLOAT16_CONVERSIONS__",
-                    "-U__CUDA_NO_BFLOAT162_OPERATORS__",
-                    "-U__CUDA_NO_BFLOAT162_CONVERSIONS__",
-                    "--expt-relaxed-constexpr",
-                    "--expt-extended-lambda",
-                    "--use_fast_math",
-                ]
-                + generator_flag
-                + cc_flag
-            ),
-        },
-        include_dirs=[this_dir],
+    cc_flag.append("arch=compute_80,code=sm_80")
+    if bare_metal_version >= Version("11.8"):
+        cc_flag.append("-gencode")
+        cc_flag.append("arch=compute_90,code=sm_90")
+
+    ext_modules.append(
+        CUDAExtension(
+            name="ft_attention",
+            sources=[
+                "ft_attention.cpp",
+                "ft_attention_cpu.cpp",
+                "decoder_masked_multihead_attention.cu",
+            ],
+            extra_compile_args={
+                "cxx": ["-O3", "-DENABLE_BF16", "-DWITH_CUDA"] + generator_flag,
+                "nvcc": append_nvcc_threads(
+                    [
+                        "-DENABLE_BF16",  # TODO
+                        "-O3",
+                        "-U__CUDA_NO_HALF_OPERATORS__",
+                        "-U__CUDA_NO_HALF_CONVERSIONS__",
+                        "-U__CUDA_NO_BFLOAT16_OPERATORS__",
+                        "-U__CUDA_NO_BFLOAT16_CONVERSIONS__",
+                        "-U__CUDA_NO_BFLOAT162_OPERATORS__",
+                        "-U__CUDA_NO_BFLOAT162_CONVERSIONS__",
+                        "--expt-relaxed-constexpr",
+                        "--expt-extended-lambda",
+                        "--use_fast_math",
+                    ]
+                    + generator_flag
+                    + cc_flag
+                ),
+            },
+            include_dirs=[this_dir],
+        )
+    )
+else:
+    # CPU-only build: only the CPU implementation of the kernels is available.
+    ext_modules.append(
+        CppExtension(
+            name="ft_attention",
+            sources=["ft_attention.cpp", "ft_attention_cpu.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir],
+        )
     )
-)
 
 setup(
     name="ft_attention",
@@ -0,0 +1,158 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fused_dense_cpu.h"
+
+namespace fused_dense {
+
+namespace {
+
+// Columns per task of the backward, which reduces the bias gradient over the rows: each task owns
+// a block of columns, so the sums are deterministic and need no atomics.
+constexpr int64_t kBlockCols = 64;
+
+template <Activation act>
+inline float activation_grad(float x) {
+    if (act == Activation::GeluApprox) {
+        return gelu_approx_bwd(x);
+    } else if (act == Activation::Relu) {
+        return x > 0.f ? 1.f : 0.f;
+    } else if (act == Activation::Gelu) {
+        return gelu_erf_bwd(x);
+    } else {
+        return 1.f;
+    }
+}
+
+// Loads n elements of a row + bias in fp32
+template <typename T>
+inline void load_row(const T *x, const T *bias, int64_t n, float *dst) {
+    for (int64_t j = 0; j < n; ++j) { dst[j] = static_cast<float>(x[j]); }
+    if (bias != nullptr) {
+        for (int64_t j = 0; j < n; ++j) { dst[j] += static_cast<float>(bias[j]); }
+    }
+}
+
+}  // namespace
+
+template<typename T>
+void bias_act_forward_cpu(const T *x, const T *bias, int64_t rows, int64_t cols, Activation act,
+                          T *out, uint8_t *mask) {
+    ACTIVATION_SWITCH(act, kAct, [&] {
+        at::parallel_for(0, rows, std::max<int64_t>(1, (1 << 14) / std::max<int64_t>(cols, 1)),
+                         [&](int64_t begin, int64_t end) {
+            std::vector<float> buf(cols);
+            for (int64_t r = begin; r < end; ++r) {
+                load_row(x + r * cols, bias, cols, buf.data());
+                if (kAct == Activation::Relu && mask != nullptr) {
+                    uint8_t *mask_row = mask + r * (cols / 8);
+                    for (int64_t j = 0; j < cols / 8; ++j) {
+                        uint8_t bits = 0;
+                        for (int b = 0; b < 8; ++b) { bits |= uint8_t(buf[8 * j + b] > 0.f) << b; }
+                        mask_row[j] = bits;
+                    }
+                }
+                T *out_row = out + r * cols;
+                for (int64_t j = 0; j < cols; ++j) {
+                    out_row[j] = static_cast<T>(apply_activation<kAct>(buf[j]));
+                }
+            }
+        });
+    });
+}
+
+template<typename T>
+void bias_act_backward_cpu(const T *grad_out, const T *x, const T *bias, const uint8_t *mask,
+                           int64_t rows, int64_t cols, Activation act, T *grad_in,
+                           float *grad_bias) {
+    const int64_t num_blocks = (cols + kBlockCols - 1) / kBlockCols;
+    ACTIVATION_SWITCH(act, kAct, [&] {
+        at::parallel_for(0, num_blocks, 1, [&](int64_t begin, int64_t end) {
+            float buf[kBlockCols], acc[kBlockCols];
+            for (int64_t blk = begin; blk < end; ++blk) {
+                const int64_t c0 = blk * kBlockCols;
+                const int64_t n = std::min(kBlockCols, cols - c0);
+                std::fill(acc, acc + n, 0.f);
+                for (int64_t r = 0; r < rows; ++r) {
+                    if (kAct == Activation::Relu && mask != nullptr) {
+                        // c0 is a multiple of 8
+                        const uint8_t *mask_row = mask + r * (cols / 8) + c0 / 8;
+                        for (int64_t j = 0; j < n; ++j) {
+                            buf[j] = float((mask_row[j / 8] >> (j % 8)) & 1);
+                        }
+                    } else {
+                        load_row(x + r * cols + c0, bias != nullptr ? bias + c0 : nullptr, n, buf);
+                        for (int64_t j = 0; j < n; ++j) { buf[j] = activation_grad<kAct>(buf[j]); }
+                    }
+                    const T *g = grad_out + r * cols + c0;
+                    T *dst = grad_in + r * cols + c0;
+                    for (int64_t j = 0; j < n; ++j) {
+                        const float d = buf[j] * static_cast<float>(g[j]);
+                        acc[j] += d;
+                        dst[j] = static_cast<T>(d);
+                    }
+                }
+                if (grad_bias != nullptr) { std::copy(acc, acc + n, grad_bias + c0); }
+            }
+        });
+    });
+}
+
+template<typename T>
+void swiglu_forward_cpu(const T *x, int64_t rows, int64_t cols, T *out) {
+    at::parallel_for(0, rows, std::max<int64_t>(1, (1 << 14) / std::max<int64_t>(cols, 1)),
+                     [&](int64_t begin, int64_t end) {
+        std::vector<float> gate(cols), value(cols);
+        for (int64_t r = begin; r < end; ++r) {
+            load_row(x + r * 2 * cols, static_cast<const T *>(nullptr), cols, gate.data());
+            load_row(x + r * 2 * cols + cols, static_cast<const T *>(nullptr), cols, value.data());
+            T *out_row = out + r * cols;
+            for (int64_t j = 0; j < cols; ++j) {
+                out_row[j] = static_cast<T>(gate[j] * sigmoid(gate[j]) * value[j]);
+            }
+        }
+    });
+}
+
+template<typename T>
+void swiglu_backward_cpu(const T *grad_out, const T *x, int64_t rows, int64_t cols, T *grad_x) {
+    at::parallel_for(0, rows, std::max<int64_t>(1, (1 << 14) / std::max<int64_t>(cols, 1)),
+                     [&](int64_t begin, int64_t end) {
+        std::vector<float> gate(cols), value(cols), g(cols);
+        for (int64_t r = begin; r < end; ++r) {
+            load_row(x + r * 2 * cols, static_cast<const T *>(nullptr), cols, gate.data());
+            load_row(x + r * 2 * cols + cols, static_cast<const T *>(nullptr), cols, value.data());
+            load_row(grad_out + r * cols, static_cast<const T *>(nullptr), cols, g.data());
+            T *grad_gate = grad_x + r * 2 * cols;
+            T *grad_value = grad_gate + cols;
+            for (int64_t j = 0; j < cols; ++j) {
+                const float s = sigmoid(gate[j]);
+                const float silu = gate[j] * s;
+                // d silu / dx = s * (1 + x * (1 - s))
+                grad_gate[j] = static_cast<T>(g[j] * value[j] * s * (1.f + gate[j] * (1.f - s)));
+                grad_value[j] = static_cast<T>(g[j] * silu);
+            }
+        }
+    });
+}
+
+template void bias_act_forward_cpu<float>(const float *x, const float *bias, int64_t rows, int64_t cols, Activation act, float *out, uint8_t *mask);
+template void bias_act_forward_cpu<at::Half>(const at::Half *x, const at::Half *bias, int64_t rows, int64_t cols, Activation act, at::Half *out, uint8_t *mask);
+template void bias_act_forward_cpu<at::BFloat16>(const at::BFloat16 *x, const at::BFloat16 *bias, int64_t rows, int64_t cols, Activation act, at::BFloat16 *out, uint8_t *mask);
+
+template void bias_act_backward_cpu<float>(const float *grad_out, const float *x, const float *bias, const uint8_t *mask, int64_t rows, int64_t cols, Activation act, float *grad_in, float *grad_bias);
+template void bias_act_backward_cpu<at::Half>(const at::Half *grad_out, const at::Half *x, const at::Half *bias, const uint8_t *mask, int64_t rows, int64_t cols, Activation act, at::Half *grad_in, float *grad_bias);
+template void bias_act_backward_cpu<at::BFloat16>(const at::BFloat16 *grad_out, const at::BFloat16 *x, const at::BFloat16 *bias, const uint8_t *mask, int64_t rows, int64_t cols, Activation act, at::BFloat16 *grad_in, float *grad_bias);
+
+template void swiglu_forward_cpu<float>(const float *x, int64_t rows, int64_t cols, float *out);
+template void swiglu_forward_cpu<at::Half>(const at::Half *x, int64_t rows, int64_t cols, at::Half *out);
+template void swiglu_forward_cpu<at::BFloat16>(const at::BFloat16 *x, int64_t rows, int64_t cols, at::BFloat16 *out);
+
+template void swiglu_backward_cpu<float>(const float *grad_out, const float *x, int64_t rows, int64_t cols, float *grad_x);
+template void swiglu_backward_cpu<at::Half>(const at::Half *grad_out, const at::Half *x, int64_t rows, int64_t cols, at::Half *grad_x);
+template void swiglu_backward_cpu<at::BFloat16>(const at::BFloat16 *grad_out, const at::BFloat16 *x, int64_t rows, int64_t cols, at::BFloat16 *grad_x);
+
+}  // namespace fused_dense
@@ -0,0 +1,108 @@
+// CPU implementation of the bias + activation kernels (GELU with the tanh approximation, exact
+// GELU, ReLU, SwiGLU), forward and backward.
+// The math functions are branch-free fp32 approximations (no calls into libm; clamps are
+// std::min / std::max, rounding uses the 1.5 * 2^23 trick), so that loops over contiguous elements
+// calling them are vectorized by the compiler (with -fno-trapping-math, see setup.py; checked with
+// g++ -O3 -fopt-info-vec). They are also used by the epilogue of the GEMMs in fused_dense_cpu.h.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace fused_dense {
+
+// Defined in fused_dense_cpu.h
+enum class Activation : int;
+
+// exp(x), with the range reduction and the degree-5 polynomial of Cephes' expf (relative error
+// ~2 ulp). The input is clamped to [-87.3, 88].
+inline float fast_exp(float x) {
+    x = std::max(std::min(x, 88.f), -87.3365478515625f);
+    // x = n * ln(2) + r, |r| <= ln(2) / 2. Adding and subtracting 1.5 * 2^23 rounds to the nearest
+    // integer (|n| <= 127).
+    const float n = (x * 1.44269504088896341f + 12582912.f) - 12582912.f;
+    const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.f;
+    // p * 2^n
+    const int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// tanh(x) = 1 - 2 / (exp(2x) + 1), absolute error ~1e-7.
+inline float fast_tanh(float x) {
+    return 1.f - 2.f / (fast_exp(2.f * x) + 1.f);
+}
+
+// erf(x), Abramowitz & Stegun 7.1.26, absolute error ~2e-7.
+inline float fast_erf(float x) {
+    const float ax = std::abs(x);
+    const float t = 1.f / (1.f + 0.3275911f * ax);
+    float p = 1.061405429f;
+    p = p * t - 1.453152027f;
+    p = p * t + 1.421413741f;
+    p = p * t - 0.284496736f;
+    p = p * t + 0.254829592f;
+    const float y = 1.f - p * t * fast_exp(-ax * ax);
+    return std::copysign(y, x);
+}
+
+inline float sigmoid(float x) { return 1.f / (1.f + fast_exp(-x)); }
+
+// 0.5 * x * (1 + tanh(sqrt(2 / pi) * (x + 0.044715 * x^3))), as CUBLASLT_EPILOGUE_GELU
+inline float gelu_approx_fwd(float x) {
+    return 0.5f * x * (1.f + fast_tanh(0.79788456f * x * (1.f + 0.044715f * x * x)));
+}
+
+// d gelu_approx / dx, computing tanh once
+inline float gelu_approx_bwd(float x) {
+    const float tanh_out = fast_tanh(0.79788456f * x * (1.f + 0.044715f * x * x));
+    // sqrt(2/pi) * 3 * 0.044715 -> 0.1070322243
+    return 0.5f * x * ((1.f - tanh_out * tanh_out) * (0.79788456f + 0.1070322243f * x * x))
+        + 0.5f * (1.f + tanh_out);
+}
+
+// 0.5 * x * (1 + erf(x / sqrt(2)))
+inline float gelu_erf_fwd(float x) {
+    return 0.5f * x * (1.f + fast_erf(x * 0.70710678f));
+}
+
+inline float gelu_erf_bwd(float x) {
+    // 1 / sqrt(2 * pi) -> 0.3989423
+    return 0.5f * (1.f + fast_erf(x * 0.70710678f)) + 0.3989423f * x * fast_exp(-0.5f * x * x);
+}
+
+// out = act(x + bias), x and out: rows x cols, bias: cols (can be null).
+// With ReLU, if mask is not null, it gets the bit-packed mask of the positive pre-activations (the
+// layout of the cuBLASLt ReLU aux output): bit b of byte r * cols / 8 + j is set iff element
+// (r, 8 * j + b) is positive. cols must then be a multiple of 8. The backward only needs the mask,
+// 1 bit per element instead of the input.
+template<typename T>
+void bias_act_forward_cpu(const T *x, const T *bias, int64_t rows, int64_t cols, Activation act,
+                          T *out, uint8_t *mask);
+
+// grad_in = grad_out * act'(x + bias), and grad_bias (fp32, can be null) = the sum of grad_in over
+// the rows. With ReLU, either x or mask (from bias_act_forward_cpu) can be passed.
+template<typename T>
+void bias_act_backward_cpu(const T *grad_out, const T *x, const T *bias, const uint8_t *mask,
+                           int64_t rows, int64_t cols, Activation act, T *grad_in,
+                           float *grad_bias);
+
+// x: rows x (2 * cols), the gate then the value. out (rows x cols) = silu(gate) * value.
+template<typename T>
+void swiglu_forward_cpu(const T *x, int64_t rows, int64_t cols, T *out);
+
+// grad_x: rows x (2 * cols).
+template<typename T>
+void swiglu_backward_cpu(const T *grad_out, const T *x, int64_t rows, int64_t cols, T *grad_x);
+
+}  // namespace fused_dense
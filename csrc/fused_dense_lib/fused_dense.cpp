@@ -2,11 +2,15 @@
 // We make it work for bfloat16
 #include <torch/extension.h>
 #include <torch/torch.h>
+#ifdef WITH_CUDA
 #include <c10/cuda/CUDAGuard.h>
+#endif
 #include <vector>
 
 #include <stdio.h>
 
+#include "fused_dense_cpu.h"
+
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
 
 // https://github.com/NVIDIA/apex/blob/master/csrc/type_shim.h
@@ -33,6 +37,21 @@ int linear_bias_wgrad_cuda(const T *input, const T *d_output, int64_t in_feature
 template <typename T>
 int linear_act_forward_cuda(const T *input, const T *weight, const T *bias, int64_t in_features, int64_t batch_size, int64_t out_features, bool is_gelu, int heuristic, T *output, void *pre_act);
 
+template <typename T>
+void linear_act_forward_quant_cpu(const T *input, const void *qweight, const float *scales, const T *bias, int64_t in_features, int64_t batch_size, int64_t out_features, int bits, int64_t group_size, fused_dense::Activation act, T *output);
+
+template <typename T>
+void linear_gather_forward_cpu(const T *input, const int64_t *indices, const T *weight, const T *bias, int64_t in_features, int64_t num_indices, int64_t out_features, T *output);
+
+template <typename T>
+void patch_embed_forward_cpu(const T *images, const T *weight, const T *bias, const T *pos_embed, const T *cls_token, int64_t batch_size, int64_t channels, int64_t height, int64_t width, int64_t patch_h, int64_t patch_w, int64_t embed_dim, bool pos_embed_has_prefix, T *output);
+
+template <typename T>
+void mlp_chunked_forward_cpu(const T *input, const T *weight1, const T *bias1, const T *weight2, const T *bias2, int64_t in_features, int64_t batch_size, int64_t hidden_features, int64_t out_features, int64_t chunk_size, fused_dense::Activation act, T *output, float *pre_act);
+
+template <typename T, typename R>
+void ln_linear_act_forward_cpu(const T *x0, const R *residual, const uint8_t *dmask, const T *gamma, const T *beta, const T *weight, const T *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, fused_dense::Activation act, T *output, R *x, T *z, float *mu, float *rsigma);
+
 template <typename T>
 int bias_act_linear_dgrad_bgrad_cuda(const T *weight, const T *d_output, const void *pre_act, int64_t in_features, int64_t batch_size, int64_t out_features, bool is_gelu, int heuristic, T *d_input, T *d_bias);
 
@@ -51,6 +70,7 @@ std::vector<at::Tensor> linear_bias_wgrad(at::Tensor input, at::Tensor d_output,
   CHECK_SHAPE(input, batch_size, in_features);
   CHECK_SHAPE(d_output, batch_size, out_features);
 
+#ifdef WITH_CUDA
   // Otherwise the kernel will be launched from cuda:0 device
   // Cast to char to avoid compiler warning about narrowing
   at::cuda::CUDAGuard device_guard{(char)input.get_device()};
@@ -80,6 +100,9 @@ std::vector<at::Tensor> linear_bias_wgrad(at::Tensor input, at::Tensor d_output,
   });
 
   return {d_weight, d_bias};
+#else
+  TORCH_CHECK(false, "fused_dense_lib was built without CUDA");
+#endif
 }
 
 std::vector<at::Tensor> linear_act_forward(at::Tensor input, at::Tensor weight,
@@ -106,6 +129,7 @@ std::vector<at::Tensor> linear_act_forward(at::Tensor input, at::Tensor weight,
     CHECK_SHAPE(bias, out_features);
   }
 
+#ifdef WITH_CUDA
   // Otherwise the kernel will be launched from cuda:0 device
   // Cast to char to avoid compiler warning about narrowing
   at::cuda::CUDAGuard device_guard{(char)input.get_device()};
@@ -136,6 +160,9 @@ std::vector<at::Tensor> linear_act_forward(at::Tensor input, at::Tensor weight,
   std::vector<at::Tensor> result = {output};
   if (save_pre_act) { result.push_back(pre_act); };
   return result;
+#else
+  TORCH_CHECK(false, "fused_dense_lib was built without CUDA");
+#endif
 }
 
 std::vector<at::Tensor> bias_act_linear_dgrad_bgrad(
@@ -160,6 +187,7 @@ std::vector<at::Tensor> bias_act_linear_dgrad_bgrad(
   // If ReLU, cuBlasLT stores a bit-mask (1 bit per element)
   CHECK_SHAPE(pre_act, batch_size, is_gelu ? in_features : in_features / 8);
 
+#ifdef WITH_CUDA
   // Otherwise the kernel will be launched from cuda:0 device
   // Cast to char to avoid compiler warning about narrowing
   at::cuda::CUDAGuard device_guard{(char)weight.get_device()};
@@ -185,10 +213,498 @@ std::vector<at::Tensor> bias_act_linear_dgrad_bgrad(
   });
 
   return {d_input, d_bias};
+#else
+  TORCH_CHECK(false, "fused_dense_lib was built without CUDA");
+#endif
+}
+
+at::Tensor linear_act_forward_quant(at::Tensor input, at::Tensor qweight, at::Tensor scales,
+                                    c10::optional<at::Tensor> bias_, int bits, int64_t group_size,
+                                    int activation) {
+
+  int64_t batch_size = input.size(0);
+  int64_t in_features = input.size(1);
+  int64_t out_features = qweight.size(0);
+
+  TORCH_CHECK(bits == 8 || bits == 4, "linear_act_forward_quant only supports 8 and 4 bits");
+  TORCH_CHECK(activation >= 0 && activation <= 3, "linear_act_forward_quant: unknown activation");
+  TORCH_CHECK(!input.is_cuda(), "linear_act_forward_quant only has a CPU implementation for now");
+  TORCH_CHECK(input.dtype() == torch::kFloat32 || input.dtype() == torch::kFloat16
+              || input.dtype() == torch::kBFloat16);
+  TORCH_CHECK(qweight.dtype() == (bits == 8 ? torch::kInt8 : torch::kUInt8));
+  TORCH_CHECK(scales.dtype() == torch::kFloat32);
+  TORCH_CHECK(!qweight.is_cuda() && !scales.is_cuda());
+  TORCH_CHECK(input.is_contiguous());
+  TORCH_CHECK(qweight.is_contiguous());
+  TORCH_CHECK(scales.is_contiguous());
+  TORCH_CHECK(group_size > 0 && in_features % group_size == 0,
+              "in_features must be divisible by group_size");
+  if (bits == 4) { TORCH_CHECK(group_size % 2 == 0, "group_size must be even for 4 bits"); }
+  CHECK_SHAPE(input, batch_size, in_features);
+  CHECK_SHAPE(qweight, out_features, bits == 8 ? in_features : in_features / 2);
+  CHECK_SHAPE(scales, out_features, in_features / group_size);
+  if (bias_.has_value()) {
+    auto bias = bias_.value();
+    TORCH_CHECK(bias.dtype() == input.dtype());
+    TORCH_CHECK(!bias.is_cuda());
+    TORCH_CHECK(bias.is_contiguous());
+    CHECK_SHAPE(bias, out_features);
+  }
+
+  auto output = at::empty({batch_size, out_features}, input.options());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "linear_act_forward_quant", [&] {
+    linear_act_forward_quant_cpu<scalar_t>(
+        input.data_ptr<scalar_t>(),
+        qweight.data_ptr(),
+        scales.data_ptr<float>(),
+        bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+        in_features,
+        batch_size,
+        out_features,
+        bits,
+        group_size,
+        static_cast<fused_dense::Activation>(activation),
+        output.data_ptr<scalar_t>());
+  });
+
+  return output;
+}
+
+at::Tensor linear_gather_forward(at::Tensor input, at::Tensor indices, at::Tensor weight,
+                                 c10::optional<at::Tensor> bias_) {
+
+  int64_t batch_size = input.size(0);
+  int64_t in_features = input.size(1);
+  int64_t num_indices = indices.size(0);
+  int64_t out_features = weight.size(0);
+
+  TORCH_CHECK(!input.is_cuda(), "linear_gather_forward only has a CPU implementation");
+  TORCH_CHECK(input.dtype() == torch::kFloat32 || input.dtype() == torch::kFloat16
+              || input.dtype() == torch::kBFloat16);
+  TORCH_CHECK(weight.dtype() == input.dtype());
+  TORCH_CHECK(indices.dtype() == torch::kInt64);
+  TORCH_CHECK(!weight.is_cuda() && !indices.is_cuda());
+  TORCH_CHECK(input.is_contiguous());
+  TORCH_CHECK(weight.is_contiguous());
+  TORCH_CHECK(indices.is_contiguous());
+  CHECK_SHAPE(input, batch_size, in_features);
+  CHECK_SHAPE(indices, num_indices);
+  CHECK_SHAPE(weight, out_features, in_features);
+  if (num_indices > 0) {
+    TORCH_CHECK(indices.min().item<int64_t>() >= 0 && indices.max().item<int64_t>() < batch_size,
+                "linear_gather_forward: indices out of range");
+  }
+  if (bias_.has_value()) {
+    auto bias = bias_.value();
+    TORCH_CHECK(bias.dtype() == input.dtype());
+    TORCH_CHECK(!bias.is_cuda());
+    TORCH_CHECK(bias.is_contiguous());
+    CHECK_SHAPE(bias, out_features);
+  }
+
+  auto output = at::empty({num_indices, out_features}, input.options());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "linear_gather_forward", [&] {
+    linear_gather_forward_cpu<scalar_t>(
+        input.data_ptr<scalar_t>(),
+        indices.data_ptr<int64_t>(),
+        weight.data_ptr<scalar_t>(),
+        bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+        in_features,
+        num_indices,
+        out_features,
+        output.data_ptr<scalar_t>());
+  });
+
+  return output;
+}
+
+// images: (batch_size, channels, height, width). weight: (embed_dim, channels * patch_h * patch_w).
+// pos_embed: (prefix + num_patches, embed_dim) or (num_patches, embed_dim), where prefix is 1 with
+// cls_token (embed_dim,) and 0 without.
+// Returns: (batch_size, prefix + num_patches, embed_dim).
+at::Tensor patch_embed_forward(at::Tensor images, at::Tensor weight, c10::optional<at::Tensor> bias_,
+                               c10::optional<at::Tensor> pos_embed_,
+                               c10::optional<at::Tensor> cls_token_, int64_t patch_h,
+                               int64_t patch_w) {
+
+  int64_t batch_size = images.size(0);
+  int64_t channels = images.size(1);
+  int64_t height = images.size(2);
+  int64_t width = images.size(3);
+  int64_t embed_dim = weight.size(0);
+
+  TORCH_CHECK(!images.is_cuda(), "patch_embed_forward only has a CPU implementation for now");
+  TORCH_CHECK(images.dtype() == torch::kFloat32 || images.dtype() == torch::kFloat16
+              || images.dtype() == torch::kBFloat16);
+  TORCH_CHECK(images.dim() == 4, "images must have shape (batch_size, channels, height, width)");
+  TORCH_CHECK(patch_h > 0 && patch_w > 0 && height % patch_h == 0 && width % patch_w == 0,
+              "the image size must be divisible by the patch size");
+  TORCH_CHECK(images.is_contiguous());
+  TORCH_CHECK(weight.dtype() == images.dtype());
+  TORCH_CHECK(!weight.is_cuda());
+  TORCH_CHECK(weight.is_contiguous());
+  CHECK_SHAPE(weight, embed_dim, channels * patch_h * patch_w);
+  int64_t num_patches = (height / patch_h) * (width / patch_w);
+  int64_t prefix = cls_token_.has_value() ? 1 : 0;
+  for (auto &t : {bias_, pos_embed_, cls_token_}) {
+    if (t.has_value()) {
+      TORCH_CHECK(t.value().dtype() == images.dtype());
+      TORCH_CHECK(!t.value().is_cuda());
+      TORCH_CHECK(t.value().is_contiguous());
+    }
+  }
+  if (bias_.has_value()) { CHECK_SHAPE(bias_.value(), embed_dim); }
+  if (cls_token_.has_value()) { CHECK_SHAPE(cls_token_.value(), embed_dim); }
+  bool pos_embed_has_prefix = true;
+  if (pos_embed_.has_value()) {
+    auto pos_embed = pos_embed_.value();
+    TORCH_CHECK(pos_embed.dim() == 2 && pos_embed.size(1) == embed_dim
+                && (pos_embed.size(0) == prefix + num_patches || pos_embed.size(0) == num_patches),
+                "pos_embed must have shape (num_patches (+ 1 with cls_token), embed_dim)");
+    pos_embed_has_prefix = pos_embed.size(0) == prefix + num_patches;
+  }
+
+  auto output = at::empty({batch_size, prefix + num_patches, embed_dim}, images.options());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, images.scalar_type(), "patch_embed_forward", [&] {
+    patch_embed_forward_cpu<scalar_t>(
+        images.data_ptr<scalar_t>(),
+        weight.data_ptr<scalar_t>(),
+        bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+        pos_embed_.has_value()? pos_embed_.value().data_ptr<scalar_t>() : nullptr,
+        cls_token_.has_value()? cls_token_.value().data_ptr<scalar_t>() : nullptr,
+        batch_size,
+        channels,
+        height,
+        width,
+        patch_h,
+        patch_w,
+        embed_dim,
+        pos_embed_has_prefix,
+        output.data_ptr<scalar_t>());
+  });
+
+  return output;
+}
+
+std::vector<at::Tensor> mlp_chunked_forward(at::Tensor input, at::Tensor weight1,
+                                            c10::optional<at::Tensor> bias1_,
+                                            at::Tensor weight2,
+                                            c10::optional<at::Tensor> bias2_,
+                                            int activation, int64_t chunk_size, bool save_pre_act) {
+
+  int64_t batch_size = input.size(0);
+  int64_t in_features = input.size(1);
+  int64_t hidden_features = weight1.size(0);
+  int64_t out_features = weight2.size(0);
+
+  TORCH_CHECK(activation >= 0 && activation <= 3, "mlp_chunked_forward: unknown activation");
+  TORCH_CHECK(chunk_size > 0);
+  TORCH_CHECK(!input.is_cuda(), "mlp_chunked_forward only has a CPU implementation");
+  TORCH_CHECK(input.dtype() == torch::kFloat32 || input.dtype() == torch::kFloat16
+              || input.dtype() == torch::kBFloat16);
+  TORCH_CHECK(input.dtype() == weight1.dtype());
+  TORCH_CHECK(input.dtype() == weight2.dtype());
+  TORCH_CHECK(!weight1.is_cuda() && !weight2.is_cuda());
+  TORCH_CHECK(input.is_contiguous());
+  TORCH_CHECK(weight1.is_contiguous());
+  TORCH_CHECK(weight2.is_contiguous());
+  CHECK_SHAPE(input, batch_size, in_features);
+  CHECK_SHAPE(weight1, hidden_features, in_features);
+  CHECK_SHAPE(weight2, out_features, hidden_features);
+  for (auto bias_ : {bias1_, bias2_}) {
+    if (bias_.has_value()) {
+      auto bias = bias_.value();
+      TORCH_CHECK(bias.dtype() == input.dtype());
+      TORCH_CHECK(!bias.is_cuda());
+      TORCH_CHECK(bias.is_contiguous());
+    }
+  }
+  if (bias1_.has_value()) { CHECK_SHAPE(bias1_.value(), hidden_features); }
+  if (bias2_.has_value()) { CHECK_SHAPE(bias2_.value(), out_features); }
+
+  auto opts = input.options();
+  auto output = at::empty({batch_size, out_features}, opts);
+  at::Tensor pre_act;
+  // fp32, as the hidden activation of the forward
+  if (save_pre_act) { pre_act = at::empty({batch_size, hidden_features}, opts.dtype(at::kFloat)); }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "mlp_chunked_forward", [&] {
+    mlp_chunked_forward_cpu<scalar_t>(
+        input.data_ptr<scalar_t>(),
+        weight1.data_ptr<scalar_t>(),
+        bias1_.has_value()? bias1_.value().data_ptr<scalar_t>() : nullptr,
+        weight2.data_ptr<scalar_t>(),
+        bias2_.has_value()? bias2_.value().data_ptr<scalar_t>() : nullptr,
+        in_features,
+        batch_size,
+        hidden_features,
+        out_features,
+        chunk_size,
+        static_cast<fused_dense::Activation>(activation),
+        output.data_ptr<scalar_t>(),
+        save_pre_act ? pre_act.data_ptr<float>() : nullptr);
+  });
+
+  std::vector<at::Tensor> result = {output};
+  if (save_pre_act) { result.push_back(pre_act); };
+  return result;
+}
+
+// Same LN semantics and outputs as dropout_add_ln_fwd in csrc/layer_norm, followed by
+// act(z @ weight^T + bias). z is only materialized if return_z.
+// Returns {output, x, z, dmask, mu, rsigma}, x is undefined if it equals x0 (as in
+// dropout_add_ln_fwd), z and dmask are undefined if they're not needed.
+std::vector<at::Tensor> ln_linear_act_forward(at::Tensor x0,
+                                              c10::optional<at::Tensor> residual_,
+                                              at::Tensor gamma,
+                                              c10::optional<at::Tensor> beta_,
+                                              at::Tensor weight,
+                                              c10::optional<at::Tensor> bias_,
+                                              float dropout_p, float epsilon, int activation,
+                                              bool residual_in_fp32, bool is_rms_norm,
+                                              bool return_z,
+                                              c10::optional<at::Generator> gen_) {
+
+  int64_t batch_size = x0.size(0);
+  int64_t in_features = x0.size(1);
+  int64_t out_features = weight.size(0);
+
+  auto itype = x0.scalar_type();
+  auto rtype = residual_.has_value()
+      ? residual_.value().scalar_type()
+      : (residual_in_fp32 ? torch::kFloat32 : itype);
+
+  TORCH_CHECK(activation >= 0 && activation <= 3, "ln_linear_act_forward: unknown activation");
+  TORCH_CHECK(dropout_p >= 0.f && dropout_p < 1.f);
+  TORCH_CHECK(!x0.is_cuda(), "ln_linear_act_forward only has a CPU implementation for now");
+  TORCH_CHECK(itype == torch::kFloat32 || itype == torch::kFloat16 || itype == torch::kBFloat16);
+  TORCH_CHECK(rtype == itype || rtype == torch::kFloat32);
+  TORCH_CHECK(gamma.scalar_type() == itype);
+  TORCH_CHECK(weight.scalar_type() == itype);
+  TORCH_CHECK(!gamma.is_cuda() && !weight.is_cuda());
+  TORCH_CHECK(x0.is_contiguous());
+  TORCH_CHECK(gamma.is_contiguous());
+  TORCH_CHECK(weight.is_contiguous());
+  CHECK_SHAPE(x0, batch_size, in_features);
+  CHECK_SHAPE(gamma, in_features);
+  CHECK_SHAPE(weight, out_features, in_features);
+  if (residual_.has_value()) {
+    auto residual = residual_.value();
+    TORCH_CHECK(!residual.is_cuda());
+    TORCH_CHECK(residual.is_contiguous());
+    CHECK_SHAPE(residual, batch_size, in_features);
+  }
+  for (auto param_ : {beta_, bias_}) {
+    if (param_.has_value()) {
+      auto param = param_.value();
+      TORCH_CHECK(param.scalar_type() == itype);
+      TORCH_CHECK(!param.is_cuda());
+      TORCH_CHECK(param.is_contiguous());
+    }
+  }
+  if (beta_.has_value()) { CHECK_SHAPE(beta_.value(), in_features); }
+  if (bias_.has_value()) { CHECK_SHAPE(bias_.value(), out_features); }
+
+  auto opts = x0.options();
+  auto output = at::empty({batch_size, out_features}, opts);
+  bool save_x = residual_.has_value() || (dropout_p > 0.f) || (itype != rtype);
+  at::Tensor x, z, dmask;
+  if (save_x) { x = at::empty({batch_size, in_features}, opts.dtype(rtype)); }
+  if (return_z) { z = at::empty({batch_size, in_features}, opts); }
+  if (dropout_p > 0.f) {
+    dmask = at::empty({batch_size, in_features}, opts.dtype(torch::kUInt8)).bernoulli_(1.f - dropout_p, gen_);
+  }
+  auto mu = at::empty({batch_size}, opts.dtype(torch::kFloat32));
+  auto rsigma = at::empty({batch_size}, opts.dtype(torch::kFloat32));
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, itype, "ln_linear_act_forward", [&] {
+    auto launch = [&](auto residual_type_tag) {
+      using residual_t = decltype(residual_type_tag);
+      ln_linear_act_forward_cpu<scalar_t, residual_t>(
+          x0.data_ptr<scalar_t>(),
+          residual_.has_value()? residual_.value().data_ptr<residual_t>() : nullptr,
+          dropout_p > 0.f ? dmask.data_ptr<uint8_t>() : nullptr,
+          gamma.data_ptr<scalar_t>(),
+          beta_.has_value()? beta_.value().data_ptr<scalar_t>() : nullptr,
+          weight.data_ptr<scalar_t>(),
+          bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+          in_features,
+          batch_size,
+          out_features,
+          dropout_p,
+          epsilon,
+          is_rms_norm,
+          static_cast<fused_dense::Activation>(activation),
+          output.data_ptr<scalar_t>(),
+          save_x ? x.data_ptr<residual_t>() : nullptr,
+          return_z ? z.data_ptr<scalar_t>() : nullptr,
+          mu.data_ptr<float>(),
+          rsigma.data_ptr<float>());
+    };
+    if (rtype == torch::kFloat32) { launch(float{}); } else { launch(scalar_t{}); }
+  });
+
+  return {output, x, z, dmask, mu, rsigma};
+}
+
+std::vector<at::Tensor> bias_act_forward(at::Tensor input, c10::optional<at::Tensor> bias_,
+                                         int activation, bool save_mask) {
+
+  int64_t batch_size = input.size(0);
+  int64_t features = input.size(1);
+
+  TORCH_CHECK(activation >= 0 && activation <= 3, "bias_act_forward: unknown activation");
+  TORCH_CHECK(!input.is_cuda(), "bias_act_forward only has a CPU implementation");
+  TORCH_CHECK(input.dtype() == torch::kFloat32 || input.dtype() == torch::kFloat16
+              || input.dtype() == torch::kBFloat16);
+  TORCH_CHECK(input.is_contiguous());
+  CHECK_SHAPE(input, batch_size, features);
+  if (bias_.has_value()) {
+    auto bias = bias_.value();
+    TORCH_CHECK(bias.dtype() == input.dtype());
+    TORCH_CHECK(!bias.is_cuda());
+    TORCH_CHECK(bias.is_contiguous());
+    CHECK_SHAPE(bias, features);
+  }
+  const bool has_mask = save_mask && activation == int(fused_dense::Activation::Relu);
+  // 1 bit per element, as the ReLU aux output of cuBLASLt
+  if (has_mask) { TORCH_CHECK(features % 8 == 0, "the ReLU mask needs features to be a multiple of 8"); }
+
+  auto output = at::empty({batch_size, features}, input.options());
+  at::Tensor mask;
+  if (has_mask) { mask = at::empty({batch_size, features / 8}, input.options().dtype(torch::kUInt8)); }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "bias_act_forward", [&] {
+    fused_dense::bias_act_forward_cpu<scalar_t>(
+        input.data_ptr<scalar_t>(),
+        bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+        batch_size,
+        features,
+        static_cast<fused_dense::Activation>(activation),
+        output.data_ptr<scalar_t>(),
+        has_mask ? mask.data_ptr<uint8_t>() : nullptr);
+  });
+
+  return {output, mask};
+}
+
+// Either input (the input of bias_act_forward) or mask (its ReLU mask) must be passed.
+std::vector<at::Tensor> bias_act_backward(at::Tensor d_output, c10::optional<at::Tensor> input_,
+                                          c10::optional<at::Tensor> bias_,
+                                          c10::optional<at::Tensor> mask_, int activation,
+                                          bool has_d_bias) {
+
+  int64_t batch_size = d_output.size(0);
+  int64_t features = d_output.size(1);
+
+  TORCH_CHECK(activation >= 0 && activation <= 3, "bias_act_backward: unknown activation");
+  TORCH_CHECK(!d_output.is_cuda(), "bias_act_backward only has a CPU implementation");
+  TORCH_CHECK(d_output.dtype() == torch::kFloat32 || d_output.dtype() == torch::kFloat16
+              || d_output.dtype() == torch::kBFloat16);
+  TORCH_CHECK(d_output.is_contiguous());
+  CHECK_SHAPE(d_output, batch_size, features);
+  const bool use_mask = !input_.has_value();
+  if (use_mask) {
+    TORCH_CHECK(mask_.has_value() && activation == int(fused_dense::Activation::Relu),
+                "bias_act_backward needs the input, or the mask with ReLU");
+    auto mask = mask_.value();
+    TORCH_CHECK(mask.dtype() == torch::kUInt8);
+    TORCH_CHECK(mask.is_contiguous());
+    TORCH_CHECK(features % 8 == 0);
+    CHECK_SHAPE(mask, batch_size, features / 8);
+  } else {
+    auto input = input_.value();
+    TORCH_CHECK(input.dtype() == d_output.dtype());
+    TORCH_CHECK(input.is_contiguous());
+    CHECK_SHAPE(input, batch_size, features);
+  }
+  if (bias_.has_value()) {
+    auto bias = bias_.value();
+    TORCH_CHECK(bias.dtype() == d_output.dtype());
+    TORCH_CHECK(bias.is_contiguous());
+    CHECK_SHAPE(bias, features);
+  }
+
+  auto d_input = at::empty({batch_size, features}, d_output.options());
+  at::Tensor d_bias;
+  if (has_d_bias) { d_bias = at::empty({features}, d_output.options().dtype(torch::kFloat32)); }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, d_output.scalar_type(), "bias_act_backward", [&] {
+    fused_dense::bias_act_backward_cpu<scalar_t>(
+        d_output.data_ptr<scalar_t>(),
+        use_mask ? nullptr : input_.value().data_ptr<scalar_t>(),
+        bias_.has_value()? bias_.value().data_ptr<scalar_t>() : nullptr,
+        use_mask ? mask_.value().data_ptr<uint8_t>() : nullptr,
+        batch_size,
+        features,
+        static_cast<fused_dense::Activation>(activation),
+        d_input.data_ptr<scalar_t>(),
+        has_d_bias ? d_bias.data_ptr<float>() : nullptr);
+  });
+
+  return {d_input, has_d_bias ? d_bias.to(d_output.dtype()) : d_bias};
+}
+
+at::Tensor swiglu_forward(at::Tensor input) {
+
+  int64_t batch_size = input.size(0);
+  int64_t features = input.size(1) / 2;
+
+  TORCH_CHECK(!input.is_cuda(), "swiglu_forward only has a CPU implementation");
+  TORCH_CHECK(input.dtype() == torch::kFloat32 || input.dtype() == torch::kFloat16
+              || input.dtype() == torch::kBFloat16);
+  TORCH_CHECK(input.is_contiguous());
+  CHECK_SHAPE(input, batch_size, 2 * features);
+
+  auto output = at::empty({batch_size, features}, input.options());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "swiglu_forward", [&] {
+    fused_dense::swiglu_forward_cpu<scalar_t>(
+        input.data_ptr<scalar_t>(), batch_size, features, output.data_ptr<scalar_t>());
+  });
+
+  return output;
+}
+
+at::Tensor swiglu_backward(at::Tensor d_output, at::Tensor input) {
+
+  int64_t batch_size = d_output.size(0);
+  int64_t features = d_output.size(1);
+
+  TORCH_CHECK(!d_output.is_cuda(), "swiglu_backward only has a CPU implementation");
+  TORCH_CHECK(d_output.dtype() == torch::kFloat32 || d_output.dtype() == torch::kFloat16
+              || d_output.dtype() == torch::kBFloat16);
+  TORCH_CHECK(input.dtype() == d_output.dtype());
+  TORCH_CHECK(d_output.is_contiguous());
+  TORCH_CHECK(input.is_contiguous());
+  CHECK_SHAPE(d_output, batch_size, features);
+  CHECK_SHAPE(input, batch_size, 2 * features);
+
+  auto d_input = at::empty({batch_size, 2 * features}, input.options());
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(at::ScalarType::Half, at::ScalarType::BFloat16, input.scalar_type(), "swiglu_backward", [&] {
+    fused_dense::swiglu_backward_cpu<scalar_t>(
+        d_output.data_ptr<scalar_t>(), input.data_ptr<scalar_t>(), batch_size, features,
+        d_input.data_ptr<scalar_t>());
+  });
+
+  return d_input;
 }
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("linear_bias_wgrad", &linear_bias_wgrad, "linear bias wgrad");
   m.def("linear_act_forward", &linear_act_forward, "linear gelu/relu forward");
   m.def("bias_act_linear_dgrad_bgrad", &bias_act_linear_dgrad_bgrad, "bias gelu/relu linear dgrad bgrad");
+  m.def("linear_act_forward_quant", &linear_act_forward_quant, "weight-only int8/int4 linear bias gelu/relu forward");
+  m.def("linear_gather_forward", &linear_gather_forward, "linear bias forward on a subset of the rows of the input");
+  m.def("patch_embed_forward", &patch_embed_forward, "ViT patchify linear bias + cls token + position embedding forward");
+  m.def("mlp_chunked_forward", &mlp_chunked_forward, "linear gelu/relu linear forward, chunked over the hidden dimension");
+  m.def("ln_linear_act_forward", &ln_linear_act_forward, "dropout add layernorm linear gelu/relu forward");
+  m.def("bias_act_forward", &bias_act_forward, "bias gelu/relu forward");
+  m.def("bias_act_backward", &bias_act_backward, "bias gelu/relu backward");
+  m.def("swiglu_forward", &swiglu_forward, "swiglu forward");
+  m.def("swiglu_backward", &swiglu_backward, "swiglu backward");
 }
@@ -0,0 +1,145 @@
+#include <ATen/ATen.h>
+
+#include <vector>
+
+#include "fused_dense_cpu.h"
+
+using fused_dense::Activation;
+
+template <typename T>
+void linear_act_forward_quant_cpu(const T *input, const void *qweight, const float *scales, const T *bias, int64_t in_features, int64_t batch_size, int64_t out_features, int bits, int64_t group_size, Activation act, T *output) {
+    fused_dense::DenseLoader<T> load_input{input, in_features, in_features};
+    ACTIVATION_SWITCH(act, kAct, [&] {
+        auto epilogue = [&](int64_t m, int64_t n, float acc) {
+            if (bias != nullptr) { acc += static_cast<float>(bias[n]); }
+            output[m * out_features + n] = static_cast<T>(fused_dense::apply_activation<kAct>(acc));
+        };
+        if (bits == 8) {
+            fused_dense::QuantLoader<8> load_weight{qweight, scales, in_features, group_size};
+            fused_dense::gemm_nt(batch_size, out_features, in_features, load_input, load_weight, epilogue);
+        } else {
+            fused_dense::QuantLoader<4> load_weight{qweight, scales, in_features, group_size};
+            fused_dense::gemm_nt(batch_size, out_features, in_features, load_input, load_weight, epilogue);
+        }
+    });
+}
+
+// output = input[indices] @ weight^T + bias, the rows of input are gathered as they're loaded into
+// the GEMM.
+template <typename T>
+void linear_gather_forward_cpu(const T *input, const int64_t *indices, const T *weight, const T *bias, int64_t in_features, int64_t num_indices, int64_t out_features, T *output) {
+    fused_dense::GatherLoader<T> load_input{input, indices, in_features, in_features};
+    fused_dense::DenseLoader<T> load_weight{weight, in_features, in_features};
+    auto epilogue = [&](int64_t m, int64_t n, float acc) {
+        if (bias != nullptr) { acc += static_cast<float>(bias[n]); }
+        output[m * out_features + n] = static_cast<T>(acc);
+    };
+    fused_dense::gemm_nt(num_indices, out_features, in_features, load_input, load_weight, epilogue);
+}
+
+// Patch embedding of a ViT: output (batch, prefix + num_patches, embed_dim), where prefix is 1 if
+// cls_token is not nullptr (row 0 of each image is then cls_token), and row prefix + p is
+// patch p @ weight^T + bias. pos_embed (can be nullptr) has either prefix + num_patches rows, added
+// to all the rows of each image, or num_patches rows (pos_embed_has_prefix == false), added to the
+// patches only.
+template <typename T>
+void patch_embed_forward_cpu(const T *images, const T *weight, const T *bias, const T *pos_embed, const T *cls_token, int64_t batch_size, int64_t channels, int64_t height, int64_t width, int64_t patch_h, int64_t patch_w, int64_t embed_dim, bool pos_embed_has_prefix, T *output) {
+    const int64_t num_patches = (height / patch_h) * (width / patch_w);
+    const int64_t prefix = cls_token != nullptr ? 1 : 0;
+    const int64_t seqlen = prefix + num_patches;
+    const int64_t pos_offset = pos_embed_has_prefix ? prefix : 0;
+    const int64_t in_features = channels * patch_h * patch_w;
+    fused_dense::PatchLoader<T> load_patches{images, channels, height, width, patch_h, patch_w};
+    fused_dense::DenseLoader<T> load_weight{weight, in_features, in_features};
+    auto epilogue = [&](int64_t m, int64_t n, float acc) {
+        const int64_t b = m / num_patches, p = m % num_patches;
+        if (bias != nullptr) { acc += static_cast<float>(bias[n]); }
+        if (pos_embed != nullptr) { acc += static_cast<float>(pos_embed[(pos_offset + p) * embed_dim + n]); }
+        output[(b * seqlen + prefix + p) * embed_dim + n] = static_cast<T>(acc);
+    };
+    fused_dense::gemm_nt(batch_size * num_patches, embed_dim, in_features, load_patches, load_weight, epilogue);
+    if (cls_token != nullptr) {
+        for (int64_t b = 0; b < batch_size; ++b) {
+            for (int64_t n = 0; n < embed_dim; ++n) {
+                float v = static_cast<float>(cls_token[n]);
+                if (pos_embed != nullptr && pos_embed_has_prefix) { v += static_cast<float>(pos_embed[n]); }
+                output[b * seqlen * embed_dim + n] = static_cast<T>(v);
+            }
+        }
+    }
+}
+
+// out = act(input @ weight1^T + bias1) @ weight2^T + bias2, one chunk of the hidden dimension at a
+// time: the (batch_size, hidden_features) activation is never materialized, only a
+// (batch_size, chunk_size) fp32 buffer and the fp32 accumulator for the output.
+// If pre_act is not nullptr, the pre-activation is also written out (for the backward), in fp32 so
+// that the backward sees the activations of the forward.
+template <typename T>
+void mlp_chunked_forward_cpu(const T *input, const T *weight1, const T *bias1, const T *weight2, const T *bias2, int64_t in_features, int64_t batch_size, int64_t hidden_features, int64_t out_features, int64_t chunk_size, Activation act, T *output, float *pre_act) {
+    std::vector<float> hidden(batch_size * chunk_size);
+    std::vector<float> out_acc(batch_size * out_features, 0.f);
+    fused_dense::DenseLoader<T> load_input{input, in_features, in_features};
+    for (int64_t start = 0; start < hidden_features; start += chunk_size) {
+        const int64_t chunk = std::min(chunk_size, hidden_features - start);
+        ACTIVATION_SWITCH(act, kAct, [&] {
+            auto epilogue1 = [&](int64_t m, int64_t n, float acc) {
+                if (bias1 != nullptr) { acc += static_cast<float>(bias1[start + n]); }
+                if (pre_act != nullptr) { pre_act[m * hidden_features + start + n] = acc; }
+                hidden[m * chunk + n] = fused_dense::apply_activation<kAct>(acc);
+            };
+            fused_dense::DenseLoader<T> load_weight1{weight1 + start * in_features, in_features, in_features};
+            fused_dense::gemm_nt(batch_size, chunk, in_features, load_input, load_weight1, epilogue1);
+        });
+        auto epilogue2 = [&](int64_t m, int64_t n, float acc) { out_acc[m * out_features + n] += acc; };
+        fused_dense::DenseLoader<float> load_hidden{hidden.data(), chunk, chunk};
+        fused_dense::DenseLoader<T> load_weight2{weight2 + start, chunk, hidden_features};
+        fused_dense::gemm_nt(batch_size, out_features, chunk, load_hidden, load_weight2, epilogue2);
+    }
+    at::parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t m = begin; m < end; ++m) {
+            for (int64_t n = 0; n < out_features; ++n) {
+                float val = out_acc[m * out_features + n];
+                if (bias2 != nullptr) { val += static_cast<float>(bias2[n]); }
+                output[m * out_features + n] = static_cast<T>(val);
+            }
+        }
+    });
+}
+
+// out = act(LN(dropout(x0) + residual) @ weight^T + bias), the LN is applied to each row block as it's
+// loaded into the GEMM. See LayerNormLoader for the side outputs.
+template <typename T, typename R>
+void ln_linear_act_forward_cpu(const T *x0, const R *residual, const uint8_t *dmask, const T *gamma, const T *beta, const T *weight, const T *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, T *output, R *x, T *z, float *mu, float *rsigma) {
+    const float dropout_scale = dropout_p > 0.f ? 1.f / (1.f - dropout_p) : 1.f;
+    fused_dense::LayerNormLoader<T, R> load_input{x0, residual, dmask, gamma, beta, in_features, dropout_scale, epsilon, is_rms_norm, x, z, mu, rsigma};
+    fused_dense::DenseLoader<T> load_weight{weight, in_features, in_features};
+    ACTIVATION_SWITCH(act, kAct, [&] {
+        auto epilogue = [&](int64_t m, int64_t n, float acc) {
+            if (bias != nullptr) { acc += static_cast<float>(bias[n]); }
+            output[m * out_features + n] = static_cast<T>(fused_dense::apply_activation<kAct>(acc));
+        };
+        fused_dense::gemm_nt(batch_size, out_features, in_features, load_input, load_weight, epilogue);
+    });
+}
+
+template void linear_act_forward_quant_cpu<float>(const float *input, const void *qweight, const float *scales, const float *bias, int64_t in_features, int64_t batch_size, int64_t out_features, int bits, int64_t group_size, Activation act, float *output);
+template void linear_act_forward_quant_cpu<at::Half>(const at::Half *input, const void *qweight, const float *scales, const at::Half *bias, int64_t in_features, int64_t batch_size, int64_t out_features, int bits, int64_t group_size, Activation act, at::Half *output);
+template void linear_act_forward_quant_cpu<at::BFloat16>(const at::BFloat16 *input, const void *qweight, const float *scales, const at::BFloat16 *bias, int64_t in_features, int64_t batch_size, int64_t out_features, int bits, int64_t group_size, Activation act, at::BFloat16 *output);
+
+template void linear_gather_forward_cpu<float>(const float *input, const int64_t *indices, const float *weight, const float *bias, int64_t in_features, int64_t num_indices, int64_t out_features, float *output);
+template void linear_gather_forward_cpu<at::Half>(const at::Half *input, const int64_t *indices, const at::Half *weight, const at::Half *bias, int64_t in_features, int64_t num_indices, int64_t out_features, at::Half *output);
+template void linear_gather_forward_cpu<at::BFloat16>(const at::BFloat16 *input, const int64_t *indices, const at::BFloat16 *weight, const at::BFloat16 *bias, int64_t in_features, int64_t num_indices, int64_t out_features, at::BFloat16 *output);
+
+template void patch_embed_forward_cpu<float>(const float *images, const float *weight, const float *bias, const float *pos_embed, const float *cls_token, int64_t batch_size, int64_t channels, int64_t height, int64_t width, int64_t patch_h, int64_t patch_w, int64_t embed_dim, bool pos_embed_has_prefix, float *output);
+template void patch_embed_forward_cpu<at::Half>(const at::Half *images, const at::Half *weight, const at::Half *bias, const at::Half *pos_embed, const at::Half *cls_token, int64_t batch_size, int64_t channels, int64_t height, int64_t width, int64_t patch_h, int64_t patch_w, int64_t embed_dim, bool pos_embed_has_prefix, at::Half *output);
+template void patch_embed_forward_cpu<at::BFloat16>(const at::BFloat16 *images, const at::BFloat16 *weight, const at::BFloat16 *bias, const at::BFloat16 *pos_embed, const at::BFloat16 *cls_token, int64_t batch_size, int64_t channels, int64_t height, int64_t width, int64_t patch_h, int64_t patch_w, int64_t embed_dim, bool pos_embed_has_prefix, at::BFloat16 *output);
+
+template void mlp_chunked_forward_cpu<float>(const float *input, const float *weight1, const float *bias1, const float *weight2, const float *bias2, int64_t in_features, int64_t batch_size, int64_t hidden_features, int64_t out_features, int64_t chunk_size, Activation act, float *output, float *pre_act);
+template void mlp_chunked_forward_cpu<at::Half>(const at::Half *input, const at::Half *weight1, const at::Half *bias1, const at::Half *weight2, const at::Half *bias2, int64_t in_features, int64_t batch_size, int64_t hidden_features, int64_t out_features, int64_t chunk_size, Activation act, at::Half *output, float *pre_act);
+template void mlp_chunked_forward_cpu<at::BFloat16>(const at::BFloat16 *input, const at::BFloat16 *weight1, const at::BFloat16 *bias1, const at::BFloat16 *weight2, const at::BFloat16 *bias2, int64_t in_features, int64_t batch_size, int64_t hidden_features, int64_t out_features, int64_t chunk_size, Activation act, at::BFloat16 *output, float *pre_act);
+
+template void ln_linear_act_forward_cpu<float, float>(const float *x0, const float *residual, const uint8_t *dmask, const float *gamma, const float *beta, const float *weight, const float *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, float *output, float *x, float *z, float *mu, float *rsigma);
+template void ln_linear_act_forward_cpu<at::Half, at::Half>(const at::Half *x0, const at::Half *residual, const uint8_t *dmask, const at::Half *gamma, const at::Half *beta, const at::Half *weight, const at::Half *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, at::Half *output, at::Half *x, at::Half *z, float *mu, float *rsigma);
+template void ln_linear_act_forward_cpu<at::Half, float>(const at::Half *x0, const float *residual, const uint8_t *dmask, const at::Half *gamma, const at::Half *beta, const at::Half *weight, const at::Half *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, at::Half *output, float *x, at::Half *z, float *mu, float *rsigma);
+template void ln_linear_act_forward_cpu<at::BFloat16, at::BFloat16>(const at::BFloat16 *x0, const at::BFloat16 *residual, const uint8_t *dmask, const at::BFloat16 *gamma, const at::BFloat16 *beta, const at::BFloat16 *weight, const at::BFloat16 *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, at::BFloat16 *output, at::BFloat16 *x, at::BFloat16 *z, float *mu, float *rsigma);
+template void ln_linear_act_forward_cpu<at::BFloat16, float>(const at::BFloat16 *x0, const float *residual, const uint8_t *dmask, const at::BFloat16 *gamma, const at::BFloat16 *beta, const at::BFloat16 *weight, const at::BFloat16 *bias, int64_t in_features, int64_t batch_size, int64_t out_features, float dropout_p, float epsilon, bool is_rms_norm, Activation act, at::BFloat16 *output, float *x, at::BFloat16 *z, float *mu, float *rsigma);
@@ -0,0 +1,289 @@
+// CPU implementation of the matmul + bias + activation used by fused_dense.
+// The GEMM computes act(A @ W^T + bias) tile by tile. The tiles of A and W are produced by loader
+// functors and each output element goes through an epilogue functor, so callers can fuse work into
+// the loads (e.g. dequantizing W) or into the epilogue without materializing the full operands.
+#pragma once
+
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "activations_cpu.h"
+
+namespace fused_dense {
+
+// Must be kept in sync with _ACTIVATION_ID in flash_attn/ops/activations.py
+enum class Activation : int {
+    None = 0,
+    GeluApprox = 1,
+    Relu = 2,
+    Gelu = 3
+};
+
+/// Usage:
+/// ```
+/// ACTIVATION_SWITCH(act, kAct, [&] {
+///     some_function<kAct>(...);
+/// });
+/// ```
+#define ACTIVATION_SWITCH(ACT, CONST_NAME, ...)                                                   \
+    [&] {                                                                                         \
+        if (ACT == fused_dense::Activation::GeluApprox) {                                         \
+            constexpr fused_dense::Activation CONST_NAME = fused_dense::Activation::GeluApprox;   \
+            return __VA_ARGS__();                                                                 \
+        } else if (ACT == fused_dense::Activation::Relu) {                                        \
+            constexpr fused_dense::Activation CONST_NAME = fused_dense::Activation::Relu;         \
+            return __VA_ARGS__();                                                                 \
+        } else if (ACT == fused_dense::Activation::Gelu) {                                        \
+            constexpr fused_dense::Activation CONST_NAME = fused_dense::Activation::Gelu;         \
+            return __VA_ARGS__();                                                                 \
+        } else {                                                                                  \
+            constexpr fused_dense::Activation CONST_NAME = fused_dense::Activation::None;         \
+            return __VA_ARGS__();                                                                 \
+        }                                                                                         \
+    }()
+
+template <Activation act>
+inline float apply_activation(float x) {
+    if (act == Activation::GeluApprox) {
+        return gelu_approx_fwd(x);
+    } else if (act == Activation::Relu) {
+        return std::max(x, 0.f);
+    } else if (act == Activation::Gelu) {
+        return gelu_erf_fwd(x);
+    } else {
+        return x;
+    }
+}
+
+// Rows of A and W per tile. A 16 x K tile of both operands stays in L2 for K up to 8192.
+constexpr int64_t kBlockM = 16;
+constexpr int64_t kBlockN = 16;
+
+// Eight independent partial sums so that the compiler vectorizes the loop without -ffast-math.
+inline float dot(const float *a, const float *b, int64_t k) {
+    float acc[8] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+    int64_t i = 0;
+    for (; i + 8 <= k; i += 8) {
+        for (int j = 0; j < 8; ++j) { acc[j] += a[i + j] * b[i + j]; }
+    }
+    float sum = 0.f;
+    for (; i < k; ++i) { sum += a[i] * b[i]; }
+    for (int j = 0; j < 8; ++j) { sum += acc[j]; }
+    return sum;
+}
+
+// Computes epilogue(m, n, sum_k A[m, k] * W[n, k]) for all m < M, n < N.
+// load_a(m_start, m_end, float *buf) writes rows [m_start, m_end) of A to buf, with row stride K.
+// It's called exactly once per row block, so it may also write per-row side outputs.
+// load_w(n_start, n_end, float *buf) does the same for W.
+// epilogue(m, n, float acc) consumes one output element. It's called exactly once per element.
+template <typename LoadA, typename LoadW, typename Epilogue>
+void gemm_nt(int64_t M, int64_t N, int64_t K,
+             const LoadA &load_a, const LoadW &load_w, const Epilogue &epilogue) {
+    if (M == 0 || N == 0) { return; }
+    auto tile = [&](const float *a_buf, int64_t m_start, int64_t m_end, float *w_buf,
+                    int64_t n_start, int64_t n_end) {
+        load_w(n_start, n_end, w_buf);
+        for (int64_t m = m_start; m < m_end; ++m) {
+            const float *a_row = a_buf + (m - m_start) * K;
+            for (int64_t n = n_start; n < n_end; ++n) {
+                epilogue(m, n, dot(a_row, w_buf + (n - n_start) * K, K));
+            }
+        }
+    };
+    const int64_t num_m_blocks = (M + kBlockM - 1) / kBlockM;
+    const int64_t num_n_blocks = (N + kBlockN - 1) / kBlockN;
+    if (num_m_blocks >= at::get_num_threads()) {
+        // Enough rows to keep every thread busy: each thread loads its row blocks of A once and
+        // streams all of W through them.
+        at::parallel_for(0, num_m_blocks, 1, [&](int64_t begin, int64_t end) {
+            std::vector<float> a_buf(kBlockM * K), w_buf(kBlockN * K);
+            for (int64_t mb = begin; mb < end; ++mb) {
+                const int64_t m_start = mb * kBlockM, m_end = std::min(M, m_start + kBlockM);
+                load_a(m_start, m_end, a_buf.data());
+                for (int64_t nb = 0; nb < num_n_blocks; ++nb) {
+                    const int64_t n_start = nb * kBlockN, n_end = std::min(N, n_start + kBlockN);
+                    tile(a_buf.data(), m_start, m_end, w_buf.data(), n_start, n_end);
+                }
+            }
+        });
+    } else {
+        // Few rows (e.g. decoding): the row block is loaded once and shared, the threads split
+        // W so that the weights are read from memory once per row block.
+        std::vector<float> a_buf(kBlockM * K);
+        for (int64_t mb = 0; mb < num_m_blocks; ++mb) {
+            const int64_t m_start = mb * kBlockM, m_end = std::min(M, m_start + kBlockM);
+            load_a(m_start, m_end, a_buf.data());
+            at::parallel_for(0, num_n_blocks, 1, [&](int64_t begin, int64_t end) {
+                std::vector<float> w_buf(kBlockN * K);
+                for (int64_t nb = begin; nb < end; ++nb) {
+                    const int64_t n_start = nb * kBlockN, n_end = std::min(N, n_start + kBlockN);
+                    tile(a_buf.data(), m_start, m_end, w_buf.data(), n_start, n_end);
+                }
+            });
+        }
+    }
+}
+
+// Loads K columns of the rows of a row-major matrix with row stride ld, converting to fp32.
+template <typename T>
+struct DenseLoader {
+    const T *ptr;
+    int64_t K;
+    int64_t ld;
+    void operator()(int64_t start, int64_t end, float *buf) const {
+        for (int64_t r = start; r < end; ++r) {
+            const T *src = ptr + r * ld;
+            float *dst = buf + (r - start) * K;
+            for (int64_t k = 0; k < K; ++k) { dst[k] = static_cast<float>(src[k]); }
+        }
+    }
+};
+
+// Loads the rows indices[r] of a row-major matrix instead of the rows r, e.g. to project only some
+// positions of the hidden states without copying them out first.
+template <typename T>
+struct GatherLoader {
+    const T *ptr;
+    const int64_t *indices;
+    int64_t K;
+    int64_t ld;
+    void operator()(int64_t start, int64_t end, float *buf) const {
+        for (int64_t r = start; r < end; ++r) {
+            const T *src = ptr + indices[r] * ld;
+            float *dst = buf + (r - start) * K;
+            for (int64_t k = 0; k < K; ++k) { dst[k] = static_cast<float>(src[k]); }
+        }
+    }
+};
+
+// Loads the patches of NCHW images as the rows of A (im2col), so that patchify + linear is one
+// GEMM without materializing the (batch, num_patches, channels * patch_h * patch_w) tensor.
+// Row r is patch r % num_patches (row-major over the grid) of image r / num_patches, and its
+// columns are ordered (channel, row in the patch, column in the patch), as
+// rearrange('b c (h p1) (w p2) -> b (h w) (c p1 p2)').
+template <typename T>
+struct PatchLoader {
+    const T *images;
+    int64_t channels;
+    int64_t height;
+    int64_t width;
+    int64_t patch_h;
+    int64_t patch_w;
+    void operator()(int64_t start, int64_t end, float *buf) const {
+        const int64_t K = channels * patch_h * patch_w;
+        const int64_t grid_w = width / patch_w;
+        const int64_t num_patches = (height / patch_h) * grid_w;
+        for (int64_t r = start; r < end; ++r) {
+            const int64_t b = r / num_patches, p = r % num_patches;
+            const int64_t y0 = (p / grid_w) * patch_h, x0 = (p % grid_w) * patch_w;
+            float *dst = buf + (r - start) * K;
+            for (int64_t c = 0; c < channels; ++c) {
+                for (int64_t i = 0; i < patch_h; ++i) {
+                    const T *src = images + ((b * channels + c) * height + y0 + i) * width + x0;
+                    for (int64_t j = 0; j < patch_w; ++j) { dst[j] = static_cast<float>(src[j]); }
+                    dst += patch_w;
+                }
+            }
+        }
+    }
+};
+
+// Loads rows of a weight-only quantized matrix and dequantizes them on the fly.
+// bits == 8: qweight is (N, K) int8.
+// bits == 4: qweight is (N, K / 2) uint8, feature 2i in the low nibble and 2i + 1 in the high
+// nibble, both stored with an offset of 8.
+// scales is (N, K / group_size) fp32, the weight is q * scale.
+template <int bits>
+struct QuantLoader {
+    const void *qweight;
+    const float *scales;
+    int64_t K;
+    int64_t group_size;
+    void operator()(int64_t start, int64_t end, float *buf) const {
+        const int64_t num_groups = K / group_size;
+        for (int64_t n = start; n < end; ++n) {
+            const float *scale = scales + n * num_groups;
+            float *dst = buf + (n - start) * K;
+            if (bits == 8) {
+                const int8_t *q = reinterpret_cast<const int8_t *>(qweight) + n * K;
+                for (int64_t g = 0; g < num_groups; ++g) {
+                    const float s = scale[g];
+                    for (int64_t k = g * group_size; k < (g + 1) * group_size; ++k) {
+                        dst[k] = static_cast<float>(q[k]) * s;
+                    }
+                }
+            } else {
+                const uint8_t *q = reinterpret_cast<const uint8_t *>(qweight) + n * (K / 2);
+                for (int64_t g = 0; g < num_groups; ++g) {
+                    const float s = scale[g];
+                    for (int64_t k = g * group_size; k < (g + 1) * group_size; k += 2) {
+                        const uint8_t packed = q[k / 2];
+                        dst[k] = static_cast<float>(int(packed & 0xF) - 8) * s;
+                        dst[k + 1] = static_cast<float>(int(packed >> 4) - 8) * s;
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Computes the rows of z = LayerNorm(dropout(x0) + residual) (or RMSNorm) as they are loaded, so
+// that z never has to go through memory before the GEMM. Same semantics as dropout_add_ln_fwd:
+// x = x0 * dmask / (1 - p) + residual is written to x_out (in the residual dtype R) if x_out is not
+// nullptr, mu and rsigma are always written (mu is 0 for RMSNorm), z is written to z_out if it's
+// not nullptr. z is rounded to T before the GEMM to match the unfused LN + linear.
+template <typename T, typename R>
+struct LayerNormLoader {
+    const T *x0;
+    const R *residual;
+    const uint8_t *dmask;
+    const T *gamma;
+    const T *beta;
+    int64_t K;
+    float dropout_scale;
+    float epsilon;
+    bool is_rms_norm;
+    R *x_out;
+    T *z_out;
+    float *mu_out;
+    float *rsigma_out;
+    void operator()(int64_t start, int64_t end, float *buf) const {
+        for (int64_t r = start; r < end; ++r) {
+            const T *x0_row = x0 + r * K;
+            float *dst = buf + (r - start) * K;
+            for (int64_t k = 0; k < K; ++k) {
+                float val = static_cast<float>(x0_row[k]);
+                if (dmask != nullptr) { val = dmask[r * K + k] ? val * dropout_scale : 0.f; }
+                if (residual != nullptr) { val += static_cast<float>(residual[r * K + k]); }
+                dst[k] = val;
+            }
+            if (x_out != nullptr) {
+                for (int64_t k = 0; k < K; ++k) { x_out[r * K + k] = static_cast<R>(dst[k]); }
+            }
+            float mu = 0.f;
+            if (!is_rms_norm) {
+                for (int64_t k = 0; k < K; ++k) { mu += dst[k]; }
+                mu /= K;
+            }
+            float var = 0.f;
+            for (int64_t k = 0; k < K; ++k) { var += (dst[k] - mu) * (dst[k] - mu); }
+            const float rsigma = 1.f / std::sqrt(var / K + epsilon);
+            mu_out[r] = mu;
+            rsigma_out[r] = rsigma;
+            for (int64_t k = 0; k < K; ++k) {
+                float z = (dst[k] - mu) * rsigma * static_cast<float>(gamma[k]);
+                if (beta != nullptr) { z += static_cast<float>(beta[k]); }
+                const T z_t = static_cast<T>(z);
+                if (z_out != nullptr) { z_out[r * K + k] = z_t; }
+                dst[k] = static_cast<float>(z_t);
+            }
+        }
+    }
+};
+
+}  // namespace fused_dense
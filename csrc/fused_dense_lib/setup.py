@@ -4,7 +4,7 @@ from packaging.version import parse, Version
 
 import torch
 from setuptools import setup
-from torch.utils.cpp_extension import BuildExtension, CUDAExtension, CUDA_HOME
+from torch.utils.cpp_extension import BuildExtension, CppExtension, CUDAExtension, CUDA_HOME
 
 
 def get_cuda_bare_metal_version(cuda_dir):
@@ -23,19 +23,35 @@ def append_nvcc_threads(nvcc_extra_args):
     return nvcc_extra_args
 
 
-setup(
-    name='fused_dense_lib',
-    ext_modules=[
+# -fno-trapping-math lets GCC if-convert the clamps of the math functions in activations_cpu.h, so
+# that the activation loops are vectorized (the kernels don't rely on floating-point exceptions).
+cxx_flags = ['-O3', '-fno-trapping-math']
+
+if CUDA_HOME is not None:
+    ext_modules = [
         CUDAExtension(
             name='fused_dense_lib',
-            sources=['fused_dense.cpp', 'fused_dense_cuda.cu'],
+            sources=['fused_dense.cpp', 'fused_dense_cpu.cpp', 'activations_cpu.cpp', 'fused_dense_cuda.cu'],
             extra_compile_args={
-                               'cxx': ['-O3',],
+                               'cxx': cxx_flags + ['-DWITH_CUDA'],
                                'nvcc': append_nvcc_threads(['-O3'])
                                }
             )
-    ],
+    ]
+else:
+    # CPU-only build (e.g. for inference hosts without nvcc): only the CPU kernels are available.
+    ext_modules = [
+        CppExtension(
+            name='fused_dense_lib',
+            sources=['fused_dense.cpp', 'fused_dense_cpu.cpp', 'activations_cpu.cpp'],
+            extra_compile_args={'cxx': cxx_flags}
+            )
+    ]
+
+
+setup(
+    name='fused_dense_lib',
+    ext_modules=ext_modules,
     cmdclass={
         'build_ext': BuildExtension
 })
-
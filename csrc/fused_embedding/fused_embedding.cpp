@@ -0,0 +1,174 @@
+#include <torch/extension.h>
+
+#include "fused_embedding_cpu.h"
+
+#define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
+
+#define DISPATCH_FLOAT_AND_HALF_AND_BF16(TYPE, NAME, ...)                  \
+  if (TYPE == at::ScalarType::Half) {                                      \
+    using scalar_t = at::Half;                                             \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::BFloat16) {                           \
+    using scalar_t = at::BFloat16;                                         \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::Float)  {                             \
+    using scalar_t = float;                                                \
+    __VA_ARGS__();                                                         \
+  } else {                                                                 \
+    AT_ERROR(#NAME, " not implemented for type '", toString(TYPE), "'"); \
+  }
+
+namespace {
+
+void check_ids(const torch::Tensor &ids, const int64_t num_tokens, const bool check_range,
+               const int64_t low, const int64_t high, const char *name) {
+    TORCH_CHECK(ids.dtype() == torch::kInt64, name, " must have dtype int64");
+    TORCH_CHECK(!ids.is_cuda(), "fused_embedding only has a CPU implementation");
+    TORCH_CHECK(ids.is_contiguous(), name, " must be contiguous");
+    CHECK_SHAPE(ids, num_tokens);
+    if (check_range && num_tokens > 0) {
+        TORCH_CHECK(ids.min().item<int64_t>() >= low && ids.max().item<int64_t>() < high,
+                    name, " out of range");
+    }
+}
+
+fused_embedding::EmbeddingParams set_params(const torch::Tensor &input_ids,
+                                            const int64_t embed_dim,
+                                            const int64_t num_embeddings,
+                                            const int64_t vocab_start_index,
+                                            const bool mask_out_of_range,
+                                            const c10::optional<torch::Tensor> &position_ids_,
+                                            const int64_t num_positions,
+                                            const int64_t position_dim,
+                                            const int64_t position_col_offset,
+                                            const float dropout_p, const int64_t seed,
+                                            const int64_t offset) {
+    TORCH_CHECK(dropout_p >= 0.f && dropout_p <= 1.f, "dropout_p must be in [0, 1]");
+    const int64_t num_tokens = input_ids.size(0);
+    // Out-of-range ids are zero rows with mask_out_of_range, and an error otherwise
+    check_ids(input_ids, num_tokens, !mask_out_of_range, vocab_start_index,
+              vocab_start_index + num_embeddings, "input_ids");
+    if (position_ids_.has_value()) {
+        check_ids(position_ids_.value(), num_tokens, true, 0, num_positions, "position_ids");
+        TORCH_CHECK(position_col_offset >= 0 && position_col_offset + position_dim <= embed_dim,
+                    "the position embeddings must fit in the columns of the output");
+    }
+    fused_embedding::EmbeddingParams params;
+    params.num_tokens = num_tokens;
+    params.embed_dim = embed_dim;
+    params.num_embeddings = num_embeddings;
+    params.vocab_start_index = vocab_start_index;
+    params.mask_out_of_range = mask_out_of_range;
+    params.num_positions = position_ids_.has_value() ? num_positions : 0;
+    params.position_dim = position_ids_.has_value() ? position_dim : 0;
+    params.position_col_offset = position_col_offset;
+    params.dropout_p = dropout_p;
+    params.seed = uint64_t(seed);
+    params.offset = uint64_t(offset);
+    return params;
+}
+
+}  // namespace
+
+// out = dropout(weight[input_ids - vocab_start_index], with zero rows for the ids outside of
+// [vocab_start_index, vocab_start_index + num_embeddings) if mask_out_of_range
+// + position_weight[position_ids] in the columns [position_col_offset, ...)), in one pass.
+// input_ids, position_ids: (num_tokens,) int64.
+// weight: (num_embeddings, embed_dim). position_weight: (num_positions, position_dim).
+// The dropout mask is a function of (seed, offset, token, column), and is regenerated in the
+// backward.
+// Returns: (num_tokens, embed_dim).
+torch::Tensor embedding_forward(const torch::Tensor input_ids, const torch::Tensor weight,
+                                const c10::optional<torch::Tensor> position_ids_,
+                                const c10::optional<torch::Tensor> position_weight_,
+                                const int64_t vocab_start_index, const bool mask_out_of_range,
+                                const int64_t position_col_offset, const float dropout_p,
+                                const int64_t seed, const int64_t offset) {
+    TORCH_CHECK(!weight.is_cuda(), "fused_embedding only has a CPU implementation");
+    TORCH_CHECK(weight.dim() == 2 && weight.is_contiguous(),
+                "weight must be a contiguous (num_embeddings, embed_dim) tensor");
+    TORCH_CHECK(position_ids_.has_value() == position_weight_.has_value(),
+                "position_ids and position_weight must be passed together");
+    int64_t num_positions = 0, position_dim = 0;
+    if (position_weight_.has_value()) {
+        auto position_weight = position_weight_.value();
+        TORCH_CHECK(position_weight.dtype() == weight.dtype(),
+                    "position_weight must have the dtype of weight");
+        TORCH_CHECK(position_weight.dim() == 2 && position_weight.is_contiguous(),
+                    "position_weight must be a contiguous (num_positions, position_dim) tensor");
+        num_positions = position_weight.size(0);
+        position_dim = position_weight.size(1);
+    }
+    auto params = set_params(input_ids, weight.size(1), weight.size(0), vocab_start_index,
+                             mask_out_of_range, position_ids_, num_positions, position_dim,
+                             position_col_offset, dropout_p, seed, offset);
+    auto out = torch::empty({params.num_tokens, params.embed_dim}, weight.options());
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(weight.scalar_type(), "embedding_forward", [&] {
+        fused_embedding::embedding_forward_cpu(
+            params, input_ids.data_ptr<int64_t>(), weight.data_ptr<scalar_t>(),
+            position_ids_.has_value() ? position_ids_.value().data_ptr<int64_t>() : nullptr,
+            position_weight_.has_value() ? position_weight_.value().data_ptr<scalar_t>() : nullptr,
+            out.data_ptr<scalar_t>());
+    });
+    return out;
+}
+
+// Gradients of embedding_forward with respect to weight (if weight_grad) and position_weight (if
+// position_ids is passed and position_weight_grad), with the same arguments. padding_idx (-1 for
+// none) is a row of weight that gets no gradient.
+// Returns: {grad_weight, grad_position_weight}, undefined when not computed.
+std::vector<torch::Tensor> embedding_backward(const torch::Tensor grad_out,
+                                              const torch::Tensor input_ids,
+                                              const c10::optional<torch::Tensor> position_ids_,
+                                              const int64_t num_embeddings,
+                                              const int64_t num_positions,
+                                              const int64_t position_dim,
+                                              const int64_t vocab_start_index,
+                                              const bool mask_out_of_range,
+                                              const int64_t position_col_offset,
+                                              const int64_t padding_idx, const float dropout_p,
+                                              const int64_t seed, const int64_t offset,
+                                              const bool weight_grad,
+                                              const bool position_weight_grad) {
+    TORCH_CHECK(!grad_out.is_cuda(), "fused_embedding only has a CPU implementation");
+    TORCH_CHECK(grad_out.dim() == 2, "grad_out must have shape (num_tokens, embed_dim)");
+    TORCH_CHECK(padding_idx >= -1 && padding_idx < num_embeddings, "padding_idx out of range");
+    auto grad = grad_out.contiguous();
+    auto params = set_params(input_ids, grad.size(1), num_embeddings, vocab_start_index,
+                             mask_out_of_range, position_ids_, num_positions, position_dim,
+                             position_col_offset, dropout_p, seed, offset);
+    CHECK_SHAPE(grad, params.num_tokens, params.embed_dim);
+    torch::Tensor grad_weight, grad_position_weight;
+    if (weight_grad) {
+        grad_weight = torch::empty({num_embeddings, params.embed_dim}, grad.options());
+    }
+    if (position_ids_.has_value() && position_weight_grad) {
+        grad_position_weight = torch::empty({num_positions, position_dim}, grad.options());
+    }
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(grad.scalar_type(), "embedding_backward", [&] {
+        fused_embedding::embedding_backward_cpu(
+            params, input_ids.data_ptr<int64_t>(),
+            position_ids_.has_value() ? position_ids_.value().data_ptr<int64_t>() : nullptr,
+            padding_idx, grad.data_ptr<scalar_t>(),
+            grad_weight.defined() ? grad_weight.data_ptr<scalar_t>() : nullptr,
+            grad_position_weight.defined() ? grad_position_weight.data_ptr<scalar_t>() : nullptr);
+    });
+    return {grad_weight, grad_position_weight};
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("embedding_forward", &embedding_forward,
+          "Fused word + position embedding lookup, with vocab-parallel masking and dropout",
+          py::arg("input_ids"), py::arg("weight"), py::arg("position_ids")=py::none(),
+          py::arg("position_weight")=py::none(), py::arg("vocab_start_index")=0,
+          py::arg("mask_out_of_range")=false, py::arg("position_col_offset")=0,
+          py::arg("dropout_p")=0.0f, py::arg("seed")=0, py::arg("offset")=0);
+    m.def("embedding_backward", &embedding_backward,
+          "Backward of embedding_forward, with a sort-based segmented reduction",
+          py::arg("grad_out"), py::arg("input_ids"), py::arg("position_ids"),
+          py::arg("num_embeddings"), py::arg("num_positions"), py::arg("position_dim"),
+          py::arg("vocab_start_index")=0, py::arg("mask_out_of_range")=false,
+          py::arg("position_col_offset")=0, py::arg("padding_idx")=-1, py::arg("dropout_p")=0.0f,
+          py::arg("seed")=0, py::arg("offset")=0, py::arg("weight_grad")=true,
+          py::arg("position_weight_grad")=true);
+}
@@ -0,0 +1,155 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fused_embedding_cpu.h"
+
+namespace fused_embedding {
+
+namespace {
+
+// Multiplies row (the columns [0, n) of token t) by the dropout mask, scaled by 1 / (1 - p).
+void apply_dropout(float* row, int64_t n, const EmbeddingParams& params, int64_t token) {
+    // Keep iff the random word is >= p * 2^32
+    const uint64_t threshold = static_cast<uint64_t>(double(params.dropout_p) * 4294967296.0);
+    const float scale = params.dropout_p < 1.f ? 1.f / (1.f - params.dropout_p) : 0.f;
+    Philox rng(params.seed, token, params.offset);
+    uint32_t r[4];
+    for (int64_t j = 0; j < n; j += 4) {
+        rng.next(r);
+        const int64_t len = std::min<int64_t>(4, n - j);
+        for (int64_t k = 0; k < len; ++k) {
+            row[j + k] = r[k] >= threshold ? row[j + k] * scale : 0.f;
+        }
+    }
+}
+
+// Stable counting sort of the tokens by key (keys outside [0, num_keys) are dropped): the tokens
+// with key k are order[starts[k] .. starts[k + 1]), in increasing order.
+template<typename KeyFn>
+void group_by_key(int64_t num_tokens, int64_t num_keys, KeyFn key, std::vector<int64_t>& order,
+                  std::vector<int64_t>& starts) {
+    starts.assign(num_keys + 1, 0);
+    for (int64_t t = 0; t < num_tokens; ++t) {
+        const int64_t k = key(t);
+        if (k >= 0 && k < num_keys) { ++starts[k + 1]; }
+    }
+    for (int64_t k = 0; k < num_keys; ++k) { starts[k + 1] += starts[k]; }
+    order.resize(starts[num_keys]);
+    std::vector<int64_t> next(starts.begin(), starts.end() - 1);
+    for (int64_t t = 0; t < num_tokens; ++t) {
+        const int64_t k = key(t);
+        if (k >= 0 && k < num_keys) { order[next[k]++] = t; }
+    }
+}
+
+// dst row k (ncols columns, row stride ncols) = sum over the tokens t of group k of the columns
+// [col_offset, col_offset + ncols) of src row t (row stride ld), except for skip_key which is
+// zeroed.
+template<typename T, typename Tsrc>
+void segmented_sum(const std::vector<int64_t>& order, const std::vector<int64_t>& starts,
+                   int64_t num_keys, int64_t skip_key, const Tsrc* src, int64_t ld,
+                   int64_t col_offset, int64_t ncols, T* dst) {
+    at::parallel_for(0, num_keys, 16, [&](int64_t begin, int64_t end) {
+        std::vector<float> acc(ncols);
+        for (int64_t k = begin; k < end; ++k) {
+            T* dst_row = dst + k * ncols;
+            if (k == skip_key || starts[k] == starts[k + 1]) {
+                std::fill(dst_row, dst_row + ncols, T(0.f));
+                continue;
+            }
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int64_t i = starts[k]; i < starts[k + 1]; ++i) {
+                const Tsrc* src_row = src + order[i] * ld + col_offset;
+                for (int64_t j = 0; j < ncols; ++j) { acc[j] += static_cast<float>(src_row[j]); }
+            }
+            for (int64_t j = 0; j < ncols; ++j) { dst_row[j] = static_cast<T>(acc[j]); }
+        }
+    });
+}
+
+template<typename T, typename Tsrc>
+void embedding_backward_impl(const EmbeddingParams& params, const int64_t* input_ids,
+                             const int64_t* position_ids, int64_t padding_idx, const Tsrc* grad,
+                             T* grad_weight, T* grad_position_weight) {
+    std::vector<int64_t> order, starts;
+    if (grad_weight != nullptr) {
+        group_by_key(params.num_tokens, params.num_embeddings,
+                     [&](int64_t t) { return input_ids[t] - params.vocab_start_index; },
+                     order, starts);
+        segmented_sum(order, starts, params.num_embeddings, padding_idx, grad, params.embed_dim,
+                      0, params.embed_dim, grad_weight);
+    }
+    if (grad_position_weight != nullptr) {
+        group_by_key(params.num_tokens, params.num_positions,
+                     [&](int64_t t) { return position_ids[t]; }, order, starts);
+        segmented_sum(order, starts, params.num_positions, -1, grad, params.embed_dim,
+                      params.position_col_offset, params.position_dim, grad_position_weight);
+    }
+}
+
+}  // namespace
+
+template<typename T>
+void embedding_forward_cpu(const EmbeddingParams& params, const int64_t* input_ids,
+                           const T* weight, const int64_t* position_ids,
+                           const T* position_weight, T* out) {
+    const int64_t dim = params.embed_dim;
+    at::parallel_for(0, params.num_tokens, 16, [&](int64_t begin, int64_t end) {
+        std::vector<float> row(dim);
+        for (int64_t t = begin; t < end; ++t) {
+            const int64_t id = input_ids[t] - params.vocab_start_index;
+            if (id >= 0 && id < params.num_embeddings) {
+                const T* weight_row = weight + id * dim;
+                for (int64_t j = 0; j < dim; ++j) { row[j] = static_cast<float>(weight_row[j]); }
+            } else {
+                std::fill(row.begin(), row.end(), 0.f);
+            }
+            if (position_weight != nullptr) {
+                const T* position_row = position_weight + position_ids[t] * params.position_dim;
+                float* dst = row.data() + params.position_col_offset;
+                for (int64_t j = 0; j < params.position_dim; ++j) {
+                    dst[j] += static_cast<float>(position_row[j]);
+                }
+            }
+            if (params.dropout_p > 0.f) { apply_dropout(row.data(), dim, params, t); }
+            T* out_row = out + t * dim;
+            for (int64_t j = 0; j < dim; ++j) { out_row[j] = static_cast<T>(row[j]); }
+        }
+    });
+}
+
+template<typename T>
+void embedding_backward_cpu(const EmbeddingParams& params, const int64_t* input_ids,
+                            const int64_t* position_ids, int64_t padding_idx, const T* grad_out,
+                            T* grad_weight, T* grad_position_weight) {
+    if (params.dropout_p <= 0.f) {
+        embedding_backward_impl(params, input_ids, position_ids, padding_idx, grad_out,
+                                grad_weight, grad_position_weight);
+        return;
+    }
+    // Gradient through the dropout, in fp32, regenerating the mask from (seed, offset)
+    const int64_t dim = params.embed_dim;
+    std::vector<float> grad(params.num_tokens * dim);
+    at::parallel_for(0, params.num_tokens, 16, [&](int64_t begin, int64_t end) {
+        for (int64_t t = begin; t < end; ++t) {
+            float* row = grad.data() + t * dim;
+            for (int64_t j = 0; j < dim; ++j) { row[j] = static_cast<float>(grad_out[t * dim + j]); }
+            apply_dropout(row, dim, params, t);
+        }
+    });
+    embedding_backward_impl(params, input_ids, position_ids, padding_idx, grad.data(),
+                            grad_weight, grad_position_weight);
+}
+
+template void embedding_forward_cpu<float>(const EmbeddingParams&, const int64_t*, const float*, const int64_t*, const float*, float*);
+template void embedding_forward_cpu<at::Half>(const EmbeddingParams&, const int64_t*, const at::Half*, const int64_t*, const at::Half*, at::Half*);
+template void embedding_forward_cpu<at::BFloat16>(const EmbeddingParams&, const int64_t*, const at::BFloat16*, const int64_t*, const at::BFloat16*, at::BFloat16*);
+
+template void embedding_backward_cpu<float>(const EmbeddingParams&, const int64_t*, const int64_t*, int64_t, const float*, float*, float*);
+template void embedding_backward_cpu<at::Half>(const EmbeddingParams&, const int64_t*, const int64_t*, int64_t, const at::Half*, at::Half*, at::Half*);
+template void embedding_backward_cpu<at::BFloat16>(const EmbeddingParams&, const int64_t*, const int64_t*, int64_t, const at::BFloat16*, at::BFloat16*, at::BFloat16*);
+
+}  // namespace fused_embedding
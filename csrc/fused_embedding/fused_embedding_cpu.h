@@ -0,0 +1,52 @@
+// CPU implementation of the fused word + position embedding lookup.
+#pragma once
+
+#include <cstdint>
+
+#include "philox.h"
+
+namespace fused_embedding {
+
+using common::Philox;
+
+struct EmbeddingParams {
+    int64_t num_tokens;
+    int64_t embed_dim;              // Columns of the output and of the word embeddings
+    // Word embeddings: num_embeddings x embed_dim, holding the ids
+    // [vocab_start_index, vocab_start_index + num_embeddings). Other ids give zero rows (the
+    // vocab-parallel embedding), which is only allowed with mask_out_of_range.
+    int64_t num_embeddings;
+    int64_t vocab_start_index;
+    bool mask_out_of_range;
+    // Position embeddings (optional): num_positions x position_dim, added to the columns
+    // [position_col_offset, position_col_offset + position_dim) of the output.
+    int64_t num_positions;
+    int64_t position_dim;
+    int64_t position_col_offset;
+    // Dropout of the output: element (token t, column j) is kept iff the 32-bit word j % 4 of
+    // block offset + j / 4 of the Philox stream (seed, t) is >= dropout_p * 2^32. The same ids,
+    // seed and offset on all ranks give the same mask, so dropout commutes with the reduction
+    // of the vocab-parallel embedding.
+    float dropout_p;
+    uint64_t seed;
+    uint64_t offset;
+};
+
+// out: num_tokens x embed_dim. position_ids and position_weight are null without position
+// embeddings.
+template<typename T>
+void embedding_forward_cpu(const EmbeddingParams& params, const int64_t* input_ids,
+                           const T* weight, const int64_t* position_ids,
+                           const T* position_weight, T* out);
+
+// grad_out: num_tokens x embed_dim. grad_weight / grad_position_weight (either can be null) are
+// overwritten. Each gradient row is the sum, in token order, of the output gradients of the
+// tokens that looked it up, in fp32: the tokens are grouped by id with a counting sort and the
+// groups are reduced in parallel, without atomics, so the result is deterministic.
+// padding_idx (local index, -1 for none) gets no gradient, as in nn.Embedding.
+template<typename T>
+void embedding_backward_cpu(const EmbeddingParams& params, const int64_t* input_ids,
+                            const int64_t* position_ids, int64_t padding_idx, const T* grad_out,
+                            T* grad_weight, T* grad_position_weight);
+
+}  // namespace fused_embedding
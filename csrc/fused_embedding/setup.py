@@ -0,0 +1,26 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+# csrc/common, for philox.h (shared with fused_sampling)
+common_dir = os.path.join(os.path.dirname(this_dir), "common")
+
+setup(
+    name="fused_embedding",
+    version="0.1",
+    description="Fused embedding lookup",
+    ext_modules=[
+        CppExtension(
+            name="fused_embedding",
+            sources=["fused_embedding.cpp", "fused_embedding_cpu.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir, common_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
@@ -0,0 +1,32 @@
+// CPU implementation of the AdamW update, for optimizer states offloaded to host memory.
+#pragma once
+
+#include <cstdint>
+
+namespace fused_optim {
+
+struct AdamParams {
+    int64_t numel;
+    float lr;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    // Decoupled weight decay (AdamW) if true, otherwise L2 regularization added to the gradient
+    bool adam_w_mode;
+    // 1 - beta^step, or 1 without bias correction
+    float bias_correction1;
+    float bias_correction2;
+    // The gradient is multiplied by grad_scale (e.g. 1 / loss scale) when it's read
+    float grad_scale;
+};
+
+// One AdamW step on fp32 master weights param and moments exp_avg, exp_avg_sq (all updated in
+// place), from grad (fp32, fp16 or bf16), following torch.optim.AdamW. The updated weights are
+// also written to param_out (the low-precision copy of the model, fp32, fp16 or bf16) unless it's
+// null. grad and param_out can be views of pinned staging buffers.
+template<typename grad_t, typename out_t>
+void adam_step_cpu(const AdamParams& params, float* param, float* exp_avg, float* exp_avg_sq,
+                   const grad_t* grad, out_t* param_out);
+
+}  // namespace fused_optim
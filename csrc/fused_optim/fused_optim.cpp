@@ -0,0 +1,189 @@
+#include <torch/extension.h>
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "adam_cpu.h"
+#include "multi_tensor_cpu.h"
+
+#define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
+
+#define DISPATCH_FLOAT_AND_HALF_AND_BF16(TYPE, NAME, ...)                  \
+  if (TYPE == at::ScalarType::Half) {                                      \
+    using scalar_t = at::Half;                                             \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::BFloat16) {                           \
+    using scalar_t = at::BFloat16;                                         \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::Float)  {                             \
+    using scalar_t = float;                                                \
+    __VA_ARGS__();                                                         \
+  } else {                                                                 \
+    AT_ERROR(#NAME, " not implemented for type '", toString(TYPE), "'"); \
+  }
+
+namespace {
+
+void check_cpu_contiguous(const torch::Tensor &x, const int64_t numel, const char *name) {
+    TORCH_CHECK(!x.is_cuda(), "fused_optim only has CPU implementations, ", name, " is on GPU");
+    TORCH_CHECK(x.is_contiguous(), name, " must be contiguous");
+    TORCH_CHECK(x.numel() == numel, name, " must have the number of elements of param");
+}
+
+std::vector<int64_t> check_tensor_list(const std::vector<torch::Tensor> &tensors,
+                                       const char *name) {
+    std::vector<int64_t> numels;
+    for (const auto &x : tensors) {
+        TORCH_CHECK(!x.is_cuda(), "fused_optim only has CPU implementations, ", name,
+                    " has a GPU tensor");
+        TORCH_CHECK(x.is_contiguous(), name, " must have contiguous tensors");
+        TORCH_CHECK(x.scalar_type() == at::ScalarType::Float
+                    || x.scalar_type() == at::ScalarType::Half
+                    || x.scalar_type() == at::ScalarType::BFloat16,
+                    name, " must have float32, float16 or bfloat16 tensors");
+        numels.push_back(x.numel());
+    }
+    return numels;
+}
+
+}  // namespace
+
+// One AdamW step (torch.optim.AdamW semantics, or Adam with L2 regularization if not
+// adam_w_mode) on fp32 master weights param and fp32 moments exp_avg and exp_avg_sq, updated in
+// place. grad (fp32, fp16 or bf16) is multiplied by grad_scale. step is the 1-based step count,
+// for the bias correction. The updated weights are also written to param_out (fp32, fp16 or
+// bf16), if passed.
+void adam_step(torch::Tensor param, torch::Tensor exp_avg, torch::Tensor exp_avg_sq,
+               const torch::Tensor grad, c10::optional<torch::Tensor> param_out_, const float lr,
+               const float beta1, const float beta2, const float eps, const float weight_decay,
+               const int64_t step, const bool adam_w_mode, const bool bias_correction,
+               const float grad_scale) {
+    TORCH_CHECK(param.dtype() == torch::kFloat32 && exp_avg.dtype() == torch::kFloat32
+                && exp_avg_sq.dtype() == torch::kFloat32,
+                "param, exp_avg and exp_avg_sq must have dtype float32");
+    TORCH_CHECK(step >= 1, "step must be >= 1");
+    const int64_t numel = param.numel();
+    check_cpu_contiguous(param, numel, "param");
+    check_cpu_contiguous(exp_avg, numel, "exp_avg");
+    check_cpu_contiguous(exp_avg_sq, numel, "exp_avg_sq");
+    check_cpu_contiguous(grad, numel, "grad");
+    if (param_out_.has_value()) { check_cpu_contiguous(param_out_.value(), numel, "param_out"); }
+    fused_optim::AdamParams params;
+    params.numel = numel;
+    params.lr = lr;
+    params.beta1 = beta1;
+    params.beta2 = beta2;
+    params.eps = eps;
+    params.weight_decay = weight_decay;
+    params.adam_w_mode = adam_w_mode;
+    params.bias_correction1 = bias_correction ? 1.f - std::pow(beta1, float(step)) : 1.f;
+    params.bias_correction2 = bias_correction ? 1.f - std::pow(beta2, float(step)) : 1.f;
+    params.grad_scale = grad_scale;
+    // param_out has the dtype of grad if it's not passed (it's then unused)
+    const auto out_type = param_out_.has_value() ? param_out_.value().scalar_type()
+                                                 : grad.scalar_type();
+    py::gil_scoped_release release;
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(grad.scalar_type(), "adam_step", [&] {
+        using grad_t = scalar_t;
+        DISPATCH_FLOAT_AND_HALF_AND_BF16(out_type, "adam_step", [&] {
+            fused_optim::adam_step_cpu<grad_t, scalar_t>(
+                params, param.data_ptr<float>(), exp_avg.data_ptr<float>(),
+                exp_avg_sq.data_ptr<float>(), grad.data_ptr<grad_t>(),
+                param_out_.has_value() ? param_out_.value().data_ptr<scalar_t>() : nullptr);
+        });
+    });
+}
+
+// shadow[i] += weight * (params[i] - shadow[i]) for all i (shadow[i].lerp_(params[i], weight)),
+// e.g. the EMA update with weight = 1 - decay. shadow: fp32 tensors, updated in place. params:
+// fp32, fp16 or bf16 tensors, with the numels of shadow.
+void multi_tensor_ema(std::vector<torch::Tensor> shadow, const std::vector<torch::Tensor> params,
+                      const float weight) {
+    TORCH_CHECK(shadow.size() == params.size(), "shadow and params must have the same length");
+    const auto numels = check_tensor_list(shadow, "shadow");
+    TORCH_CHECK(check_tensor_list(params, "params") == numels,
+                "shadow and params must have tensors of the same numels");
+    for (const auto &s : shadow) {
+        TORCH_CHECK(s.scalar_type() == at::ScalarType::Float, "shadow must have float32 tensors");
+    }
+    const auto chunks = fused_optim::make_chunks(numels);
+    py::gil_scoped_release release;
+    fused_optim::multi_tensor_apply(chunks, [&](int64_t, const fused_optim::TensorChunk &c) {
+        DISPATCH_FLOAT_AND_HALF_AND_BF16(params[c.tensor].scalar_type(), "multi_tensor_ema", [&] {
+            fused_optim::ema_chunk(shadow[c.tensor].data_ptr<float>() + c.start,
+                                   params[c.tensor].data_ptr<scalar_t>() + c.start, c.size,
+                                   weight);
+        });
+    });
+}
+
+// L2 norm of the concatenation of tensors (fp32, fp16 or bf16), accumulated in fp32 in a fixed
+// order (deterministic), and the norm of each tensor if per_tensor.
+// Returns: {norm () float32, per_tensor_norms (num_tensors,) float32 or undefined,
+// found_inf () bool: whether the tensors have an inf or a nan}.
+std::vector<torch::Tensor> multi_tensor_l2norm(const std::vector<torch::Tensor> tensors,
+                                               const bool per_tensor) {
+    const auto numels = check_tensor_list(tensors, "tensors");
+    const auto chunks = fused_optim::make_chunks(numels);
+    std::vector<float> partial(chunks.size());
+    std::unique_ptr<bool[]> nonfinite(new bool[chunks.size()]());
+    {
+        py::gil_scoped_release release;
+        fused_optim::multi_tensor_apply(chunks, [&](int64_t i, const fused_optim::TensorChunk &c) {
+            const auto &x = tensors[c.tensor];
+            DISPATCH_FLOAT_AND_HALF_AND_BF16(x.scalar_type(), "multi_tensor_l2norm", [&] {
+                partial[i] = fused_optim::sum_squares_chunk(x.data_ptr<scalar_t>() + c.start,
+                                                            c.size, &nonfinite[i]);
+            });
+        });
+    }
+    std::vector<float> tensor_sums(tensors.size(), 0.f);
+    bool found_inf = false;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        tensor_sums[chunks[i].tensor] += partial[i];
+        found_inf |= nonfinite[i];
+    }
+    float total = 0.f;
+    for (const float sum : tensor_sums) { total += sum; }
+    auto opts = torch::TensorOptions().dtype(torch::kFloat32);
+    torch::Tensor per_tensor_norms;
+    if (per_tensor) {
+        per_tensor_norms = torch::empty({int64_t(tensors.size())}, opts);
+        float *out = per_tensor_norms.data_ptr<float>();
+        for (size_t t = 0; t < tensors.size(); ++t) { out[t] = std::sqrt(tensor_sums[t]); }
+    }
+    return {torch::full({}, std::sqrt(total), opts), per_tensor_norms,
+            torch::full({}, found_inf, torch::TensorOptions().dtype(torch::kBool))};
+}
+
+// tensors[i] *= scale for all i, in place (e.g. gradient clipping).
+void multi_tensor_scale(std::vector<torch::Tensor> tensors, const float scale) {
+    const auto chunks = fused_optim::make_chunks(check_tensor_list(tensors, "tensors"));
+    py::gil_scoped_release release;
+    fused_optim::multi_tensor_apply(chunks, [&](int64_t, const fused_optim::TensorChunk &c) {
+        auto &x = tensors[c.tensor];
+        DISPATCH_FLOAT_AND_HALF_AND_BF16(x.scalar_type(), "multi_tensor_scale", [&] {
+            fused_optim::scale_chunk(x.data_ptr<scalar_t>() + c.start, c.size, scale);
+        });
+    });
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("adam_step", &adam_step,
+          "AdamW step on fp32 master weights and moments in host memory, writing back the "
+          "low-precision weights",
+          py::arg("param"), py::arg("exp_avg"), py::arg("exp_avg_sq"), py::arg("grad"),
+          py::arg("param_out")=py::none(), py::arg("lr")=1e-3f, py::arg("beta1")=0.9f,
+          py::arg("beta2")=0.999f, py::arg("eps")=1e-8f, py::arg("weight_decay")=0.f,
+          py::arg("step")=1, py::arg("adam_w_mode")=true, py::arg("bias_correction")=true,
+          py::arg("grad_scale")=1.f);
+    m.def("multi_tensor_ema", &multi_tensor_ema,
+          "EMA update of fp32 shadow tensors, shadow += weight * (params - shadow)",
+          py::arg("shadow"), py::arg("params"), py::arg("weight"));
+    m.def("multi_tensor_l2norm", &multi_tensor_l2norm,
+          "Global (and per-tensor) L2 norm of a list of tensors, with inf / nan detection",
+          py::arg("tensors"), py::arg("per_tensor")=false);
+    m.def("multi_tensor_scale", &multi_tensor_scale, "Multiply a list of tensors in place",
+          py::arg("tensors"), py::arg("scale"));
+}
@@ -0,0 +1,82 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "multi_tensor_cpu.h"
+
+namespace fused_optim {
+
+std::vector<TensorChunk> make_chunks(const std::vector<int64_t>& numels) {
+    std::vector<TensorChunk> chunks;
+    for (int64_t t = 0; t < int64_t(numels.size()); ++t) {
+        for (int64_t start = 0; start < numels[t]; start += kMultiTensorChunkSize) {
+            chunks.push_back({t, start, std::min(kMultiTensorChunkSize, numels[t] - start)});
+        }
+    }
+    return chunks;
+}
+
+void multi_tensor_apply(const std::vector<TensorChunk>& chunks,
+                        const std::function<void(int64_t, const TensorChunk&)>& fn) {
+    at::parallel_for(0, int64_t(chunks.size()), 1, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; ++i) { fn(i, chunks[i]); }
+    });
+}
+
+template<typename T>
+void ema_chunk(float* shadow, const T* param, int64_t size, float weight) {
+    for (int64_t i = 0; i < size; ++i) {
+        shadow[i] += weight * (static_cast<float>(param[i]) - shadow[i]);
+    }
+}
+
+template<typename T>
+float sum_squares_chunk(const T* x, int64_t size, bool* nonfinite) {
+    // Independent accumulators, so that the loop vectorizes
+    constexpr int kAccumulators = 8;
+    float acc[kAccumulators] = {0.f};
+    int64_t i = 0;
+    for (; i + kAccumulators <= size; i += kAccumulators) {
+        for (int k = 0; k < kAccumulators; ++k) {
+            const float v = static_cast<float>(x[i + k]);
+            acc[k] += v * v;
+        }
+    }
+    for (; i < size; ++i) {
+        const float v = static_cast<float>(x[i]);
+        acc[0] += v * v;
+    }
+    float sum = 0.f;
+    for (int k = 0; k < kAccumulators; ++k) { sum += acc[k]; }
+    // An inf or a nan makes the sum non-finite, but so does an overflow: only then look for them
+    if (!std::isfinite(sum)) {
+        for (int64_t j = 0; j < size; ++j) {
+            if (!std::isfinite(static_cast<float>(x[j]))) {
+                *nonfinite = true;
+                break;
+            }
+        }
+    }
+    return sum;
+}
+
+template<typename T>
+void scale_chunk(T* x, int64_t size, float scale) {
+    for (int64_t i = 0; i < size; ++i) { x[i] = static_cast<T>(static_cast<float>(x[i]) * scale); }
+}
+
+template void ema_chunk<float>(float*, const float*, int64_t, float);
+template void ema_chunk<at::Half>(float*, const at::Half*, int64_t, float);
+template void ema_chunk<at::BFloat16>(float*, const at::BFloat16*, int64_t, float);
+
+template float sum_squares_chunk<float>(const float*, int64_t, bool*);
+template float sum_squares_chunk<at::Half>(const at::Half*, int64_t, bool*);
+template float sum_squares_chunk<at::BFloat16>(const at::BFloat16*, int64_t, bool*);
+
+template void scale_chunk<float>(float*, int64_t, float);
+template void scale_chunk<at::Half>(at::Half*, int64_t, float);
+template void scale_chunk<at::BFloat16>(at::BFloat16*, int64_t, float);
+
+}  // namespace fused_optim
@@ -0,0 +1,39 @@
+// CPU multi-tensor ops: an operation on a list of tensors (e.g. all the parameters or gradients of
+// a model) runs as one parallel loop over chunks of the tensors, instead of one op per tensor.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace fused_optim {
+
+// Elements per chunk, the unit of work of the multi-tensor ops.
+constexpr int64_t kMultiTensorChunkSize = 64 * 1024;
+
+struct TensorChunk {
+    int64_t tensor;  // Index in the tensor list
+    int64_t start;   // First element of the chunk in the tensor
+    int64_t size;
+};
+
+// The chunks of tensors with numels elements, in order.
+std::vector<TensorChunk> make_chunks(const std::vector<int64_t>& numels);
+
+// Calls fn(i, chunks[i]) for all chunks, in parallel.
+void multi_tensor_apply(const std::vector<TensorChunk>& chunks,
+                        const std::function<void(int64_t, const TensorChunk&)>& fn);
+
+// shadow += weight * (param - shadow), with fp32 shadow weights (the EMA update).
+template<typename T>
+void ema_chunk(float* shadow, const T* param, int64_t size, float weight);
+
+// Sum of squares of x, accumulated in fp32. Sets *nonfinite if x has an inf or a nan.
+template<typename T>
+float sum_squares_chunk(const T* x, int64_t size, bool* nonfinite);
+
+// x *= scale, in place.
+template<typename T>
+void scale_chunk(T* x, int64_t size, float scale);
+
+}  // namespace fused_optim
@@ -0,0 +1,25 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="fused_optim",
+    version="0.1",
+    description="Fused optimizer kernels",
+    ext_modules=[
+        CppExtension(
+            name="fused_optim",
+            sources=["fused_optim.cpp", "adam_cpu.cpp", "multi_tensor_cpu.cpp"],
+            # -fno-math-errno: std::sqrt is then inlined, and the Adam update loop vectorized
+            extra_compile_args={"cxx": ["-O3", "-fno-math-errno"]},
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
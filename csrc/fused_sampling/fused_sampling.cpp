@@ -0,0 +1,52 @@
+#include <torch/extension.h>
+
+#include "fused_sampling_cpu.h"
+
+#define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
+
+#define DISPATCH_FLOAT_AND_HALF_AND_BF16(TYPE, NAME, ...)                  \
+  if (TYPE == at::ScalarType::Half) {                                      \
+    using scalar_t = at::Half;                                             \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::BFloat16) {                           \
+    using scalar_t = at::BFloat16;                                         \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::Float)  {                             \
+    using scalar_t = float;                                                \
+    __VA_ARGS__();                                                         \
+  } else {                                                                 \
+    AT_ERROR(#NAME, " not implemented for type '", toString(TYPE), "'"); \
+  }
+
+// Fused temperature + top-k + top-p sampling, one token per row.
+// logits: (batch_size, vocab_size).
+// top_k: 1 is greedy (argmax), 0 doesn't limit the number of candidates. top_p: 0.0 (or 1.0)
+// disables top-p. Top-k is applied first, then top-p over the top-k candidates, as in
+// flash_attn.utils.generation.sample.
+// seed, offset: row i draws from the Philox stream (seed, subsequence i, offset), so that a step
+// can be replayed.
+// Returns: (batch_size,) int64.
+torch::Tensor sample(const torch::Tensor logits, const int top_k, const float top_p,
+                     const float temperature, const int64_t seed, const int64_t offset) {
+    TORCH_CHECK(!logits.is_cuda(), "fused_sampling only has a CPU implementation");
+    TORCH_CHECK(logits.dim() == 2, "logits must have shape (batch_size, vocab_size)");
+    TORCH_CHECK(logits.stride(1) == 1, "logits must be contiguous in the vocab dimension");
+    TORCH_CHECK(top_k >= 0, "top_k must be non-negative");
+    TORCH_CHECK(top_p >= 0.f && top_p <= 1.f, "top_p must be in [0, 1]");
+    const int64_t batch_size = logits.size(0);
+    const int64_t vocab_size = logits.size(1);
+    TORCH_CHECK(vocab_size > 0 && vocab_size <= std::numeric_limits<int32_t>::max());
+    auto out = torch::empty({batch_size}, logits.options().dtype(torch::kInt64));
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(logits.scalar_type(), "sample", [&] {
+        fused_sampling::sample_cpu(logits.data_ptr<scalar_t>(), batch_size, vocab_size,
+                                   logits.stride(0), top_k, top_p, temperature, uint64_t(seed),
+                                   uint64_t(offset), out.data_ptr<int64_t>());
+    });
+    return out;
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("sample", &sample, "Fused top-k / top-p sampling",
+          py::arg("logits"), py::arg("top_k")=1, py::arg("top_p")=0.0f, py::arg("temperature")=1.0f,
+          py::arg("seed")=0, py::arg("offset")=0);
+}
@@ -0,0 +1,118 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+#include "fused_sampling_cpu.h"
+
+namespace fused_sampling {
+
+namespace {
+
+// Number of candidates selected at first for top-p without top-k, multiplied by 4 every time they
+// don't hold top_p of the probability mass.
+constexpr int64_t kTopPFirstCandidates = 256;
+
+int64_t argmax(const float* x, int64_t n) {
+    // First occurrence of the max, as torch.argmax
+    int64_t best = 0;
+    for (int64_t i = 1; i < n; ++i) {
+        if (x[i] > x[best]) { best = i; }
+    }
+    return best;
+}
+
+float max_of(const float* x, int64_t n) {
+    float m[8];
+    std::fill(m, m + 8, -INFINITY);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; ++j) { m[j] = std::max(m[j], x[i + j]); }
+    }
+    for (; i < n; ++i) { m[0] = std::max(m[0], x[i]); }
+    return *std::max_element(m, m + 8);
+}
+
+// Draw from the candidates idx[0 .. n), with unnormalized probabilities p[idx[j]] summing to
+// total.
+int64_t draw(const float* p, const int32_t* idx, int64_t n, double total, double u) {
+    const double target = u * total;
+    double cumsum = 0.0;
+    for (int64_t j = 0; j < n; ++j) {
+        cumsum += p[idx[j]];
+        if (cumsum > target) { return idx[j]; }
+    }
+    // Rounding: the last candidate with a nonzero probability
+    for (int64_t j = n - 1; j > 0; --j) {
+        if (p[idx[j]] > 0.f) { return idx[j]; }
+    }
+    return idx[0];
+}
+
+// One row. x: the logits in fp32 (overwritten with the unnormalized probabilities), idx: scratch
+// buffer of vocab_size indices.
+int64_t sample_row(float* x, int32_t* idx, int64_t vocab_size, int top_k, float top_p,
+                   float temperature, Philox& rng) {
+    if (top_k == 1 || temperature <= 0.f) { return argmax(x, vocab_size); }
+    const bool use_top_p = top_p > 0.f && top_p < 1.f;
+    const int64_t k = top_k > 0 ? std::min<int64_t>(top_k, vocab_size) : vocab_size;
+    auto greater = [x](int32_t a, int32_t b) { return x[a] > x[b] || (x[a] == x[b] && a < b); };
+    std::iota(idx, idx + vocab_size, 0);
+    // Partial selection of the top-k, O(vocab_size), instead of sorting the whole vocabulary.
+    if (k < vocab_size) { std::nth_element(idx, idx + k, idx + vocab_size, greater); }
+    const float x_max = k < vocab_size ? x[*std::min_element(idx, idx + k, greater)] : max_of(x, vocab_size);
+    const float inv_temperature = 1.f / temperature;
+    double total = 0.0;
+    for (int64_t j = 0; j < k; ++j) {
+        const int32_t i = idx[j];
+        x[i] = std::exp((x[i] - x_max) * inv_temperature);
+        total += x[i];
+    }
+    if (!use_top_p) { return draw(x, idx, k, total, rng.uniform()); }
+
+    // Top-p: keep the candidates, in decreasing order of probability, until the ones before hold
+    // top_p of the mass. Only the candidates that may be kept are sorted: the top-k, or without
+    // top-k, chunks of candidates of growing size.
+    const double threshold = top_p * total;
+    auto by_prob = [x](int32_t a, int32_t b) { return x[a] > x[b] || (x[a] == x[b] && a < b); };
+    int64_t sorted = 0;
+    double kept_mass = 0.0;
+    int64_t chunk = top_k > 0 ? k : std::min(kTopPFirstCandidates, k);
+    while (true) {
+        const int64_t end = std::min(sorted + chunk, k);
+        if (end < k) { std::nth_element(idx + sorted, idx + end, idx + k, by_prob); }
+        std::sort(idx + sorted, idx + end, by_prob);
+        for (; sorted < end; ++sorted) {
+            if (kept_mass >= threshold) { return draw(x, idx, sorted, kept_mass, rng.uniform()); }
+            kept_mass += x[idx[sorted]];
+        }
+        if (sorted == k) { return draw(x, idx, k, kept_mass, rng.uniform()); }
+        chunk *= 4;
+    }
+}
+
+}  // namespace
+
+template<typename T>
+void sample_cpu(const T* logits, int64_t batch_size, int64_t vocab_size, int64_t ld, int top_k,
+                float top_p, float temperature, uint64_t seed, uint64_t offset, int64_t* out) {
+    at::parallel_for(0, batch_size, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> x(vocab_size);
+        std::vector<int32_t> idx(vocab_size);
+        for (int64_t row = begin; row < end; ++row) {
+            const T* logits_row = logits + row * ld;
+            for (int64_t i = 0; i < vocab_size; ++i) { x[i] = static_cast<float>(logits_row[i]); }
+            Philox rng(seed, row, offset);
+            out[row] = sample_row(x.data(), idx.data(), vocab_size, top_k, top_p, temperature, rng);
+        }
+    });
+}
+
+template void sample_cpu<float>(const float*, int64_t, int64_t, int64_t, int, float, float, uint64_t, uint64_t, int64_t*);
+template void sample_cpu<at::Half>(const at::Half*, int64_t, int64_t, int64_t, int, float, float, uint64_t, uint64_t, int64_t*);
+template void sample_cpu<at::BFloat16>(const at::BFloat16*, int64_t, int64_t, int64_t, int, float, float, uint64_t, uint64_t, int64_t*);
+
+}  // namespace fused_sampling
@@ -0,0 +1,19 @@
+// CPU implementation of fused top-k / top-p sampling from logits.
+#pragma once
+
+#include <cstdint>
+
+#include "philox.h"
+
+namespace fused_sampling {
+
+using common::Philox;
+
+// logits: batch_size x vocab_size (row stride ld). Writes one token per row to out.
+// top_k <= 0 means no top-k, top_p <= 0 or >= 1 means no top-p, top_k == 1 or
+// temperature <= 0 means greedy. Row i draws from Philox(seed, i, offset).
+template<typename T>
+void sample_cpu(const T* logits, int64_t batch_size, int64_t vocab_size, int64_t ld, int top_k,
+                float top_p, float temperature, uint64_t seed, uint64_t offset, int64_t* out);
+
+}  // namespace fused_sampling
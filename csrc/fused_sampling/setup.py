@@ -0,0 +1,26 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+# csrc/common, for philox.h (shared with fused_embedding)
+common_dir = os.path.join(os.path.dirname(this_dir), "common")
+
+setup(
+    name="fused_sampling",
+    version="0.1",
+    description="Fused top-k / top-p sampling",
+    ext_modules=[
+        CppExtension(
+            name="fused_sampling",
+            sources=["fused_sampling.cpp", "fused_sampling_cpu.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir, common_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
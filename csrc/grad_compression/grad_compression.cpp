@@ -0,0 +1,100 @@
+#include <torch/extension.h>
+
+#include <vector>
+
+#include "quantize_cpu.h"
+
+#define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
+
+#define DISPATCH_FLOAT_AND_HALF_AND_BF16(TYPE, NAME, ...)                  \
+  if (TYPE == at::ScalarType::Half) {                                      \
+    using scalar_t = at::Half;                                             \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::BFloat16) {                           \
+    using scalar_t = at::BFloat16;                                         \
+    __VA_ARGS__();                                                         \
+  } else if (TYPE == at::ScalarType::Float)  {                             \
+    using scalar_t = float;                                                \
+    __VA_ARGS__();                                                         \
+  } else {                                                                 \
+    AT_ERROR(#NAME, " not implemented for type '", toString(TYPE), "'"); \
+  }
+
+namespace {
+
+void check_cpu_contiguous(const torch::Tensor &x, const char *name) {
+    TORCH_CHECK(!x.is_cuda(), "grad_compression only has CPU implementations, ", name,
+                " is on GPU");
+    TORCH_CHECK(x.is_contiguous(), name, " must be contiguous");
+}
+
+}  // namespace
+
+// Blockwise int8 quantization of x (fp32, fp16 or bf16), with one fp32 scale (max |x| / 127) per
+// block of block_size elements. With error feedback, error (fp32, numel of x) is added to x before
+// the quantization and is then replaced by the quantization error, in place.
+// Returns: {q (numel,) int8, scales (num_blocks,) float32}.
+std::vector<torch::Tensor> quantize_blockwise(const torch::Tensor x, const int64_t block_size,
+                                              c10::optional<torch::Tensor> error_) {
+    TORCH_CHECK(block_size > 0, "block_size must be positive");
+    check_cpu_contiguous(x, "x");
+    const int64_t numel = x.numel();
+    const int64_t num_blocks = (numel + block_size - 1) / block_size;
+    float *error = nullptr;
+    if (error_.has_value()) {
+        auto &e = error_.value();
+        check_cpu_contiguous(e, "error");
+        TORCH_CHECK(e.dtype() == torch::kFloat32, "error must have dtype float32");
+        TORCH_CHECK(e.numel() == numel, "error must have the number of elements of x");
+        error = e.data_ptr<float>();
+    }
+    auto q = torch::empty({numel}, x.options().dtype(torch::kInt8));
+    auto scales = torch::empty({num_blocks}, x.options().dtype(torch::kFloat32));
+    py::gil_scoped_release release;
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(x.scalar_type(), "quantize_blockwise", [&] {
+        grad_compression::quantize_blockwise_cpu<scalar_t>(
+            x.data_ptr<scalar_t>(), numel, block_size, error, q.data_ptr<int8_t>(),
+            scales.data_ptr<float>());
+    });
+    return {q, scales};
+}
+
+// out = alpha * sum of the dequantized rows of q (numel,) or (num_rows, numel), with scales
+// (num_blocks,) or (num_rows, num_blocks), added to out if accumulate. out: fp32, fp16 or bf16
+// with numel elements, written in place.
+void dequantize_blockwise(const torch::Tensor q, const torch::Tensor scales,
+                          const int64_t block_size, torch::Tensor out, const float alpha,
+                          const bool accumulate) {
+    TORCH_CHECK(block_size > 0, "block_size must be positive");
+    TORCH_CHECK(q.dtype() == torch::kInt8, "q must have dtype int8");
+    TORCH_CHECK(scales.dtype() == torch::kFloat32, "scales must have dtype float32");
+    TORCH_CHECK(q.dim() == 1 || q.dim() == 2, "q must have 1 or 2 dimensions");
+    check_cpu_contiguous(q, "q");
+    check_cpu_contiguous(scales, "scales");
+    check_cpu_contiguous(out, "out");
+    const int64_t num_rows = q.dim() == 2 ? q.size(0) : 1;
+    const int64_t numel = q.size(-1);
+    const int64_t num_blocks = (numel + block_size - 1) / block_size;
+    if (q.dim() == 2) {
+        CHECK_SHAPE(scales, num_rows, num_blocks);
+    } else {
+        CHECK_SHAPE(scales, num_blocks);
+    }
+    TORCH_CHECK(out.numel() == numel, "out must have the number of elements of a row of q");
+    py::gil_scoped_release release;
+    DISPATCH_FLOAT_AND_HALF_AND_BF16(out.scalar_type(), "dequantize_blockwise", [&] {
+        grad_compression::dequantize_blockwise_cpu<scalar_t>(
+            q.data_ptr<int8_t>(), scales.data_ptr<float>(), num_rows, numel, block_size, alpha,
+            accumulate, out.data_ptr<scalar_t>());
+    });
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("quantize_blockwise", &quantize_blockwise,
+          "Blockwise int8 quantization, with optional error feedback",
+          py::arg("x"), py::arg("block_size")=256, py::arg("error")=py::none());
+    m.def("dequantize_blockwise", &dequantize_blockwise,
+          "Dequantize (and sum) blockwise int8 tensors into out",
+          py::arg("q"), py::arg("scales"), py::arg("block_size"), py::arg("out"),
+          py::arg("alpha")=1.f, py::arg("accumulate")=false);
+}
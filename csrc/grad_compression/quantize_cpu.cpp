@@ -0,0 +1,88 @@
+#include <ATen/ATen.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "quantize_cpu.h"
+
+namespace grad_compression {
+
+template<typename T>
+void quantize_blockwise_cpu(const T* x, int64_t numel, int64_t block_size, float* error,
+                            int8_t* q, float* scales) {
+    const int64_t num_blocks = (numel + block_size - 1) / block_size;
+    at::parallel_for(0, num_blocks, 16, [&](int64_t begin, int64_t end) {
+        std::vector<float> v(block_size);
+        for (int64_t b = begin; b < end; ++b) {
+            const int64_t start = b * block_size;
+            const int64_t len = std::min(block_size, numel - start);
+            float absmax = 0.f;
+            bool finite = true;
+            for (int64_t i = 0; i < len; ++i) {
+                v[i] = static_cast<float>(x[start + i])
+                    + (error != nullptr ? error[start + i] : 0.f);
+                absmax = std::max(absmax, std::abs(v[i]));
+                finite &= std::isfinite(v[i]);
+            }
+            if (!finite) {
+                scales[b] = std::numeric_limits<float>::quiet_NaN();
+                for (int64_t i = 0; i < len; ++i) { q[start + i] = 0; }
+                if (error != nullptr) {
+                    for (int64_t i = 0; i < len; ++i) { error[start + i] = 0.f; }
+                }
+                continue;
+            }
+            const float scale = absmax / 127.f;
+            const float inv_scale = absmax > 0.f ? 127.f / absmax : 0.f;
+            scales[b] = scale;
+            for (int64_t i = 0; i < len; ++i) {
+                const float r = std::nearbyint(v[i] * inv_scale);
+                q[start + i] = static_cast<int8_t>(std::min(127.f, std::max(-127.f, r)));
+            }
+            if (error != nullptr) {
+                for (int64_t i = 0; i < len; ++i) {
+                    error[start + i] = v[i] - q[start + i] * scale;
+                }
+            }
+        }
+    });
+}
+
+template<typename T>
+void dequantize_blockwise_cpu(const int8_t* q, const float* scales, int64_t num_rows,
+                              int64_t numel, int64_t block_size, float alpha, bool accumulate,
+                              T* out) {
+    const int64_t num_blocks = (numel + block_size - 1) / block_size;
+    at::parallel_for(0, num_blocks, 16, [&](int64_t begin, int64_t end) {
+        std::vector<float> acc(block_size);
+        for (int64_t b = begin; b < end; ++b) {
+            const int64_t start = b * block_size;
+            const int64_t len = std::min(block_size, numel - start);
+            std::fill(acc.begin(), acc.begin() + len, 0.f);
+            // Rows in order, for the same result on all ranks
+            for (int64_t r = 0; r < num_rows; ++r) {
+                const int8_t* q_row = q + r * numel + start;
+                const float scale = scales[r * num_blocks + b];
+                for (int64_t i = 0; i < len; ++i) { acc[i] += q_row[i] * scale; }
+            }
+            for (int64_t i = 0; i < len; ++i) {
+                const float value = alpha * acc[i]
+                    + (accumulate ? static_cast<float>(out[start + i]) : 0.f);
+                out[start + i] = static_cast<T>(value);
+            }
+        }
+    });
+}
+
+template void quantize_blockwise_cpu<float>(const float*, int64_t, int64_t, float*, int8_t*, float*);
+template void quantize_blockwise_cpu<at::Half>(const at::Half*, int64_t, int64_t, float*, int8_t*, float*);
+template void quantize_blockwise_cpu<at::BFloat16>(const at::BFloat16*, int64_t, int64_t, float*, int8_t*, float*);
+
+template void dequantize_blockwise_cpu<float>(const int8_t*, const float*, int64_t, int64_t, int64_t, float, bool, float*);
+template void dequantize_blockwise_cpu<at::Half>(const int8_t*, const float*, int64_t, int64_t, int64_t, float, bool, at::Half*);
+template void dequantize_blockwise_cpu<at::BFloat16>(const int8_t*, const float*, int64_t, int64_t, int64_t, float, bool, at::BFloat16*);
+
+}  // namespace grad_compression
@@ -0,0 +1,26 @@
+// CPU implementation of the blockwise 8-bit quantization of gradients for compressed
+// communication.
+#pragma once
+
+#include <cstdint>
+
+namespace grad_compression {
+
+// x (numel elements) is split into blocks of block_size elements (the last one can be shorter),
+// each quantized to int8 with its own scale: q = round(x / scale), scale = max |x| / 127.
+// With error feedback (error not null), error is added to x first, and is then overwritten by
+// the quantization error (x + error - q * scale). A block with an inf or a nan gets a nan scale,
+// so that it dequantizes to nan (for the loss scaler to skip the step), and a zero error.
+template<typename T>
+void quantize_blockwise_cpu(const T* x, int64_t numel, int64_t block_size, float* error,
+                            int8_t* q, float* scales);
+
+// out = alpha * sum_r q[r] * scales[r] (+ out if accumulate), for num_rows quantized rows of
+// numel elements (rows of q and scales are contiguous), e.g. the mean of the gradients received
+// from all ranks with alpha = 1 / world_size.
+template<typename T>
+void dequantize_blockwise_cpu(const int8_t* q, const float* scales, int64_t num_rows,
+                              int64_t numel, int64_t block_size, float alpha, bool accumulate,
+                              T* out);
+
+}  // namespace grad_compression
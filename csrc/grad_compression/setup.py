@@ -0,0 +1,24 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="grad_compression",
+    version="0.1",
+    description="Gradient compression kernels for DDP communication hooks",
+    ext_modules=[
+        CppExtension(
+            name="grad_compression",
+            sources=["grad_compression.cpp", "quantize_cpu.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
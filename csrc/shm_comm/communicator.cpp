@@ -0,0 +1,237 @@
+#include "communicator.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ATen/ATen.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace shm_comm {
+
+namespace {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the flags must be lock-free to be shared between processes");
+
+// A peer that doesn't show up for this long has most likely died.
+constexpr double kTimeoutSeconds = 600.0;
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+inline int64_t round_up(int64_t x, int64_t multiple) { return (x + multiple - 1) / multiple * multiple; }
+
+// dst[i] = sum over r of srcs[r][i], in fp32, in rank order.
+template <typename T>
+void sum(const T *const *srcs, int num_srcs, int64_t n, T *dst) {
+    constexpr int64_t kBlock = 256;
+    float acc[kBlock];
+    for (int64_t start = 0; start < n; start += kBlock) {
+        const int64_t len = std::min(kBlock, n - start);
+        for (int64_t i = 0; i < len; ++i) { acc[i] = static_cast<float>(srcs[0][start + i]); }
+        for (int r = 1; r < num_srcs; ++r) {
+            const T *src = srcs[r] + start;
+            for (int64_t i = 0; i < len; ++i) { acc[i] += static_cast<float>(src[i]); }
+        }
+        for (int64_t i = 0; i < len; ++i) { dst[start + i] = static_cast<T>(acc[i]); }
+    }
+}
+
+template <typename F>
+void dispatch(ReduceType type, const F &f) {
+    if (type == ReduceType::Float) {
+        f(float{});
+    } else if (type == ReduceType::Half) {
+        f(at::Half{});
+    } else {
+        f(at::BFloat16{});
+    }
+}
+
+}  // namespace
+
+Communicator::Communicator(const std::string &name, int rank, int world_size, int64_t buffer_bytes)
+    : name_(name), rank_(rank), world_size_(world_size), buffer_bytes_(round_up(buffer_bytes, 64)) {
+    if (world_size <= 0 || rank < 0 || rank >= world_size || buffer_bytes <= 0) {
+        throw std::invalid_argument("shm_comm: invalid rank, world_size or buffer_bytes");
+    }
+    // Flags, then 2 x world_size slots, then 2 result buffers
+    const int64_t flags_bytes = round_up(world_size * int64_t(sizeof(Flag)), 4096);
+    size_ = flags_bytes + (2 * world_size + 2) * buffer_bytes_;
+    const int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("shm_comm: cannot open " + name + ": " + std::strerror(errno));
+    }
+    // A new segment is zero-filled, so all the flags start at 0. Every rank sets the same size.
+    if (::ftruncate(fd, size_) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::runtime_error("shm_comm: cannot resize " + name + ": " + std::strerror(err));
+    }
+    void *ptr = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("shm_comm: cannot map " + name + ": " + std::strerror(err));
+    }
+    base_ = static_cast<uint8_t *>(ptr);
+    flags_ = reinterpret_cast<Flag *>(base_);
+    data_ = base_ + flags_bytes;
+    worker_ = std::thread([this] { worker_loop(); });
+}
+
+Communicator::~Communicator() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    worker_.join();
+    ::munmap(base_, size_);
+}
+
+void Communicator::unlink() { ::shm_unlink(name_.c_str()); }
+
+uint8_t *Communicator::slot(int parity, int rank) const {
+    return data_ + (int64_t(parity) * world_size_ + rank) * buffer_bytes_;
+}
+
+uint8_t *Communicator::result(int parity) const {
+    return data_ + (2 * int64_t(world_size_) + parity) * buffer_bytes_;
+}
+
+void Communicator::publish() {
+    flags_[rank_].value.store(++phase_, std::memory_order_release);
+}
+
+void Communicator::wait_all() {
+    const auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < world_size_; ++r) {
+        int64_t spins = 0;
+        while (flags_[r].value.load(std::memory_order_acquire) < phase_) {
+            if (++spins < 1024) {
+                cpu_relax();
+                continue;
+            }
+            std::this_thread::yield();
+            if (spins % 65536 == 0
+                && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > kTimeoutSeconds) {
+                throw std::runtime_error("shm_comm: timed out waiting for rank " + std::to_string(r));
+            }
+        }
+    }
+}
+
+void Communicator::barrier() {
+    publish();
+    wait_all();
+}
+
+void Communicator::all_gather(const void *input, void *output, int64_t nbytes) {
+    const uint8_t *in = static_cast<const uint8_t *>(input);
+    uint8_t *out = static_cast<uint8_t *>(output);
+    for (int64_t offset = 0; offset < nbytes; offset += buffer_bytes_) {
+        const int64_t len = std::min(buffer_bytes_, nbytes - offset);
+        const int parity = num_chunks_++ % 2;
+        std::memcpy(slot(parity, rank_), in + offset, len);
+        publish();
+        wait_all();
+        for (int r = 0; r < world_size_; ++r) {
+            std::memcpy(out + r * nbytes + offset, slot(parity, r), len);
+        }
+    }
+}
+
+void Communicator::reduce_scatter(const void *input, void *output, int64_t count, ReduceType type) {
+    dispatch(type, [&](auto tag) {
+        using T = decltype(tag);
+        const T *in = static_cast<const T *>(input);
+        T *out = static_cast<T *>(output);
+        // Each slot holds one piece for each destination rank
+        const int64_t piece = buffer_bytes_ / int64_t(sizeof(T)) / world_size_;
+        std::vector<const T *> srcs(world_size_);
+        for (int64_t offset = 0; offset < count; offset += piece) {
+            const int64_t len = std::min(piece, count - offset);
+            const int parity = num_chunks_++ % 2;
+            T *my_slot = reinterpret_cast<T *>(slot(parity, rank_));
+            for (int d = 0; d < world_size_; ++d) {
+                std::memcpy(my_slot + d * piece, in + d * count + offset, len * sizeof(T));
+            }
+            publish();
+            wait_all();
+            for (int r = 0; r < world_size_; ++r) {
+                srcs[r] = reinterpret_cast<const T *>(slot(parity, r)) + rank_ * piece;
+            }
+            sum(srcs.data(), world_size_, len, out + offset);
+        }
+    });
+}
+
+void Communicator::all_reduce(const void *input, void *output, int64_t count, ReduceType type) {
+    dispatch(type, [&](auto tag) {
+        using T = decltype(tag);
+        const T *in = static_cast<const T *>(input);
+        T *out = static_cast<T *>(output);
+        const int64_t chunk = buffer_bytes_ / int64_t(sizeof(T));
+        std::vector<const T *> srcs(world_size_);
+        for (int64_t offset = 0; offset < count; offset += chunk) {
+            const int64_t len = std::min(chunk, count - offset);
+            const int parity = num_chunks_++ % 2;
+            std::memcpy(slot(parity, rank_), in + offset, len * sizeof(T));
+            publish();
+            wait_all();
+            // Each rank reduces its segment of the chunk into the result buffer
+            const int64_t segment = (len + world_size_ - 1) / world_size_;
+            const int64_t seg_start = std::min(len, rank_ * segment);
+            const int64_t seg_len = std::min(len, seg_start + segment) - seg_start;
+            for (int r = 0; r < world_size_; ++r) {
+                srcs[r] = reinterpret_cast<const T *>(slot(parity, r)) + seg_start;
+            }
+            T *res = reinterpret_cast<T *>(result(parity));
+            sum(srcs.data(), world_size_, seg_len, res + seg_start);
+            publish();
+            wait_all();
+            std::memcpy(out + offset, res, len * sizeof(T));
+        }
+    });
+}
+
+std::shared_future<void> Communicator::submit(std::function<void()> fn) {
+    std::packaged_task<void()> task(std::move(fn));
+    std::shared_future<void> future = task.get_future().share();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+    return future;
+}
+
+void Communicator::worker_loop() {
+    while (true) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) { return; }
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task();
+    }
+}
+
+}  // namespace shm_comm
@@ -0,0 +1,90 @@
+// Collectives between the processes of one host through a POSIX shared-memory segment.
+//
+// Each rank has a slot in the segment, double-buffered. A collective is split into chunks that fit
+// in the slots. For each chunk, every rank copies its input into its slot, publishes it by bumping
+// its flag (a monotonic counter, release store) and waits until the flags of all ranks have
+// caught up (acquire loads). Then:
+// - all_gather: every rank copies all the slots to its output.
+// - reduce_scatter: every rank sums its segment over all the slots.
+// - all_reduce: reduce_scatter into a shared result buffer, publish and wait again, then
+//   all_gather of the result buffer.
+// Sums are computed in fp32, over the ranks in the same order on every rank, so all ranks get
+// bitwise identical results. There are no locks: each buffer parity is only rewritten after a
+// wait that proves that every rank is done reading it.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace shm_comm {
+
+enum class ReduceType : int { Float = 0, Half = 1, BFloat16 = 2 };
+
+struct alignas(64) Flag {
+    std::atomic<uint64_t> value;
+};
+
+class Communicator {
+public:
+    // Maps the segment `name` (created if needed, all ranks must pass the same arguments).
+    // buffer_bytes is the size of the slot of each rank, i.e. the chunk size of the collectives.
+    Communicator(const std::string &name, int rank, int world_size, int64_t buffer_bytes);
+    ~Communicator();
+    Communicator(const Communicator &) = delete;
+    Communicator &operator=(const Communicator &) = delete;
+
+    // Remove the name of the segment, it's freed once every rank has unmapped it. Call once all
+    // ranks have been constructed.
+    void unlink();
+
+    // Blocking collectives. All ranks must call the same collectives in the same order, and only
+    // from the communication thread (i.e. from a function passed to submit).
+    // output (world_size * nbytes) = concatenation of the inputs (nbytes) of all ranks.
+    void all_gather(const void *input, void *output, int64_t nbytes);
+    // output (count) = sum over the ranks of input[rank * count:(rank + 1) * count].
+    void reduce_scatter(const void *input, void *output, int64_t count, ReduceType type);
+    // output (count) = sum over the ranks of input (count). output may be input.
+    void all_reduce(const void *input, void *output, int64_t count, ReduceType type);
+    void barrier();
+
+    // Runs fn on the communication thread of this communicator, after the previously submitted
+    // work. The collectives above can be called from fn to overlap them with computation.
+    std::shared_future<void> submit(std::function<void()> fn);
+
+    int rank() const { return rank_; }
+    int world_size() const { return world_size_; }
+    int64_t buffer_bytes() const { return buffer_bytes_; }
+
+private:
+    uint8_t *slot(int parity, int rank) const;
+    uint8_t *result(int parity) const;
+    void publish();
+    void wait_all();
+    void worker_loop();
+
+    std::string name_;
+    const int rank_, world_size_;
+    const int64_t buffer_bytes_;
+    uint8_t *base_ = nullptr;
+    int64_t size_ = 0;
+    Flag *flags_ = nullptr;  // One per rank, each on its own cache line
+    uint8_t *data_ = nullptr;
+    // Number of flag bumps and of chunks so far, the same on all ranks
+    uint64_t phase_ = 0;
+    uint64_t num_chunks_ = 0;
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::packaged_task<void()>> queue_;
+    bool stop_ = false;
+};
+
+}  // namespace shm_comm
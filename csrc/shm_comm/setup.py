@@ -0,0 +1,25 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="shm_comm",
+    version="0.1",
+    description="Shared-memory collectives for single-host tensor parallelism",
+    ext_modules=[
+        CppExtension(
+            name="shm_comm",
+            sources=["shm_comm.cpp", "communicator.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            extra_link_args=["-lrt"],
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
@@ -0,0 +1,115 @@
+#include <torch/extension.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "communicator.h"
+
+using shm_comm::Communicator;
+using shm_comm::ReduceType;
+
+namespace {
+
+// Handle of a collective running on the communication thread, same interface as the Work
+// returned by torch.distributed with async_op=True.
+struct Work {
+    std::shared_future<void> future;
+    bool wait() {
+        py::gil_scoped_release release;
+        future.get();  // Rethrows the error of the collective, if any
+        return true;
+    }
+    bool is_completed() const {
+        return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+};
+
+ReduceType reduce_type(const at::Tensor &x) {
+    if (x.scalar_type() == at::kFloat) { return ReduceType::Float; }
+    if (x.scalar_type() == at::kHalf) { return ReduceType::Half; }
+    TORCH_CHECK(x.scalar_type() == at::kBFloat16, "shm_comm only reduces fp32, fp16 and bf16 tensors");
+    return ReduceType::BFloat16;
+}
+
+void check_tensors(const at::Tensor &input, const at::Tensor &output) {
+    TORCH_CHECK(!input.is_cuda() && !output.is_cuda(), "shm_comm only supports CPU tensors");
+    TORCH_CHECK(input.is_contiguous() && output.is_contiguous());
+    TORCH_CHECK(input.dtype() == output.dtype(), "input and output must have the same dtype");
+}
+
+class ShmCommunicator {
+public:
+    ShmCommunicator(const std::string &name, int rank, int world_size, int64_t buffer_bytes)
+        : comm_(std::make_shared<Communicator>(name, rank, world_size, buffer_bytes)) {}
+
+    // The lambdas hold references to the tensors until the collective is done
+    Work all_gather(at::Tensor input, at::Tensor output) {
+        check_tensors(input, output);
+        TORCH_CHECK(output.numel() == input.numel() * comm_->world_size(),
+                    "all_gather: output must have world_size times as many elements as input");
+        auto comm = comm_;
+        return {comm->submit([comm, input, output] {
+            comm->all_gather(input.data_ptr(), output.data_ptr(), input.nbytes());
+        })};
+    }
+
+    Work reduce_scatter(at::Tensor input, at::Tensor output) {
+        check_tensors(input, output);
+        TORCH_CHECK(input.numel() == output.numel() * comm_->world_size(),
+                    "reduce_scatter: input must have world_size times as many elements as output");
+        // Each chunk holds buffer_bytes / element_size / world_size elements for each rank
+        TORCH_CHECK(comm_->buffer_bytes() / input.element_size() / comm_->world_size() > 0,
+                    "reduce_scatter: buffer_bytes must hold at least one element for each rank");
+        const ReduceType type = reduce_type(input);
+        auto comm = comm_;
+        return {comm->submit([comm, input, output, type] {
+            comm->reduce_scatter(input.data_ptr(), output.data_ptr(), output.numel(), type);
+        })};
+    }
+
+    // output may be input
+    Work all_reduce(at::Tensor input, at::Tensor output) {
+        check_tensors(input, output);
+        TORCH_CHECK(input.numel() == output.numel(), "all_reduce: input and output must have the same size");
+        const ReduceType type = reduce_type(input);
+        auto comm = comm_;
+        return {comm->submit([comm, input, output, type] {
+            comm->all_reduce(input.data_ptr(), output.data_ptr(), input.numel(), type);
+        })};
+    }
+
+    Work barrier() {
+        auto comm = comm_;
+        return {comm->submit([comm] { comm->barrier(); })};
+    }
+
+    void unlink() { comm_->unlink(); }
+    int rank() const { return comm_->rank(); }
+    int world_size() const { return comm_->world_size(); }
+    int64_t buffer_bytes() const { return comm_->buffer_bytes(); }
+
+private:
+    std::shared_ptr<Communicator> comm_;
+};
+
+}  // namespace
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<Work>(m, "Work")
+        .def("wait", &Work::wait)
+        .def("is_completed", &Work::is_completed);
+
+    py::class_<ShmCommunicator>(m, "ShmCommunicator")
+        .def(py::init<const std::string &, int, int, int64_t>(), py::arg("name"), py::arg("rank"),
+             py::arg("world_size"), py::arg("buffer_bytes") = int64_t(1) << 22)
+        .def("all_gather", &ShmCommunicator::all_gather, py::arg("input"), py::arg("output"))
+        .def("reduce_scatter", &ShmCommunicator::reduce_scatter, py::arg("input"), py::arg("output"))
+        .def("all_reduce", &ShmCommunicator::all_reduce, py::arg("input"), py::arg("output"))
+        .def("barrier", &ShmCommunicator::barrier)
+        .def("unlink", &ShmCommunicator::unlink,
+             "Remove the name of the segment once all the ranks have attached to it")
+        .def_property_readonly("rank", &ShmCommunicator::rank)
+        .def_property_readonly("world_size", &ShmCommunicator::world_size)
+        .def_property_readonly("buffer_bytes", &ShmCommunicator::buffer_bytes);
+}
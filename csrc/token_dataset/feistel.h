@@ -0,0 +1,58 @@
+// Pseudorandom permutation of [0, n), keyed by (seed, epoch), computed element by element: a
+// balanced Feistel network on the smallest even number of bits covering n, restricted to [0, n)
+// by cycle walking. Element i of the permutation costs O(1) (a few rounds, fewer than 4 walks on
+// average), so a sampler can start at any position without materializing the permutation.
+#pragma once
+
+#include <cstdint>
+
+namespace token_dataset {
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+class FeistelPermutation {
+public:
+    static constexpr int kRounds = 6;
+
+    FeistelPermutation(uint64_t n, uint64_t seed, uint64_t epoch) : n_(n) {
+        half_bits_ = 1;
+        while (half_bits_ < 32 && (uint64_t(1) << (2 * half_bits_)) < n) { ++half_bits_; }
+        mask_ = (uint64_t(1) << half_bits_) - 1;
+        const uint64_t key = mix64(mix64(seed) ^ (epoch + 0x9e3779b97f4a7c15ULL));
+        for (int r = 0; r < kRounds; ++r) {
+            round_keys_[r] = mix64(key + uint64_t(r + 1) * 0x9e3779b97f4a7c15ULL);
+        }
+    }
+
+    uint64_t size() const { return n_; }
+
+    // Element i (< n) of the permutation
+    uint64_t operator()(uint64_t i) const {
+        uint64_t x = i;
+        do { x = encrypt(x); } while (x >= n_);
+        return x;
+    }
+
+private:
+    uint64_t encrypt(uint64_t x) const {
+        uint64_t left = x >> half_bits_, right = x & mask_;
+        for (int r = 0; r < kRounds; ++r) {
+            const uint64_t next = left ^ (mix64(right ^ round_keys_[r]) & mask_);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits_) | right;
+    }
+
+    uint64_t n_;
+    int half_bits_;
+    uint64_t mask_;
+    uint64_t round_keys_[kRounds];
+};
+
+}  // namespace token_dataset
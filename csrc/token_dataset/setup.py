@@ -0,0 +1,24 @@
+import os
+
+from setuptools import setup
+
+from torch.utils.cpp_extension import BuildExtension, CppExtension
+
+
+# ninja build does not work unless include_dirs are abs path
+this_dir = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="token_dataset",
+    version="0.1",
+    description="Memory-mapped token dataset loader",
+    ext_modules=[
+        CppExtension(
+            name="token_dataset",
+            sources=["token_dataset.cpp", "token_file.cpp", "token_writer.cpp"],
+            extra_compile_args={"cxx": ["-O3"]},
+            include_dirs=[this_dir],
+        )
+    ],
+    cmdclass={"build_ext": BuildExtension},
+)
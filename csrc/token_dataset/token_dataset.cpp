@@ -0,0 +1,255 @@
+#include <torch/extension.h>
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "feistel.h"
+#include "token_file.h"
+#include "token_writer.h"
+
+namespace {
+
+token_dataset::TokenType token_type_from_string(const std::string &dtype) {
+    if (dtype == "uint16") { return token_dataset::TokenType::UInt16; }
+    if (dtype == "int32") { return token_dataset::TokenType::Int32; }
+    if (dtype == "uint32") { return token_dataset::TokenType::UInt32; }
+    TORCH_CHECK(false, "TokenLoader: unsupported token dtype ", dtype,
+                ", must be uint16, int32 or uint32");
+}
+
+// Training sequences of seq_len + 1 tokens (the inputs and the shifted targets) read from a
+// token file, or from the concatenation of the shards of a corpus: sequence i is the tokens
+// [i * seq_len, (i + 1) * seq_len + 1), as LMDataset. Only full sequences are read.
+// Batches are submitted (sequence indices, e.g. from a shuffling sampler) ahead of time and
+// assembled by a pool of threads into (batch_size, seq_len + 1) int64 tensors, while the kernel
+// is told to read their pages in the background.
+class TokenLoader {
+public:
+    TokenLoader(const std::string &path, int64_t offset, int64_t num_tokens,
+                const std::string &dtype, int64_t seq_len, int num_threads)
+        : seq_len_(seq_len), pool_(num_threads) {
+        TORCH_CHECK(seq_len > 0, "TokenLoader: seq_len must be positive");
+        add_file(path, offset, num_tokens, token_type_from_string(dtype));
+    }
+
+    TokenLoader(const std::vector<std::string> &paths, const std::vector<int64_t> &num_tokens,
+                const std::string &dtype, int64_t seq_len, int num_threads)
+        : seq_len_(seq_len), pool_(num_threads) {
+        TORCH_CHECK(seq_len > 0, "TokenLoader: seq_len must be positive");
+        TORCH_CHECK(paths.size() == num_tokens.size(),
+                    "TokenLoader: paths and num_tokens must have the same length");
+        for (size_t i = 0; i < paths.size(); ++i) {
+            add_file(paths[i], 0, num_tokens[i], token_type_from_string(dtype));
+        }
+    }
+
+    int64_t num_tokens() const { return starts_.back(); }
+    int64_t seq_len() const { return seq_len_; }
+    int64_t num_sequences() const {
+        return num_tokens() > 0 ? (num_tokens() - 1) / seq_len_ : 0;
+    }
+    int64_t num_pending() const { return int64_t(pending_.size()); }
+
+    // Reads the sequences now, in parallel.
+    torch::Tensor read(const torch::Tensor &indices) {
+        auto idx = check_indices(indices);
+        auto out = torch::empty({idx.size(0), seq_len_ + 1}, torch::kInt64);
+        py::gil_scoped_release release;
+        const int64_t *idx_ptr = idx.data_ptr<int64_t>();
+        int64_t *out_ptr = out.data_ptr<int64_t>();
+        at::parallel_for(0, idx.size(0), 1, [&](int64_t begin, int64_t end) {
+            for (int64_t r = begin; r < end; ++r) {
+                read_tokens(idx_ptr[r] * seq_len_, seq_len_ + 1, out_ptr + r * (seq_len_ + 1));
+            }
+        });
+        return out;
+    }
+
+    // Queues a batch, returned by a later next() (in submission order).
+    void submit(const torch::Tensor &indices) {
+        auto idx = check_indices(indices);
+        auto out = torch::empty({idx.size(0), seq_len_ + 1}, torch::kInt64);
+        const int64_t *idx_ptr = idx.data_ptr<int64_t>();
+        for (int64_t r = 0; r < idx.size(0); ++r) {
+            prefetch_tokens(idx_ptr[r] * seq_len_, seq_len_ + 1);
+        }
+        int64_t *out_ptr = out.data_ptr<int64_t>();
+        const int64_t batch_size = idx.size(0);
+        // idx and out are kept alive by pending_ until the task has run
+        auto future = pool_.submit([this, idx_ptr, out_ptr, batch_size] {
+            for (int64_t r = 0; r < batch_size; ++r) {
+                read_tokens(idx_ptr[r] * seq_len_, seq_len_ + 1, out_ptr + r * (seq_len_ + 1));
+            }
+        });
+        pending_.push_back({idx, out, std::move(future)});
+    }
+
+    // The oldest submitted batch, waiting for it if needed.
+    torch::Tensor next() {
+        TORCH_CHECK(!pending_.empty(), "TokenLoader: no batch was submitted");
+        Pending batch = std::move(pending_.front());
+        pending_.pop_front();
+        {
+            py::gil_scoped_release release;
+            batch.future.wait();
+        }
+        batch.future.get();  // Rethrows the exception of the task, if any
+        return batch.out;
+    }
+
+private:
+    struct Pending {
+        torch::Tensor indices;
+        torch::Tensor out;
+        std::shared_future<void> future;
+    };
+
+    void add_file(const std::string &path, int64_t offset, int64_t num_tokens,
+                  token_dataset::TokenType token_type) {
+        files_.push_back(std::make_unique<token_dataset::TokenFile>(path, offset, num_tokens,
+                                                                    token_type));
+        starts_.push_back(starts_.back() + files_.back()->num_tokens());
+    }
+
+    // Calls fn(file, start in the file, length, position in the range) for the parts of the
+    // tokens [start, start + length) in each file.
+    template <typename Fn>
+    void for_each_part(int64_t start, int64_t length, Fn &&fn) const {
+        size_t f = std::upper_bound(starts_.begin(), starts_.end(), start) - starts_.begin() - 1;
+        for (int64_t pos = 0; pos < length && f < files_.size(); ++f) {
+            const int64_t begin = start + pos - starts_[f];
+            const int64_t n = std::min(length - pos, starts_[f + 1] - starts_[f] - begin);
+            if (n > 0) { fn(*files_[f], begin, n, pos); }
+            pos += std::max<int64_t>(n, 0);
+        }
+    }
+
+    void read_tokens(int64_t start, int64_t length, int64_t *out) const {
+        for_each_part(start, length, [&](const token_dataset::TokenFile &file, int64_t begin,
+                                         int64_t n, int64_t pos) {
+            file.read(begin, n, out + pos);
+        });
+    }
+
+    void prefetch_tokens(int64_t start, int64_t length) const {
+        for_each_part(start, length, [](const token_dataset::TokenFile &file, int64_t begin,
+                                        int64_t n, int64_t) { file.prefetch(begin, n); });
+    }
+
+    torch::Tensor check_indices(const torch::Tensor &indices) const {
+        TORCH_CHECK(!indices.is_cuda(), "TokenLoader: indices must be on CPU");
+        TORCH_CHECK(indices.dim() == 1, "TokenLoader: indices must have shape (batch_size,)");
+        auto idx = indices.to(torch::kInt64).contiguous();
+        if (idx.numel() > 0) {
+            TORCH_CHECK(idx.min().item<int64_t>() >= 0
+                        && idx.max().item<int64_t>() < num_sequences(),
+                        "TokenLoader: sequence index out of range");
+        }
+        return idx;
+    }
+
+    std::vector<std::unique_ptr<token_dataset::TokenFile>> files_;
+    // starts_[i] is the position of the first token of files_[i] in the concatenation
+    std::vector<int64_t> starts_ = {0};
+    int64_t seq_len_;
+    std::deque<Pending> pending_;
+    // Last, so that it's destroyed first: the tasks use files_ and the tensors of pending_
+    token_dataset::ThreadPool pool_;
+};
+
+// The elements at the given positions of the pseudorandom permutation of [0, n) keyed by
+// (seed, epoch)
+torch::Tensor permutation(const torch::Tensor &positions, int64_t n, int64_t seed, int64_t epoch) {
+    TORCH_CHECK(!positions.is_cuda(), "permutation: positions must be on CPU");
+    TORCH_CHECK(n > 0, "permutation: n must be positive");
+    auto positions_ = positions.to(torch::kInt64).contiguous();
+    if (positions_.numel() > 0) {
+        TORCH_CHECK(positions_.min().item<int64_t>() >= 0 && positions_.max().item<int64_t>() < n,
+                    "permutation: position out of range");
+    }
+    auto out = torch::empty_like(positions_);
+    const token_dataset::FeistelPermutation perm(n, uint64_t(seed), uint64_t(epoch));
+    const int64_t *pos_ptr = positions_.data_ptr<int64_t>();
+    int64_t *out_ptr = out.data_ptr<int64_t>();
+    at::parallel_for(0, positions_.numel(), 4096, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; ++i) { out_ptr[i] = int64_t(perm(uint64_t(pos_ptr[i]))); }
+    });
+    return out;
+}
+
+// Python wrapper of token_dataset::ShardWriter
+class ShardWriter {
+public:
+    ShardWriter(const std::string &prefix, const std::string &dtype, int64_t first_document)
+        : writer_(prefix, token_type_from_string(dtype), first_document) {}
+
+    int64_t first_document() const { return writer_.first_document(); }
+    int64_t num_documents() const { return writer_.num_documents(); }
+    int64_t num_tokens() const { return writer_.num_tokens(); }
+
+    void append(const torch::Tensor &tokens, const torch::Tensor &doc_lens) {
+        TORCH_CHECK(!tokens.is_cuda() && !doc_lens.is_cuda(),
+                    "ShardWriter: tokens and doc_lens must be on CPU");
+        TORCH_CHECK(tokens.dim() == 1 && doc_lens.dim() == 1,
+                    "ShardWriter: tokens and doc_lens must be 1-dimensional");
+        auto tokens_ = tokens.to(torch::kInt64).contiguous();
+        auto doc_lens_ = doc_lens.to(torch::kInt64).contiguous();
+        TORCH_CHECK(doc_lens_.sum().item<int64_t>() == tokens_.numel(),
+                    "ShardWriter: doc_lens must sum to the number of tokens");
+        py::gil_scoped_release release;
+        writer_.append(tokens_.data_ptr<int64_t>(), doc_lens_.data_ptr<int64_t>(),
+                       doc_lens_.numel());
+    }
+
+    void flush() {
+        py::gil_scoped_release release;
+        writer_.flush();
+    }
+
+private:
+    token_dataset::ShardWriter writer_;
+};
+
+}  // namespace
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<TokenLoader>(m, "TokenLoader")
+        .def(py::init<const std::string &, int64_t, int64_t, const std::string &, int64_t, int>(),
+             py::arg("path"), py::arg("offset")=0, py::arg("num_tokens")=-1,
+             py::arg("dtype")="uint16", py::arg("seq_len")=1024, py::arg("num_threads")=4)
+        .def(py::init<const std::vector<std::string> &, const std::vector<int64_t> &,
+                      const std::string &, int64_t, int>(),
+             "Read the concatenation of the token files paths (e.g. the shards of a corpus)",
+             py::arg("paths"), py::arg("num_tokens"), py::arg("dtype")="uint16",
+             py::arg("seq_len")=1024, py::arg("num_threads")=4)
+        .def_property_readonly("num_tokens", &TokenLoader::num_tokens)
+        .def_property_readonly("seq_len", &TokenLoader::seq_len)
+        .def_property_readonly("num_sequences", &TokenLoader::num_sequences)
+        .def_property_readonly("num_pending", &TokenLoader::num_pending)
+        .def("read", &TokenLoader::read, "Read the sequences of indices now",
+             py::arg("indices"))
+        .def("submit", &TokenLoader::submit,
+             "Queue the batch of sequences indices, assembled in the background",
+             py::arg("indices"))
+        .def("next", &TokenLoader::next, "The oldest submitted batch, (batch_size, seq_len + 1)");
+
+    m.def("permutation", &permutation,
+          "The elements at positions of the pseudorandom permutation of [0, n) keyed by "
+          "(seed, epoch)",
+          py::arg("positions"), py::arg("n"), py::arg("seed"), py::arg("epoch")=0);
+
+    py::class_<ShardWriter>(m, "ShardWriter")
+        .def(py::init<const std::string &, const std::string &, int64_t>(),
+             py::arg("prefix"), py::arg("dtype")="uint16", py::arg("first_document")=0)
+        .def_property_readonly("first_document", &ShardWriter::first_document)
+        .def_property_readonly("num_documents", &ShardWriter::num_documents)
+        .def_property_readonly("num_tokens", &ShardWriter::num_tokens)
+        .def("append", &ShardWriter::append,
+             "Append documents, given as their concatenated tokens and their lengths",
+             py::arg("tokens"), py::arg("doc_lens"))
+        .def("flush", &ShardWriter::flush);
+}
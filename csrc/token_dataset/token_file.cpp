@@ -0,0 +1,139 @@
+#include "token_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace token_dataset {
+
+namespace {
+
+template <typename T>
+void convert(const uint8_t *src, int64_t length, int64_t *out) {
+    T buf[256];
+    for (int64_t i = 0; i < length; i += 256) {
+        const int64_t n = std::min<int64_t>(256, length - i);
+        // The file data can be unaligned (e.g. after a .npy header)
+        std::memcpy(buf, src + i * sizeof(T), n * sizeof(T));
+        for (int64_t j = 0; j < n; ++j) { out[i + j] = static_cast<int64_t>(buf[j]); }
+    }
+}
+
+}  // namespace
+
+TokenFile::TokenFile(const std::string &path, int64_t offset, int64_t num_tokens,
+                     TokenType token_type)
+    : path_(path), offset_(offset), token_type_(token_type) {
+    element_size_ = token_type == TokenType::UInt16 ? 2 : 4;
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("TokenFile: cannot open " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::runtime_error("TokenFile: cannot stat " + path + ": " + std::strerror(err));
+    }
+    map_size_ = st.st_size;
+    if (offset < 0 || offset > map_size_) {
+        ::close(fd);
+        throw std::runtime_error("TokenFile: offset out of range for " + path);
+    }
+    const int64_t available = (map_size_ - offset) / element_size_;
+    num_tokens_ = num_tokens < 0 ? available : num_tokens;
+    if (num_tokens_ > available) {
+        ::close(fd);
+        throw std::runtime_error("TokenFile: " + path + " has fewer tokens than requested");
+    }
+    if (map_size_ > 0) {
+        void *ptr = ::mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            const int err = errno;
+            ::close(fd);
+            throw std::runtime_error("TokenFile: cannot map " + path + ": " + std::strerror(err));
+        }
+        map_ = static_cast<const uint8_t *>(ptr);
+        // Samples are read at random positions: don't let the kernel read ahead around each
+        // access, prefetch() says what will be needed.
+        ::madvise(const_cast<uint8_t *>(map_), map_size_, MADV_RANDOM);
+    }
+    // The mapping keeps the file alive
+    ::close(fd);
+}
+
+TokenFile::~TokenFile() {
+    if (map_ != nullptr) { ::munmap(const_cast<uint8_t *>(map_), map_size_); }
+}
+
+void TokenFile::read(int64_t start, int64_t length, int64_t *out) const {
+    if (start < 0 || length < 0 || start + length > num_tokens_) {
+        throw std::out_of_range("TokenFile: tokens out of range");
+    }
+    const uint8_t *src = map_ + offset_ + start * element_size_;
+    switch (token_type_) {
+        case TokenType::UInt16: convert<uint16_t>(src, length, out); break;
+        case TokenType::Int32: convert<int32_t>(src, length, out); break;
+        case TokenType::UInt32: convert<uint32_t>(src, length, out); break;
+    }
+}
+
+void TokenFile::prefetch(int64_t start, int64_t length) const {
+    if (map_ == nullptr || length <= 0) { return; }
+    static const int64_t page_size = ::sysconf(_SC_PAGESIZE);
+    // madvise needs a page-aligned address
+    const int64_t begin = (offset_ + start * element_size_) / page_size * page_size;
+    const int64_t end = std::min(map_size_, offset_ + (start + length) * element_size_);
+    if (end > begin) {
+        ::madvise(const_cast<uint8_t *>(map_) + begin, end - begin, MADV_WILLNEED);
+    }
+}
+
+ThreadPool::ThreadPool(int num_threads) {
+    for (int i = 0; i < std::max(num_threads, 1); ++i) {
+        threads_.emplace_back([this] { run(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) { t.join(); }
+}
+
+std::shared_future<void> ThreadPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> packaged(std::move(task));
+    std::shared_future<void> future = packaged.get_future().share();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(packaged));
+    }
+    cv_.notify_one();
+    return future;
+}
+
+void ThreadPool::run() {
+    while (true) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            // Finish the queued tasks before stopping: their futures may be waited on
+            if (tasks_.empty()) { return; }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+}  // namespace token_dataset
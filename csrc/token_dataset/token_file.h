@@ -0,0 +1,74 @@
+// Read-only memory mapping of a flat array of tokens (uint16, int32 or uint32), e.g. the .bin /
+// .npy files of training/src/datamodules/language_modeling_hf.py, read as fixed-length training
+// sequences converted to int64.
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace token_dataset {
+
+enum class TokenType : int {
+    UInt16 = 0,
+    Int32 = 1,
+    UInt32 = 2
+};
+
+class TokenFile {
+public:
+    // The tokens are num_tokens elements of type token_type starting at byte offset (e.g. after
+    // the header of a .npy file). num_tokens < 0 means up to the end of the file.
+    TokenFile(const std::string &path, int64_t offset, int64_t num_tokens, TokenType token_type);
+    ~TokenFile();
+    TokenFile(const TokenFile &) = delete;
+    TokenFile &operator=(const TokenFile &) = delete;
+
+    int64_t num_tokens() const { return num_tokens_; }
+    const std::string &path() const { return path_; }
+
+    // Copies the tokens [start, start + length) to out, as int64.
+    void read(int64_t start, int64_t length, int64_t *out) const;
+
+    // MADV_WILLNEED on the pages of the tokens [start, start + length), so that the kernel reads
+    // them in the background.
+    void prefetch(int64_t start, int64_t length) const;
+
+private:
+    std::string path_;
+    const uint8_t *map_ = nullptr;
+    int64_t map_size_ = 0;
+    int64_t offset_;
+    int64_t num_tokens_;
+    TokenType token_type_;
+    int64_t element_size_;
+};
+
+// Fixed pool of threads running tasks in submission order. submit returns a future that is ready
+// when the task has run (and holds its exception, if any).
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    std::shared_future<void> submit(std::function<void()> task);
+
+private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::packaged_task<void()>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+}  // namespace token_dataset
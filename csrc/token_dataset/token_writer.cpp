@@ -0,0 +1,176 @@
+#include "token_writer.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace token_dataset {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string &what, const std::string &path) {
+    throw std::runtime_error("ShardWriter: " + what + " " + path + ": " + std::strerror(errno));
+}
+
+void write_all(int fd, const void *data, int64_t size, int64_t offset, const std::string &path) {
+    const uint8_t *ptr = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t n = ::pwrite(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            throw_errno("cannot write", path);
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+void read_all(int fd, void *data, int64_t size, int64_t offset, const std::string &path) {
+    uint8_t *ptr = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t n = ::pread(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            throw_errno("cannot read", path);
+        }
+        if (n == 0) { throw std::runtime_error("ShardWriter: " + path + " is truncated"); }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+int64_t file_size(int fd, const std::string &path) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) { throw_errno("cannot stat", path); }
+    return st.st_size;
+}
+
+template <typename T>
+void pack(const int64_t *tokens, int64_t length, uint8_t *out) {
+    for (int64_t i = 0; i < length; ++i) {
+        if (tokens[i] < int64_t(std::numeric_limits<T>::min())
+            || tokens[i] > int64_t(std::numeric_limits<T>::max())) {
+            throw std::out_of_range("ShardWriter: token " + std::to_string(tokens[i])
+                                    + " doesn't fit in the token type");
+        }
+        const T value = static_cast<T>(tokens[i]);
+        std::memcpy(out + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+}  // namespace
+
+ShardWriter::ShardWriter(const std::string &prefix, TokenType token_type, int64_t first_document)
+    : prefix_(prefix), token_type_(token_type), first_document_(first_document) {
+    element_size_ = token_type == TokenType::UInt16 ? 2 : 4;
+    const std::string bin_path = prefix + ".bin", idx_path = prefix + ".idx";
+    idx_fd_ = ::open(idx_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (idx_fd_ < 0) { throw_errno("cannot open", idx_path); }
+    bin_fd_ = ::open(bin_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (bin_fd_ < 0) {
+        ::close(idx_fd_);
+        throw_errno("cannot open", bin_path);
+    }
+    try {
+        const int64_t header_bytes = kIndexHeaderSize * int64_t(sizeof(int64_t));
+        const int64_t idx_size = file_size(idx_fd_, idx_path);
+        if (idx_size < header_bytes) {
+            // New shard (or its header was never completely written)
+            const int64_t header[kIndexHeaderSize] = {kIndexMagic, kIndexVersion,
+                                                      int64_t(token_type), first_document};
+            if (::ftruncate(idx_fd_, 0) != 0 || ::ftruncate(bin_fd_, 0) != 0) {
+                throw_errno("cannot truncate", prefix);
+            }
+            write_all(idx_fd_, header, header_bytes, 0, idx_path);
+        } else {
+            int64_t header[kIndexHeaderSize];
+            read_all(idx_fd_, header, header_bytes, 0, idx_path);
+            if (header[0] != kIndexMagic || header[1] != kIndexVersion) {
+                throw std::runtime_error("ShardWriter: " + idx_path + " is not a token index");
+            }
+            if (header[2] != int64_t(token_type)) {
+                throw std::runtime_error("ShardWriter: " + idx_path
+                                         + " was written with another token type");
+            }
+            first_document_ = header[3];
+            // Drop a partially written offset, and the tokens of incomplete documents
+            num_documents_ = (idx_size - header_bytes) / int64_t(sizeof(int64_t));
+            if (num_documents_ > 0) {
+                read_all(idx_fd_, &num_tokens_, sizeof(int64_t),
+                         header_bytes + (num_documents_ - 1) * int64_t(sizeof(int64_t)), idx_path);
+            }
+            if (file_size(bin_fd_, bin_path) < num_tokens_ * element_size_) {
+                throw std::runtime_error("ShardWriter: " + bin_path
+                                         + " has fewer tokens than its index");
+            }
+            if (::ftruncate(idx_fd_, header_bytes + num_documents_ * int64_t(sizeof(int64_t))) != 0
+                || ::ftruncate(bin_fd_, num_tokens_ * element_size_) != 0) {
+                throw_errno("cannot truncate", prefix);
+            }
+        }
+    } catch (...) {
+        ::close(idx_fd_);
+        ::close(bin_fd_);
+        throw;
+    }
+}
+
+ShardWriter::~ShardWriter() {
+    ::close(idx_fd_);
+    ::close(bin_fd_);
+}
+
+int64_t ShardWriter::num_documents() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_documents_;
+}
+
+int64_t ShardWriter::num_tokens() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_tokens_;
+}
+
+void ShardWriter::append(const int64_t *tokens, const int64_t *doc_lens, int64_t num_documents) {
+    if (num_documents <= 0) { return; }
+    int64_t length = 0;
+    for (int64_t i = 0; i < num_documents; ++i) {
+        if (doc_lens[i] < 0) { throw std::invalid_argument("ShardWriter: negative length"); }
+        length += doc_lens[i];
+    }
+    // Packed outside of the lock
+    std::vector<uint8_t> packed(length * element_size_);
+    switch (token_type_) {
+        case TokenType::UInt16: pack<uint16_t>(tokens, length, packed.data()); break;
+        case TokenType::Int32: pack<int32_t>(tokens, length, packed.data()); break;
+        case TokenType::UInt32: pack<uint32_t>(tokens, length, packed.data()); break;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int64_t> offsets(num_documents);
+    int64_t end = num_tokens_;
+    for (int64_t i = 0; i < num_documents; ++i) {
+        end += doc_lens[i];
+        offsets[i] = end;
+    }
+    write_all(bin_fd_, packed.data(), packed.size(), num_tokens_ * element_size_, prefix_ + ".bin");
+    write_all(idx_fd_, offsets.data(), num_documents * int64_t(sizeof(int64_t)),
+              (kIndexHeaderSize + num_documents_) * int64_t(sizeof(int64_t)), prefix_ + ".idx");
+    num_tokens_ = end;
+    num_documents_ += num_documents;
+}
+
+void ShardWriter::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (::fsync(bin_fd_) != 0) { throw_errno("cannot sync", prefix_ + ".bin"); }
+    if (::fsync(idx_fd_) != 0) { throw_errno("cannot sync", prefix_ + ".idx"); }
+}
+
+}  // namespace token_dataset
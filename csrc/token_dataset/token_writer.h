@@ -0,0 +1,61 @@
+// Append-only writer of a shard of a tokenized corpus: documents are packed back to back in
+// <prefix>.bin (uint16, int32 or uint32, readable by TokenFile), and <prefix>.idx is the offsets
+// index of their boundaries. Each worker writes its own shard, and the corpus is the shards
+// ordered by their first document.
+//
+// <prefix>.idx is a header of kIndexHeaderSize int64 values (kIndexMagic, kIndexVersion, the token
+// type, the id of the first document of the shard), followed by the end offset (in tokens) of
+// every document: it's the cu_seqlens of the documents, without the leading 0.
+//
+// Writes are resumable: the tokens of a batch of documents are written before their offsets, so
+// the index only lists complete documents, and reopening a shard drops anything after the last
+// of them.
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "token_file.h"
+
+namespace token_dataset {
+
+constexpr int64_t kIndexMagic = 0x31305844494b4f54;  // "TOKIDX01"
+constexpr int64_t kIndexVersion = 1;
+constexpr int64_t kIndexHeaderSize = 4;
+
+class ShardWriter {
+public:
+    // Creates the shard, or reopens it to append to it. first_document is recorded when the
+    // shard is created (e.g. the index of its first document in the whole dataset).
+    ShardWriter(const std::string &prefix, TokenType token_type, int64_t first_document);
+    ~ShardWriter();
+    ShardWriter(const ShardWriter &) = delete;
+    ShardWriter &operator=(const ShardWriter &) = delete;
+
+    int64_t first_document() const { return first_document_; }
+    int64_t num_documents() const;
+    int64_t num_tokens() const;
+
+    // Appends num_documents documents, of lengths doc_lens, whose tokens are concatenated in
+    // tokens. Throws std::out_of_range if a token doesn't fit in the token type.
+    // Thread-safe: the documents of a call are contiguous.
+    void append(const int64_t *tokens, const int64_t *doc_lens, int64_t num_documents);
+
+    // fsync of the shard, for the writes to survive a crash of the machine (they already survive
+    // a crash of the process).
+    void flush();
+
+private:
+    std::string prefix_;
+    TokenType token_type_;
+    int64_t element_size_;
+    int64_t first_document_;
+    int bin_fd_ = -1;
+    int idx_fd_ = -1;
+    int64_t num_documents_ = 0;
+    int64_t num_tokens_ = 0;
+    mutable std::mutex mutex_;
+};
+
+}  // namespace token_dataset
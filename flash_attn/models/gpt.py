@@ -20,17 +20,18 @@ from flash_attn.modules.mha import MHA, ParallelMHA
 from flash_attn.modules.mlp import Mlp, FusedMLP, ParallelFusedMLP
 from flash_attn.modules.block import Block, ParallelBlock
 from flash_attn.modules.embedding import GPT2Embeddings, ParallelGPT2Embeddings
-from flash_attn.utils.distributed import sync_shared_params, all_gather_raw
+from flash_attn.utils.distributed import sync_shared_params, all_gather_raw, all_gather
 from flash_attn.utils.pretrained import state_dict_from_pretrained
+from flash_attn.utils.pretrained import state_dict_from_pretrained_mmap, load_lazy_state_dict
 from flash_attn.utils.generation import GenerationMixin
 from flash_attn.models.opt import remap_state_dict_hf_opt
 from flash_attn.models.gptj import remap_state_dict_hf_gptj
 from flash_attn.models.gpt_neox import remap_state_dict_hf_gpt_neox
 
 try:
-    from flash_attn.ops.fused_dense import ColumnParallelLinear
+    from flash_attn.ops.fused_dense import ColumnParallelLinear, fused_dense_gather_func
 except ImportError:
-    ColumnParallelLinear = None
+    ColumnParallelLinear, fused_dense_gather_func = None, None
 
 try:
     from flash_attn.ops.layer_norm import dropout_add_layer_norm
@@ -192,18 +193,26 @@ class GPTPreTrainedModel(nn.Module):
 
     @classmethod
     def from_pretrained(cls, model_name, config, *args, strict=True, device=None, dtype=None,
-                        world_size=1, rank=0, **kwargs):
+                        world_size=1, rank=0, use_mmap=False, **kwargs):
         """
         Instantiate a GPTPreTrainedModel from a pre-trained model file or a pytorch state dict.
         Download and cache the pre-trained model file if needed.
+        If use_mmap, the safetensors checkpoint is memory-mapped and remapped / sharded lazily:
+        each tensor (or each rank's shard of it) is read and converted to dtype straight into the
+        parameters of the model, so the full checkpoint is never loaded. Only GPT-2 for now.
         """
         # Instantiate model.
         model = cls(config, *args, device=device, dtype=dtype, **kwargs)
-        # Load state_dict in cpu because we already initialized the model in GPU, and we don't
-        # want extra stuff taking up more GPU memory
-        state_dict = state_dict_from_pretrained(
-            model_name, device='cpu', dtype=dtype
-        )
+        if use_mmap:
+            if not model_name.startswith('gpt2'):
+                raise NotImplementedError(f'use_mmap is not supported for {model_name} yet')
+            state_dict = state_dict_from_pretrained_mmap(model_name)
+        else:
+            # Load state_dict in cpu because we already initialized the model in GPU, and we don't
+            # want extra stuff taking up more GPU memory
+            state_dict = state_dict_from_pretrained(
+                model_name, device='cpu', dtype=dtype
+            )
         if model_name.startswith('gpt2'):
             state_dict = remap_state_dict_hf_gpt2(state_dict, config)
         elif model_name.startswith('facebook/opt'):
@@ -217,7 +226,10 @@ class GPTPreTrainedModel(nn.Module):
             raise NotImplementedError(f'Model {model_name} not supported')
         if world_size > 1:
             state_dict = shard_state_dict_tp(state_dict, config, world_size, rank)
-        load_return = model.load_state_dict(state_dict, strict=strict)
+        if use_mmap:
+            load_return = load_lazy_state_dict(model, state_dict, strict=strict)
+        else:
+            load_return = model.load_state_dict(state_dict, strict=strict)
         logger.info(load_return)
         return model
 
@@ -402,13 +414,36 @@ class GPTLMHeadModel(GPTPreTrainedModel, GenerationMixin):
         if self.process_group is not None:
             sync_shared_params(self, self.process_group)
 
-    def forward(self, input_ids, position_ids=None, inference_params=None):
+    def forward(self, input_ids, position_ids=None, inference_params=None, num_last_tokens=0,
+                logits_positions=None):
         """
             inference_params: for generation. Adapted from Megatron-LM (and Apex)
             https://github.com/NVIDIA/apex/blob/3ff1a10f72ec07067c4e44759442329804ac5162/apex/transformer/testing/standalone_transformer_lm.py#L470
+            num_last_tokens: if > 0, only compute the logits of the last num_last_tokens positions
+                of each sequence, of shape (batch_size, num_last_tokens, vocab_size). E.g. 1 for the
+                prompt pass of generation.
+            logits_positions: if not None, (num_positions,) indices into the batch_size * seqlen
+                positions, only compute the logits of those, of shape (num_positions, vocab_size).
+                E.g. cu_seqlens[1:] - 1 for the last token of each sequence of a packed varlen batch.
+            The hidden states of the selected positions are gathered before the LM head, so the
+            GEMM with the vocabulary only runs on those.
         """
+        assert num_last_tokens == 0 or logits_positions is None
         hidden_states = self.transformer(input_ids, position_ids=position_ids,
                                          inference_params=inference_params)
+        CausalLMOutput = namedtuple('CausalLMOutput', ['logits'])
+        if num_last_tokens > 0 or logits_positions is not None:
+            batch_size, seqlen = input_ids.shape
+            if num_last_tokens > 0:
+                num_last_tokens = min(num_last_tokens, seqlen)
+                logits_positions = (
+                    torch.arange(batch_size, device=input_ids.device)[:, None] * seqlen
+                    + torch.arange(seqlen - num_last_tokens, seqlen, device=input_ids.device)
+                ).flatten()
+            lm_logits = self._positions_logits(hidden_states, logits_positions, inference_params)
+            if num_last_tokens > 0:
+                lm_logits = rearrange(lm_logits, '(b s) d -> b s d', b=batch_size)
+            return CausalLMOutput(logits=lm_logits)
         if self.project_out is not None:
             hidden_states = self.project_out(hidden_states)
         lm_logits = self.lm_head(hidden_states)
@@ -416,9 +451,30 @@ class GPTLMHeadModel(GPTPreTrainedModel, GenerationMixin):
         if isinstance(self.lm_head, ColumnParallelLinear) and inference_params is not None:
             lm_logits, _ = all_gather_raw(lm_logits, self.lm_head.process_group)
             lm_logits = rearrange(lm_logits, '(n b) s d -> b s (n d)', b=hidden_states.shape[0])
-        CausalLMOutput = namedtuple('CausalLMOutput', ['logits'])
         return CausalLMOutput(logits=lm_logits)
 
+    def _positions_logits(self, hidden_states, positions, inference_params=None):
+        """Logits of the rows `positions` of the (batch_size * seqlen, hidden_dim) hidden states."""
+        is_parallel = isinstance(self.lm_head, ColumnParallelLinear)
+        hidden_states = hidden_states.reshape(-1, hidden_states.shape[-1])
+        # With sequence parallel, each rank only has a slice of the positions
+        if is_parallel and self.lm_head.sequence_parallel:
+            hidden_states = all_gather(hidden_states, self.lm_head.process_group)
+        if self.project_out is not None:
+            hidden_states = self.project_out(hidden_states.index_select(0, positions))
+            positions = torch.arange(hidden_states.shape[0], device=hidden_states.device)
+        if fused_dense_gather_func is not None:
+            lm_logits = fused_dense_gather_func(hidden_states, positions, self.lm_head.weight,
+                                                self.lm_head.bias)
+        else:
+            lm_logits = F.linear(hidden_states.index_select(0, positions), self.lm_head.weight,
+                                 self.lm_head.bias)
+        # During inference, we want the full logit for sampling
+        if is_parallel and inference_params is not None:
+            lm_logits, _ = all_gather_raw(lm_logits, self.lm_head.process_group)
+            lm_logits = rearrange(lm_logits, '(n b) d -> b (n d)', b=positions.shape[0])
+        return lm_logits
+
     def load_state_dict(self, state_dict, strict=True):
         # Remapping from our checkpoints that used a different ordering of layers in the block
         # Previous: Attn / MLP -> Dropout -> Add -> LN
@@ -467,11 +523,13 @@ def shard_state_dict_tp(state_dict, config, world_size, rank):
         dim = x.shape[-1] // world_size
         state_dict[key] = x[..., rank * dim:(rank + 1) * dim]
 
+    # Only indexing and reshape, so that this also works on the LazyTensors of a memory-mapped
+    # checkpoint (see flash_attn.utils.pretrained.LazyTensor).
     def shard_qkv_headdim(state_dict, key):
-        x = rearrange(state_dict[key], '(three d) ... -> three d ...', three=3)
+        x = state_dict[key]
+        x = x.reshape(3, x.shape[0] // 3, *x.shape[1:])
         dim = x.shape[1] // world_size
-        state_dict[key] = rearrange(x[:, rank * dim:(rank + 1) * dim],
-                                    'three d ... -> (three d) ...')
+        state_dict[key] = x[:, rank * dim:(rank + 1) * dim].reshape(-1, *x.shape[2:])
 
     shard_first_dim(state_dict, 'transformer.embeddings.word_embeddings.weight')
     if 'lm_head.weight' in state_dict:
@@ -569,7 +627,7 @@ def remap_state_dict_hf_gpt2(state_dict, config):
 
     # Attention
     for d in range(config.num_hidden_layers):
-        state_dict.pop(f'h.{d}.attn.bias')  # We don't store this bias
+        state_dict.pop(f'h.{d}.attn.bias', None)  # We don't store this bias
         Wqkv = state_dict.pop(f'h.{d}.attn.c_attn.weight')
         state_dict[f'transformer.layers.{d}.mixer.Wqkv.weight'] = Wqkv.t()
         Wout = state_dict.pop(f'h.{d}.attn.c_proj.weight')
@@ -28,6 +28,11 @@ try:
 except ImportError:
     dropout_add_layer_norm = None
 
+try:
+    from flash_attn.ops.fused_dense import fused_patch_embed_func
+except ImportError:
+    fused_patch_embed_func = None
+
 
 def create_mixer_cls(num_heads, qkv_bias, attn_drop, use_flash_attn, fused_bias_fc,
                      cross_attn=False):
@@ -212,13 +217,26 @@ class VisionTransformer(nn.Module):
             x = x + self.pos_embed
         return x
 
+    def _use_fused_patch_embed(self, x):
+        # The fused op only has a CPU implementation, and doesn't apply the norm of PatchEmbed
+        return (fused_patch_embed_func is not None and not x.is_cuda
+                and isinstance(self.patch_embed, PatchEmbed) and self.patch_embed.flatten
+                and isinstance(self.patch_embed.norm, nn.Identity))
+
     def forward_features(self, x, all_tokens=True):
         """
         If all_tokens==False and self.global_pool == 'token', we only return the features for the
         cls token.
         """
-        x = self.patch_embed(x)
-        hidden_states = self._pos_embed(x)
+        if self._use_fused_patch_embed(x):
+            # Patchify + linear + cls token + position embedding in one op, writing the sequence
+            hidden_states = fused_patch_embed_func(
+                x, self.patch_embed.proj.weight, self.patch_embed.proj.bias,
+                self.patch_embed.patch_size, self.pos_embed, self.cls_token
+            )
+        else:
+            x = self.patch_embed(x)
+            hidden_states = self._pos_embed(x)
         residual = None
         if self.global_pool != 'token' or all_tokens:
         # if True:
@@ -8,6 +8,16 @@ from einops import rearrange
 
 from flash_attn.utils.distributed import reduce_scatter, all_reduce
 
+try:
+    from flash_attn.ops.fused_embedding import fused_embedding, fused_embedding_func
+except ImportError:
+    fused_embedding, fused_embedding_func = None, None
+
+
+def _use_fused_embedding(input_ids):
+    # The fused embedding op only has a CPU implementation
+    return fused_embedding is not None and not input_ids.is_cuda
+
 
 class GPT2Embeddings(nn.Module):
 
@@ -40,6 +50,16 @@ class GPT2Embeddings(nn.Module):
             position_ids: (batch, seqlen)
         """
         batch_size, seqlen = input_ids.shape
+        if self.project_in is None and _use_fused_embedding(input_ids):
+            # Word and position embeddings in one pass
+            if self.max_position_embeddings > 0 and position_ids is None:
+                position_ids = torch.arange(seqlen, dtype=torch.long, device=input_ids.device)
+            has_pos = self.max_position_embeddings > 0
+            return fused_embedding_func(
+                input_ids, self.word_embeddings.weight, position_ids if has_pos else None,
+                self.position_embeddings.weight if has_pos else None,
+                padding_idx=self.word_embeddings.padding_idx
+            )
         embeddings = self.word_embeddings(input_ids)
         if self.project_in is not None:
             embeddings = self.project_in(embeddings)
@@ -115,6 +135,9 @@ class VocabParallelEmbedding(nn.Embedding):
             rank = torch.distributed.get_rank(self.process_group)
             vocab_size = self.num_embeddings
             vocab_start_index, vocab_end_index = rank * vocab_size, (rank + 1) * vocab_size
+            if _use_fused_embedding(input):
+                return fused_embedding_func(input, self.weight, vocab_start_index=vocab_start_index,
+                                            mask_out_of_range=True)
             # Create a mask of valid vocab ids (1 means it needs to be masked).
             input_ids_mask = (input < vocab_start_index) | (input >= vocab_end_index)
             input = input - vocab_start_index
@@ -166,17 +189,33 @@ class ParallelGPT2Embeddings(nn.Module):
         """
         batch_size, seqlen = input_ids.shape
         world_size = torch.distributed.get_world_size(self.process_group)
-        embeddings = self.word_embeddings(input_ids)
-        if self.max_position_embeddings > 0:
-            if position_ids is None:
+        if _use_fused_embedding(input_ids):
+            # Vocab-parallel word embeddings and column-parallel position embeddings in one pass
+            if self.max_position_embeddings > 0 and position_ids is None:
                 position_ids = torch.arange(seqlen, dtype=torch.long, device=input_ids.device)
-            position_embeddings = self.position_embeddings(position_ids)
-            if world_size <= 1:
-                embeddings = embeddings + position_embeddings
-            else:
-                partition_dim = self.position_embeddings.embedding_dim
-                rank = torch.distributed.get_rank(self.process_group)
-                embeddings[..., rank * partition_dim:(rank + 1) * partition_dim] += position_embeddings
+            has_pos = self.max_position_embeddings > 0
+            rank = torch.distributed.get_rank(self.process_group)
+            embeddings = fused_embedding_func(
+                input_ids, self.word_embeddings.weight, position_ids if has_pos else None,
+                self.position_embeddings.weight if has_pos else None,
+                vocab_start_index=rank * self.word_embeddings.num_embeddings,
+                mask_out_of_range=world_size > 1,
+                position_col_offset=(rank * self.position_embeddings.embedding_dim
+                                     if has_pos else 0),
+                padding_idx=self.word_embeddings.padding_idx
+            )
+        else:
+            embeddings = self.word_embeddings(input_ids)
+            if self.max_position_embeddings > 0:
+                if position_ids is None:
+                    position_ids = torch.arange(seqlen, dtype=torch.long, device=input_ids.device)
+                position_embeddings = self.position_embeddings(position_ids)
+                if world_size <= 1:
+                    embeddings = embeddings + position_embeddings
+                else:
+                    partition_dim = self.position_embeddings.embedding_dim
+                    rank = torch.distributed.get_rank(self.process_group)
+                    embeddings[..., rank * partition_dim:(rank + 1) * partition_dim] += position_embeddings
         if combine_batch_seqlen_dim:
             embeddings = rearrange(embeddings, 'b s d -> (b s) d')
         reduce_fn = reduce_scatter if self.sequence_parallel else all_reduce
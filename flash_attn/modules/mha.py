@@ -289,26 +289,41 @@ class LinearResidual(nn.Linear):
         return super().forward(input), input
 
 
+def _get_ft_kv_cache(kv, inference_params, layer_idx):
+    """Return the (k_cache, v_cache) of layer_idx in the layouts of the FT kernel, allocating them
+    if needed: k_cache has shape (b, h, headdim / packsize, s, packsize) where packsize = 4 if fp32,
+    8 if fp16 or bf16, v_cache has shape (b, h, s, headdim).
+    kv: (..., nheads, head_dim), only used for the shapes, dtype and device.
+    """
+    if layer_idx not in inference_params.key_value_memory_dict:
+        num_heads, head_dim = kv.shape[-2:]
+        packsize = 4 if kv.dtype == torch.float32 else 8
+        inference_params.key_value_memory_dict[layer_idx] = (
+            torch.empty(inference_params.max_batch_size, num_heads, head_dim // packsize,
+                        inference_params.max_sequence_len, packsize, dtype=kv.dtype,
+                        device=kv.device),
+            torch.empty(inference_params.max_batch_size, num_heads,
+                        inference_params.max_sequence_len, head_dim, dtype=kv.dtype,
+                        device=kv.device)
+        )
+    return inference_params.key_value_memory_dict[layer_idx]
+
+
 def _update_kv_cache(kv, inference_params, layer_idx):
     """kv: (batch_size, seqlen, 2, nheads, head_dim) or (batch_size, 1, 2, nheads, head_dim)
     """
     # Pre-allocate memory for key-values for inference.
-    num_heads, head_dim = kv.shape[-2:]
-    if layer_idx not in inference_params.key_value_memory_dict:
-        kv_cache = torch.empty(
-            inference_params.max_batch_size, inference_params.max_sequence_len, 2,
-            num_heads, head_dim, dtype=kv.dtype, device=kv.device
-        )
-        inference_params.key_value_memory_dict[layer_idx] = kv_cache
+    if not inference_params.fused_ft_kernel:
+        if layer_idx not in inference_params.key_value_memory_dict:
+            num_heads, head_dim = kv.shape[-2:]
+            inference_params.key_value_memory_dict[layer_idx] = torch.empty(
+                inference_params.max_batch_size, inference_params.max_sequence_len, 2,
+                num_heads, head_dim, dtype=kv.dtype, device=kv.device
+            )
+        kv_cache = inference_params.key_value_memory_dict[layer_idx]
     else:
-        if not inference_params.fused_ft_kernel:
-            kv_cache = inference_params.key_value_memory_dict[layer_idx]
-        else:
-            # For FT, k_cache has shape (b, h, headdim / packsize, s, packsize)
-            # where packsize = 4 if fp32, 8 if fp16 or bf16.
-            # v_cache has shape (b, h, s, headdim)
-            k_cache, v_cache = inference_params.key_value_memory_dict[layer_idx]
-            kv_cache = None
+        k_cache, v_cache = _get_ft_kv_cache(kv, inference_params, layer_idx)
+        kv_cache = None
     # Adjust key and value for inference
     batch_start = inference_params.batch_size_offset
     batch_end = batch_start + kv.shape[0]
@@ -327,12 +342,15 @@ def _update_kv_cache(kv, inference_params, layer_idx):
         # FT kernel requires different layouts for the k_cache and v_cache.
         assert kv.dtype in [torch.float16, torch.bfloat16, torch.float32]
         packsize = 4 if kv.dtype == torch.float32 else 8
-        if kv_cache is not None:
-            kv_cache[batch_start:batch_end, sequence_start:sequence_end, ...] = kv
-            k_cache = rearrange(kv_cache[:, :, 0], 'b s h (d packsize) -> b h d s packsize',
-                                packsize=packsize).contiguous()
-            v_cache = rearrange(kv_cache[:, :, 1], 'b s h d -> b h s d').contiguous()
-            inference_params.key_value_memory_dict[layer_idx] = (k_cache, v_cache)
+        if not kv.is_cuda and ft_attention is not None:
+            # Scatter the K/V straight from the QKV projection output to the FT layouts
+            batch_size, seqlen = kv.shape[:2]
+            k, v = rearrange(kv, 'b s two h d -> two (b s) h d').unbind(dim=0)
+            ft_attention.append_kv_cache(
+                k, v, k_cache[batch_start:batch_end], v_cache[batch_start:batch_end],
+                torch.arange(0, (batch_size + 1) * seqlen, seqlen, dtype=torch.int32),
+                torch.zeros(batch_size, dtype=torch.int32)
+            )
         else:
             k_cache[batch_start:batch_end, :, :, :sequence_end, :] = rearrange(
                 kv[:, :, 0], 'b s h (d packsize) -> b h d s packsize', packsize=packsize
@@ -343,6 +361,48 @@ def _update_kv_cache(kv, inference_params, layer_idx):
         return kv
 
 
+def _ft_single_query_attention(qkv, inference_params, layer_idx, rotary_emb_dim=0,
+                               neox_rotary_style=True):
+    """qkv: (batch_size, 1, 3, nheads, headdim). The batch may be smaller than max_batch_size
+    (e.g. after the finished sequences have been compacted away), we use the rows
+    [batch_size_offset, batch_size_offset + batch_size) of the KV cache.
+    """
+    batch_start = inference_params.batch_size_offset
+    batch_end = batch_start + qkv.shape[0]
+    k_cache, v_cache = inference_params.key_value_memory_dict[layer_idx]
+    lengths_per_sample = (inference_params.lengths_per_sample[batch_start:batch_end]
+                          if inference_params.lengths_per_sample is not None else None)
+    finished = (inference_params.finished[batch_start:batch_end]
+                if inference_params.finished is not None else None)
+    context = ft_attention.single_query_attention(
+        *rearrange(qkv, 'b 1 three h d -> b three h d').unbind(dim=1),
+        k_cache[batch_start:batch_end], v_cache[batch_start:batch_end],
+        lengths_per_sample, inference_params.sequence_len_offset, rotary_emb_dim,
+        neox_rotary_style, finished_=finished
+    )
+    return rearrange(context, 'b h d -> b 1 h d')
+
+
+def _ft_kv_cache_attention(qkv, inference_params, layer_idx, softmax_scale=None, causal=True):
+    """qkv: (batch_size, seqlen, 3, nheads, headdim). Attention of the new tokens against the KV
+    cache in the FT layouts (the prompt, or the next chunk of a chunked prefill), the new K/V are
+    written to the cache in the same pass. CPU only.
+    """
+    batch_size, seqlen = qkv.shape[:2]
+    batch_start = inference_params.batch_size_offset
+    batch_end = batch_start + batch_size
+    k_cache, v_cache = _get_ft_kv_cache(qkv, inference_params, layer_idx)
+    cache_seqlens = torch.full((batch_size,), inference_params.sequence_len_offset,
+                               dtype=torch.int32)
+    q, k, v = rearrange(qkv, 'b s three h d -> three (b s) h d').unbind(dim=0)
+    context = ft_attention.varlen_attention_with_kv_cache(
+        q, k, v, k_cache[batch_start:batch_end], v_cache[batch_start:batch_end],
+        torch.arange(0, (batch_size + 1) * seqlen, seqlen, dtype=torch.int32), cache_seqlens,
+        softmax_scale=softmax_scale or 0.0, is_causal=causal
+    )
+    return rearrange(context, '(b s) h d -> b s h d', b=batch_size)
+
+
 class MHA(nn.Module):
     """Multi-head self-attention and cross-attention
     """
@@ -478,7 +538,15 @@ class MHA(nn.Module):
                 else:
                     context = torch.utils.checkpoint.checkpoint(self.inner_attn, qkv, **kwargs)
             else:
-                if (not inference_params.fused_ft_kernel) or inference_params.sequence_len_offset == 0:
+                if (inference_params.fused_ft_kernel and qkv.shape[1] > 1 and not qkv.is_cuda
+                        and ft_attention is not None):
+                    # Attention and the KV cache update in one pass, straight into the FT layouts
+                    if self.rotary_emb_dim > 0:
+                        qkv = self.rotary_emb(qkv, seqlen_offset=inference_params.sequence_len_offset)
+                    assert self.layer_idx is not None, 'Generation requires layer_idx in the constructor'
+                    context = _ft_kv_cache_attention(qkv, inference_params, self.layer_idx,
+                                                     self.inner_cross_attn.softmax_scale, self.causal)
+                elif (not inference_params.fused_ft_kernel) or inference_params.sequence_len_offset == 0:
                     if self.rotary_emb_dim > 0:
                         qkv = self.rotary_emb(qkv, seqlen_offset=inference_params.sequence_len_offset)
                     q = qkv[:, :, 0]
@@ -490,14 +558,10 @@ class MHA(nn.Module):
                 else:
                     assert inference_params.fused_ft_kernel
                     assert ft_attention is not None
-                    context = ft_attention.single_query_attention(
-                        *rearrange(qkv, 'b 1 three h d -> b three h d').unbind(dim=1),
-                        *inference_params.key_value_memory_dict[self.layer_idx],
-                        inference_params.lengths_per_sample, inference_params.sequence_len_offset,
-                        self.rotary_emb_dim,
-                        not self.rotary_emb.interleaved  # neox_rotary_style
+                    context = _ft_single_query_attention(
+                        qkv, inference_params, self.layer_idx, self.rotary_emb_dim,
+                        self.rotary_emb_dim == 0 or not self.rotary_emb.interleaved  # neox_rotary_style
                     )
-                    context = rearrange(context, 'b h d -> b 1 h d')
         else:
             if not self.return_residual:
                 q = self.Wq(x if mixer_subset is None else x[:, mixer_subset])
@@ -591,7 +655,15 @@ class ParallelMHA(nn.Module):
             else:
                 context = torch.utils.checkpoint.checkpoint(self.inner_attn, qkv, **kwargs)
         else:
-            if (not inference_params.fused_ft_kernel) or inference_params.sequence_len_offset == 0:
+            if (inference_params.fused_ft_kernel and qkv.shape[1] > 1 and not qkv.is_cuda
+                    and ft_attention is not None):
+                # Attention and the KV cache update in one pass, straight into the FT layouts
+                if self.rotary_emb_dim > 0:
+                    qkv = self.rotary_emb(qkv, seqlen_offset=inference_params.sequence_len_offset)
+                assert self.layer_idx is not None, 'Generation requires layer_idx in the constructor'
+                context = _ft_kv_cache_attention(qkv, inference_params, self.layer_idx,
+                                                 self.inner_cross_attn.softmax_scale, self.causal)
+            elif (not inference_params.fused_ft_kernel) or inference_params.sequence_len_offset == 0:
                 if self.rotary_emb_dim > 0:
                     qkv = self.rotary_emb(qkv, seqlen_offset=inference_params.sequence_len_offset)
                 q = qkv[:, :, 0]
@@ -604,14 +676,10 @@ class ParallelMHA(nn.Module):
             else:
                 assert inference_params.fused_ft_kernel
                 assert ft_attention is not None
-                context = ft_attention.single_query_attention(
-                    *rearrange(qkv, 'b 1 three h d -> b three h d').unbind(dim=1),
-                    *inference_params.key_value_memory_dict[self.layer_idx],
-                    inference_params.lengths_per_sample, inference_params.sequence_len_offset,
-                    self.rotary_emb_dim,
-                    not self.rotary_emb.interleaved  # neox_rotary_style
+                context = _ft_single_query_attention(
+                    qkv, inference_params, self.layer_idx, self.rotary_emb_dim,
+                    self.rotary_emb_dim == 0 or not self.rotary_emb.interleaved  # neox_rotary_style
                 )
-                context = rearrange(context, 'b h d -> b 1 h d')
         if seqlen is None:
             context = rearrange(context, 'b s h d -> b s (h d)')
         else:
@@ -5,6 +5,14 @@ import torch
 import torch.nn as nn
 import torch.nn.functional as F
 
+try:
+    import fused_dense_lib
+except ImportError:
+    fused_dense_lib = None
+
+# Must be kept in sync with fused_dense::Activation in csrc/fused_dense_lib/fused_dense_cpu.h
+_ACTIVATION_ID = {'none': 0, 'gelu_approx': 1, 'relu': 2, 'gelu': 3}
+
 
 # 1/sqrt(2*pi)-> 0.3989423
 # 1/sqrt(2)   -> 0.70710678
@@ -38,17 +46,116 @@ class GeLUFunction(torch.autograd.Function):
     # bias is an optional argument
     def forward(ctx, input, bias):
         ctx.save_for_backward(input, bias)
+        if _use_native(input):
+            return _bias_act_forward_native(input, bias, 'gelu_approx')[0]
         return bias_gelu(input, bias)
 
     @staticmethod
     def backward(ctx, grad_output):
         input, bias = ctx.saved_tensors
-        tmp = bias_gelu_back(grad_output, input, bias)
-        return tmp, tmp
+        if _use_native(input):
+            return _bias_act_backward_native(grad_output, input, bias, None, 'gelu_approx', True)
+        return bias_gelu_back(grad_output, input, bias)
 
 
 bias_gelu_impl = GeLUFunction.apply
 
+
+def _use_native(x):
+    # The native activation kernels only have a CPU implementation
+    return fused_dense_lib is not None and not x.is_cuda
+
+
+def _bias_act_forward_native(x, bias, activation, save_mask=False):
+    """Return: act(x + bias), and the bit-packed ReLU mask if save_mask (None otherwise).
+    """
+    batch_shape, n = x.shape[:-1], x.shape[-1]
+    out, mask = fused_dense_lib.bias_act_forward(
+        x.reshape(batch_shape.numel(), n).contiguous(), bias, _ACTIVATION_ID[activation],
+        save_mask
+    )
+    return out.reshape(x.shape), mask
+
+
+def _bias_act_backward_native(grad_output, x, bias, mask, activation, has_grad_bias):
+    batch_shape, n = grad_output.shape[:-1], grad_output.shape[-1]
+    grad_input, grad_bias = fused_dense_lib.bias_act_backward(
+        grad_output.reshape(batch_shape.numel(), n).contiguous(),
+        x.reshape(batch_shape.numel(), n).contiguous() if x is not None else None,
+        bias, mask, _ACTIVATION_ID[activation], has_grad_bias
+    )
+    return grad_input.reshape(grad_output.shape), grad_bias
+
+
+class BiasActFunction(torch.autograd.Function):
+
+    @staticmethod
+    def forward(ctx, x, bias, activation):
+        """activation(x + bias) with the native kernels (CPU).
+        With ReLU, only a 1-bit mask per element is saved for the backward, not the input.
+        """
+        ctx.activation = activation
+        ctx.has_bias = bias is not None
+        save_mask = activation == 'relu' and x.shape[-1] % 8 == 0
+        out, mask = _bias_act_forward_native(x, bias, activation, save_mask)
+        if save_mask:
+            ctx.save_for_backward(None, bias, mask)
+        else:
+            ctx.save_for_backward(x, bias, None)
+        return out
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        x, bias, mask = ctx.saved_tensors
+        grad_input, grad_bias = _bias_act_backward_native(
+            grad_output, x, bias, mask, ctx.activation, ctx.has_bias and ctx.needs_input_grad[1]
+        )
+        return grad_input, grad_bias, None
+
+
+def bias_act(x, bias=None, activation='gelu_approx'):
+    """activation(x + bias), activation in 'gelu_approx' (tanh approximation), 'gelu' (exact erf),
+    'relu'. Uses fused native kernels on CPU.
+    """
+    assert activation in ['gelu_approx', 'gelu', 'relu']
+    if _use_native(x):
+        return BiasActFunction.apply(x, bias, activation)
+    if bias is not None:
+        x = x + bias
+    if activation == 'relu':
+        return F.relu(x)
+    return F.gelu(x, approximate='tanh' if activation == 'gelu_approx' else 'none')
+
+
+class SwiGLUFunction(torch.autograd.Function):
+
+    @staticmethod
+    def forward(ctx, x):
+        ctx.save_for_backward(x)
+        batch_shape, n = x.shape[:-1], x.shape[-1]
+        out = fused_dense_lib.swiglu_forward(x.reshape(batch_shape.numel(), n).contiguous())
+        return out.reshape(*batch_shape, n // 2)
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        x, = ctx.saved_tensors
+        batch_shape, n = x.shape[:-1], x.shape[-1]
+        grad_x = fused_dense_lib.swiglu_backward(
+            grad_output.reshape(batch_shape.numel(), n // 2).contiguous(),
+            x.reshape(batch_shape.numel(), n).contiguous()
+        )
+        return grad_x.reshape(x.shape)
+
+
+def swiglu(x):
+    """silu(gate) * value, where x = [gate, value] along the last dimension.
+    Uses fused native kernels on CPU.
+    """
+    if _use_native(x):
+        return SwiGLUFunction.apply(x)
+    gate, value = x.chunk(2, dim=-1)
+    return F.silu(gate) * value
+
 # this function is tanh approximation of gelu
 # actual gelu is:
 # x * 0.5 * (1.0 + torch.erf(x * 0.70710678))
@@ -67,6 +174,13 @@ def gelu_bwd(g, x):
     return (ff * g).to(dtype=x.dtype)
 
 
+# gradient of actual gelu
+@torch.jit.script
+def gelu_exact_bwd(g, x):
+    ff = 0.5 * (1.0 + torch.erf(x * 0.70710678)) + 0.3989423 * x * torch.exp(-0.5 * x * x)
+    return (ff * g).to(dtype=x.dtype)
+
+
 class FastGeLUFunction(torch.autograd.Function):
     @staticmethod
     # bias is an optional argument
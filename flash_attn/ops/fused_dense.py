@@ -12,10 +12,13 @@ from torch import Tensor
 from torch.distributed import ProcessGroup
 from torch.cuda.amp import custom_bwd, custom_fwd
 
+from einops import rearrange
+
 # import fused_dense_cuda  # from apex
 import fused_dense_lib as fused_dense_cuda
 
-from flash_attn.ops.activations import gelu_bwd, relu_bwd, sqrelu_fwd, sqrelu_bwd
+from flash_attn.ops.activations import gelu_bwd, gelu_exact_bwd, relu_bwd, sqrelu_fwd, sqrelu_bwd
+from flash_attn.ops.activations import _ACTIVATION_ID
 from flash_attn.utils.distributed import all_gather_raw, reduce_scatter_raw, all_reduce_raw
 from flash_attn.utils.distributed import reduce_scatter, all_reduce
 
@@ -124,6 +127,214 @@ def fused_dense_func(x: Tensor, weight: Tensor, bias: Optional[Tensor] = None,
         return out if not return_residual else (out, x)
 
 
+def _chunk_bounds(num_tokens, num_chunks):
+    num_chunks = max(1, min(num_chunks, num_tokens))
+    return [(i * num_tokens // num_chunks, (i + 1) * num_tokens // num_chunks)
+            for i in range(num_chunks)]
+
+
+class AllGatherLinearFunc(torch.autograd.Function):
+    """linear(all_gather(x), weight, bias), the ColumnParallelLinear with sequence parallel, with
+    the communication overlapped with the GEMMs: the local tokens are split into num_chunks
+    chunks, and the all_gather of chunk i + 1 runs while the GEMM of chunk i does. In the
+    backward, the reduce_scatter of the input gradient of chunk i runs while the GEMMs of the
+    next chunks do.
+    Works on any device with any backend that supports async collectives (e.g. gloo on CPU).
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, process_group, num_chunks=1):
+        ctx.process_group = process_group
+        ctx.num_chunks = num_chunks
+        ctx.save_for_backward(x, weight)
+        world_size = torch.distributed.get_world_size(process_group)
+        batch_shape = x.shape[:-1]
+        x = x.reshape(-1, x.shape[-1]).contiguous()
+        num_tokens = x.shape[0]
+        bounds = _chunk_bounds(num_tokens, num_chunks)
+        gathered = [all_gather_raw(x[bounds[0][0]:bounds[0][1]], process_group, async_op=True)]
+        out = None
+        for i, (start, end) in enumerate(bounds):
+            if i + 1 < len(bounds):
+                next_start, next_end = bounds[i + 1]
+                gathered.append(all_gather_raw(x[next_start:next_end], process_group,
+                                               async_op=True))
+            total_x, handle = gathered[i]
+            handle.wait()
+            gathered[i] = None
+            # Rows of total_x are (rank, token of the chunk)
+            out_chunk = F.linear(total_x, weight, bias)
+            if out is None:
+                out = torch.empty(world_size, num_tokens, out_chunk.shape[-1],
+                                  dtype=out_chunk.dtype, device=out_chunk.device)
+            out[:, start:end] = out_chunk.reshape(world_size, end - start, -1)
+        return out.reshape(world_size * batch_shape[0], *batch_shape[1:], out.shape[-1])
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        x, weight = ctx.saved_tensors
+        process_group = ctx.process_group
+        world_size = torch.distributed.get_world_size(process_group)
+        x = x.reshape(-1, x.shape[-1]).contiguous()
+        num_tokens = x.shape[0]
+        grad_output = grad_output.reshape(world_size, num_tokens, grad_output.shape[-1])
+        grad_x = torch.empty_like(x) if ctx.needs_input_grad[0] else None
+        grad_weight = torch.zeros_like(weight) if ctx.needs_input_grad[1] else None
+        reduced = []
+        for start, end in _chunk_bounds(num_tokens, ctx.num_chunks):
+            g = grad_output[:, start:end].reshape(-1, grad_output.shape[-1])
+            if grad_weight is not None:
+                # Needed after the GEMM of the input gradient, which hides it
+                total_x, handle_x = all_gather_raw(x[start:end], process_group, async_op=True)
+            if grad_x is not None:
+                grad_x_chunk, handle = reduce_scatter_raw(g @ weight, process_group, async_op=True)
+                reduced.append((start, end, grad_x_chunk, handle))
+            if grad_weight is not None:
+                handle_x.wait()
+                grad_weight.addmm_(g.t(), total_x)
+        for start, end, grad_x_chunk, handle in reduced:
+            handle.wait()
+            grad_x[start:end] = grad_x_chunk
+        grad_bias = grad_output.sum(dim=(0, 1)) if ctx.needs_input_grad[2] else None
+        if grad_x is not None:
+            grad_x = grad_x.reshape(ctx.saved_tensors[0].shape)
+        return grad_x, grad_weight, grad_bias, None, None
+
+
+class LinearReduceScatterFunc(torch.autograd.Function):
+    """reduce_scatter(linear(x, weight, bias)), the RowParallelLinear with sequence parallel, with
+    the communication overlapped with the GEMMs: the reduce_scatter of the output of chunk i runs
+    while the GEMM of chunk i + 1 does, and in the backward the all_gather of the output gradient
+    of chunk i + 1 runs while the GEMMs of chunk i do. x is (world_size * num_tokens, ...), the
+    chunks are taken along num_tokens.
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, process_group, num_chunks=1):
+        ctx.process_group = process_group
+        ctx.num_chunks = num_chunks
+        ctx.save_for_backward(x, weight)
+        world_size = torch.distributed.get_world_size(process_group)
+        assert x.shape[0] % world_size == 0
+        batch_shape = x.shape[:-1]
+        x = x.reshape(world_size, -1, x.shape[-1])
+        num_tokens = x.shape[1]
+        reduced = []
+        for start, end in _chunk_bounds(num_tokens, num_chunks):
+            out_chunk = F.linear(x[:, start:end].reshape(-1, x.shape[-1]), weight, bias)
+            reduced.append((start, end,
+                            *reduce_scatter_raw(out_chunk, process_group, async_op=True)))
+        out = None
+        for start, end, out_chunk, handle in reduced:
+            handle.wait()
+            if out is None:
+                out = torch.empty(num_tokens, out_chunk.shape[-1], dtype=out_chunk.dtype,
+                                  device=out_chunk.device)
+            out[start:end] = out_chunk
+        return out.reshape(batch_shape[0] // world_size, *batch_shape[1:], out.shape[-1])
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        x, weight = ctx.saved_tensors
+        process_group = ctx.process_group
+        world_size = torch.distributed.get_world_size(process_group)
+        x = x.reshape(world_size, -1, x.shape[-1])
+        num_tokens = x.shape[1]
+        grad_output = grad_output.reshape(num_tokens, grad_output.shape[-1]).contiguous()
+        grad_x = torch.empty_like(x) if ctx.needs_input_grad[0] else None
+        grad_weight = torch.zeros_like(weight) if ctx.needs_input_grad[1] else None
+        grad_bias = (torch.zeros(weight.shape[0], dtype=grad_output.dtype, device=x.device)
+                     if ctx.needs_input_grad[2] else None)
+        bounds = _chunk_bounds(num_tokens, ctx.num_chunks)
+        gathered = [all_gather_raw(grad_output[bounds[0][0]:bounds[0][1]], process_group,
+                                   async_op=True)]
+        for i, (start, end) in enumerate(bounds):
+            if i + 1 < len(bounds):
+                next_start, next_end = bounds[i + 1]
+                gathered.append(all_gather_raw(grad_output[next_start:next_end], process_group,
+                                               async_op=True))
+            g, handle = gathered[i]
+            handle.wait()
+            gathered[i] = None
+            if grad_x is not None:
+                grad_x[:, start:end] = (g @ weight).reshape(world_size, end - start, -1)
+            if grad_weight is not None:
+                grad_weight.addmm_(g.t(), x[:, start:end].reshape(-1, x.shape[-1]))
+            if grad_bias is not None:
+                grad_bias += g.sum(dim=0)
+        if grad_x is not None:
+            grad_x = grad_x.reshape(ctx.saved_tensors[0].shape)
+        return grad_x, grad_weight, grad_bias, None, None
+
+
+def all_gather_linear_func(x: Tensor, weight: Tensor, bias: Optional[Tensor],
+                           process_group: ProcessGroup, num_chunks: int = 1):
+    return AllGatherLinearFunc.apply(x, weight, bias, process_group, num_chunks)
+
+
+def linear_reduce_scatter_func(x: Tensor, weight: Tensor, bias: Optional[Tensor],
+                               process_group: ProcessGroup, num_chunks: int = 1):
+    return LinearReduceScatterFunc.apply(x, weight, bias, process_group, num_chunks)
+
+
+def fused_dense_gather_func(x: Tensor, indices: Tensor, weight: Tensor,
+                            bias: Optional[Tensor] = None):
+    """x[indices] @ weight^T + bias, where x is (num_rows, in_features) and indices (num_indices,)
+    are rows of x, e.g. the last position of each sequence for the LM head during prefill.
+    On CPU (without autograd), the rows are gathered as they're loaded into the GEMM.
+    """
+    needs_grad = torch.is_grad_enabled() and any(
+        t is not None and t.requires_grad for t in (x, weight, bias)
+    )
+    if not x.is_cuda and not needs_grad and x.dtype == weight.dtype:
+        return fused_dense_cuda.linear_gather_forward(
+            x.contiguous(), indices.to(torch.long).contiguous(), weight.contiguous(),
+            bias.contiguous() if bias is not None else None
+        )
+    return F.linear(x.index_select(0, indices), weight, bias)
+
+
+def fused_patch_embed_func(x: Tensor, weight: Tensor, bias: Optional[Tensor], patch_size,
+                           pos_embed: Optional[Tensor] = None, cls_token: Optional[Tensor] = None):
+    """ViT patch embedding: the patches of the images x (batch, channels, height, width) ordered
+    (channels, patch_size[0], patch_size[1]) @ weight^T + bias, with cls_token (embed_dim) prepended
+    if not None, and pos_embed added. pos_embed (num_patches (+ 1 with cls_token), embed_dim), with a
+    leading dim of 1 or not, is added either to the whole sequence or to the patches only, as
+    VisionTransformer._pos_embed (no_embed_class).
+    On CPU (without autograd), the patches are gathered as they're loaded into the GEMM and the
+    bias and position embedding are added in its epilogue, which writes the
+    (batch, 1 + num_patches, embed_dim) sequence directly.
+    """
+    embed_dim = weight.shape[0]
+    pos_embed = pos_embed.reshape(-1, embed_dim) if pos_embed is not None else None
+    cls_token = cls_token.reshape(embed_dim) if cls_token is not None else None
+    needs_grad = torch.is_grad_enabled() and any(
+        t is not None and t.requires_grad for t in (x, weight, bias, pos_embed, cls_token)
+    )
+    if (not x.is_cuda and not needs_grad
+            and all(t is None or t.dtype == x.dtype for t in (weight, bias, pos_embed, cls_token))):
+        return fused_dense_cuda.patch_embed_forward(
+            x.contiguous(), weight.contiguous(), bias.contiguous() if bias is not None else None,
+            pos_embed.contiguous() if pos_embed is not None else None,
+            cls_token.contiguous() if cls_token is not None else None,
+            patch_size[0], patch_size[1]
+        )
+    out = F.linear(rearrange(x, 'b c (h p1) (w p2) -> b (h w) (c p1 p2)',
+                             p1=patch_size[0], p2=patch_size[1]), weight, bias)
+    num_patches = out.shape[1]
+    if pos_embed is not None and pos_embed.shape[0] == num_patches:
+        out = out + pos_embed
+    if cls_token is not None:
+        out = torch.cat([cls_token.expand(out.shape[0], 1, -1).to(out.dtype), out], dim=1)
+    if pos_embed is not None and pos_embed.shape[0] != num_patches:
+        out = out + pos_embed
+    return out
+
+
 class FusedDense(nn.Linear):
 
     def __init__(self, in_features: int, out_features: int, bias: bool = True,
@@ -143,7 +354,11 @@ class FusedDense(nn.Linear):
 class ColumnParallelLinear(nn.Linear):
 
     def __init__(self, in_features: int, out_features: int, process_group: ProcessGroup,
-                 bias: bool = True, sequence_parallel=True, device=None, dtype=None) -> None:
+                 bias: bool = True, sequence_parallel=True, num_chunks: int = 1, device=None,
+                 dtype=None) -> None:
+        """num_chunks: with sequence parallel, split the tokens into num_chunks chunks to overlap
+        the all_gather with the matmul (see AllGatherLinearFunc).
+        """
         world_size = torch.distributed.get_world_size(process_group)
         if out_features % world_size != 0:
             raise ValueError(f'out_features ({out_features}) must be divisible by '
@@ -152,11 +367,15 @@ class ColumnParallelLinear(nn.Linear):
                          device=device, dtype=dtype)
         self.process_group = process_group
         self.sequence_parallel = sequence_parallel
+        self.num_chunks = num_chunks
 
     def forward(self, x):
         # If self.sequence_parallel is True, we're doing Tensor Parallel with sequence parallelism:
         # we do an all_gather of x before doing the matmul.
         # If not, then the input is already gathered.
+        if self.sequence_parallel and (self.num_chunks > 1 or not x.is_cuda):
+            return all_gather_linear_func(x, self.weight, self.bias, self.process_group,
+                                          self.num_chunks)
         return fused_dense_func(x, self.weight, self.bias, process_group=self.process_group,
                                 sequence_parallel=self.sequence_parallel)
 
@@ -164,7 +383,11 @@ class ColumnParallelLinear(nn.Linear):
 class RowParallelLinear(nn.Linear):
 
     def __init__(self, in_features: int, out_features: int, process_group: ProcessGroup,
-                 bias: bool = True, sequence_parallel=True, device=None, dtype=None) -> None:
+                 bias: bool = True, sequence_parallel=True, num_chunks: int = 1, device=None,
+                 dtype=None) -> None:
+        """num_chunks: with sequence parallel, split the tokens into num_chunks chunks to overlap
+        the reduce_scatter with the matmul (see LinearReduceScatterFunc).
+        """
         world_size = torch.distributed.get_world_size(process_group)
         rank = torch.distributed.get_rank(process_group)
         if in_features % world_size != 0:
@@ -175,12 +398,16 @@ class RowParallelLinear(nn.Linear):
                          device=device, dtype=dtype)
         self.process_group = process_group
         self.sequence_parallel = sequence_parallel
+        self.num_chunks = num_chunks
 
     def forward(self, x):
         """
         We're doing Tensor Parallel with sequence parallelism: we do the matmul and then
         a reduce_scatter of the result.
         """
+        if self.sequence_parallel and (self.num_chunks > 1 or not x.is_cuda):
+            return linear_reduce_scatter_func(x, self.weight, self.bias, self.process_group,
+                                              self.num_chunks)
         out = fused_dense_func(x, self.weight, self.bias)
         reduce_fn = reduce_scatter if self.sequence_parallel else all_reduce
         return reduce_fn(out, self.process_group)
@@ -204,8 +431,9 @@ class FusedMLPFunc(torch.autograd.Function):
         2: recompute pre_act and gelu_out / relu_out in the bwd
         """
         assert -1 <= heuristic <= 4
-        assert activation in ['gelu_approx', 'relu', 'sqrelu']
-        if activation == 'sqrelu':
+        assert activation in ['gelu_approx', 'gelu', 'relu', 'sqrelu']
+        if activation in ['gelu', 'sqrelu']:
+            # The cuBLASLt epilogues only have the tanh approximation of gelu, and relu
             assert heuristic == -1
         if not save_pre_act:
             checkpoint_lvl = 2
@@ -244,8 +472,7 @@ class FusedMLPFunc(torch.autograd.Function):
             raise RuntimeError('fused_dense only supports matrix dims <= 2M')
         if heuristic == -1:
             pre_act = F.linear(total_x, weight1, bias1)
-            activation_fn = (partial(F.gelu, approximate='tanh') if activation == 'gelu_approx'
-                             else (sqrelu_fwd if activation == 'sqrelu' else F.relu))
+            activation_fn = _activation_fn(activation)
             with torch.jit.fuser('fuser2'):
                 output1 = activation_fn(pre_act)
             # This is before adding bias1
@@ -276,8 +503,7 @@ class FusedMLPFunc(torch.autograd.Function):
         grad_output = grad_output.contiguous()
         checkpoint_lvl = ctx.checkpoint_lvl
         activation = ctx.activation
-        activation_fn = (partial(F.gelu, approximate='tanh') if activation == 'gelu_approx'
-                         else (sqrelu_fwd if activation == 'sqrelu' else F.relu))
+        activation_fn = _activation_fn(activation)
         if ctx.return_residual:
             grad_input, = args
             grad_input = grad_input.contiguous()
@@ -324,8 +550,7 @@ class FusedMLPFunc(torch.autograd.Function):
         if ctx.heuristic == -1:
             # grad_pre_act = matmul_dgelu(grad_output, weight2, pre_act)
             grad_output1 = F.linear(grad_output, weight2.t())
-            activation_grad_fn = (gelu_bwd if activation == 'gelu_approx'
-                                  else (sqrelu_bwd if activation == 'sqrelu' else relu_bwd))
+            activation_grad_fn = _activation_grad_fn(activation)
             with torch.jit.fuser('fuser2'):
                 grad_pre_act = activation_grad_fn(grad_output1, pre_act)
         else:
@@ -381,7 +606,7 @@ def fused_mlp_func(
     process_group: Optional[ProcessGroup] = None,
     sequence_parallel: bool = True
 ):
-    assert activation in ['gelu_approx', 'relu', 'sqrelu']
+    assert activation in ['gelu_approx', 'gelu', 'relu', 'sqrelu']
     dtype_eligible = (x.dtype in [torch.float16, torch.bfloat16]
                       or (x.dtype == torch.float32 and torch.is_autocast_enabled()))
     # If we save pre-activation, dimension must be divisible by 128 (relu) or 8 (gelu)
@@ -395,8 +620,8 @@ def fused_mlp_func(
     else:
         assert process_group is None
         pre_act = F.linear(x, weight1, bias1)
-        activation_fn = (partial(F.gelu, approximate='tanh') if activation == 'gelu_approx'
-                         else partial(F.relu, inplace=True))
+        activation_fn = (partial(F.relu, inplace=True) if activation == 'relu'
+                         else _activation_fn(activation))
         output1 = activation_fn(pre_act)
         output2 = F.linear(output1, weight2, bias2)
         return output2 if not return_residual else (output2, x)
@@ -429,7 +654,7 @@ class FusedMLP(nn.Module):
             to fuse the backward of nn.Linear with the residual connection.
         """
         assert checkpoint_lvl in [0, 1, 2]
-        assert activation in ['gelu_approx', 'relu', 'sqrelu']
+        assert activation in ['gelu_approx', 'gelu', 'relu', 'sqrelu']
         factory_kwargs = {'device': device, 'dtype': dtype}
         super().__init__()
         if out_features is None:
@@ -437,7 +662,7 @@ class FusedMLP(nn.Module):
         self.activation = activation
         self.return_residual = return_residual
         self.checkpoint_lvl = checkpoint_lvl
-        self.heuristic = heuristic if activation != 'sqrelu' else -1
+        self.heuristic = heuristic if activation not in ['gelu', 'sqrelu'] else -1
         self.fc1 = nn.Linear(in_features, hidden_features, bias=bias1, **factory_kwargs)
         self.fc2 = nn.Linear(hidden_features, out_features, bias=bias2, **factory_kwargs)
 
@@ -490,7 +715,7 @@ class ParallelFusedMLP(nn.Module):
                 For CUDA <= 11.7, we set heuristic=1 for fp16 and heuristic=-1 for bf16.
         """
         assert checkpoint_lvl in [0, 1, 2]
-        assert activation in ['gelu_approx', 'relu', 'sqrelu']
+        assert activation in ['gelu_approx', 'gelu', 'relu', 'sqrelu']
         assert process_group is not None
         factory_kwargs = {'device': device, 'dtype': dtype}
         super().__init__()
@@ -500,7 +725,7 @@ class ParallelFusedMLP(nn.Module):
         self.process_group = process_group
         self.sequence_parallel = sequence_parallel
         self.checkpoint_lvl = checkpoint_lvl
-        self.heuristic = heuristic if activation != 'sqrelu' else -1
+        self.heuristic = heuristic if activation not in ['gelu', 'sqrelu'] else -1
         self.fc1 = ColumnParallelLinear(in_features, hidden_features, process_group,
                                         bias=bias1, **factory_kwargs)
         self.fc2 = RowParallelLinear(hidden_features, out_features, process_group,
@@ -525,3 +750,407 @@ class ParallelFusedMLP(nn.Module):
         )
         reduce_fn = reduce_scatter if self.sequence_parallel else all_reduce
         return reduce_fn(out, self.process_group)
+
+
+class FusedMLPChunkedFunc(torch.autograd.Function):
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight1, bias1, weight2, bias2, activation='gelu_approx', chunk_size=1024,
+                recompute=True):
+        """
+        Compute fc2(activation(fc1(x))) one chunk of the hidden dimension at a time, accumulating
+        the output of fc2 directly, so that the (tokens, hidden_features) activation is never
+        materialized.
+        recompute: if True, don't save anything of size hidden_features for the backward: the
+            pre-activation of each chunk is recomputed there. If False, save the pre-activation.
+        """
+        assert activation in ['gelu_approx', 'gelu', 'relu']
+        ctx.activation = activation
+        ctx.chunk_size = chunk_size
+        ctx.recompute = recompute
+        if torch.is_autocast_enabled():
+            dtype = torch.get_autocast_gpu_dtype()
+            x = x.to(dtype=dtype)
+            weight1, weight2 = [a.to(dtype=dtype) for a in [weight1, weight2]]
+            bias1 = bias1.to(dtype=dtype) if bias1 is not None else None
+            bias2 = bias2.to(dtype=dtype) if bias2 is not None else None
+        x = x.contiguous()
+        weight1 = weight1.contiguous()
+        bias1 = bias1.contiguous() if bias1 is not None else None
+        weight2 = weight2.contiguous()
+        bias2 = bias2.contiguous() if bias2 is not None else None
+        batch_shape, n = x.shape[:-1], x.shape[-1]
+        batch_dim = batch_shape.numel()
+        x = x.reshape(batch_dim, n)
+        hidden_features = weight1.shape[0]
+        if not x.is_cuda:
+            output, *rest = fused_dense_cuda.mlp_chunked_forward(
+                x, weight1, bias1, weight2, bias2, _ACTIVATION_ID[activation], chunk_size,
+                not recompute
+            )
+            pre_act = rest[0] if not recompute else None
+        else:
+            if bias2 is not None:
+                output = bias2.expand(batch_dim, -1).contiguous()
+            else:
+                output = torch.zeros(batch_dim, weight2.shape[0], dtype=x.dtype, device=x.device)
+            pre_act = (torch.empty(batch_dim, hidden_features, dtype=x.dtype, device=x.device)
+                       if not recompute else None)
+            for start in range(0, hidden_features, chunk_size):
+                end = min(start + chunk_size, hidden_features)
+                bias1_chunk = bias1[start:end] if bias1 is not None else None
+                if recompute and activation != 'gelu':
+                    output1, = fused_dense_cuda.linear_act_forward(
+                        x, weight1[start:end], bias1_chunk, activation == 'gelu_approx', False, 0
+                    )
+                else:
+                    pre_act_chunk = F.linear(x, weight1[start:end], bias1_chunk)
+                    if not recompute:
+                        pre_act[:, start:end] = pre_act_chunk
+                    output1 = _activation_fn(activation)(pre_act_chunk)
+                output.addmm_(output1, weight2[:, start:end].t())
+        if recompute:
+            ctx.save_for_backward(x, weight1, bias1, weight2)
+        else:
+            ctx.save_for_backward(x, weight1, bias1, weight2, pre_act)
+        return output.reshape(*batch_shape, output.shape[-1])
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        grad_output = grad_output.contiguous()
+        x, weight1, bias1, weight2, *rest = ctx.saved_tensors
+        chunk_size = ctx.chunk_size
+        activation_fn = _activation_fn(ctx.activation)
+        activation_grad_fn = _activation_grad_fn(ctx.activation)
+        batch_shape = grad_output.shape[:-1]
+        grad_output = grad_output.reshape(batch_shape.numel(), grad_output.shape[-1])
+        hidden_features = weight1.shape[0]
+        grad_input = None
+        grad_weight1 = torch.empty_like(weight1) if ctx.needs_input_grad[1] else None
+        grad_bias1 = (torch.empty(hidden_features, dtype=x.dtype, device=x.device)
+                      if ctx.needs_input_grad[2] else None)
+        grad_weight2 = torch.empty_like(weight2) if ctx.needs_input_grad[3] else None
+        grad_bias2 = grad_output.sum(dim=0) if ctx.needs_input_grad[4] else None
+        # The CPU forward keeps the hidden chunk (and the saved pre-activation) in fp32: the
+        # backward recomputes it in fp32 too, so that it sees the activations of the forward
+        act_dtype = torch.float32 if not x.is_cuda else x.dtype
+        x_act, grad_output_act = x.to(act_dtype), grad_output.to(act_dtype)
+        for start in range(0, hidden_features, chunk_size):
+            end = min(start + chunk_size, hidden_features)
+            if ctx.recompute:
+                pre_act = F.linear(x_act, weight1[start:end].to(act_dtype),
+                                   bias1[start:end].to(act_dtype) if bias1 is not None else None)
+            else:
+                pre_act = rest[0][:, start:end]
+            if not x.is_cuda:
+                # Native activation kernels, which also reduce the bias gradient
+                pre_act = pre_act.contiguous()
+                if grad_weight2 is not None:
+                    output1, _ = fused_dense_cuda.bias_act_forward(
+                        pre_act, None, _ACTIVATION_ID[ctx.activation], False
+                    )
+                    grad_weight2[:, start:end] = grad_output_act.t() @ output1
+                grad_pre_act, grad_bias1_chunk = fused_dense_cuda.bias_act_backward(
+                    grad_output_act @ weight2[:, start:end].to(act_dtype), pre_act, None, None,
+                    _ACTIVATION_ID[ctx.activation], grad_bias1 is not None
+                )
+                if grad_weight1 is not None:
+                    grad_weight1[start:end] = grad_pre_act.t() @ x_act
+                if grad_bias1 is not None:
+                    grad_bias1[start:end] = grad_bias1_chunk
+            else:
+                if grad_weight2 is not None:
+                    with torch.jit.fuser('fuser2'):
+                        output1 = activation_fn(pre_act)
+                    grad_weight2[:, start:end] = grad_output.t() @ output1
+                with torch.jit.fuser('fuser2'):
+                    grad_pre_act = activation_grad_fn(grad_output @ weight2[:, start:end], pre_act)
+                if grad_weight1 is not None:
+                    grad_weight1[start:end] = grad_pre_act.t() @ x
+                if grad_bias1 is not None:
+                    grad_bias1[start:end] = grad_pre_act.sum(dim=0)
+            if ctx.needs_input_grad[0]:
+                if grad_input is None:
+                    grad_input = grad_pre_act @ weight1[start:end].to(act_dtype)
+                else:
+                    grad_input.addmm_(grad_pre_act, weight1[start:end].to(act_dtype))
+        if grad_input is not None:
+            grad_input = grad_input.to(x.dtype).reshape(*batch_shape, grad_input.shape[-1])
+        return (grad_input, grad_weight1, grad_bias1, grad_weight2, grad_bias2,
+                None, None, None)
+
+
+def _activation_fn(activation):
+    return {'gelu_approx': partial(F.gelu, approximate='tanh'), 'gelu': F.gelu, 'relu': F.relu,
+            'sqrelu': sqrelu_fwd}[activation]
+
+
+def _activation_grad_fn(activation):
+    return {'gelu_approx': gelu_bwd, 'gelu': gelu_exact_bwd, 'relu': relu_bwd,
+            'sqrelu': sqrelu_bwd}[activation]
+
+
+def fused_mlp_chunked_func(
+    x: Tensor, weight1: Tensor, weight2: Tensor, bias1: Optional[Tensor] = None,
+    bias2: Optional[Tensor] = None, activation: str = 'gelu_approx', chunk_size: int = 1024,
+    recompute: bool = True
+):
+    assert activation in ['gelu_approx', 'gelu', 'relu']
+    dtype_eligible = (x.dtype in [torch.float16, torch.bfloat16]
+                      or (x.dtype == torch.float32
+                          and (not x.is_cuda or torch.is_autocast_enabled())))
+    if dtype_eligible:
+        return FusedMLPChunkedFunc.apply(x, weight1, bias1, weight2, bias2, activation,
+                                         chunk_size, recompute)
+    else:
+        output1 = _activation_fn(activation)(F.linear(x, weight1, bias1))
+        return F.linear(output1, weight2, bias2)
+
+
+class ChunkedFusedMLP(nn.Module):
+
+    def __init__(self, in_features, hidden_features, out_features=None, bias1=True, bias2=True,
+                 activation='gelu_approx', chunk_size=1024, recompute=True, device=None,
+                 dtype=None):
+        """
+        Same as FusedMLP (same parameters), but the hidden dimension is processed in chunks of
+        chunk_size and the output of fc2 is accumulated directly, so the
+        (tokens, hidden_features) activation is never materialized.
+        recompute: if True, the activation of each chunk is recomputed in the backward instead of
+            saving the pre-activation.
+        """
+        assert activation in ['gelu_approx', 'gelu', 'relu']
+        factory_kwargs = {'device': device, 'dtype': dtype}
+        super().__init__()
+        if out_features is None:
+            out_features = in_features
+        self.activation = activation
+        self.chunk_size = chunk_size
+        self.recompute = recompute
+        self.fc1 = nn.Linear(in_features, hidden_features, bias=bias1, **factory_kwargs)
+        self.fc2 = nn.Linear(hidden_features, out_features, bias=bias2, **factory_kwargs)
+
+    def forward(self, x):
+        return fused_mlp_chunked_func(
+            x, self.fc1.weight, self.fc2.weight, self.fc1.bias, self.fc2.bias,
+            activation=self.activation, chunk_size=self.chunk_size, recompute=self.recompute
+        )
+
+
+@torch.no_grad()
+def quantize_weight(weight: Tensor, bits: int = 8, group_size: int = -1):
+    """Symmetric weight-only quantization, to be done once offline.
+    Arguments:
+        weight: (out_features, in_features)
+        bits: 8 or 4. With 4 bits, input features 2i and 2i + 1 are packed into one uint8 (2i in
+            the low nibble), each stored with an offset of 8.
+        group_size: number of consecutive input features that share a scale. -1 means one scale
+            per output channel.
+    Return:
+        qweight: (out_features, in_features), int8 if bits == 8,
+            (out_features, in_features // 2), uint8 if bits == 4.
+        scales: (out_features, in_features // group_size), float32.
+    """
+    assert bits in [4, 8]
+    out_features, in_features = weight.shape
+    if group_size == -1:
+        group_size = in_features
+    assert in_features % group_size == 0, 'in_features must be divisible by group_size'
+    assert bits == 8 or group_size % 2 == 0, 'group_size must be even for 4 bits'
+    qmax = 2 ** (bits - 1) - 1
+    w = rearrange(weight.float(), 'o (g s) -> o g s', s=group_size)
+    scales = w.abs().amax(dim=-1).clamp(min=1e-8) / qmax
+    q = torch.clamp(torch.round(w / scales.unsqueeze(-1)), -qmax - 1, qmax)
+    q = rearrange(q, 'o g s -> o (g s)')
+    if bits == 8:
+        qweight = q.to(torch.int8)
+    else:
+        q = (q + 8).to(torch.uint8)
+        qweight = q[:, 0::2] | (q[:, 1::2] << 4)
+    return qweight.contiguous(), scales.contiguous()
+
+
+def dequantize_weight(qweight: Tensor, scales: Tensor, bits: int = 8,
+                      dtype: Optional[torch.dtype] = None):
+    """Inverse of quantize_weight. Return: (out_features, in_features) of type dtype
+    (default float32).
+    """
+    assert bits in [4, 8]
+    if bits == 8:
+        q = qweight.float()
+    else:
+        q = torch.stack([qweight & 0xF, qweight >> 4], dim=-1).flatten(-2).float() - 8
+    w = rearrange(q, 'o (g s) -> o g s', g=scales.shape[1]) * scales.unsqueeze(-1)
+    return rearrange(w, 'o g s -> o (g s)').to(dtype=dtype if dtype is not None else torch.float32)
+
+
+def fused_dense_quant_func(x: Tensor, qweight: Tensor, scales: Tensor,
+                           bias: Optional[Tensor] = None, bits: int = 8,
+                           activation: str = 'none'):
+    """Linear with weight-only int8 / int4 weights (from quantize_weight), followed by
+    bias + activation. For inference only, there's no backward.
+    On CPU the weights are dequantized tile by tile inside the GEMM, they're never materialized.
+    There's no CUDA kernel yet: on GPU we dequantize the weights and use the regular path.
+    """
+    assert activation in _ACTIVATION_ID
+    if x.is_cuda:
+        weight = dequantize_weight(qweight, scales, bits, dtype=x.dtype)
+        out = F.linear(x, weight, bias)
+        if activation == 'gelu_approx':
+            out = F.gelu(out, approximate='tanh')
+        elif activation == 'gelu':
+            out = F.gelu(out)
+        elif activation == 'relu':
+            out = F.relu(out)
+        return out
+    batch_shape, n = x.shape[:-1], x.shape[-1]
+    out = fused_dense_cuda.linear_act_forward_quant(
+        x.reshape(batch_shape.numel(), n).contiguous(), qweight, scales, bias, bits,
+        n // scales.shape[1], _ACTIVATION_ID[activation]
+    )
+    return out.reshape(*batch_shape, out.shape[-1])
+
+
+class QuantizedFusedDense(nn.Module):
+
+    def __init__(self, in_features: int, out_features: int, bias: bool = True, bits: int = 8,
+                 group_size: int = -1, activation: str = 'none', device=None,
+                 dtype=None) -> None:
+        """
+        Weight-only quantized linear (+ activation) for inference. The weights are buffers,
+        usually filled from a trained nn.Linear with from_linear.
+        group_size: number of input features sharing a scale. -1 means per output channel.
+        """
+        assert bits in [4, 8]
+        assert activation in _ACTIVATION_ID
+        super().__init__()
+        if group_size == -1:
+            group_size = in_features
+        self.in_features = in_features
+        self.out_features = out_features
+        self.bits = bits
+        self.group_size = group_size
+        self.activation = activation
+        self.register_buffer('qweight', torch.zeros(
+            out_features, in_features if bits == 8 else in_features // 2,
+            dtype=torch.int8 if bits == 8 else torch.uint8, device=device
+        ))
+        self.register_buffer('scales', torch.ones(out_features, in_features // group_size,
+                                                  dtype=torch.float32, device=device))
+        if bias:
+            self.register_buffer('bias', torch.zeros(out_features, device=device, dtype=dtype))
+        else:
+            self.bias = None
+
+    @classmethod
+    def from_linear(cls, linear: nn.Linear, bits: int = 8, group_size: int = -1,
+                    activation: str = 'none'):
+        module = cls(linear.in_features, linear.out_features, bias=linear.bias is not None,
+                     bits=bits, group_size=group_size, activation=activation,
+                     device=linear.weight.device, dtype=linear.weight.dtype)
+        module.qweight, module.scales = quantize_weight(linear.weight, bits, module.group_size)
+        if linear.bias is not None:
+            module.bias = linear.bias.detach().clone()
+        return module
+
+    def forward(self, x):
+        return fused_dense_quant_func(x, self.qweight, self.scales, self.bias, bits=self.bits,
+                                      activation=self.activation)
+
+
+class QuantizedFusedMLP(nn.Module):
+
+    def __init__(self, fc1: QuantizedFusedDense, fc2: QuantizedFusedDense):
+        """Inference-only FusedMLP with weight-only quantized fc1 and fc2. The activation is
+        applied in the epilogue of fc1. Usually built from a trained FusedMLP with from_mlp.
+        """
+        super().__init__()
+        assert fc1.activation != 'none' and fc2.activation == 'none'
+        self.fc1 = fc1
+        self.fc2 = fc2
+
+    @classmethod
+    def from_mlp(cls, mlp: nn.Module, bits: int = 8, group_size: int = -1):
+        activation = getattr(mlp, 'activation', 'gelu_approx')
+        assert activation in ['gelu_approx', 'gelu', 'relu'], \
+            f'activation {activation} not supported'
+        return cls(QuantizedFusedDense.from_linear(mlp.fc1, bits, group_size, activation),
+                   QuantizedFusedDense.from_linear(mlp.fc2, bits, group_size))
+
+    def forward(self, x):
+        return self.fc2(self.fc1(x))
+
+
+def _dropout_add_ln_ref(x0, residual, ln_weight, ln_bias, dropout_p, epsilon,
+                        residual_in_fp32=False, is_rms_norm=False):
+    dtype = x0.dtype
+    x = F.dropout(x0, dropout_p) if dropout_p > 0.0 else x0
+    if residual is not None:
+        x = (x.float() + residual.float()).to(residual.dtype)
+    elif residual_in_fp32:
+        x = x.float()
+    if is_rms_norm:
+        xf = x.float()
+        z = xf * torch.rsqrt(xf.square().mean(dim=-1, keepdim=True) + epsilon) * ln_weight.float()
+        if ln_bias is not None:
+            z = z + ln_bias.float()
+    else:
+        z = F.layer_norm(x.float(), x.shape[-1:], ln_weight.float(),
+                         ln_bias.float() if ln_bias is not None else None, epsilon)
+    return z.to(dtype), x
+
+
+def dropout_add_ln_linear_func(x0: Tensor, residual: Optional[Tensor], ln_weight: Tensor,
+                               ln_bias: Optional[Tensor], weight: Tensor,
+                               bias: Optional[Tensor] = None, dropout_p: float = 0.0,
+                               epsilon: float = 1e-5, activation: str = 'none',
+                               prenorm: bool = False, residual_in_fp32: bool = False,
+                               is_rms_norm: bool = False, return_z: bool = False):
+    """act(LN(dropout(x0) + residual) @ weight^T + bias), e.g. the norm + QKV projection or the
+    norm + fc1 of a prenorm Block. Same LN semantics as dropout_add_layer_norm (residual_in_fp32
+    only has an effect if residual is None).
+    On CPU (without autograd), the LN is applied to each tile of rows as it's loaded into the
+    GEMM, so z = LN(...) is only written to memory if return_z. Otherwise we run the LN and the
+    linear one after the other.
+    Return: out, followed by the new residual if prenorm, followed by z if return_z.
+    """
+    assert activation in _ACTIVATION_ID
+    needs_grad = torch.is_grad_enabled() and any(
+        t is not None and t.requires_grad
+        for t in (x0, residual, ln_weight, ln_bias, weight, bias)
+    )
+    if not x0.is_cuda and not needs_grad:
+        batch_shape, n = x0.shape[:-1], x0.shape[-1]
+        out, x, z, _, _, _ = fused_dense_cuda.ln_linear_act_forward(
+            x0.reshape(-1, n).contiguous(),
+            residual.reshape(-1, n).contiguous() if residual is not None else None,
+            ln_weight.contiguous(), ln_bias.contiguous() if ln_bias is not None else None,
+            weight.contiguous(), bias, dropout_p, epsilon, _ACTIVATION_ID[activation],
+            residual_in_fp32, is_rms_norm, return_z, None
+        )
+        if x is None:  # x is x0 when there's no residual, no dropout and no dtype conversion
+            x = x0
+        out = out.reshape(*batch_shape, out.shape[-1])
+        x, z = x.reshape(x0.shape), (z.reshape(x0.shape) if z is not None else None)
+    else:
+        if x0.is_cuda:
+            from flash_attn.ops.layer_norm import dropout_add_layer_norm
+            from flash_attn.ops.rms_norm import dropout_add_rms_norm
+            ln_fn = dropout_add_rms_norm if is_rms_norm else dropout_add_layer_norm
+            z, x = ln_fn(x0, residual, ln_weight, ln_bias, dropout_p, epsilon, prenorm=True,
+                         residual_in_fp32=residual_in_fp32)
+        else:
+            z, x = _dropout_add_ln_ref(x0, residual, ln_weight, ln_bias, dropout_p, epsilon,
+                                       residual_in_fp32, is_rms_norm)
+        out = fused_dense_func(z, weight, bias)
+        if activation == 'gelu_approx':
+            out = F.gelu(out, approximate='tanh')
+        elif activation == 'gelu':
+            out = F.gelu(out)
+        elif activation == 'relu':
+            out = F.relu(out)
+    if not prenorm and not return_z:
+        return out
+    return (out, *((x,) if prenorm else ()), *((z,) if return_z else ()))
@@ -0,0 +1,67 @@
+# Copyright (c) 2023, Tri Dao.
+
+import torch
+
+try:
+    import fused_embedding
+except ImportError:
+    fused_embedding = None
+
+
+class FusedEmbeddingFunc(torch.autograd.Function):
+
+    @staticmethod
+    def forward(ctx, input_ids, weight, position_ids, position_weight, vocab_start_index,
+                mask_out_of_range, position_col_offset, padding_idx, dropout_p):
+        """input_ids, position_ids: (num_tokens,) int64.
+        """
+        # Same generator state on all ranks -> same dropout mask on all ranks
+        seed = (int(torch.randint(0, 2 ** 62, (1,)).item())
+                if dropout_p > 0.0 else 0)
+        out = fused_embedding.embedding_forward(
+            input_ids, weight, position_ids, position_weight, vocab_start_index, mask_out_of_range,
+            position_col_offset, dropout_p, seed, 0
+        )
+        ctx.save_for_backward(input_ids, position_ids)
+        ctx.num_embeddings = weight.shape[0]
+        ctx.position_shape = position_weight.shape if position_weight is not None else (0, 0)
+        ctx.vocab_start_index = vocab_start_index
+        ctx.mask_out_of_range = mask_out_of_range
+        ctx.position_col_offset = position_col_offset
+        ctx.padding_idx = padding_idx
+        ctx.dropout_p = dropout_p
+        ctx.seed = seed
+        return out
+
+    @staticmethod
+    def backward(ctx, grad_out):
+        input_ids, position_ids = ctx.saved_tensors
+        grad_weight, grad_position_weight = fused_embedding.embedding_backward(
+            grad_out, input_ids, position_ids, ctx.num_embeddings, ctx.position_shape[0],
+            ctx.position_shape[1], ctx.vocab_start_index, ctx.mask_out_of_range,
+            ctx.position_col_offset, ctx.padding_idx, ctx.dropout_p, ctx.seed, 0,
+            ctx.needs_input_grad[1], ctx.needs_input_grad[3]
+        )
+        return None, grad_weight, None, grad_position_weight, None, None, None, None, None
+
+
+def fused_embedding_func(input_ids, weight, position_ids=None, position_weight=None,
+                         vocab_start_index=0, mask_out_of_range=False, position_col_offset=0,
+                         padding_idx=None, dropout_p=0.0):
+    """dropout(weight[input_ids - vocab_start_index] + position_weight[position_ids]) in one pass
+    (CPU only), where the position embeddings are added to the columns
+    [position_col_offset, position_col_offset + position_weight.shape[1]).
+    If mask_out_of_range, the ids outside of [vocab_start_index, vocab_start_index + weight.shape[0])
+    give zero word embeddings (VocabParallelEmbedding).
+    input_ids: (...). position_ids: broadcastable to input_ids.
+    Return: (..., weight.shape[1]).
+    """
+    batch_shape = input_ids.shape
+    input_ids = input_ids.reshape(-1).contiguous()
+    if position_ids is not None:
+        position_ids = position_ids.expand(batch_shape).reshape(-1).contiguous()
+    out = FusedEmbeddingFunc.apply(
+        input_ids, weight, position_ids, position_weight, vocab_start_index, mask_out_of_range,
+        position_col_offset, -1 if padding_idx is None else padding_idx, dropout_p
+    )
+    return out.reshape(*batch_shape, out.shape[-1])
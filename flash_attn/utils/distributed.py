@@ -1,9 +1,15 @@
+import uuid
 from typing import Optional
 
 import torch
 from torch import Tensor
 from torch.distributed import ProcessGroup
 
+try:
+    import shm_comm
+except ImportError:
+    shm_comm = None
+
 # `all_gather_into_tensor` and `reduce_scatter_tensor` are new placeholders for
 # `_all_gather_base` and `_reduce_scatter_base`. They require the most recent
 # version of PyTorch. The following 4 lines are for backward compatibility with
@@ -14,13 +20,66 @@ if "reduce_scatter_tensor" not in dir(torch.distributed):
     torch.distributed.reduce_scatter_tensor = torch.distributed._reduce_scatter_base
 
 
+# Shared-memory communicators (csrc/shm_comm), by process group
+_shm_communicators = {}
+
+
+def init_shm_backend(process_group: Optional[ProcessGroup] = None, buffer_bytes: int = 1 << 22):
+    """Run the collectives of all_gather_raw, reduce_scatter_raw and all_reduce_raw (and of the
+    autograd functions below) on CPU tensors through a shared-memory segment instead of
+    process_group's backend (e.g. gloo over sockets). All the ranks of process_group must be on
+    the same host and call this together. buffer_bytes is the chunk size of the collectives.
+    """
+    if shm_comm is None:
+        raise ImportError('shm_comm is not installed, see csrc/shm_comm')
+    group = process_group if process_group is not None else torch.distributed.group.WORLD
+    rank = torch.distributed.get_rank(group)
+    name = [f'/flash_attn_shm_{uuid.uuid4().hex}' if rank == 0 else None]
+    torch.distributed.broadcast_object_list(
+        name, src=torch.distributed.get_global_rank(group, 0), group=group
+    )
+    comm = shm_comm.ShmCommunicator(name[0], rank, torch.distributed.get_world_size(group),
+                                    buffer_bytes)
+    # The segment is freed once every rank has exited, even if they crash
+    torch.distributed.barrier(group=group)
+    if rank == 0:
+        comm.unlink()
+    _shm_communicators[group] = comm
+    return comm
+
+
+def _get_shm_communicator(process_group: Optional[ProcessGroup], input_: Tensor,
+                          reduce: bool = False):
+    if not _shm_communicators or input_.is_cuda:
+        return None
+    if reduce and input_.dtype not in [torch.float32, torch.float16, torch.bfloat16]:
+        return None
+    group = process_group if process_group is not None else torch.distributed.group.WORLD
+    return _shm_communicators.get(group)
+
+
+def _wait_if_sync(handle, async_op: bool):
+    if not async_op:
+        handle.wait()
+        return None
+    return handle
+
+
 # Raw operation, does not support autograd, but does support async
 def all_gather_raw(input_: Tensor, process_group: ProcessGroup, async_op: bool = False):
     world_size = torch.distributed.get_world_size(process_group)
     output = torch.empty(world_size * input_.shape[0], *input_.shape[1:],
                          dtype=input_.dtype, device=input_.device)
-    handle = torch.distributed.all_gather_into_tensor(output, input_.contiguous(),
-                                                      group=process_group, async_op=async_op)
+    shm = _get_shm_communicator(process_group, input_)
+    if shm is not None:
+        handle = _wait_if_sync(shm.all_gather(input_.contiguous(), output), async_op)
+    elif torch.distributed.get_backend(process_group) == 'gloo':
+        # gloo doesn't implement all_gather_into_tensor, gather into views of output instead
+        handle = torch.distributed.all_gather(list(output.chunk(world_size)), input_.contiguous(),
+                                              group=process_group, async_op=async_op)
+    else:
+        handle = torch.distributed.all_gather_into_tensor(output, input_.contiguous(),
+                                                          group=process_group, async_op=async_op)
     return output, handle
 
 
@@ -30,16 +89,29 @@ def reduce_scatter_raw(input_: Tensor, process_group: ProcessGroup, async_op: bo
     assert input_.shape[0] % world_size == 0
     output = torch.empty(input_.shape[0] // world_size, *input_.shape[1:],
                          dtype=input_.dtype, device=input_.device)
-    handle = torch.distributed.reduce_scatter_tensor(output, input_.contiguous(),
-                                                     group=process_group,
-                                                     async_op=async_op)
+    shm = _get_shm_communicator(process_group, input_, reduce=True)
+    if shm is not None:
+        handle = _wait_if_sync(shm.reduce_scatter(input_.contiguous(), output), async_op)
+    elif torch.distributed.get_backend(process_group) == 'gloo':
+        # gloo doesn't implement reduce_scatter: all_reduce, and keep this rank's chunk
+        total = input_.clone(memory_format=torch.contiguous_format)
+        handle = torch.distributed.all_reduce(total, group=process_group, async_op=async_op)
+        output = total.chunk(world_size)[torch.distributed.get_rank(process_group)]
+    else:
+        handle = torch.distributed.reduce_scatter_tensor(output, input_.contiguous(),
+                                                         group=process_group,
+                                                         async_op=async_op)
     return output, handle
 
 
 # Raw operation, does not support autograd, but does support async
 def all_reduce_raw(input_: Tensor, process_group: ProcessGroup, async_op: bool = False):
     input_ = input_.contiguous()
-    handle = torch.distributed.all_reduce(input_, group=process_group, async_op=async_op)
+    shm = _get_shm_communicator(process_group, input_, reduce=True)
+    if shm is not None:
+        handle = _wait_if_sync(shm.all_reduce(input_, input_), async_op)
+    else:
+        handle = torch.distributed.all_reduce(input_, group=process_group, async_op=async_op)
     return input_, handle
 
 
@@ -122,6 +194,6 @@ def allreduce_sequence_parallel_grad(model: torch.nn.Module, process_group: Proc
     if grads:
         with torch.no_grad():
             coalesced = torch._utils._flatten_dense_tensors(grads)
-            torch.distributed.all_reduce(coalesced, group=process_group)
+            all_reduce_raw(coalesced, process_group)
             for buf, synced in zip(grads, torch._utils._unflatten_dense_tensors(coalesced, grads)):
                 buf.copy_(synced)
@@ -15,6 +15,11 @@ from einops import rearrange
 
 from transformers.generation import GreedySearchDecoderOnlyOutput, SampleDecoderOnlyOutput
 
+try:
+    import fused_sampling
+except ImportError:
+    fused_sampling = None
+
 
 @dataclass
 class InferenceParams:
@@ -27,6 +32,24 @@ class InferenceParams:
     key_value_memory_dict: dict = field(default_factory=dict)
     fused_ft_kernel: bool = False
     lengths_per_sample: Optional[Tensor] = None
+    # (max_batch_size,) bool. The FT attention kernel skips the rows of the finished sequences.
+    finished: Optional[Tensor] = None
+
+
+def compact_batch(inference_params, keep):
+    """Move the rows `keep` of the KV cache (and of lengths_per_sample and finished) to the front,
+    so that the sequences that are still active form a dense batch [0, len(keep)).
+    Arguments:
+        keep: (n,) indices into the current batch, in increasing order.
+    """
+    assert inference_params.batch_size_offset == 0
+    n = keep.shape[0]
+    for kv in inference_params.key_value_memory_dict.values():
+        for cache in (kv if isinstance(kv, tuple) else (kv,)):
+            cache[:n] = cache[keep]
+    for t in (inference_params.lengths_per_sample, inference_params.finished):
+        if t is not None:
+            t[:n] = t[keep]
 
 
 # https://github.com/NVIDIA/Megatron-LM/blob/0bb597b42c53355a567aba2a1357cc34b9d99ddd/megatron/text_generation/sampling.py
@@ -42,7 +65,7 @@ def modify_logits_for_top_p_filtering(logits, top_p):
     sorted_indices_to_remove = cumulative_probs <= (1 - top_p)
     # scatter sorted tensors to original indexing
     indices_to_remove = sorted_indices_to_remove.scatter(1, sorted_indices, sorted_indices_to_remove)
-    logits = logits.masked_fill(indices_to_remove, float('-inf'))
+    logits.masked_fill_(indices_to_remove, float('-inf'))
 
 
 def sample(logits, top_k=1, top_p=0.0, temperature=1.0):
@@ -52,6 +75,13 @@ def sample(logits, top_k=1, top_p=0.0, temperature=1.0):
     """
     if top_k == 1:  # Short-circuit for greedy decoding
         return logits.argmax(dim=-1)
+    elif fused_sampling is not None and not logits.is_cuda:
+        # One fused op, with a partial selection of the candidates instead of a sort of the whole
+        # vocabulary. The Philox seed is drawn from torch's RNG, so torch.manual_seed applies.
+        if top_p > 0.0:
+            assert top_p <= 1.0, 'top-p should be in (0, 1].'
+        seed = torch.randint(0, 2 ** 62, (1,)).item()
+        return fused_sampling.sample(logits, top_k, top_p, temperature, seed)
     else:
         if top_p > 0.0:
             assert top_p <= 1.0, 'top-p should be in (0, 1].'
@@ -72,12 +102,17 @@ def sample(logits, top_k=1, top_p=0.0, temperature=1.0):
 
 def decode(input_ids, model, max_length, top_k=1, top_p=0.0, temperature=1.0,
            eos_token_id=None, teacher_outputs=None, vocab_size=None, tensor_parallel=1,
-           fused_ft_kernel=False, cg=False, timing=False):
+           fused_ft_kernel=False, cg=False, timing=False, compaction_threshold=0.5):
     """Decoding, either greedy or with top-k or top-p sampling.
     If top-k = 0, don't limit the number of candidates (pure sampling).
     Top-k and top-p can be used together. If top_k > 0 and top_p > 0, then top-k is applied first,
     then top-p.
     We assume that all sequences in the same batch have the same length.
+    If eos_token_id is not None, the sequences that have emitted it are finished: they're padded
+    with eos_token_id, the FT attention kernel skips them, and once the fraction of active
+    sequences drops to compaction_threshold or below, the finished ones are removed from the
+    batch (compact_batch) so that the whole step runs on the active ones only. There's no
+    compaction with cg, since the CUDA graph is captured for a fixed batch size.
 
     Arguments:
         input_ids: (batch, seq_len)
@@ -105,6 +140,31 @@ def decode(input_ids, model, max_length, top_k=1, top_p=0.0, temperature=1.0,
     else:
         inference_params = InferenceParams(max_sequence_len=max_length, max_batch_size=batch_size,
                                            fused_ft_kernel=fused_ft_kernel)
+    if eos_token_id is not None and inference_params.finished is None:
+        inference_params.finished = torch.zeros(batch_size, dtype=torch.bool,
+                                                device=input_ids.device)
+    if inference_params.finished is not None:
+        inference_params.finished.zero_()
+    # Indices, in the original batch, of the rows of the current batch. None if there's been no
+    # compaction yet.
+    active_idx = None
+    cur_batch_size = batch_size
+
+    def to_full_batch(x, fill_value):
+        if active_idx is None:
+            return x
+        out = x.new_full((batch_size, *x.shape[1:]), fill_value)
+        out[active_idx] = x
+        return out
+
+    def update_finished(next_token):
+        if eos_token_id is None:
+            return next_token
+        finished = inference_params.finished[:cur_batch_size]
+        next_token = next_token.masked_fill(finished, eos_token_id)
+        finished |= next_token == eos_token_id
+        return next_token
+
     scores = []
     with torch.inference_mode():
         if timing:
@@ -112,7 +172,8 @@ def decode(input_ids, model, max_length, top_k=1, top_p=0.0, temperature=1.0,
                 torch.distributed.barrier()
             torch.cuda.synchronize()
             start = time.time()
-        logits = model(input_ids, inference_params=inference_params).logits[:, -1]
+        logits = model(input_ids, inference_params=inference_params,
+                       num_last_tokens=1).logits[:, -1]
         if vocab_size is not None:
             logits = logits[..., :vocab_size]
         scores.append(logits if not cg else logits.clone())
@@ -120,11 +181,20 @@ def decode(input_ids, model, max_length, top_k=1, top_p=0.0, temperature=1.0,
             next_token = sample(logits, top_k=top_k, top_p=top_p, temperature=temperature)
         else:
             next_token = teacher_outputs[:, seqlen_og]
+        next_token = update_finished(next_token)
         sequences = [next_token]
         inference_params.sequence_len_offset = seqlen_og
         while True:
-            position_ids = torch.full((batch_size, 1), inference_params.sequence_len_offset,
-                                    dtype=torch.long, device=input_ids.device)
+            if eos_token_id is not None and not cg:
+                num_active = cur_batch_size - inference_params.finished[:cur_batch_size].sum().item()
+                if num_active <= compaction_threshold * cur_batch_size:
+                    keep = (~inference_params.finished[:cur_batch_size]).nonzero().squeeze(-1)
+                    compact_batch(inference_params, keep)
+                    active_idx = keep if active_idx is None else active_idx[keep]
+                    next_token = next_token[keep]
+                    cur_batch_size = num_active
+            position_ids = torch.full((cur_batch_size, 1), inference_params.sequence_len_offset,
+                                      dtype=torch.long, device=input_ids.device)
             if not cg:
                 logits = model(rearrange(next_token, 'b -> b 1'), position_ids=position_ids,
                                inference_params=inference_params).logits[:, -1]
@@ -133,14 +203,17 @@ def decode(input_ids, model, max_length, top_k=1, top_p=0.0, temperature=1.0,
                                                    inference_params.sequence_len_offset)
             if vocab_size is not None:
                 logits = logits[..., :vocab_size]
-            scores.append(logits if not cg else logits.clone())
+            scores.append(to_full_batch(logits if not cg else logits.clone(), float('-inf')))
             if teacher_outputs is None or teacher_output_len <= inference_params.sequence_len_offset + 1:
                 next_token = sample(logits, top_k=top_k, temperature=temperature)
             else:
                 next_token = teacher_outputs[:, inference_params.sequence_len_offset + 1]
-            sequences.append(next_token)
+                if active_idx is not None:
+                    next_token = next_token[active_idx]
+            next_token = update_finished(next_token)
+            sequences.append(to_full_batch(next_token, eos_token_id))
             inference_params.sequence_len_offset += 1
-            if eos_token_id is not None and (next_token == eos_token_id).all():
+            if eos_token_id is not None and inference_params.finished[:cur_batch_size].all():
                 break
             if inference_params.sequence_len_offset >= max_length - 1:
                 break
@@ -181,6 +254,23 @@ def allocate_kv_cache(max_batch_size, max_seqlen, nheads, headdim, layers: Union
             for i in layers}
 
 
+def pack_cross_attention_memory(kv):
+    """Pack the encoder keys / values once, in the layouts that
+    ft_attention.single_query_cross_attention reads at every decoding step.
+    Arguments:
+        kv: (batch_size, memory_seqlen, 2, nheads, headdim)
+    Return:
+        k_memory: (batch_size, nheads, headdim / packsize, memory_seqlen, packsize)
+        v_memory: (batch_size, nheads, memory_seqlen, headdim)
+    """
+    assert kv.dtype in [torch.float16, torch.bfloat16, torch.float32]
+    packsize = 4 if kv.dtype == torch.float32 else 8
+    k_memory = rearrange(kv[:, :, 0], 'b s h (d packsize) -> b h d s packsize',
+                         packsize=packsize).contiguous()
+    v_memory = rearrange(kv[:, :, 1], 'b s h d -> b h s d').contiguous()
+    return k_memory, v_memory
+
+
 def seqlen_to_seqlen_type(seqlen: int) -> int:
     """Convert sequence length to a seqlen_type.
     This is used to determine which cuda graph to use.
@@ -231,10 +321,12 @@ def update_graph_cache(model, cache, batch_size, seqlen_og, max_seqlen, tensor_p
             model.config.num_hidden_layers, device, dtype
         )
         lengths_per_sample = torch.full((batch_size,), seqlen_og, dtype=torch.int32, device=device)
+        # Allocated here so that the CUDA graphs capture it, decode() updates it in place
+        finished = torch.zeros(batch_size, dtype=torch.bool, device=device)
         cache.inference_params = InferenceParams(
             max_sequence_len=max_seqlen, max_batch_size=batch_size,
             sequence_len_offset=seqlen_og, key_value_memory_dict=kv_cache, fused_ft_kernel=True,
-            lengths_per_sample=lengths_per_sample
+            lengths_per_sample=lengths_per_sample, finished=finished
         )
         cache.mempool = torch.cuda.graphs.graph_pool_handle()
     for s_type in range(seqlen_to_seqlen_type(seqlen_og), seqlen_to_seqlen_type(max_seqlen) + 1):
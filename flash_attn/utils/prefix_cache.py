@@ -0,0 +1,229 @@
+# Copyright (c) 2023, Tri Dao.
+# Prefix cache for serving: requests that share a prompt prefix (e.g. a long system prompt) share
+# the physical pages of its KV cache, in the paged layout of
+# ft_attention.varlen_attention_with_kv_cache. Only that paged path reads shared pages (decoding is
+# then one new token per sequence): allocate_kv_cache / _update_kv_cache and single_query_attention
+# keep one contiguous cache per sequence, so flash_attn.utils.generation doesn't use it.
+import heapq
+import itertools
+from typing import List, Sequence, Tuple, Union
+
+import torch
+
+
+def allocate_paged_kv_cache(num_pages, page_size, nheads, headdim, layers: Union[int, Sequence],
+                            device, dtype=torch.float16):
+    """Paged version of allocate_kv_cache: for each layer, k_cache of shape
+    (num_pages, nheads, headdim / packsize, page_size, packsize) and v_cache of shape
+    (num_pages, nheads, page_size, headdim), indexed by a block table.
+    """
+    assert dtype in [torch.float16, torch.bfloat16, torch.float32]
+    packsize = 4 if dtype == torch.float32 else 8
+    assert headdim % packsize == 0
+    k_cache_shape = (num_pages, nheads, headdim // packsize, page_size, packsize)
+    v_cache_shape = (num_pages, nheads, page_size, headdim)
+    if isinstance(layers, int):
+        layers = range(layers)
+    return {i: (torch.empty(k_cache_shape, device=device, dtype=dtype),
+                torch.empty(v_cache_shape, device=device, dtype=dtype))
+            for i in layers}
+
+
+class _Node:
+
+    def __init__(self, key=(), pages=(), parent=None):
+        # key: the tokens of the edge from the parent, len(key) == len(pages) * page_size
+        self.key = tuple(key)
+        self.pages = list(pages)
+        self.parent = parent
+        # Keyed by the first page of tokens of the child's key
+        self.children = {}
+        self.last_access = 0
+
+
+class PrefixCache:
+    """Radix tree over token ids, at the granularity of KV cache pages, mapping prompt prefixes to
+    the pages that hold their K/V.
+
+    Each request gets a list of pages (its block table): the longest cached prefix of its prompt,
+    shared with the other requests and the tree, followed by pages of its own. Pages are reference
+    counted: a page goes back to the free list once no request holds it and the tree doesn't hold it
+    either. The pages of the tree that no request holds are evicted, least recently used first, when
+    the free list runs out.
+
+    Usage, for each request:
+        pages, num_cached_tokens = cache.acquire(prompt)  # pages cover the whole prompt
+        # prefill prompt[num_cached_tokens:] with cache.block_table([pages, ...]) and
+        # cache_seqlens = num_cached_tokens
+        cache.insert(prompt, pages)  # share the full pages of the prompt with later requests
+        cache.extend(pages, num_tokens)  # during decoding, when crossing a page boundary
+        cache.release(pages)  # when the request is done
+    """
+
+    def __init__(self, num_pages, page_size):
+        self.num_pages = num_pages
+        self.page_size = page_size
+        self.free_pages = list(range(num_pages - 1, -1, -1))
+        self.ref_count = [0] * num_pages
+        self.in_tree = [False] * num_pages
+        self.root = _Node()
+        self._clock = itertools.count(1)
+        self.num_requests = 0
+        self.num_prompt_tokens = 0
+        self.num_cached_tokens = 0
+        self.num_evicted_pages = 0
+
+    def _chunk(self, tokens, i):
+        return tuple(tokens[i:i + self.page_size])
+
+    def _split(self, node, num_pages):
+        """Split the edge of node after its first num_pages pages, return the upper part."""
+        split_len = num_pages * self.page_size
+        upper = _Node(node.key[:split_len], node.pages[:num_pages], node.parent)
+        upper.children[self._chunk(node.key, split_len)] = node
+        upper.last_access = node.last_access
+        node.parent.children[self._chunk(node.key, 0)] = upper
+        node.key, node.pages, node.parent = node.key[split_len:], node.pages[num_pages:], upper
+        return upper
+
+    def _match(self, tokens, max_pages):
+        """Walk the tree along tokens (at most max_pages pages). Return the last node reached, the
+        pages matched and the matched length, splitting the last edge if it matches partially.
+        """
+        node, pages, i = self.root, [], 0
+        while len(pages) < max_pages:
+            chunk = self._chunk(tokens, i)
+            child = node.children.get(chunk) if len(chunk) == self.page_size else None
+            if child is None:
+                break
+            num_matched = 0
+            while (num_matched < len(child.pages) and len(pages) + num_matched < max_pages
+                   and self._chunk(child.key, num_matched * self.page_size)
+                   == self._chunk(tokens, i + num_matched * self.page_size)):
+                num_matched += 1
+            if num_matched < len(child.pages):
+                child = self._split(child, num_matched)
+            node = child
+            pages.extend(node.pages)
+            i += num_matched * self.page_size
+        return node, pages, i
+
+    def _touch(self, node):
+        clock = next(self._clock)
+        while node is not None:
+            node.last_access = clock
+            node = node.parent
+
+    def _evict(self, num_pages):
+        """Evict the least recently used leaves that no request holds until num_pages are free."""
+        heap = []
+        stack = [self.root]
+        while stack:
+            node = stack.pop()
+            stack.extend(node.children.values())
+            if node is not self.root and not node.children:
+                heapq.heappush(heap, (node.last_access, id(node), node))
+        while len(self.free_pages) < num_pages and heap:
+            _, _, node = heapq.heappop(heap)
+            if any(self.ref_count[p] > 0 for p in node.pages):
+                continue
+            for p in node.pages:
+                self.in_tree[p] = False
+                self.free_pages.append(p)
+            self.num_evicted_pages += len(node.pages)
+            parent = node.parent
+            del parent.children[self._chunk(node.key, 0)]
+            if parent is not self.root and not parent.children:
+                heapq.heappush(heap, (parent.last_access, id(parent), parent))
+
+    def _alloc(self, num_pages):
+        if len(self.free_pages) < num_pages:
+            self._evict(num_pages)
+        if len(self.free_pages) < num_pages:
+            raise RuntimeError(f'PrefixCache is out of pages: {num_pages} needed, '
+                               f'{len(self.free_pages)} free')
+        pages = [self.free_pages.pop() for _ in range(num_pages)]
+        for p in pages:
+            self.ref_count[p] = 1
+        return pages
+
+    def acquire(self, tokens: Sequence[int]) -> Tuple[List[int], int]:
+        """Return the pages for a new request with prompt `tokens`, covering the whole prompt, and
+        the number of leading tokens whose K/V are already in those pages. At least the last token
+        of the prompt is left to compute, since its output is needed.
+        """
+        tokens = list(tokens)
+        node, pages, num_cached = self._match(tokens, (len(tokens) - 1) // self.page_size)
+        self._touch(node)
+        for p in pages:
+            self.ref_count[p] += 1
+        try:
+            pages = pages + self._alloc(-(-len(tokens) // self.page_size) - len(pages))
+        except RuntimeError:
+            self.release(pages)
+            raise
+        self.num_requests += 1
+        self.num_prompt_tokens += len(tokens)
+        self.num_cached_tokens += num_cached
+        return pages, num_cached
+
+    def extend(self, pages: List[int], num_tokens: int):
+        """Append pages to the block table of a request so that it covers num_tokens tokens."""
+        num_needed = -(-num_tokens // self.page_size) - len(pages)
+        if num_needed > 0:
+            pages.extend(self._alloc(num_needed))
+
+    def insert(self, tokens: Sequence[int], pages: List[int]):
+        """Add the full pages of `tokens`, whose K/V are in `pages`, to the tree. The prefix that
+        was already cached keeps its pages, the request's own copies of it are freed on release.
+        """
+        tokens = list(tokens)
+        num_full_pages = min(len(tokens) // self.page_size, len(pages))
+        node, matched, i = self._match(tokens, num_full_pages)
+        if len(matched) < num_full_pages:
+            new_pages = pages[len(matched):num_full_pages]
+            child = _Node(tokens[i:num_full_pages * self.page_size], new_pages, node)
+            node.children[self._chunk(child.key, 0)] = child
+            for p in new_pages:
+                self.in_tree[p] = True
+            node = child
+        self._touch(node)
+
+    def release(self, pages: List[int]):
+        """The request is done with `pages`. The ones not in the tree go back to the free list."""
+        for p in pages:
+            self.ref_count[p] -= 1
+            assert self.ref_count[p] >= 0
+            if self.ref_count[p] == 0 and not self.in_tree[p]:
+                self.free_pages.append(p)
+
+    def block_table(self, pages_per_request: Sequence[List[int]], max_num_pages=None,
+                    device=None):
+        """(batch_size, max_num_pages) int32 block table, for
+        ft_attention.varlen_attention_with_kv_cache.
+        """
+        if max_num_pages is None:
+            max_num_pages = max(len(pages) for pages in pages_per_request)
+        table = torch.zeros(len(pages_per_request), max_num_pages, dtype=torch.int32)
+        for i, pages in enumerate(pages_per_request):
+            table[i, :len(pages)] = torch.tensor(pages, dtype=torch.int32)
+        return table.to(device) if device is not None else table
+
+    def metrics(self):
+        num_cached_pages = sum(self.in_tree)
+        num_used_pages = sum(1 for p in range(self.num_pages)
+                             if self.ref_count[p] > 0 or self.in_tree[p])
+        num_referenced = sum(self.ref_count)
+        return {
+            'requests': self.num_requests,
+            'prompt_tokens': self.num_prompt_tokens,
+            'cached_tokens': self.num_cached_tokens,
+            # Fraction of the prompt tokens whose K/V came from the cache
+            'hit_rate': self.num_cached_tokens / max(self.num_prompt_tokens, 1),
+            'free_pages': len(self.free_pages),
+            'used_pages': num_used_pages,
+            'cached_pages': num_cached_pages,
+            # Pages the requests would hold without sharing, minus the pages they do hold
+            'shared_pages_saved': num_referenced - sum(1 for c in self.ref_count if c > 0),
+            'evicted_pages': self.num_evicted_pages,
+        }
@@ -1,10 +1,23 @@
+import json
+import math
+import mmap
+import os
+from collections import OrderedDict
+
 import torch
+from torch.nn.modules.module import _IncompatibleKeys
 
 from transformers.utils import WEIGHTS_NAME, WEIGHTS_INDEX_NAME
+from transformers.utils import SAFE_WEIGHTS_NAME, SAFE_WEIGHTS_INDEX_NAME
 from transformers.utils import is_remote_url
 from transformers.modeling_utils import load_state_dict
 from transformers.utils.hub import cached_file, get_checkpoint_shard_files
 
+try:
+    import checkpoint_loader
+except ImportError:
+    checkpoint_loader = None
+
 
 def state_dict_from_pretrained(model_name, device=None, dtype=None):
     # If not fp32, then we don't want to load directly to the GPU
@@ -35,3 +48,323 @@ def state_dict_from_pretrained(model_name, device=None, dtype=None):
         state_dict = {k: v.to(dtype=dtype) for k, v in state_dict.items()}
     state_dict = {k: v.to(device=device) for k, v in state_dict.items()}
     return state_dict
+
+
+_SAFETENSORS_DTYPES = {'F64': torch.float64, 'F32': torch.float32, 'F16': torch.float16,
+                       'BF16': torch.bfloat16, 'I64': torch.int64, 'I32': torch.int32,
+                       'I16': torch.int16, 'I8': torch.int8, 'U8': torch.uint8, 'BOOL': torch.bool}
+
+
+class _MappedFile:
+    """A safetensors file mapped in memory: an 8-byte little-endian header length, a JSON header
+    mapping names to dtype, shape and data_offsets, then the raw tensor data.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        if checkpoint_loader is not None:
+            self.native = checkpoint_loader.MmapFile(path)
+            read = self.native.read
+        else:
+            self.native = None
+            with open(path, 'rb') as f:
+                # ACCESS_COPY so that torch.frombuffer gets a writable buffer. The pages stay
+                # shared with the page cache since they're never written to.
+                self.mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+            read = lambda offset, length: self.mmap[offset:offset + length]
+        header_len = int.from_bytes(read(0, 8), 'little')
+        self.header = json.loads(read(8, header_len))
+        self.header.pop('__metadata__', None)
+        self.data_offset = 8 + header_len
+
+
+def _contiguous_strides(shape):
+    strides, stride = [], 1
+    for size in reversed(shape):
+        strides.append(stride)
+        stride *= size
+    return list(reversed(strides))
+
+
+def _view_strides(shape, strides, new_shape):
+    """Strides of new_shape as a view of (shape, strides), None if it needs a copy.
+    Same as at::detail::computeStride.
+    """
+    if math.prod(shape) == 0 or len(shape) == 0:
+        return _contiguous_strides(new_shape)
+    new_strides = [0] * len(new_shape)
+    view_d = len(new_shape) - 1
+    chunk_base_stride = strides[-1]
+    tensor_numel, view_numel = 1, 1
+    for tensor_d in range(len(shape) - 1, -1, -1):
+        tensor_numel *= shape[tensor_d]
+        if (tensor_d == 0 or (shape[tensor_d - 1] != 1
+                              and strides[tensor_d - 1] != tensor_numel * chunk_base_stride)):
+            while view_d >= 0 and (view_numel < tensor_numel or new_shape[view_d] == 1):
+                new_strides[view_d] = view_numel * chunk_base_stride
+                view_numel *= new_shape[view_d]
+                view_d -= 1
+            if view_numel != tensor_numel:
+                return None
+            if tensor_d > 0:
+                chunk_base_stride = strides[tensor_d - 1]
+                tensor_numel, view_numel = 1, 1
+    return new_strides if view_d == -1 else None
+
+
+class LazyTensor:
+    """A strided view of a tensor in a memory-mapped checkpoint, only read when materialized.
+
+    It supports what the remapping and tensor parallel sharding functions (e.g.
+    remap_state_dict_hf_gpt2 and shard_state_dict_tp) do to the tensors: t(), indexing with
+    slices, reshape and F.pad of the end of the first dimension (with zeros). These only change
+    the view, so each rank only reads its shard of each tensor from disk.
+    """
+
+    def __init__(self, file, dtype, shape, strides, offset, pad_rows=0, final_shape=None):
+        self.file = file
+        self.dtype_code = dtype
+        # The view: shape and strides in elements, offset in bytes from the start of the file
+        self._shape = list(shape)
+        self._strides = list(strides)
+        self.offset = offset
+        # Zero rows appended to the first dimension
+        self.pad_rows = pad_rows
+        # Reshape applied after materializing, for views that can't be expressed with strides
+        self.final_shape = final_shape
+
+    @property
+    def dtype(self):
+        return _SAFETENSORS_DTYPES[self.dtype_code]
+
+    @property
+    def shape(self):
+        if self.final_shape is not None:
+            return torch.Size(self.final_shape)
+        if self.pad_rows > 0:
+            return torch.Size([self._shape[0] + self.pad_rows] + self._shape[1:])
+        return torch.Size(self._shape)
+
+    def size(self, dim=None):
+        return self.shape if dim is None else self.shape[dim]
+
+    def dim(self):
+        return len(self.shape)
+
+    ndim = property(dim)
+
+    def numel(self):
+        return math.prod(self.shape)
+
+    def __repr__(self):
+        return (f'LazyTensor(shape={tuple(self.shape)}, dtype={self.dtype}, '
+                f'file={self.file.path})')
+
+    def _replace(self, **kwargs):
+        args = dict(file=self.file, dtype=self.dtype_code, shape=self._shape,
+                    strides=self._strides, offset=self.offset, pad_rows=self.pad_rows,
+                    final_shape=self.final_shape)
+        args.update(kwargs)
+        return LazyTensor(**args)
+
+    def _check_view(self, op, allow_pad=False):
+        if self.final_shape is not None or (self.pad_rows > 0 and not allow_pad):
+            raise NotImplementedError(f'LazyTensor: {op} of a padded or reshaped view is not '
+                                      'supported, materialize it first')
+
+    def t(self):
+        self._check_view('t()')
+        assert self.dim() <= 2
+        return self._replace(shape=self._shape[::-1], strides=self._strides[::-1])
+
+    def __getitem__(self, idx):
+        if not isinstance(idx, tuple):
+            idx = (idx,)
+        if any(i is Ellipsis for i in idx):
+            e = next(j for j, i in enumerate(idx) if i is Ellipsis)
+            idx = idx[:e] + (slice(None),) * (self.dim() - len(idx) + 1) + idx[e + 1:]
+        assert len(idx) <= self.dim()
+        self._check_view('indexing', allow_pad=all(i == slice(None) for i in idx[1:]))
+        element_size = torch.empty((), dtype=self.dtype).element_size()
+        offset, shape, strides, pad_rows = self.offset, [], [], 0
+        for d, (size, stride) in enumerate(zip(self._shape, self._strides)):
+            i = idx[d] if d < len(idx) else slice(None)
+            if isinstance(i, slice):
+                num_rows = size + (self.pad_rows if d == 0 else 0)
+                start, stop, step = i.indices(num_rows)
+                if d == 0 and self.pad_rows > 0:
+                    assert step == 1, 'LazyTensor: strided slices of padded views are not supported'
+                    real_start, real_stop = min(start, size), min(max(stop, start), size)
+                    pad_rows = max(stop - start, 0) - (real_stop - real_start)
+                    offset += real_start * stride * element_size
+                    shape.append(real_stop - real_start)
+                    strides.append(stride)
+                else:
+                    offset += start * stride * element_size
+                    shape.append(len(range(start, stop, step)))
+                    strides.append(stride * step)
+            else:
+                assert not (d == 0 and self.pad_rows > 0)
+                i = int(i)
+                if i < 0:
+                    i += size
+                assert 0 <= i < size, 'LazyTensor: index out of range'
+                offset += i * stride * element_size
+        return self._replace(shape=shape, strides=strides, offset=offset, pad_rows=pad_rows)
+
+    def reshape(self, *shape):
+        self._check_view('reshape')
+        if len(shape) == 1 and isinstance(shape[0], (tuple, list, torch.Size)):
+            shape = shape[0]
+        shape = [int(s) for s in shape]
+        if -1 in shape:
+            known = math.prod(s for s in shape if s != -1)
+            shape[shape.index(-1)] = self.numel() // known if known else 0
+        assert math.prod(shape) == self.numel(), 'LazyTensor: invalid shape for reshape'
+        strides = _view_strides(self._shape, self._strides, shape)
+        if strides is None:
+            return self._replace(final_shape=shape)
+        return self._replace(shape=shape, strides=strides)
+
+    view = reshape
+
+    def _pad(self, pad, mode='constant', value=None):
+        assert mode == 'constant' and not value, 'LazyTensor: only zero padding is supported'
+        self._check_view('F.pad')
+        pad = list(pad) + [0] * (2 * self.dim() - len(pad))
+        # pad is (left, right) for the last dimension, then for the one before, ...
+        assert all(p == 0 for p in pad[:2 * self.dim() - 1]), \
+            'LazyTensor: only padding at the end of the first dimension is supported'
+        assert pad[-1] >= 0
+        return self._replace(pad_rows=pad[-1])
+
+    @classmethod
+    def __torch_function__(cls, func, types, args=(), kwargs=None):
+        # F.pad is a Python function in older PyTorch versions and torch._C._nn.pad in newer ones
+        if getattr(func, '__name__', None) in ('pad', '_pad'):
+            return args[0]._pad(*args[1:], **(kwargs or {}))
+        raise NotImplementedError(f'LazyTensor does not support {func}, materialize it first')
+
+    def _copy_to(self, out):
+        """Copy the view (without padding or final reshape) into out, of shape self._shape."""
+        if math.prod(self._shape) == 0:
+            return
+        native_dtypes = (torch.float32, torch.float16, torch.bfloat16)
+        if self.file.native is None:
+            count = sum((size - 1) * stride for size, stride in zip(self._shape, self._strides)) + 1
+            src = torch.frombuffer(self.file.mmap, dtype=self.dtype, count=count,
+                                   offset=self.offset)
+            out.copy_(src.as_strided(self._shape, self._strides))
+        elif (out.is_cuda or not out.is_contiguous()
+              or (out.dtype != self.dtype
+                  and (out.dtype not in native_dtypes or self.dtype not in native_dtypes))):
+            tmp = torch.empty(self._shape, dtype=self.dtype)
+            self._copy_to(tmp)
+            out.copy_(tmp)
+        else:
+            checkpoint_loader.strided_copy(self.file.native, self.offset, self.dtype_code,
+                                           self._shape, self._strides, out)
+
+    def materialize(self, dtype=None, out=None):
+        """Read the view from the file into a new CPU tensor (of dtype, by default the dtype of
+        the checkpoint), or into out (e.g. a parameter of the model), converting the dtype.
+        """
+        if out is None:
+            out = torch.empty(self.shape, dtype=dtype if dtype is not None else self.dtype)
+        assert out.shape == self.shape, f'LazyTensor: out must have shape {tuple(self.shape)}'
+        if self.final_shape is not None:
+            if out.is_contiguous():
+                self._copy_to(out.view(self._shape))
+            else:
+                out.copy_(self._replace(final_shape=None).materialize(dtype=out.dtype)
+                          .reshape(self.final_shape))
+        elif self.pad_rows > 0:
+            self._copy_to(out[:self._shape[0]])
+            out[self._shape[0]:].zero_()
+        else:
+            self._copy_to(out)
+        return out
+
+
+def mmap_state_dict(paths):
+    """Memory-map safetensors files, return a state dict of LazyTensors.
+    Nothing but the headers is read from disk until the tensors are materialized.
+    """
+    if isinstance(paths, (str, os.PathLike)):
+        paths = [paths]
+    state_dict = OrderedDict()
+    for path in paths:
+        file = _MappedFile(str(path))
+        for name, info in file.header.items():
+            start, _ = info['data_offsets']
+            state_dict[name] = LazyTensor(file, info['dtype'], info['shape'],
+                                          _contiguous_strides(info['shape']),
+                                          file.data_offset + start)
+    return state_dict
+
+
+def save_safetensors(state_dict, path):
+    """Write state_dict in the safetensors format, e.g. to convert a checkpoint for mmap_state_dict.
+    Tensors are laid out by decreasing element size so that each one is aligned.
+    """
+    codes = {dtype: code for code, dtype in _SAFETENSORS_DTYPES.items()}
+    tensors = sorted(((name, t.detach().cpu().contiguous()) for name, t in state_dict.items()),
+                     key=lambda x: -x[1].element_size())
+    header, offset = {}, 0
+    for name, t in tensors:
+        nbytes = t.numel() * t.element_size()
+        header[name] = {'dtype': codes[t.dtype], 'shape': list(t.shape),
+                        'data_offsets': [offset, offset + nbytes]}
+        offset += nbytes
+    header = json.dumps(header).encode()
+    header += b' ' * (-len(header) % 8)
+    with open(path, 'wb') as f:
+        f.write(len(header).to_bytes(8, 'little'))
+        f.write(header)
+        for _, t in tensors:
+            f.write(t.reshape(-1).view(torch.uint8).numpy().tobytes())
+
+
+def state_dict_from_pretrained_mmap(model_name):
+    """Lazy version of state_dict_from_pretrained, for checkpoints in the safetensors format
+    (model_name can also be a local file or directory).
+    """
+    if os.path.isfile(model_name):
+        return mmap_state_dict(model_name)
+    resolved_archive_file = cached_file(model_name, SAFE_WEIGHTS_NAME,
+                                        _raise_exceptions_for_missing_entries=False)
+    if resolved_archive_file is not None:
+        return mmap_state_dict(resolved_archive_file)
+    resolved_archive_file = cached_file(model_name, SAFE_WEIGHTS_INDEX_NAME,
+                                        _raise_exceptions_for_missing_entries=False)
+    if resolved_archive_file is None:
+        raise EnvironmentError(f"Model name {model_name} has no safetensors checkpoint.")
+    resolved_archive_file, _ = get_checkpoint_shard_files(model_name, resolved_archive_file)
+    return mmap_state_dict(resolved_archive_file)
+
+
+def load_lazy_state_dict(model, state_dict, strict=True):
+    """Same as model.load_state_dict, but the LazyTensors of state_dict are read from the file
+    and converted to the dtype of the model straight into its parameters and buffers, one tensor
+    at a time, so the checkpoint is never fully in memory.
+    """
+    own_state = model.state_dict()
+    missing_keys = [k for k in own_state if k not in state_dict]
+    unexpected_keys = [k for k in state_dict if k not in own_state]
+    if strict and (missing_keys or unexpected_keys):
+        raise RuntimeError(f'Error(s) in loading state_dict for {model.__class__.__name__}: '
+                           f'missing keys {missing_keys}, unexpected keys {unexpected_keys}')
+    with torch.no_grad():
+        for name, value in state_dict.items():
+            if name not in own_state:
+                continue
+            target = own_state[name]
+            if tuple(target.shape) != tuple(value.shape):
+                raise RuntimeError(f'size mismatch for {name}: copying a param with shape '
+                                   f'{tuple(value.shape)}, the shape in the model is '
+                                   f'{tuple(target.shape)}')
+            if isinstance(value, LazyTensor):
+                value.materialize(out=target)
+            else:
+                target.copy_(value)
+    return _IncompatibleKeys(missing_keys, unexpected_keys)
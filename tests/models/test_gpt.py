@@ -122,3 +122,27 @@ def test_gpt2_optimized(model_name):
     print(f'HF fp16 max diff: {(logits_hf - logits_ref).abs().max().item()}')
     print(f'HF fp16 mean diff: {(logits_hf - logits_ref).abs().mean().item()}')
     assert (logits - logits_ref).abs().max().item() < 3 * (logits_hf - logits_ref).abs().max().item()
+
+
+@pytest.mark.parametrize('word_embed_proj_dim', [None, 64])
+def test_gpt_logits_positions(word_embed_proj_dim):
+    """Projecting only some positions onto the vocabulary must give the same logits as slicing
+    the full logits.
+    """
+    config = GPT2Config(n_embd=128, n_head=4, n_layer=2, vocab_size=1000,
+                        word_embed_proj_dim=word_embed_proj_dim)
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config)
+    model.eval()
+    batch_size, seqlen = 3, 37
+    input_ids = torch.randint(0, config.vocab_size, (batch_size, seqlen), dtype=torch.long)
+    with torch.inference_mode():
+        logits = model(input_ids).logits
+        logits_last = model(input_ids, num_last_tokens=2).logits
+        assert logits_last.shape == (batch_size, 2, logits.shape[-1])
+        assert torch.allclose(logits_last, logits[:, -2:], atol=1e-4)
+        # Last token of each sequence of a packed batch
+        cu_seqlens = torch.tensor([0, 10, 11, 37])
+        logits_pos = model(input_ids[:1], logits_positions=cu_seqlens[1:] - 1).logits
+        assert torch.allclose(logits_pos, model(input_ids[:1]).logits[0, cu_seqlens[1:] - 1],
+                              atol=1e-4)
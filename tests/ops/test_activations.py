@@ -0,0 +1,73 @@
+import torch
+import torch.nn.functional as F
+import pytest
+
+from flash_attn.ops.activations import bias_act, bias_gelu_impl, swiglu
+
+
+def bias_act_ref(x, bias, activation):
+    x = x.float() + bias.float() if bias is not None else x.float()
+    if activation == 'relu':
+        return F.relu(x)
+    return F.gelu(x, approximate='tanh' if activation == 'gelu_approx' else 'none')
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('has_bias', [True, False])
+@pytest.mark.parametrize('activation', ['gelu_approx', 'gelu', 'relu'])
+# The ReLU mask is only saved for a multiple of 8 features: 1001 takes the path that saves the input,
+# and isn't a multiple of the 64 columns per block of the backward either
+@pytest.mark.parametrize('features', [64, 1000, 1001])
+def test_bias_act(features, activation, has_bias, dtype):
+    rtol, atol = (1e-5, 1e-5) if dtype == torch.float32 else (1e-2, 1e-2)
+    torch.random.manual_seed(0)
+    x = torch.randn(3, 37, features, dtype=dtype, requires_grad=True)
+    bias = torch.randn(features, dtype=dtype, requires_grad=True) if has_bias else None
+    x_ref = x.detach().clone().requires_grad_()
+    bias_ref = bias.detach().clone().requires_grad_() if has_bias else None
+    out = bias_act(x, bias, activation)
+    out_ref = bias_act_ref(x_ref, bias_ref, activation)
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+    g = torch.randn_like(out)
+    out.backward(g)
+    out_ref.backward(g.float())
+    assert torch.allclose(x.grad.float(), x_ref.grad, rtol=rtol, atol=atol)
+    if has_bias:
+        # Sum over 111 rows
+        assert torch.allclose(bias.grad.float(), bias_ref.grad, rtol=rtol, atol=atol * 10)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+def test_bias_gelu_impl(dtype):
+    rtol, atol = (1e-5, 1e-5) if dtype == torch.float32 else (1e-2, 1e-2)
+    torch.random.manual_seed(0)
+    x = torch.randn(64, 256, dtype=dtype, requires_grad=True)
+    bias = torch.randn(256, dtype=dtype, requires_grad=True)
+    x_ref = x.detach().clone().requires_grad_()
+    bias_ref = bias.detach().clone().requires_grad_()
+    out = bias_gelu_impl(x, bias)
+    out_ref = bias_act_ref(x_ref, bias_ref, 'gelu_approx')
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+    g = torch.randn_like(out)
+    out.backward(g)
+    out_ref.backward(g.float())
+    assert torch.allclose(x.grad.float(), x_ref.grad, rtol=rtol, atol=atol)
+    assert torch.allclose(bias.grad.float(), bias_ref.grad, rtol=rtol, atol=atol * 10)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+def test_swiglu(dtype):
+    rtol, atol = (1e-5, 1e-5) if dtype == torch.float32 else (1e-2, 1e-2)
+    torch.random.manual_seed(0)
+    x = torch.randn(5, 23, 2 * 300, dtype=dtype, requires_grad=True)
+    x_ref = x.detach().clone().float().requires_grad_()
+    out = swiglu(x)
+    gate, value = x_ref.chunk(2, dim=-1)
+    out_ref = F.silu(gate) * value
+    assert out.shape == (5, 23, 300)
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+    g = torch.randn_like(out)
+    out.backward(g)
+    out_ref.backward(g.float())
+    assert torch.allclose(x.grad.float(), x_ref.grad, rtol=rtol, atol=atol)
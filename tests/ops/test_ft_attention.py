@@ -0,0 +1,403 @@
+import math
+
+import torch
+import pytest
+
+from einops import rearrange
+
+import ft_attention
+
+from flash_attn.utils.generation import InferenceParams, allocate_kv_cache, compact_batch
+from flash_attn.utils.generation import pack_cross_attention_memory
+from flash_attn.modules import mha as mha_module
+from flash_attn.modules.mha import MHA
+
+
+def pack_k_cache(k_cache):
+    """(batch, nheads, seqlen, headdim) -> (batch, nheads, headdim / x, seqlen, x), the layout of
+    the K cache of ft_attention, with x = 4 for fp32 and x = 8 for fp16 / bf16.
+    """
+    packsize = 4 if k_cache.dtype == torch.float32 else 8
+    return rearrange(k_cache, 'b h l (d x) -> b h d l x', x=packsize).contiguous()
+
+
+def unpack_k_cache(k_cache):
+    return rearrange(k_cache, 'b h d l x -> b h l (d x)')
+
+
+def single_query_attention_ref(q, k, v, k_cache, v_cache, lengths, ia3_tasks=None,
+                               ia3_key_weights=None, ia3_value_weights=None):
+    """
+    Arguments:
+        q, k, v: (batch_size, nheads, headdim)
+        k_cache, v_cache: (batch_size, nheads, seqlen, headdim), not packed.
+        lengths: list of ints, the number of tokens already in the cache for each sample.
+    Return:
+        out: (batch_size, nheads, headdim), and the updated k_cache, v_cache.
+    """
+    k_cache, v_cache = k_cache.clone(), v_cache.clone()
+    if ia3_tasks is not None:
+        k = k * ia3_key_weights[ia3_tasks.long()]
+        v = v * ia3_value_weights[ia3_tasks.long()]
+    out = torch.empty_like(q)
+    for b, l in enumerate(lengths):
+        k_cache[b, :, l] = k[b]
+        v_cache[b, :, l] = v[b]
+        scores = torch.einsum('hd,hsd->hs', q[b].float(), k_cache[b, :, :l + 1].float())
+        attn = torch.softmax(scores / math.sqrt(q.shape[-1]), dim=-1)
+        out[b] = torch.einsum('hs,hsd->hd', attn, v_cache[b, :, :l + 1].float()).to(q.dtype)
+    return out, k_cache, v_cache
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('num_tasks', [1, 3])
+@pytest.mark.parametrize('headdim', [64, 128])
+def test_single_query_attention_ia3(headdim, num_tasks, dtype):
+    device = 'cpu'
+    rtol, atol = (1e-2, 2e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, max_seqlen = 6, 4, 64
+    q, k, v = torch.randn(3, batch_size, nheads, headdim, device=device, dtype=dtype).unbind(0)
+    k_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    lengths = torch.randint(0, max_seqlen, (batch_size,), dtype=torch.int32, device=device)
+    ia3_tasks = torch.randint(0, num_tasks, (batch_size,), dtype=torch.int32, device=device)
+    ia3_key_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+    ia3_value_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+    k_cache_packed = pack_k_cache(k_cache)
+    v_cache_ft = v_cache.clone()
+    out = ft_attention.single_query_attention(
+        q, k, v, k_cache_packed, v_cache_ft, lengths, 0, ia3_tasks_=ia3_tasks,
+        ia3_key_weights_=ia3_key_weights, ia3_value_weights_=ia3_value_weights
+    )
+    out_ref, k_cache_ref, v_cache_ref = single_query_attention_ref(
+        q, k, v, k_cache, v_cache, lengths.tolist(), ia3_tasks, ia3_key_weights,
+        ia3_value_weights
+    )
+    assert torch.allclose(out, out_ref, rtol=rtol, atol=atol)
+    assert torch.allclose(unpack_k_cache(k_cache_packed), k_cache_ref, rtol=rtol, atol=atol)
+    assert torch.allclose(v_cache_ft, v_cache_ref, rtol=rtol, atol=atol)
+    # A batch mixing adapters gives the same result as running each sample on its own
+    for b in range(batch_size):
+        k_cache_b = pack_k_cache(k_cache[b:b + 1])
+        out_b = ft_attention.single_query_attention(
+            q[b:b + 1], k[b:b + 1], v[b:b + 1], k_cache_b, v_cache[b:b + 1].clone(),
+            lengths[b:b + 1], 0, ia3_tasks_=torch.zeros(1, dtype=torch.int32),
+            ia3_key_weights_=ia3_key_weights[ia3_tasks[b].item()].unsqueeze(0).contiguous(),
+            ia3_value_weights_=ia3_value_weights[ia3_tasks[b].item()].unsqueeze(0).contiguous()
+        )
+        assert torch.equal(out_b, out[b:b + 1])
+
+
+@pytest.mark.parametrize('bad_task', [-1, 3])
+def test_single_query_attention_ia3_bad_task(bad_task):
+    device = 'cpu'
+    batch_size, nheads, headdim, max_seqlen, num_tasks = 2, 4, 64, 16, 3
+    q, k, v = torch.randn(3, batch_size, nheads, headdim, device=device).unbind(0)
+    k_cache = pack_k_cache(torch.randn(batch_size, nheads, max_seqlen, headdim, device=device))
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device)
+    ia3_tasks = torch.tensor([0, bad_task], dtype=torch.int32, device=device)
+    ia3_key_weights = torch.rand(num_tasks, nheads, headdim, device=device)
+    ia3_value_weights = torch.rand(num_tasks, nheads, headdim, device=device)
+    with pytest.raises(RuntimeError, match='ia3_tasks'):
+        ft_attention.single_query_attention(
+            q, k, v, k_cache, v_cache, None, 0, ia3_tasks_=ia3_tasks,
+            ia3_key_weights_=ia3_key_weights, ia3_value_weights_=ia3_value_weights
+        )
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+def test_single_query_attention_finished(dtype):
+    device = 'cpu'
+    rtol, atol = (1e-3, 1e-3) if dtype == torch.float16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, max_seqlen = 8, 4, 64, 32
+    q, k, v = torch.randn(3, batch_size, nheads, headdim, device=device, dtype=dtype).unbind(0)
+    k_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    timestep = 17
+    finished = torch.rand(batch_size, device=device) < 0.5
+    k_cache_packed = pack_k_cache(k_cache)
+    k_cache_og = k_cache_packed.clone()
+    v_cache_ft = v_cache.clone()
+    out = ft_attention.single_query_attention(q, k, v, k_cache_packed, v_cache_ft, None, timestep,
+                                              finished_=finished)
+    out_ref, k_cache_ref, v_cache_ref = single_query_attention_ref(
+        q, k, v, k_cache, v_cache, [timestep] * batch_size
+    )
+    active = ~finished
+    assert torch.allclose(out[active], out_ref[active], rtol=rtol, atol=atol)
+    assert torch.allclose(unpack_k_cache(k_cache_packed)[active], k_cache_ref[active])
+    assert torch.allclose(v_cache_ft[active], v_cache_ref[active])
+    # The finished rows are skipped: zero output, KV cache untouched
+    assert torch.all(out[finished] == 0)
+    assert torch.equal(k_cache_packed[finished], k_cache_og[finished])
+    assert torch.equal(v_cache_ft[finished], v_cache[finished])
+
+
+def test_compact_batch():
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, max_seqlen, nlayers = 6, 2, 32, 16, 2
+    inference_params = InferenceParams(max_sequence_len=max_seqlen, max_batch_size=batch_size,
+                                       fused_ft_kernel=True)
+    inference_params.key_value_memory_dict = allocate_kv_cache(
+        batch_size, max_seqlen, nheads, headdim, nlayers, 'cpu', torch.float32
+    )
+    for k_cache, v_cache in inference_params.key_value_memory_dict.values():
+        k_cache.normal_()
+        v_cache.normal_()
+    inference_params.lengths_per_sample = torch.arange(batch_size, dtype=torch.int32)
+    inference_params.finished = torch.tensor([True, False, True, True, False, False])
+    kv_og = {l: (k.clone(), v.clone()) for l, (k, v) in
+             inference_params.key_value_memory_dict.items()}
+    keep = (~inference_params.finished).nonzero().squeeze(-1)
+    compact_batch(inference_params, keep)
+    n = keep.shape[0]
+    for l, (k_cache, v_cache) in inference_params.key_value_memory_dict.items():
+        assert torch.equal(k_cache[:n], kv_og[l][0][keep])
+        assert torch.equal(v_cache[:n], kv_og[l][1][keep])
+    assert torch.equal(inference_params.lengths_per_sample[:n], keep.int())
+    assert not inference_params.finished[:n].any()
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('has_ia3', [False, True])
+def test_single_query_cross_attention(has_ia3, dtype):
+    device = 'cpu'
+    rtol, atol = (1e-2, 2e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, memory_seqlen, num_tasks = 4, 4, 64, 48, 2
+    kv = torch.randn(batch_size, memory_seqlen, 2, nheads, headdim, device=device, dtype=dtype)
+    memory_lengths = torch.randint(1, memory_seqlen + 1, (batch_size,), dtype=torch.int32,
+                                   device=device)
+    ia3_kwargs = {}
+    k, v = kv.unbind(dim=2)
+    if has_ia3:
+        ia3_tasks = torch.randint(0, num_tasks, (batch_size,), dtype=torch.int32, device=device)
+        ia3_key_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+        ia3_value_weights = torch.rand(num_tasks, nheads, headdim, device=device, dtype=dtype) + 0.5
+        ia3_kwargs = dict(ia3_tasks_=ia3_tasks, ia3_key_weights_=ia3_key_weights,
+                          ia3_value_weights_=ia3_value_weights)
+        k = k * rearrange(ia3_key_weights[ia3_tasks.long()], 'b h d -> b 1 h d')
+        v = v * rearrange(ia3_value_weights[ia3_tasks.long()], 'b h d -> b 1 h d')
+    k_memory, v_memory = pack_cross_attention_memory(kv)
+    for timestep in range(3):
+        q = torch.randn(batch_size, nheads, headdim, device=device, dtype=dtype)
+        out = ft_attention.single_query_cross_attention(q, k_memory, v_memory, memory_lengths,
+                                                        timestep, **ia3_kwargs)
+        out_ref = torch.empty_like(q)
+        for b, l in enumerate(memory_lengths.tolist()):
+            scores = torch.einsum('hd,shd->hs', q[b].float(), k[b, :l].float()) / math.sqrt(headdim)
+            out_ref[b] = torch.einsum('hs,shd->hd', torch.softmax(scores, dim=-1),
+                                      v[b, :l].float()).to(dtype)
+        assert torch.allclose(out, out_ref, rtol=rtol, atol=atol)
+
+
+def paged_to_contiguous(cache, block_table, block_size):
+    """(num_blocks, nheads, block_size, headdim) + (batch_size, max_num_blocks) block table ->
+    (batch_size, nheads, max_num_blocks * block_size, headdim).
+    """
+    return rearrange(cache[block_table.long()], 'b nblocks h s d -> b h (nblocks s) d')
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('paged', [False, True])
+@pytest.mark.parametrize('causal', [False, True])
+def test_varlen_attention_with_kv_cache(causal, paged, dtype):
+    device = 'cpu'
+    rtol, atol = (1e-2, 2e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, max_seqlen, block_size = 4, 4, 64, 80, 16
+    cache_seqlens = torch.tensor([0, 13, 40, 79], dtype=torch.int32, device=device)
+    seqlens_q = torch.tensor([37, 1, 20, 1], dtype=torch.int32, device=device)
+    cu_seqlens_q = torch.nn.functional.pad(seqlens_q.cumsum(0, dtype=torch.int32), (1, 0))
+    total = cu_seqlens_q[-1].item()
+    q, k, v = torch.randn(3, total, nheads, headdim, device=device, dtype=dtype).unbind(0)
+    if paged:
+        max_num_blocks = max_seqlen // block_size
+        num_blocks = batch_size * max_num_blocks + 3
+        block_table = torch.randperm(num_blocks, dtype=torch.int32, device=device)[
+            :batch_size * max_num_blocks].reshape(batch_size, max_num_blocks)
+        v_cache = torch.randn(num_blocks, nheads, block_size, headdim, device=device, dtype=dtype)
+        k_cache = torch.randn(num_blocks, nheads, block_size, headdim, device=device, dtype=dtype)
+        k_cache_ref = paged_to_contiguous(k_cache, block_table, block_size)
+        v_cache_ref = paged_to_contiguous(v_cache, block_table, block_size)
+    else:
+        block_table = None
+        k_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+        v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+        k_cache_ref, v_cache_ref = k_cache.clone(), v_cache.clone()
+    k_cache_packed = pack_k_cache(k_cache)
+    out = ft_attention.varlen_attention_with_kv_cache(
+        q, k, v, k_cache_packed, v_cache, cu_seqlens_q, cache_seqlens, block_table,
+        is_causal=causal
+    )
+    k_cache_out = unpack_k_cache(k_cache_packed)
+    if paged:
+        k_cache_out = paged_to_contiguous(k_cache_out, block_table, block_size)
+        v_cache = paged_to_contiguous(v_cache, block_table, block_size)
+    for b in range(batch_size):
+        l, start, end = cache_seqlens[b].item(), cu_seqlens_q[b].item(), cu_seqlens_q[b + 1].item()
+        k_cache_ref[b, :, l:l + end - start] = rearrange(k[start:end], 's h d -> h s d')
+        v_cache_ref[b, :, l:l + end - start] = rearrange(v[start:end], 's h d -> h s d')
+        seqlen_k = l + end - start
+        scores = torch.einsum('shd,htd->hst', q[start:end].float(),
+                              k_cache_ref[b, :, :seqlen_k].float()) / math.sqrt(headdim)
+        if causal:
+            mask = torch.ones(end - start, seqlen_k, dtype=torch.bool, device=device).tril(l)
+            scores.masked_fill_(~mask, float('-inf'))
+        out_ref = torch.einsum('hst,htd->shd', torch.softmax(scores, dim=-1),
+                               v_cache_ref[b, :, :seqlen_k].float()).to(dtype)
+        assert torch.allclose(out[start:end], out_ref, rtol=rtol, atol=atol)
+        assert torch.equal(k_cache_out[b, :, :seqlen_k], k_cache_ref[b, :, :seqlen_k])
+        assert torch.equal(v_cache[b, :, :seqlen_k], v_cache_ref[b, :, :seqlen_k])
+
+
+def test_varlen_attention_with_kv_cache_chunked_prefill():
+    """Prefilling a prompt chunk by chunk gives the same output as prefilling it in one call."""
+    device, dtype = 'cpu', torch.float32
+    # set seed
+    torch.random.manual_seed(0)
+    nheads, headdim, seqlen, chunk_size = 4, 64, 100, 32
+    q, k, v = torch.randn(3, seqlen, nheads, headdim, device=device, dtype=dtype).unbind(0)
+    k_cache = torch.zeros(1, nheads, headdim // 4, seqlen, 4, device=device, dtype=dtype)
+    v_cache = torch.zeros(1, nheads, seqlen, headdim, device=device, dtype=dtype)
+    out = ft_attention.varlen_attention_with_kv_cache(
+        q, k, v, k_cache.clone(), v_cache.clone(),
+        torch.tensor([0, seqlen], dtype=torch.int32), torch.zeros(1, dtype=torch.int32)
+    )
+    out_chunks = []
+    for start in range(0, seqlen, chunk_size):
+        end = min(start + chunk_size, seqlen)
+        out_chunks.append(ft_attention.varlen_attention_with_kv_cache(
+            q[start:end], k[start:end], v[start:end], k_cache, v_cache,
+            torch.tensor([0, end - start], dtype=torch.int32),
+            torch.tensor([start], dtype=torch.int32)
+        ))
+    assert torch.allclose(torch.cat(out_chunks), out, rtol=1e-5, atol=1e-5)
+
+
+def test_varlen_attention_with_kv_cache_empty_cu_seqlens():
+    nheads, headdim, seqlen = 2, 32, 8
+    q, k, v = torch.randn(3, 0, nheads, headdim).unbind(0)
+    k_cache = torch.zeros(0, nheads, headdim // 4, seqlen, 4)
+    v_cache = torch.zeros(0, nheads, seqlen, headdim)
+    with pytest.raises(RuntimeError, match='cu_seqlens_q'):
+        ft_attention.varlen_attention_with_kv_cache(
+            q, k, v, k_cache, v_cache, torch.zeros(0, dtype=torch.int32),
+            torch.zeros(0, dtype=torch.int32)
+        )
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+@pytest.mark.parametrize('paged', [False, True])
+def test_append_kv_cache(paged, dtype):
+    device = 'cpu'
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, max_seqlen, block_size = 3, 4, 64, 48, 16
+    cache_seqlens = torch.tensor([0, 5, 30], dtype=torch.int32, device=device)
+    cu_seqlens_q = torch.tensor([0, 48, 50, 68], dtype=torch.int32, device=device)
+    # K/V sliced from a packed QKV projection output
+    qkv = torch.randn(68, 3, nheads, headdim, device=device, dtype=dtype)
+    k, v = qkv[:, 1], qkv[:, 2]
+    if paged:
+        num_blocks = batch_size * max_seqlen // block_size
+        block_table = torch.randperm(num_blocks, dtype=torch.int32, device=device).reshape(
+            batch_size, max_seqlen // block_size)
+        k_cache = torch.randn(num_blocks, nheads, block_size, headdim, device=device, dtype=dtype)
+        v_cache = torch.randn(num_blocks, nheads, block_size, headdim, device=device, dtype=dtype)
+    else:
+        block_table = None
+        k_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+        v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    k_cache_packed = pack_k_cache(k_cache)
+    ft_attention.append_kv_cache(k, v, k_cache_packed, v_cache, cu_seqlens_q, cache_seqlens,
+                                 block_table)
+    k_cache_out, v_cache_out = unpack_k_cache(k_cache_packed), v_cache
+    if paged:
+        k_cache = paged_to_contiguous(k_cache, block_table, block_size)
+        k_cache_out = paged_to_contiguous(k_cache_out, block_table, block_size)
+        v_cache_out = paged_to_contiguous(v_cache, block_table, block_size)
+    k_cache_ref = k_cache.clone()
+    for b in range(batch_size):
+        l, start, end = cache_seqlens[b].item(), cu_seqlens_q[b].item(), cu_seqlens_q[b + 1].item()
+        k_cache_ref[b, :, l:l + end - start] = rearrange(k[start:end], 's h d -> h s d')
+        assert torch.equal(v_cache_out[b, :, l:l + end - start],
+                           rearrange(v[start:end], 's h d -> h s d'))
+    assert torch.equal(k_cache_out, k_cache_ref)
+
+
+def test_mha_ft_prefill():
+    """On CPU with fused_ft_kernel, the prompt K/V are written straight into the FT layouts by the
+    prompt attention, then decoding with the FT kernel matches decoding with the (b, s, 2, h, d)
+    cache."""
+    device, dtype = 'cpu', torch.float32
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, seqlen, embed_dim, nheads, max_seqlen = 2, 20, 128, 4, 32
+    mha = MHA(embed_dim, nheads, causal=True, layer_idx=0, device=device, dtype=dtype)
+    x = torch.randn(batch_size, seqlen + 3, embed_dim, device=device, dtype=dtype)
+    outs = []
+    for fused_ft_kernel in [False, True]:
+        inference_params = InferenceParams(max_sequence_len=max_seqlen, max_batch_size=batch_size,
+                                           fused_ft_kernel=fused_ft_kernel)
+        out = [mha(x[:, :seqlen], inference_params=inference_params)]
+        for i in range(seqlen, seqlen + 3):
+            inference_params.sequence_len_offset = i
+            out.append(mha(x[:, i:i + 1], inference_params=inference_params))
+        outs.append(torch.cat(out, dim=1))
+    assert torch.allclose(outs[1], outs[0], rtol=1e-4, atol=1e-4)
+
+
+def test_mha_ft_prefill_without_extension(monkeypatch):
+    """Without ft_attention, the prompt with fused_ft_kernel falls back to the torch path, which
+    writes the same FT layouts."""
+    device, dtype = 'cpu', torch.float32
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, seqlen, embed_dim, nheads, max_seqlen = 2, 20, 128, 4, 32
+    mha = MHA(embed_dim, nheads, causal=True, layer_idx=0, device=device, dtype=dtype)
+    x = torch.randn(batch_size, seqlen, embed_dim, device=device, dtype=dtype)
+    outs, caches = [], []
+    for has_ft_attention in [True, False]:
+        if not has_ft_attention:
+            monkeypatch.setattr(mha_module, 'ft_attention', None)
+        inference_params = InferenceParams(max_sequence_len=max_seqlen, max_batch_size=batch_size,
+                                           fused_ft_kernel=True)
+        outs.append(mha(x, inference_params=inference_params))
+        k_cache, v_cache = inference_params.key_value_memory_dict[0]
+        caches.append((k_cache[..., :seqlen, :], v_cache[:, :, :seqlen]))
+    assert torch.allclose(outs[1], outs[0], rtol=1e-4, atol=1e-4)
+    assert torch.allclose(caches[1][0], caches[0][0]) and torch.allclose(caches[1][1], caches[0][1])
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('num_queries', [2, 5, 16])
+def test_multi_token_attention(num_queries, dtype):
+    """Verifying num_queries draft tokens in one call gives the same output and KV cache as
+    decoding them one by one with single_query_attention."""
+    device = 'cpu'
+    rtol, atol = (1e-2, 2e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, nheads, headdim, max_seqlen = 4, 4, 64, 64
+    q, k, v = torch.randn(3, batch_size, num_queries, nheads, headdim, device=device,
+                          dtype=dtype).unbind(0)
+    k_cache = pack_k_cache(torch.randn(batch_size, nheads, max_seqlen, headdim, device=device,
+                                       dtype=dtype))
+    v_cache = torch.randn(batch_size, nheads, max_seqlen, headdim, device=device, dtype=dtype)
+    lengths = torch.randint(0, max_seqlen - num_queries + 1, (batch_size,), dtype=torch.int32,
+                            device=device)
+    k_cache_ref, v_cache_ref = k_cache.clone(), v_cache.clone()
+    out = ft_attention.multi_token_attention(q, k, v, k_cache, v_cache, lengths, 0)
+    out_ref = torch.stack([ft_attention.single_query_attention(
+        q[:, i], k[:, i], v[:, i], k_cache_ref, v_cache_ref, lengths + i, 0
+    ) for i in range(num_queries)], dim=1)
+    assert torch.allclose(out, out_ref, rtol=rtol, atol=atol)
+    assert torch.equal(k_cache, k_cache_ref)
+    assert torch.equal(v_cache, v_cache_ref)
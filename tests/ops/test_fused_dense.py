@@ -7,7 +7,10 @@ import pytest
 
 from einops import rearrange
 
-from flash_attn.ops.fused_dense import FusedDense, FusedMLP
+from flash_attn.ops.fused_dense import FusedDense, FusedMLP, ChunkedFusedMLP
+from flash_attn.ops.fused_dense import QuantizedFusedDense, quantize_weight, dequantize_weight
+from flash_attn.ops.fused_dense import dropout_add_ln_linear_func, fused_dense_gather_func
+from flash_attn.ops.fused_dense import fused_patch_embed_func
 
 
 @pytest.mark.parametrize('dtype', [torch.float16, torch.bfloat16])
@@ -72,7 +75,7 @@ def test_fused_linear_bias(in_features, out_features, has_bias, return_residual,
 @pytest.mark.parametrize('has_bias1', [True, False])
 # @pytest.mark.parametrize('has_bias2', [True])
 # @pytest.mark.parametrize('has_bias1', [True])
-@pytest.mark.parametrize('activation', ['gelu_approx', 'relu'])
+@pytest.mark.parametrize('activation', ['gelu_approx', 'gelu', 'relu'])
 # @pytest.mark.parametrize('activation', ['relu'])
 @pytest.mark.parametrize('out_features', [1024, 4096])
 @pytest.mark.parametrize('in_features', [1024, 4096])
@@ -104,8 +107,8 @@ def test_fused_mlp(in_features, out_features, activation, has_bias1, has_bias2,
         model.fc2.weight.copy_(model_pt_fc2.weight)
         if has_bias2:
             model.fc2.bias.copy_(model_pt_fc2.bias)
-    activation_fn = (partial(F.gelu, approximate='tanh') if activation == 'gelu_approx'
-                     else partial(F.relu, inplace=True))
+    activation_fn = {'gelu_approx': partial(F.gelu, approximate='tanh'), 'gelu': F.gelu,
+                     'relu': partial(F.relu, inplace=True)}[activation]
     out_pt = model_pt_fc2(activation_fn(model_pt_fc1(x_pt)))
     if not return_residual:
         out = model(x)
@@ -131,3 +134,213 @@ def test_fused_mlp(in_features, out_features, activation, has_bias1, has_bias2,
     assert torch.allclose(model.fc2.weight.grad, model_pt_fc2.weight.grad, rtol=rtol, atol=atol * 10)
     if has_bias2:
         assert torch.allclose(model.fc2.bias.grad, model_pt_fc2.bias.grad, rtol=rtol, atol=atol * 5)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('activation', ['none', 'gelu_approx', 'relu'])
+@pytest.mark.parametrize('has_bias', [True, False])
+@pytest.mark.parametrize('group_size', [-1, 128])
+@pytest.mark.parametrize('bits', [8, 4])
+@pytest.mark.parametrize('batch_size', [1, 77])
+def test_fused_dense_quant(batch_size, bits, group_size, has_bias, activation, dtype):
+    device = 'cpu'
+    rtol, atol = (3e-3, 2e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    in_features, out_features = 512, 1000
+    x = torch.randn(batch_size, in_features, device=device, dtype=dtype)
+    model_pt = torch.nn.Linear(in_features, out_features, bias=has_bias, device=device, dtype=dtype)
+    model = QuantizedFusedDense.from_linear(model_pt, bits=bits, group_size=group_size,
+                                            activation=activation)
+    weight_deq = dequantize_weight(model.qweight, model.scales, bits)
+    # Quantization error is bounded by half a step
+    step = rearrange(model.scales, 'o g -> o g 1').expand(
+        -1, -1, in_features // model.scales.shape[1]).reshape(out_features, in_features)
+    assert ((weight_deq - model_pt.weight.float()).abs() <= step / 2 + 1e-6).all()
+    out_ref = F.linear(x.float(), weight_deq, model_pt.bias.float() if has_bias else None)
+    if activation == 'gelu_approx':
+        out_ref = F.gelu(out_ref, approximate='tanh')
+    elif activation == 'relu':
+        out_ref = F.relu(out_ref)
+    out = model(x)
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+
+
+def test_quantize_weight_int4_packing():
+    torch.random.manual_seed(0)
+    weight = torch.randn(64, 256)
+    qweight, scales = quantize_weight(weight, bits=4, group_size=32)
+    assert qweight.shape == (64, 128) and qweight.dtype == torch.uint8
+    assert scales.shape == (64, 8)
+    q = torch.stack([qweight & 0xF, qweight >> 4], dim=-1).flatten(-2).long() - 8
+    assert q.min() >= -8 and q.max() <= 7
+    q_ref = torch.round(weight / scales.repeat_interleave(32, dim=1)).long()
+    assert torch.equal(q, q_ref)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('recompute', [True, False])
+@pytest.mark.parametrize('chunk_size', [256, 384, 4096])
+@pytest.mark.parametrize('activation', ['gelu_approx', 'gelu', 'relu'])
+def test_fused_mlp_chunked(activation, chunk_size, recompute, dtype):
+    device = 'cpu'
+    rtol, atol = (3e-3, 3e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size = 4
+    seqlen = 64
+    in_features, hidden_features = 256, 1024
+    x_pt = torch.randn(batch_size, seqlen, in_features, device=device, dtype=dtype,
+                       requires_grad=True)
+    x = x_pt.detach().clone().requires_grad_()
+    model = ChunkedFusedMLP(in_features, hidden_features, activation=activation,
+                            chunk_size=chunk_size, recompute=recompute, device=device,
+                            dtype=dtype)
+    model_pt_fc1 = torch.nn.Linear(in_features, hidden_features, device=device, dtype=dtype)
+    model_pt_fc2 = torch.nn.Linear(hidden_features, in_features, device=device, dtype=dtype)
+    with torch.no_grad():
+        model_pt_fc1.weight.copy_(model.fc1.weight)
+        model_pt_fc1.bias.copy_(model.fc1.bias)
+        model_pt_fc2.weight.copy_(model.fc2.weight)
+        model_pt_fc2.bias.copy_(model.fc2.bias)
+    activation_fn = {'gelu_approx': partial(F.gelu, approximate='tanh'), 'gelu': F.gelu,
+                     'relu': F.relu}[activation]
+    # The chunked MLP keeps the hidden activation in fp32, so we compare to a fp32 reference
+    out_ref = F.linear(activation_fn(F.linear(x_pt.float(), model_pt_fc1.weight.float(),
+                                              model_pt_fc1.bias.float())),
+                       model_pt_fc2.weight.float(), model_pt_fc2.bias.float())
+    out_pt = model_pt_fc2(activation_fn(model_pt_fc1(x_pt)))
+    out = model(x)
+    assert out.shape == out_pt.shape
+    assert (out.float() - out_ref).abs().max() <= 2 * (out_pt.float() - out_ref).abs().max() + 1e-5
+
+    g = torch.randn_like(out) / 32
+    out_pt.backward(g)
+    out.backward(g)
+    assert torch.allclose(x.grad, x_pt.grad, rtol=rtol, atol=atol)
+    assert torch.allclose(model.fc1.weight.grad, model_pt_fc1.weight.grad, rtol=rtol, atol=atol * 10)
+    assert torch.allclose(model.fc1.bias.grad, model_pt_fc1.bias.grad, rtol=rtol, atol=atol * 5)
+    assert torch.allclose(model.fc2.weight.grad, model_pt_fc2.weight.grad, rtol=rtol, atol=atol * 10)
+    assert torch.allclose(model.fc2.bias.grad, model_pt_fc2.bias.grad, rtol=rtol, atol=atol * 5)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('is_rms_norm', [False, True])
+@pytest.mark.parametrize('has_residual', [False, True])
+@pytest.mark.parametrize('residual_in_fp32', [False, True])
+@pytest.mark.parametrize('activation', ['none', 'gelu_approx'])
+def test_dropout_add_ln_linear(activation, residual_in_fp32, has_residual, is_rms_norm, dtype):
+    device = 'cpu'
+    rtol, atol = (3e-3, 3e-2) if dtype == torch.bfloat16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    batch_size, seqlen = 4, 37
+    in_features, out_features = 256, 768
+    x0 = torch.randn(batch_size, seqlen, in_features, device=device, dtype=dtype)
+    residual = (torch.randn(batch_size, seqlen, in_features, device=device,
+                            dtype=torch.float32 if residual_in_fp32 else dtype)
+                if has_residual else None)
+    ln_weight = torch.randn(in_features, device=device, dtype=dtype)
+    ln_bias = torch.randn(in_features, device=device, dtype=dtype) if not is_rms_norm else None
+    weight = torch.randn(out_features, in_features, device=device, dtype=dtype) / math.sqrt(in_features)
+    bias = torch.randn(out_features, device=device, dtype=dtype)
+    with torch.no_grad():
+        out, x, z = dropout_add_ln_linear_func(
+            x0, residual, ln_weight, ln_bias, weight, bias, 0.0, 1e-5, activation=activation,
+            prenorm=True, residual_in_fp32=residual_in_fp32, is_rms_norm=is_rms_norm,
+            return_z=True
+        )
+    x_ref = x0 if residual is None else (x0.float() + residual.float()).to(residual.dtype)
+    if residual is None and residual_in_fp32:
+        x_ref = x_ref.float()
+    xf = x_ref.float()
+    if is_rms_norm:
+        z_ref = xf * torch.rsqrt(xf.square().mean(dim=-1, keepdim=True) + 1e-5) * ln_weight.float()
+    else:
+        z_ref = F.layer_norm(xf, (in_features,), ln_weight.float(), ln_bias.float(), 1e-5)
+    out_ref = F.linear(z_ref.to(dtype).float(), weight.float(), bias.float())
+    if activation == 'gelu_approx':
+        out_ref = F.gelu(out_ref, approximate='tanh')
+    assert x.dtype == x_ref.dtype and torch.allclose(x, x_ref)
+    assert z.dtype == dtype
+    assert torch.allclose(z.float(), z_ref, rtol=rtol, atol=atol)
+    assert out.shape == (batch_size, seqlen, out_features)
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+    # Without return_z / prenorm we only get the output
+    out_only = dropout_add_ln_linear_func(
+        x0, residual, ln_weight, ln_bias, weight, bias, 0.0, 1e-5, activation=activation,
+        residual_in_fp32=residual_in_fp32, is_rms_norm=is_rms_norm
+    )
+    assert torch.equal(out_only, out)
+
+
+@pytest.mark.parametrize('dropout_p', [0.37])
+def test_dropout_add_ln_linear_dropout(dropout_p):
+    torch.random.manual_seed(0)
+    in_features, out_features = 128, 64
+    x0 = torch.randn(512, in_features)
+    residual = torch.randn(512, in_features)
+    ln_weight, ln_bias = torch.randn(in_features), torch.randn(in_features)
+    weight, bias = torch.randn(out_features, in_features), torch.randn(out_features)
+    out, x = dropout_add_ln_linear_func(x0, residual, ln_weight, ln_bias, weight, bias, dropout_p,
+                                        1e-5, prenorm=True)
+    dropped = (x - residual).abs() < 1e-6
+    assert abs(dropped.float().mean().item() - dropout_p) < 0.02
+    x0_scaled = torch.where(dropped, torch.zeros_like(x0), x0 / (1 - dropout_p))
+    assert torch.allclose(x, x0_scaled + residual, atol=1e-5)
+    z_ref = F.layer_norm(x, (in_features,), ln_weight, ln_bias, 1e-5)
+    assert torch.allclose(out, F.linear(z_ref, weight, bias), rtol=1e-4, atol=1e-3)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('has_bias', [True, False])
+@pytest.mark.parametrize('num_indices', [1, 4, 33])
+def test_fused_dense_gather(num_indices, has_bias, dtype):
+    device = 'cpu'
+    rtol, atol = (3e-3, 3e-2) if dtype != torch.float32 else (1e-4, 1e-4)
+    torch.random.manual_seed(0)
+    num_rows, in_features, out_features = 100, 256, 1000
+    x = torch.randn(num_rows, in_features, device=device, dtype=dtype)
+    weight = torch.randn(out_features, in_features, device=device, dtype=dtype) / math.sqrt(in_features)
+    bias = torch.randn(out_features, device=device, dtype=dtype) if has_bias else None
+    indices = torch.randint(0, num_rows, (num_indices,), device=device)
+    out = fused_dense_gather_func(x, indices, weight, bias)
+    out_ref = F.linear(x[indices].float(), weight.float(), bias.float() if has_bias else None)
+    assert out.shape == (num_indices, out_features)
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('pos_embed_mode', ['all', 'patches_only', 'none'])
+@pytest.mark.parametrize('has_cls_token', [True, False])
+@pytest.mark.parametrize('patch_size', [(16, 16), (8, 12)])
+def test_fused_patch_embed(patch_size, has_cls_token, pos_embed_mode, dtype):
+    device = 'cpu'
+    rtol, atol = (3e-3, 3e-2) if dtype != torch.float32 else (1e-4, 1e-4)
+    torch.random.manual_seed(0)
+    batch_size, channels, height, width, embed_dim = 3, 3, 48, 96, 128
+    num_patches = (height // patch_size[0]) * (width // patch_size[1])
+    in_features = channels * patch_size[0] * patch_size[1]
+    x = torch.randn(batch_size, channels, height, width, device=device, dtype=dtype)
+    weight = torch.randn(embed_dim, in_features, device=device, dtype=dtype) / math.sqrt(in_features)
+    bias = torch.randn(embed_dim, device=device, dtype=dtype)
+    cls_token = torch.randn(1, 1, embed_dim, device=device, dtype=dtype) if has_cls_token else None
+    pos_len = num_patches + (1 if has_cls_token and pos_embed_mode == 'all' else 0)
+    pos_embed = (torch.randn(1, pos_len, embed_dim, device=device, dtype=dtype)
+                 if pos_embed_mode != 'none' else None)
+    out = fused_patch_embed_func(x, weight, bias, patch_size, pos_embed, cls_token)
+    # Reference: Conv2d patchify + flatten, then VisionTransformer._pos_embed, in fp32
+    out_ref = F.conv2d(x.float(), weight.float().reshape(embed_dim, channels, *patch_size),
+                       bias.float(), stride=patch_size)
+    out_ref = rearrange(out_ref, 'b d h w -> b (h w) d')
+    if pos_embed_mode == 'patches_only':
+        out_ref = out_ref + pos_embed.float()
+    if has_cls_token:
+        out_ref = torch.cat([cls_token.float().expand(batch_size, -1, -1), out_ref], dim=1)
+    if pos_embed_mode == 'all':
+        out_ref = out_ref + pos_embed.float()
+    assert out.shape == (batch_size, (1 if has_cls_token else 0) + num_patches, embed_dim)
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
@@ -0,0 +1,79 @@
+import torch
+import torch.nn.functional as F
+import pytest
+
+from flash_attn.ops.fused_embedding import fused_embedding_func
+
+
+def embedding_ref(input_ids, weight, position_ids, position_weight, vocab_start_index,
+                  position_col_offset, padding_idx):
+    """The unfused VocabParallelEmbedding + ColumnParallelEmbedding lookups, in fp32."""
+    mask = (input_ids < vocab_start_index) | (input_ids >= vocab_start_index + weight.shape[0])
+    ids = (input_ids - vocab_start_index).masked_fill(mask, 0)
+    out = F.embedding(ids, weight.float(), padding_idx=padding_idx).masked_fill(mask[..., None], 0.0)
+    if position_weight is not None:
+        pos = F.embedding(position_ids, position_weight.float())
+        out = torch.cat([out[..., :position_col_offset],
+                         out[..., position_col_offset:position_col_offset + pos.shape[-1]] + pos,
+                         out[..., position_col_offset + pos.shape[-1]:]], dim=-1)
+    return out
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('dropout_p', [0.0, 0.17])
+@pytest.mark.parametrize('vocab_parallel', [False, True])
+@pytest.mark.parametrize('has_pos', [False, True])
+def test_fused_embedding(has_pos, vocab_parallel, dropout_p, dtype):
+    rtol, atol = (1e-5, 1e-5) if dtype == torch.float32 else (1e-2, 2e-2)
+    torch.random.manual_seed(0)
+    batch_size, seqlen, vocab_size, embed_dim, max_positions = 4, 200, 1000, 64, 256
+    # A shard of the vocabulary, and of the embedding dim for the position embeddings
+    num_embeddings = vocab_size // 4 if vocab_parallel else vocab_size
+    vocab_start_index = 2 * num_embeddings if vocab_parallel else 0
+    position_dim, position_col_offset = (embed_dim // 4, embed_dim // 2) if vocab_parallel else (embed_dim, 0)
+    padding_idx = None if vocab_parallel else 3
+    # Skewed ids, so that some rows are looked up by many tokens
+    input_ids = (torch.rand(batch_size, seqlen) ** 3 * vocab_size).long()
+    input_ids[0, :10] = 3
+    position_ids = torch.arange(seqlen) if has_pos else None
+    weight = torch.randn(num_embeddings, embed_dim, dtype=dtype, requires_grad=True)
+    position_weight = (torch.randn(max_positions, position_dim, dtype=dtype, requires_grad=True)
+                       if has_pos else None)
+    weight_ref = weight.detach().clone().requires_grad_()
+    position_weight_ref = (position_weight.detach().clone().requires_grad_()
+                           if has_pos else None)
+
+    out = fused_embedding_func(input_ids, weight, position_ids, position_weight,
+                               vocab_start_index=vocab_start_index,
+                               mask_out_of_range=vocab_parallel,
+                               position_col_offset=position_col_offset, padding_idx=padding_idx,
+                               dropout_p=dropout_p)
+    out_ref = embedding_ref(input_ids, weight_ref, position_ids, position_weight_ref,
+                            vocab_start_index, position_col_offset, padding_idx)
+    assert out.shape == (batch_size, seqlen, embed_dim) and out.dtype == dtype
+    if dropout_p > 0.0:
+        # Recover the mask: kept elements are scaled by 1 / (1 - p)
+        keep = out != 0
+        nonzero = out_ref != 0
+        assert abs(keep[nonzero].float().mean().item() - (1 - dropout_p)) < 0.02
+        out_ref = out_ref * keep / (1 - dropout_p)
+    assert torch.allclose(out.float(), out_ref, rtol=rtol, atol=atol)
+
+    g = torch.randn_like(out)
+    out.backward(g)
+    out_ref.backward(g.float())
+    assert torch.allclose(weight.grad.float(), weight_ref.grad.float(), rtol=rtol,
+                          atol=atol * 10)
+    if has_pos:
+        assert torch.allclose(position_weight.grad.float(), position_weight_ref.grad.float(),
+                              rtol=rtol, atol=atol * 10)
+
+
+def test_fused_embedding_dropout_deterministic():
+    input_ids = torch.randint(0, 100, (2, 50))
+    weight = torch.randn(100, 32)
+    torch.random.manual_seed(1)
+    out0 = fused_embedding_func(input_ids, weight, dropout_p=0.5)
+    torch.random.manual_seed(1)
+    out1 = fused_embedding_func(input_ids, weight, dropout_p=0.5)
+    assert torch.equal(out0, out1)
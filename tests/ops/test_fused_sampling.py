@@ -0,0 +1,52 @@
+import torch
+import pytest
+
+from flash_attn.utils.generation import modify_logits_for_top_p_filtering
+
+import fused_sampling
+
+
+def sampling_probs_ref(logits, top_k, top_p, temperature):
+    """The distribution that flash_attn.utils.generation.sample draws from, (batch_size, vocab_size).
+    """
+    logits = logits.float() / temperature
+    if top_k > 0:
+        kth_largest = torch.topk(logits, min(top_k, logits.shape[-1]), dim=-1).values[:, -1:]
+        logits = logits.masked_fill(logits < kth_largest, float('-inf'))
+    modify_logits_for_top_p_filtering(logits, top_p)
+    return torch.softmax(logits, dim=-1)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+def test_fused_sampling_greedy(dtype):
+    torch.random.manual_seed(0)
+    logits = torch.randn(16, 5000, dtype=dtype)
+    assert torch.equal(fused_sampling.sample(logits, top_k=1), logits.argmax(dim=-1))
+    assert torch.equal(fused_sampling.sample(logits, top_k=0, temperature=0.0),
+                       logits.argmax(dim=-1))
+
+
+@pytest.mark.parametrize('top_k,top_p,temperature', [
+    (0, 0.0, 1.0), (20, 0.0, 1.0), (0, 0.8, 1.0), (50, 0.5, 0.7), (0, 0.3, 2.0), (5, 1.0, 1.0)
+])
+def test_fused_sampling_distribution(top_k, top_p, temperature):
+    torch.random.manual_seed(0)
+    num_samples, vocab_size = 50000, 300
+    logits = torch.randn(1, vocab_size) * 2
+    probs_ref = sampling_probs_ref(logits, top_k, top_p, temperature)[0]
+    # The same row many times: each row draws from its own Philox subsequence
+    samples = fused_sampling.sample(logits.expand(num_samples, vocab_size), top_k, top_p,
+                                    temperature, seed=1234)
+    freqs = torch.bincount(samples, minlength=vocab_size).float() / num_samples
+    # Only the candidates are ever drawn
+    assert torch.all(freqs[probs_ref == 0] == 0)
+    assert (freqs - probs_ref).abs().sum() / 2 < 0.03
+
+
+def test_fused_sampling_seed():
+    torch.random.manual_seed(0)
+    logits = torch.randn(64, 1000)
+    out = fused_sampling.sample(logits, 0, 0.9, 1.0, seed=7, offset=3)
+    assert torch.equal(fused_sampling.sample(logits, 0, 0.9, 1.0, seed=7, offset=3), out)
+    assert not torch.equal(fused_sampling.sample(logits, 0, 0.9, 1.0, seed=7, offset=4), out)
+    assert not torch.equal(fused_sampling.sample(logits, 0, 0.9, 1.0, seed=8, offset=3), out)
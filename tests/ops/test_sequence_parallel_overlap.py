@@ -0,0 +1,87 @@
+# Run test with:
+# torchrun --no_python --nproc_per_node=4 pytest -q -s tests/ops/test_sequence_parallel_overlap.py
+
+import torch
+import pytest
+
+from flash_attn.ops.fused_dense import ColumnParallelLinear, RowParallelLinear
+
+
+def _init():
+    if not torch.distributed.is_initialized():
+        torch.distributed.init_process_group(backend='gloo', init_method='env://')
+    return torch.distributed.group.WORLD
+
+
+@pytest.mark.parametrize('num_chunks', [1, 3, 4])
+@pytest.mark.parametrize('has_bias', [True, False])
+@pytest.mark.parametrize('out_features', [64])
+@pytest.mark.parametrize('in_features', [96])
+def test_column_parallel_overlap(in_features, out_features, has_bias, num_chunks):
+    group = _init()
+    world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+    # Same seed on all ranks: every rank builds the same full (non-parallel) reference
+    torch.random.manual_seed(0)
+    batch_size, seqlen = 2, 8 * world_size
+    x_pt = torch.randn(batch_size * seqlen, in_features, requires_grad=True)
+    model_pt = torch.nn.Linear(in_features, out_features, bias=has_bias)
+    partition_num_tokens = batch_size * seqlen // world_size
+    partition_out_features = out_features // world_size
+    tokens = slice(rank * partition_num_tokens, (rank + 1) * partition_num_tokens)
+    features = slice(rank * partition_out_features, (rank + 1) * partition_out_features)
+    x = x_pt[tokens].detach().clone().requires_grad_()
+    model = ColumnParallelLinear(in_features, out_features, group, bias=has_bias,
+                                 sequence_parallel=True, num_chunks=num_chunks)
+    with torch.no_grad():
+        model.weight.copy_(model_pt.weight[features])
+        if has_bias:
+            model.bias.copy_(model_pt.bias[features])
+
+    out = model(x)
+    out_pt = model_pt(x_pt)
+    assert torch.allclose(out, out_pt[:, features], rtol=1e-5, atol=1e-5)
+
+    g = torch.randn_like(out_pt)
+    out_pt.backward(g)
+    out.backward(g[:, features])
+    assert torch.allclose(x.grad, x_pt.grad[tokens], rtol=1e-5, atol=1e-5)
+    assert torch.allclose(model.weight.grad, model_pt.weight.grad[features], rtol=1e-5, atol=1e-5)
+    if has_bias:
+        assert torch.allclose(model.bias.grad, model_pt.bias.grad[features], rtol=1e-5, atol=1e-5)
+
+
+@pytest.mark.parametrize('num_chunks', [1, 3, 4])
+@pytest.mark.parametrize('has_bias', [True, False])
+@pytest.mark.parametrize('out_features', [64])
+@pytest.mark.parametrize('in_features', [96])
+def test_row_parallel_overlap(in_features, out_features, has_bias, num_chunks):
+    group = _init()
+    world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+    torch.random.manual_seed(0)
+    batch_size, seqlen = 2, 8 * world_size
+    x_pt = torch.randn(batch_size * seqlen, in_features * world_size, requires_grad=True)
+    model_pt = torch.nn.Linear(in_features * world_size, out_features, bias=has_bias)
+    partition_num_tokens = batch_size * seqlen // world_size
+    tokens = slice(rank * partition_num_tokens, (rank + 1) * partition_num_tokens)
+    features = slice(rank * in_features, (rank + 1) * in_features)
+    x = x_pt[:, features].detach().clone().requires_grad_()
+    model = RowParallelLinear(in_features * world_size, out_features, group, bias=has_bias,
+                              sequence_parallel=True, num_chunks=num_chunks)
+    with torch.no_grad():
+        model.weight.copy_(model_pt.weight[:, features])
+        if has_bias and rank == 0:
+            model.bias.copy_(model_pt.bias)
+
+    out = model(x)
+    out_pt = model_pt(x_pt)
+    assert torch.allclose(out, out_pt[tokens], rtol=1e-5, atol=1e-5)
+
+    g = torch.randn_like(out_pt)
+    out_pt.backward(g)
+    out.backward(g[tokens])
+    assert torch.allclose(x.grad, x_pt.grad[:, features], rtol=1e-5, atol=1e-5)
+    assert torch.allclose(model.weight.grad, model_pt.weight.grad[:, features],
+                          rtol=1e-5, atol=1e-5)
+    if has_bias and rank == 0:
+        # The bias gradient is the sum over the tokens of all ranks
+        assert torch.allclose(model.bias.grad, model_pt.bias.grad, rtol=1e-5, atol=1e-5)
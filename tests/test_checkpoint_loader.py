@@ -0,0 +1,77 @@
+import torch
+import pytest
+
+from transformers import GPT2Config
+from transformers.models.gpt2.modeling_gpt2 import GPT2LMHeadModel as GPT2LMHeadModelHF
+
+from flash_attn.models.gpt import GPTLMHeadModel, remap_state_dict_hf_gpt2, shard_state_dict_tp
+from flash_attn.utils.pretrained import LazyTensor, mmap_state_dict, save_safetensors
+from flash_attn.utils.pretrained import load_lazy_state_dict
+
+
+@pytest.mark.parametrize('out_dtype', [None, torch.float32, torch.float16, torch.bfloat16])
+def test_mmap_state_dict(tmp_path, out_dtype):
+    torch.manual_seed(0)
+    state_dict = {
+        'a': torch.randn(37, 64),
+        'b': torch.randn(5, 3, 7, dtype=torch.float16),
+        'c': torch.randn(129, dtype=torch.bfloat16),
+        'd': torch.arange(11),
+        'e': torch.randn(0, 4),
+    }
+    path = tmp_path / 'model.safetensors'
+    save_safetensors(state_dict, path)
+    lazy = mmap_state_dict(path)
+    assert set(lazy.keys()) == set(state_dict.keys())
+    for name, t in state_dict.items():
+        assert isinstance(lazy[name], LazyTensor) and lazy[name].shape == t.shape
+        dtype = out_dtype if t.is_floating_point() else None
+        out = lazy[name].materialize(dtype=dtype)
+        assert torch.equal(out, t.to(dtype=dtype) if dtype is not None else t)
+    # Views: transpose, slices, reshape that needs a copy, zero padding of the first dimension
+    a, a_lazy = state_dict['a'], lazy['a']
+    assert torch.equal(a_lazy.t()[3:9, ::2].materialize(), a.t()[3:9, ::2])
+    assert torch.equal(a_lazy.t()[..., 5].materialize(), a.t()[..., 5])
+    assert torch.equal(a_lazy.t().reshape(-1).materialize(), a.t().reshape(-1))
+    padded = torch.nn.functional.pad(a_lazy, (0, 0, 0, 11))
+    assert padded.shape == (48, 64)
+    assert torch.equal(padded[24:48].materialize(), torch.nn.functional.pad(a, (0, 0, 0, 11))[24:48])
+
+
+@pytest.mark.parametrize('world_size', [1, 2, 4])
+def test_gpt2_lazy_remap_shard(tmp_path, world_size):
+    """Remapping and sharding the LazyTensors gives the same tensors as on the loaded state dict."""
+    config = GPT2Config(n_embd=128, n_head=4, n_layer=2, vocab_size=1001)
+    config.pad_vocab_size_multiple = 8
+    torch.manual_seed(0)
+    state_dict_hf = GPT2LMHeadModelHF(config).transformer.state_dict()
+    path = tmp_path / 'model.safetensors'
+    save_safetensors(state_dict_hf, path)
+    for rank in range(world_size):
+        state_dict = remap_state_dict_hf_gpt2(dict(state_dict_hf), config)
+        lazy = remap_state_dict_hf_gpt2(mmap_state_dict(path), config)
+        if world_size > 1:
+            state_dict = shard_state_dict_tp(state_dict, config, world_size, rank)
+            lazy = shard_state_dict_tp(lazy, config, world_size, rank)
+        assert set(lazy.keys()) == set(state_dict.keys())
+        for name, t in state_dict.items():
+            assert lazy[name].shape == t.shape, name
+            assert torch.equal(lazy[name].materialize(), t), name
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+def test_load_lazy_state_dict(tmp_path, dtype):
+    config = GPT2Config(n_embd=128, n_head=4, n_layer=2, vocab_size=1000)
+    torch.manual_seed(0)
+    state_dict_hf = GPT2LMHeadModelHF(config).transformer.state_dict()
+    path = tmp_path / 'model.safetensors'
+    save_safetensors(state_dict_hf, path)
+    model_ref = GPTLMHeadModel(config, dtype=dtype)
+    model_ref.load_state_dict(remap_state_dict_hf_gpt2(
+        {k: v.to(dtype) for k, v in state_dict_hf.items()}, config
+    ))
+    model = GPTLMHeadModel(config, dtype=dtype)
+    load_lazy_state_dict(model, remap_state_dict_hf_gpt2(mmap_state_dict(path), config))
+    for (name, p), p_ref in zip(model.state_dict().items(), model_ref.state_dict().values()):
+        assert p.dtype == dtype
+        assert torch.equal(p, p_ref), name
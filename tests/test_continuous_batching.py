@@ -0,0 +1,103 @@
+import math
+
+import torch
+import pytest
+
+continuous_batching = pytest.importorskip('continuous_batching')
+ft_attention = pytest.importorskip('ft_attention')
+
+
+def make_requests(num_requests, max_prompt_len, max_new_tokens, seed=0):
+    g = torch.Generator().manual_seed(seed)
+    prompt_lens = torch.randint(1, max_prompt_len + 1, (num_requests,), generator=g).tolist()
+    new_tokens = torch.randint(1, max_new_tokens + 1, (num_requests,), generator=g).tolist()
+    return list(zip(range(num_requests), prompt_lens, new_tokens))
+
+
+@pytest.mark.parametrize('max_tokens_per_step', [8, 64])
+def test_scheduler(max_tokens_per_step):
+    num_slots, max_seqlen, max_prefill_chunk = 4, 128, 16
+    scheduler = continuous_batching.Scheduler(num_slots, max_seqlen, max_tokens_per_step,
+                                              max_prefill_chunk)
+    requests = make_requests(20, 60, 30)
+    eos_request = 5  # Ends at its first decode token, before max_new_tokens
+    for id, prompt_len, max_new_tokens in requests:
+        scheduler.add_request(id, prompt_len, max_new_tokens)
+    num_computed = {}
+    slot_owner = {}
+
+    def model_step(batch):
+        assert 0 < batch.total_tokens <= max_tokens_per_step
+        assert batch.cu_seqlens[-1].item() == batch.total_tokens
+        for id, slot, cache_seqlen, num_tokens in zip(batch.request_ids, batch.slots.tolist(),
+                                                      batch.cache_seqlens.tolist(),
+                                                      batch.num_tokens.tolist()):
+            assert slot_owner.setdefault(slot, id) == id
+            assert cache_seqlen == num_computed.get(id, 0)
+            assert num_tokens <= max_prefill_chunk
+            num_computed[id] = cache_seqlen + num_tokens
+        return [id == eos_request and num_computed[id] > requests[id][1]
+                for id in batch.request_ids]
+
+    finished = []
+    while scheduler.has_work():
+        for r in scheduler.step(model_step):
+            del slot_owner[r['slot']]
+            finished.append(r)
+    assert sorted(r['id'] for r in finished) == list(range(len(requests)))
+    for r in finished:
+        id, prompt_len, max_new_tokens = requests[r['id']]
+        assert r['num_generated'] == (min(2, max_new_tokens) if id == eos_request else max_new_tokens)
+        assert r['arrival_time'] <= r['admit_time'] <= r['first_token_time'] <= r['finish_time']
+    metrics = scheduler.metrics()
+    assert metrics.num_finished == len(requests) and metrics.num_queued == 0
+    assert metrics.num_generated_tokens == sum(r['num_generated'] for r in finished)
+    assert 0 < metrics.budget_utilization <= 1
+    assert metrics.p99_latency >= metrics.mean_latency > 0
+
+
+def test_scheduler_attention():
+    """A synthetic one-layer model on the KV cache slots: each request gets the same outputs as when
+    it runs alone, whatever the requests it's batched with."""
+    num_slots, max_seqlen, nheads, headdim = 3, 64, 2, 32
+    scheduler = continuous_batching.Scheduler(num_slots, max_seqlen, max_tokens_per_step=12,
+                                              max_prefill_chunk=5)
+    requests = make_requests(8, 20, 10, seed=1)
+    for id, prompt_len, max_new_tokens in requests:
+        scheduler.add_request(id, prompt_len, max_new_tokens)
+    k_cache = torch.zeros(num_slots, nheads, headdim // 4, max_seqlen, 4)
+    v_cache = torch.zeros(num_slots, nheads, max_seqlen, headdim)
+
+    def qkv(id, positions):
+        # The q, k, v of token `position` of request `id`
+        g = torch.Generator().manual_seed(id)
+        return torch.randn(max_seqlen, 3, nheads, headdim, generator=g)[positions].unbind(dim=1)
+
+    outputs = {}
+
+    def model_step(batch):
+        positions = torch.cat([torch.arange(l, l + n) for l, n in
+                               zip(batch.cache_seqlens.tolist(), batch.num_tokens.tolist())])
+        entry = torch.repeat_interleave(torch.arange(len(batch.request_ids)), batch.num_tokens)
+        q, k, v = [torch.cat(t) for t in zip(*[qkv(batch.request_ids[e], p) for e, p in
+                                               zip(entry.tolist(), positions.split(1))])]
+        out = ft_attention.varlen_attention_with_kv_cache(
+            q, k, v, k_cache, v_cache, batch.cu_seqlens, batch.cache_seqlens,
+            batch.slots.unsqueeze(1)
+        )
+        last = batch.cu_seqlens[1:] - 1
+        for e, id in enumerate(batch.request_ids):
+            if batch.samples[e]:
+                outputs.setdefault(id, []).append(out[last[e]])
+        return [False] * len(batch.request_ids)
+
+    while scheduler.has_work():
+        scheduler.step(model_step)
+    for id, prompt_len, max_new_tokens in requests:
+        seqlen = prompt_len + max_new_tokens - 1
+        q, k, v = qkv(id, torch.arange(seqlen))
+        scores = torch.einsum('shd,thd->hst', q, k) / math.sqrt(headdim)
+        scores.masked_fill_(~torch.ones(seqlen, seqlen, dtype=torch.bool).tril(), float('-inf'))
+        out_ref = torch.einsum('hst,thd->shd', torch.softmax(scores, dim=-1), v)
+        assert torch.allclose(torch.stack(outputs[id]), out_ref[prompt_len - 1:], rtol=1e-4,
+                              atol=1e-4)
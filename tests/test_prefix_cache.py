@@ -0,0 +1,89 @@
+import math
+
+import torch
+import pytest
+
+from einops import rearrange
+
+from flash_attn.utils.prefix_cache import PrefixCache, allocate_paged_kv_cache
+
+
+def test_prefix_cache_sharing():
+    page_size = 4
+    cache = PrefixCache(num_pages=16, page_size=page_size)
+    system_prompt = list(range(100, 110))  # 2 full pages + 2 tokens
+    pages0, num_cached0 = cache.acquire(system_prompt + [1, 2, 3])
+    assert num_cached0 == 0 and len(pages0) == 4
+    cache.insert(system_prompt + [1, 2, 3], pages0)
+    pages1, num_cached1 = cache.acquire(system_prompt + [4, 5])
+    # The 2 full pages of the system prompt are shared, the rest isn't
+    assert num_cached1 == 8 and pages1[:2] == pages0[:2] and pages1[2] not in pages0
+    assert cache.metrics()['shared_pages_saved'] == 2
+    cache.extend(pages1, 13)
+    assert len(pages1) == 4
+    cache.release(pages0)
+    cache.release(pages1)
+    metrics = cache.metrics()
+    assert metrics['hit_rate'] == 8 / 25
+    # The 3 full pages of the first prompt stay cached after the requests are done
+    assert metrics['cached_pages'] == 3 and metrics['free_pages'] == 13
+    # A prompt made of cached pages only still leaves its last token to compute
+    pages2, num_cached2 = cache.acquire(system_prompt[:8])
+    assert num_cached2 == 4 and pages2[0] == pages0[0]
+    cache.release(pages2)
+
+
+def test_prefix_cache_lru_eviction():
+    page_size = 2
+    cache = PrefixCache(num_pages=7, page_size=page_size)
+    prompts = [[i] * 5 for i in range(3)]  # 2 full pages + 1 token each
+    for prompt in prompts:
+        pages, _ = cache.acquire(prompt)
+        cache.insert(prompt, pages)
+        cache.release(pages)
+    assert cache.metrics()['cached_pages'] == 6
+    # Make prompt 0 the most recently used, then allocate 4 pages: prompts 1 and 2 are evicted
+    pages, num_cached = cache.acquire(prompts[0])
+    assert num_cached == 4
+    cache.release(pages)
+    pages, _ = cache.acquire([7] * 8)
+    assert cache.metrics()['evicted_pages'] == 4
+    assert cache.acquire(prompts[0])[1] == 4
+    # Pages held by a request are never evicted
+    with pytest.raises(RuntimeError):
+        cache.acquire([8] * 8)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+def test_prefix_cache_attention(dtype):
+    """Requests sharing the pages of a common prefix get the same attention output as requests
+    with their own contiguous cache."""
+    ft_attention = pytest.importorskip('ft_attention')
+    device = 'cpu'
+    rtol, atol = (1e-3, 1e-3) if dtype == torch.float16 else (1e-4, 1e-4)
+    # set seed
+    torch.random.manual_seed(0)
+    nheads, headdim, page_size, vocab_size = 2, 32, 8, 16
+    # One layer whose K/V of a token only depend on the token id, and the query on the position
+    kv_table = torch.randn(vocab_size, 2, nheads, headdim, device=device, dtype=dtype)
+    cache = PrefixCache(num_pages=32, page_size=page_size)
+    k_cache, v_cache = allocate_paged_kv_cache(32, page_size, nheads, headdim, 1, device, dtype)[0]
+    system_prompt = torch.randint(0, vocab_size, (21,)).tolist()
+    prompts = [system_prompt + torch.randint(0, vocab_size, (n,)).tolist() for n in [5, 12, 1]]
+    for prompt in prompts:
+        pages, num_cached = cache.acquire(prompt)
+        new_tokens = torch.tensor(prompt[num_cached:])
+        q = torch.randn(len(new_tokens), nheads, headdim, device=device, dtype=dtype)
+        k, v = kv_table[new_tokens].unbind(dim=1)
+        out = ft_attention.varlen_attention_with_kv_cache(
+            q, k, v, k_cache, v_cache, torch.tensor([0, len(new_tokens)], dtype=torch.int32),
+            torch.tensor([num_cached], dtype=torch.int32), cache.block_table([pages])
+        )
+        cache.insert(prompt, pages)
+        k_all, v_all = kv_table[torch.tensor(prompt)].unbind(dim=1)
+        scores = torch.einsum('shd,thd->hst', q.float(), k_all.float()) / math.sqrt(headdim)
+        mask = torch.ones(len(new_tokens), len(prompt), dtype=torch.bool).tril(num_cached)
+        scores.masked_fill_(~mask, float('-inf'))
+        out_ref = torch.einsum('hst,thd->shd', torch.softmax(scores, dim=-1), v_all.float())
+        assert torch.allclose(out, out_ref.to(dtype), rtol=rtol, atol=atol)
+    assert cache.metrics()['cached_tokens'] == 2 * 16
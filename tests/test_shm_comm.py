@@ -0,0 +1,75 @@
+# Run test with:
+# torchrun --no_python --nproc_per_node=4 pytest -q -s tests/test_shm_comm.py
+
+import uuid
+
+import torch
+import pytest
+
+from flash_attn.utils.distributed import all_gather_raw, reduce_scatter_raw, all_reduce_raw
+from flash_attn.utils.distributed import init_shm_backend, _shm_communicators
+
+
+def _init():
+    if not torch.distributed.is_initialized():
+        torch.distributed.init_process_group(backend='gloo', init_method='env://')
+    group = torch.distributed.group.WORLD
+    if group not in _shm_communicators:
+        # Small buffer so that the collectives run in several chunks
+        init_shm_backend(group, buffer_bytes=4096)
+    return group
+
+
+@pytest.mark.parametrize('async_op', [False, True])
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('numel_per_rank', [1, 1000, 10000])
+def test_shm_collectives(numel_per_rank, dtype, async_op):
+    group = _init()
+    world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+    torch.random.manual_seed(rank)
+    x = torch.randn(world_size * numel_per_rank, 3, dtype=dtype)
+
+    def wait(out, handle):
+        if async_op:
+            handle.wait()
+        return out
+
+    out = wait(*all_gather_raw(x, group, async_op=async_op))
+    # Reference: the gloo collectives on the same group
+    out_ref = [torch.empty_like(x) for _ in range(world_size)]
+    torch.distributed.all_gather(out_ref, x, group=group)
+    assert torch.equal(out, torch.cat(out_ref))
+
+    rtol, atol = (1e-5, 1e-5) if dtype == torch.float32 else (1e-2, 3e-2)
+    out = wait(*reduce_scatter_raw(x, group, async_op=async_op))
+    sum_ref = x.float().clone()
+    torch.distributed.all_reduce(sum_ref, group=group)
+    assert torch.allclose(out.float(), sum_ref.chunk(world_size)[rank], rtol=rtol, atol=atol)
+
+    out = wait(*all_reduce_raw(x.clone(), group, async_op=async_op))
+    assert torch.allclose(out.float(), sum_ref, rtol=rtol, atol=atol)
+    # The result is bitwise identical on all ranks
+    out_all = [torch.empty_like(out) for _ in range(world_size)]
+    torch.distributed.all_gather(out_all, out, group=group)
+    assert all(torch.equal(o, out) for o in out_all)
+
+
+def test_shm_async_ordering():
+    """Several collectives in flight complete in order."""
+    group = _init()
+    world_size = torch.distributed.get_world_size()
+    xs = [torch.full((1000,), float(i)) for i in range(5)]
+    results = [all_reduce_raw(x, group, async_op=True) for x in xs]
+    for i, (out, handle) in enumerate(results):
+        handle.wait()
+        assert torch.equal(out, torch.full((1000,), float(i * world_size)))
+
+
+def test_shm_reduce_scatter_small_buffer():
+    """A buffer too small to hold one element per rank is rejected instead of looping forever."""
+    shm_comm = pytest.importorskip('shm_comm')
+    comm = shm_comm.ShmCommunicator(f'/flash_attn_shm_test_{uuid.uuid4().hex}', rank=0,
+                                    world_size=32, buffer_bytes=64)
+    comm.unlink()
+    with pytest.raises(RuntimeError, match='buffer_bytes'):
+        comm.reduce_scatter(torch.randn(32 * 4), torch.empty(4))
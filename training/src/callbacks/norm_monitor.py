@@ -13,6 +13,8 @@ from pytorch_lightning.strategies import DeepSpeedStrategy
 import torch
 import torch.nn as nn
 
+from src.utils.multi_tensor import global_norm
+
 try:
     from apex.contrib.layer_norm import FastLayerNorm
 except ImportError:
@@ -70,8 +72,11 @@ class NormMonitor(Callback):
                 stats[f'stats/{param_name}_grad_mean'] = param_grad_abs_mean
                 grad_l1_norm.append(param_grad_abs_mean * param.grad.numel())
         stats['total_param_l1_norm'] = torch.stack(param_l1_norm).sum()
+        stats['total_param_l2_norm'] = global_norm(named_parameters.values())[0]
         if grad_l1_norm:
             stats['total_grad_l1_norm'] = torch.stack(grad_l1_norm).sum()
+            grads = [p.grad for p in named_parameters.values() if p.grad is not None]
+            stats['total_grad_l2_norm'] = global_norm(grads)[0] / loss_scale
         # Sort by params name
         stats = OrderedDict(sorted(stats.items()))
         if trainer.loggers is not None:
@@ -1,11 +1,14 @@
 # Inspired by https://github.com/NVIDIA/Megatron-LM/blob/main/tasks/zeroshot_gpt/datasets.py
 # Except we don't pad the last block and don't use overlapping eval
 # And we return both the input and the target
+import itertools
 import math
 import numpy as np
 
 import torch
 
+from src.datamodules.datasets.token_corpus import TokenCorpus, token_dataset
+
 
 class LMDataset(torch.utils.data.Dataset):
 
@@ -30,3 +33,74 @@ class LMDataset(torch.utils.data.Dataset):
         seq_len = min(self.seq_len, self.ntokens - 1 - start_idx)
         data = torch.as_tensor(self.tokens[start_idx:(start_idx + seq_len + 1)].astype(np.int64))
         return data[:-1], data[1:].clone()
+
+
+class LMBatchLoader:
+    """Iterates over the batches of LMDataset(tokens, seq_len) (with drop_last=True), like a
+    DataLoader, but the sequences are read from the token file by the native token_dataset
+    extension: prefetch batches are assembled ahead of time by num_threads background threads,
+    while the pages they need are being read ahead by the kernel.
+    tokens should be a np.memmap (e.g. np.load(..., mmap_mode='r')) of uint16, int32 or uint32, or
+    a TokenCorpus.
+    The sampler yields sequence indices, as for LMDataset (with drop_last=True: the loader only
+    has full sequences). LMBatchLoader isn't a DataLoader, so Lightning doesn't call set_epoch on
+    its sampler: it does it itself, with an epoch counter that starts at the sampler's epoch and
+    advances at every iteration (or is set with set_epoch), so that each epoch is shuffled
+    differently.
+    """
+
+    def __init__(self, tokens, seq_len, batch_size, sampler=None, drop_last=False, num_threads=4,
+                 prefetch=4):
+        assert token_dataset is not None, 'token_dataset is not installed'
+        self.seq_len = seq_len
+        self.batch_size = batch_size
+        self.sampler = sampler
+        self.drop_last = drop_last
+        self.prefetch = max(prefetch, 1)
+        if isinstance(tokens, TokenCorpus):
+            self.loader = token_dataset.TokenLoader(
+                [str(path) for path in tokens.paths], num_tokens=tokens.shard_num_tokens,
+                dtype=tokens.dtype.name, seq_len=seq_len, num_threads=num_threads
+            )
+        else:
+            assert isinstance(tokens, np.memmap) and tokens.filename is not None
+            assert tokens.ndim == 1
+            self.loader = token_dataset.TokenLoader(
+                str(tokens.filename), offset=tokens.offset, num_tokens=len(tokens),
+                dtype=np.dtype(tokens.dtype).name, seq_len=seq_len, num_threads=num_threads
+            )
+        self.total_sequences = self.loader.num_sequences
+        self.epoch = getattr(sampler, 'epoch', 0)
+
+    def set_epoch(self, epoch):
+        """The epoch of the next iteration."""
+        self.epoch = epoch
+
+    def __len__(self):
+        n = len(self.sampler) if self.sampler is not None else self.total_sequences
+        return n // self.batch_size if self.drop_last else math.ceil(n / self.batch_size)
+
+    def _index_batches(self):
+        indices = iter(self.sampler) if self.sampler is not None else iter(range(self.total_sequences))
+        while True:
+            batch = list(itertools.islice(indices, self.batch_size))
+            if len(batch) == 0 or (self.drop_last and len(batch) < self.batch_size):
+                return
+            yield torch.tensor(batch, dtype=torch.long)
+
+    def __iter__(self):
+        # Drop batches left over from an interrupted iteration
+        while self.loader.num_pending > 0:
+            self.loader.next()
+        if hasattr(self.sampler, 'set_epoch'):
+            self.sampler.set_epoch(self.epoch)
+        self.epoch += 1
+        index_batches = self._index_batches()
+        for idx in itertools.islice(index_batches, self.prefetch):
+            self.loader.submit(idx)
+        while self.loader.num_pending > 0:
+            data = self.loader.next()
+            idx = next(index_batches, None)
+            if idx is not None:
+                self.loader.submit(idx)
+            yield data[:, :-1].contiguous(), data[:, 1:].contiguous()
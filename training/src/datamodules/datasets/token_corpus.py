@@ -0,0 +1,115 @@
+# A tokenized corpus stored as shards written by the token_dataset extension (csrc/token_dataset):
+# <prefix>.<shard>.bin holds the packed tokens of the documents of a shard, and <prefix>.<shard>.idx
+# a header and the end offsets of the documents. See csrc/token_dataset/token_writer.h.
+from pathlib import Path
+
+import numpy as np
+
+import torch
+
+try:
+    import token_dataset
+except ImportError:
+    token_dataset = None
+
+
+INDEX_MAGIC = 0x31305844494b4f54  # "TOKIDX01"
+INDEX_HEADER_SIZE = 4
+TOKEN_DTYPES = [np.uint16, np.int32, np.uint32]  # Indexed by the token type of the header
+
+
+def shard_prefix(prefix, shard):
+    return f'{prefix}.{shard:05d}'
+
+
+def write_documents(prefix, shard, documents, dtype, first_document):
+    """Append documents (lists of token ids) to a shard, which is created if needed.
+    first_document is the index of documents[0] in the corpus: documents that were already written
+    (e.g. before the job was interrupted) are skipped. The shard must be resumed with the same
+    documents: resuming with a different sharding (e.g. another number of workers) raises an error
+    rather than writing documents twice.
+    """
+    assert token_dataset is not None, 'token_dataset is not installed'
+    writer = token_dataset.ShardWriter(shard_prefix(prefix, shard), np.dtype(dtype).name,
+                                       first_document)
+    skip = writer.first_document + writer.num_documents - first_document
+    if skip < 0 or first_document < writer.first_document:
+        raise RuntimeError(f'Shard {shard_prefix(prefix, shard)} is missing documents before '
+                           f'{first_document}, it was written with a different sharding')
+    documents = documents[skip:]
+    if len(documents) > 0:
+        doc_lens = np.array([len(doc) for doc in documents], dtype=np.int64)
+        tokens = np.fromiter((t for doc in documents for t in doc), dtype=np.int64,
+                             count=int(doc_lens.sum()))
+        writer.append(torch.from_numpy(tokens), torch.from_numpy(doc_lens))
+    return writer.num_tokens
+
+
+class TokenCorpus:
+    """The concatenation of the shards <prefix>.*.bin, ordered by their first document, read by
+    memory-mapping. Slicing it gives numpy arrays, so that it can be used as the tokens of
+    LMDataset.
+    """
+
+    def __init__(self, prefix):
+        prefix = Path(prefix)
+        shards = []
+        for idx_path in prefix.parent.glob(f'{prefix.name}.*.idx'):
+            header = np.fromfile(idx_path, dtype=np.int64, count=INDEX_HEADER_SIZE)
+            if len(header) < INDEX_HEADER_SIZE or header[0] != INDEX_MAGIC:
+                raise RuntimeError(f'{idx_path} is not a token index')
+            # A partially written offset (interrupted write) is ignored
+            num_documents = (idx_path.stat().st_size - INDEX_HEADER_SIZE * 8) // 8
+            ends = (np.memmap(idx_path, dtype=np.int64, mode='r', offset=INDEX_HEADER_SIZE * 8,
+                              shape=(num_documents,))
+                    if num_documents > 0 else np.zeros(0, dtype=np.int64))
+            shards.append((int(header[3]), idx_path.with_suffix('.bin'), TOKEN_DTYPES[header[2]],
+                           ends))
+        if not shards:
+            raise FileNotFoundError(f'No shard {prefix}.*.idx')
+        shards.sort(key=lambda shard: shard[0])
+        self.dtype = np.dtype(shards[0][2])
+        assert all(np.dtype(shard[2]) == self.dtype for shard in shards)
+        self.paths = [shard[1] for shard in shards]
+        # Only the documents listed in the index are complete
+        self.shard_num_tokens = [int(shard[3][-1]) if len(shard[3]) > 0 else 0 for shard in shards]
+        self.shards = [np.memmap(path, dtype=self.dtype, mode='r', shape=(n,)) if n > 0
+                       else np.zeros(0, dtype=self.dtype)
+                       for path, n in zip(self.paths, self.shard_num_tokens)]
+        self.shard_starts = np.cumsum([0] + self.shard_num_tokens)
+        self._shard_doc_ends = [shard[3] for shard in shards]
+
+    def __len__(self):
+        return int(self.shard_starts[-1])
+
+    @property
+    def num_documents(self):
+        return sum(len(ends) for ends in self._shard_doc_ends)
+
+    def cu_seqlens(self):
+        """The boundaries of the documents: document i is the tokens
+        [cu_seqlens[i], cu_seqlens[i + 1]), as the cu_seqlens of the varlen functions.
+        """
+        return np.concatenate([np.zeros(1, dtype=np.int64)]
+                              + [ends + start for ends, start
+                                 in zip(self._shard_doc_ends, self.shard_starts)])
+
+    def __getitem__(self, idx):
+        if not isinstance(idx, slice):
+            idx = int(idx)
+            if idx < 0:
+                idx += len(self)
+            if not 0 <= idx < len(self):
+                raise IndexError('TokenCorpus index out of range')
+            shard = np.searchsorted(self.shard_starts, idx, side='right') - 1
+            return self.shards[shard][idx - self.shard_starts[shard]]
+        start, stop, step = idx.indices(len(self))
+        assert step == 1, 'TokenCorpus only supports contiguous slices'
+        if stop <= start:
+            return np.zeros(0, dtype=self.dtype)
+        first = np.searchsorted(self.shard_starts, start, side='right') - 1
+        last = np.searchsorted(self.shard_starts, stop, side='left') - 1
+        parts = [self.shards[s][max(start - self.shard_starts[s], 0):
+                                min(stop, self.shard_starts[s + 1]) - self.shard_starts[s]]
+                 for s in range(first, last + 1)]
+        return parts[0] if len(parts) == 1 else np.concatenate(parts)
@@ -1,33 +1,115 @@
 # Adapted from https://github.com/Lightning-AI/lightning/blob/2845e7565dbe6b765ae32870e7d2bc456529c30a/tests/tests_pytorch/utilities/test_auto_restart.py#L1397
+# The shuffling order is a pseudorandom permutation keyed by (seed, epoch), computed chunk by chunk
+# (a Feistel network, see csrc/token_dataset/feistel.h), instead of a torch.randperm of the whole
+# dataset: resuming from any position is O(1), and no list of indices is built.
+import warnings
 from typing import Iterator
-import math
+
+import numpy as np
 
 import torch
 from torch.utils.data import RandomSampler, DistributedSampler
 
+try:
+    import token_dataset
+except ImportError:
+    token_dataset = None
+
+
+CHUNK_SIZE = 1 << 16
+FEISTEL_ROUNDS = 6
+_GOLDEN_GAMMA = 0x9e3779b97f4a7c15
+_MASK64 = (1 << 64) - 1
+
+
+def _mix64(z):
+    """splitmix64 finalizer, on python ints or uint64 arrays."""
+    if isinstance(z, int):
+        z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & _MASK64
+        z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & _MASK64
+        return z ^ (z >> 31)
+    with np.errstate(over='ignore'):
+        z = (z ^ (z >> np.uint64(30))) * np.uint64(0xbf58476d1ce4e5b9)
+        z = (z ^ (z >> np.uint64(27))) * np.uint64(0x94d049bb133111eb)
+    return z ^ (z >> np.uint64(31))
+
+
+def _permutation_ref(positions, n, seed, epoch):
+    """Same as token_dataset.permutation, in numpy."""
+    half_bits = 1
+    while half_bits < 32 and (1 << (2 * half_bits)) < n:
+        half_bits += 1
+    mask = np.uint64((1 << half_bits) - 1)
+    key = _mix64(_mix64(seed & _MASK64) ^ ((epoch + _GOLDEN_GAMMA) & _MASK64))
+    round_keys = [np.uint64(_mix64((key + (r + 1) * _GOLDEN_GAMMA) & _MASK64))
+                  for r in range(FEISTEL_ROUNDS)]
+
+    def encrypt(x):
+        left, right = x >> np.uint64(half_bits), x & mask
+        for round_key in round_keys:
+            left, right = right, left ^ (_mix64(right ^ round_key) & mask)
+        return (left << np.uint64(half_bits)) | right
+
+    x = encrypt(positions.numpy().astype(np.uint64))
+    # Cycle walking, until the elements are in [0, n)
+    outside = np.flatnonzero(x >= np.uint64(n))
+    while len(outside) > 0:
+        x[outside] = encrypt(x[outside])
+        outside = outside[x[outside] >= np.uint64(n)]
+    return torch.from_numpy(x.astype(np.int64))
+
+
+def permutation(positions, n, seed, epoch=0):
+    """The elements at positions (an int64 tensor) of the pseudorandom permutation of [0, n)
+    keyed by (seed, epoch).
+    """
+    if token_dataset is not None:
+        return token_dataset.permutation(positions, n, seed, epoch)
+    return _permutation_ref(positions, n, seed, epoch)
+
+
+def permuted_indices(n, seed, epoch, start, num_samples, shuffle=True, rank=0, num_replicas=1):
+    """Yields the indices at positions [start, num_samples) of the rank's share of the permutation
+    of [0, n): positions rank, rank + num_replicas, ..., wrapping around past n (as the padding of
+    DistributedSampler).
+    """
+    for chunk_start in range(start, num_samples, CHUNK_SIZE):
+        chunk_end = min(chunk_start + CHUNK_SIZE, num_samples)
+        positions = (torch.arange(chunk_start, chunk_end) * num_replicas + rank) % n
+        yield from (permutation(positions, n, seed, epoch) if shuffle else positions).tolist()
+
 
 class RandomFaultTolerantSampler(RandomSampler):
 
-    def __init__(self, *args, generator=None, **kwargs):
-        # generator = torch.Generator().manual_seed(seed)
-        # super().__init__(*args, generator=generator, **kwargs)
+    def __init__(self, *args, generator=None, seed=None, **kwargs):
+        super().__init__(*args, generator=generator, **kwargs)
         # TD [2022-07-17]: We don't force the seed to be zero. We generate random seed,
         # which should be reproducible if pl.seed_everything was called before hand.
         # This means that changing the seed of the experiment will also change the
         # sampling order.
-        if generator is None:
-            seed = int(torch.empty((), dtype=torch.int64).random_().item())
-            generator = torch.Generator().manual_seed(seed)
-        super().__init__(*args, generator=generator, **kwargs)
+        if seed is None:
+            seed = int(torch.empty((), dtype=torch.int64).random_(generator=generator).item())
+        self.seed = seed
+        # The pass in progress (or the next one if counter == 0), each of them in a different order
+        self.epoch = 0
         self.counter = 0
         # self.start_counter = 0
         self.restarting = False
 
     def state_dict(self):
-        return {"random_state": self.state, "counter": self.counter}
+        return {"seed": self.seed, "epoch": self.epoch, "counter": self.counter}
 
     def load_state_dict(self, state_dict):
-        self.generator.set_state(state_dict.get("random_state"))
+        if "random_state" in state_dict:
+            # Saved by the torch.randperm version of this sampler: its order can't be reproduced,
+            # so resuming at its counter would skip some samples and repeat others.
+            warnings.warn("RandomFaultTolerantSampler: the state_dict is from an older version, "
+                          "restarting the epoch from the beginning")
+            self.epoch, self.counter = 0, 0
+            self.restarting = True
+            return
+        self.seed = state_dict.get("seed", self.seed)
+        self.epoch = state_dict.get("epoch", 0)
         self.counter = state_dict["counter"]
         # self.start_counter = self.counter
         self.restarting = True
@@ -43,21 +125,20 @@ class RandomFaultTolerantSampler(RandomSampler):
     def __iter__(self) -> Iterator[int]:
         n = len(self.data_source)
 
-        self.state = self.generator.get_state()
-        indices = torch.randperm(n, generator=self.generator).tolist()
-
-        if not self.restarting:
+        if not self.restarting and self.counter > 0:
+            # The previous pass ended early (e.g. limit_train_batches, or an abandoned iterator):
+            # the new one still gets a new order.
+            self.epoch += 1
             self.counter = 0
-        else:
-            indices = indices[self.counter:]
-            self.restarting = False
+        self.restarting = False
         # self.start_counter = self.counter
 
-        for index in indices:
+        for index in permuted_indices(n, self.seed, self.epoch, self.counter, n):
             self.counter += 1
             yield index
 
         self.counter = 0
+        self.epoch += 1
         # self.start_counter = self.counter
 
 
@@ -84,38 +165,16 @@ class FaultTolerantDistributedSampler(DistributedSampler):
         # return self.num_samples - self.start_counter
 
     def __iter__(self):
-        if self.shuffle:
-            # deterministically shuffle based on epoch and seed
-            g = torch.Generator()
-            g.manual_seed(self.seed + self.epoch)
-            indices = torch.randperm(len(self.dataset), generator=g).tolist()  # type: ignore[arg-type]
-        else:
-            indices = list(range(len(self.dataset)))  # type: ignore[arg-type]
-
-        if not self.drop_last:
-            # add extra samples to make it evenly divisible
-            padding_size = self.total_size - len(indices)
-            if padding_size <= len(indices):
-                indices += indices[:padding_size]
-            else:
-                indices += (indices * math.ceil(padding_size / len(indices)))[:padding_size]
-        else:
-            # remove tail of data to make it evenly divisible.
-            indices = indices[:self.total_size]
-        assert len(indices) == self.total_size
-
-        # subsample
-        indices = indices[self.rank:self.total_size:self.num_replicas]
-        assert len(indices) == self.num_samples
-
+        # The rank's share of the permutation: positions rank, rank + num_replicas, ... of it, up
+        # to total_size, i.e. truncated if drop_last, otherwise padded by wrapping around.
         if not self.restarting:
             self.counter = 0
-        else:
-            indices = indices[self.counter:]
-            self.restarting = False
+        self.restarting = False
         # self.start_counter = self.counter
 
-        for index in indices:
+        for index in permuted_indices(len(self.dataset), self.seed, self.epoch, self.counter,
+                                      self.num_samples, shuffle=self.shuffle, rank=self.rank,
+                                      num_replicas=self.num_replicas):
             self.counter += 1
             yield index
 
@@ -17,7 +17,8 @@ from datasets import load_dataset
 
 from pytorch_lightning import LightningDataModule
 
-from src.datamodules.datasets.lm_dataset import LMDataset
+from src.datamodules.datasets.lm_dataset import LMDataset, LMBatchLoader
+from src.datamodules.datasets.token_corpus import TokenCorpus, write_documents, token_dataset
 from src.datamodules.fault_tolerant_sampler import RandomFaultTolerantSampler
 from src.datamodules.fault_tolerant_sampler import FaultTolerantDistributedSampler
 from src.datamodules.datasets.detokenizer import DATASET_TOKENIZATION_REGISTRY
@@ -44,7 +45,8 @@ class LMDataModule(LightningDataModule):
                  detokenize=False, val_only=False, batch_size=32, batch_size_eval=None, num_workers=1,
                  shuffle=False, pin_memory=False, drop_last=False, fault_tolerant=False, ddp=False,
                  fast_forward_epochs=None, fast_forward_batches=None,
-                 use_shmem=True):
+                 use_shmem=True, native_loader=False, native_loader_threads=4,
+                 native_writer=False):
         super().__init__()
         self.dataset_name = dataset_name
         self.dataset_config_name = dataset_config_name
@@ -76,6 +78,16 @@ class LMDataModule(LightningDataModule):
         self.use_shmem = use_shmem
         if self.use_shmem:
             assert cache_dir is not None
+        # Read the training batches with the token_dataset extension (csrc/token_dataset), when
+        # the tokens are memory-mapped (i.e. in the cache)
+        self.native_loader = native_loader
+        self.native_loader_threads = native_loader_threads
+        # Tokenize straight into the cache, as shards written by the token_dataset extension
+        # (read back as a TokenCorpus), instead of concatenating the tokens in memory first
+        self.native_writer = native_writer
+        if self.native_writer:
+            assert cache_dir is not None
+            assert token_dataset is not None, 'token_dataset is not installed'
 
     def prepare_data(self):
         if self.cache_dir is None:  # Just download the dataset
@@ -97,7 +109,8 @@ class LMDataModule(LightningDataModule):
     def process_dataset(self):
         cache_dir = None if self.cache_dir is None else self.cache_dir / self._cache_dir_name
         if cache_dir is not None:
-            if cache_dir.is_dir():
+            # tokenizer.pkl is written last: otherwise the cache is incomplete
+            if (cache_dir / 'tokenizer.pkl').is_file():
                 return self._load_from_cache(cache_dir)
 
         raw_datasets = load_dataset(self.dataset_name, self.dataset_config_name)
@@ -151,6 +164,44 @@ class LMDataModule(LightningDataModule):
         #     remove_columns=column_names,
         #     desc="Running tokenizer on dataset",
         # )
+        if self.native_writer:
+            # Tokenize and write the documents to the cache directly, each worker appending to its
+            # own shard, which is resumed if it was interrupted. The documents of a shard depend
+            # on the number of workers, so resuming requires the same num_workers.
+            cache_dir.mkdir(parents=True, exist_ok=True)
+            num_shards = max(self.num_workers, 1)
+            num_shards_path = cache_dir / 'num_shards.txt'
+            if num_shards_path.is_file():
+                if int(num_shards_path.read_text()) != num_shards:
+                    raise RuntimeError(
+                        f'{cache_dir} was partially written with num_workers='
+                        f'{num_shards_path.read_text().strip()}: resume with the same num_workers,'
+                        f' or delete it'
+                    )
+            else:
+                num_shards_path.write_text(str(num_shards))
+            dtype = np.uint16 if tokenizer.vocab_size < 64 * 1024 else np.int32
+            def tokenize_write(examples, indices, rank, prefix):
+                documents = tokenize(examples)['input_ids']
+                write_documents(prefix, rank or 0, documents, dtype, first_document=indices[0])
+                return {'len': [len(doc) for doc in documents]}
+            concat_ids = {}
+            for name, ds in raw_datasets.items():
+                ds.map(
+                    tokenize_write,
+                    fn_kwargs={'prefix': cache_dir / name},
+                    batched=True,
+                    with_indices=True,
+                    with_rank=True,
+                    num_proc=num_shards,
+                    remove_columns=column_names,
+                    load_from_cache_file=False,  # The shards are the cache
+                    desc="Tokenizing and writing shards",
+                )
+                concat_ids[name] = TokenCorpus(cache_dir / name)
+            self._save_to_cache(concat_ids, tokenizer, cache_dir)
+            return concat_ids, tokenizer
+
         dtype = np.uint16 if tokenizer.vocab_size < 64 * 1024 else np.int32
         def tokenize_concat(examples):
             # We just need 'input_ids', not 'attention_mask' (since it's all 1)
@@ -233,14 +284,17 @@ class LMDataModule(LightningDataModule):
         cache_dir.mkdir(parents=True, exist_ok=True)
         logger.info(f'Saving to cache at {str(cache_dir)}')
         for k, v in concat_ids.items():
-            np.save(cache_dir / f'{k}.npy', v)
+            if not isinstance(v, TokenCorpus):  # Already written
+                np.save(cache_dir / f'{k}.npy', v)
         with open(cache_dir / 'tokenizer.pkl', 'wb') as f:
             pickle.dump(tokenizer, f)
 
     def _load_from_cache(self, cache_dir):
         assert cache_dir.is_dir()
         logger.info(f'Load from cache at {str(cache_dir)}')
-        concat_ids = {split: np.load(cache_dir / f'{split}.npy', mmap_mode='r')
+        concat_ids = {split: (np.load(cache_dir / f'{split}.npy', mmap_mode='r')
+                              if (cache_dir / f'{split}.npy').is_file()
+                              else TokenCorpus(cache_dir / split))
                       for split in ['train', 'validation', 'test']}
         with open(cache_dir / 'tokenizer.pkl', 'rb') as f:
             tokenizer = pickle.load(f)
@@ -266,6 +320,25 @@ class LMDataModule(LightningDataModule):
         else:
             shuffle = self.shuffle
             sampler = None
+        if self.native_loader and isinstance(self.dataset_train.tokens, (np.memmap, TokenCorpus)):
+            # LMBatchLoader is not a DataLoader, so Lightning doesn't replace its sampler with a
+            # DistributedSampler: without one, every rank would read the same batches. (With ddp,
+            # sampler is already a FaultTolerantDistributedSampler.)
+            if (sampler is None and torch.distributed.is_available()
+                    and torch.distributed.is_initialized()
+                    and torch.distributed.get_world_size() > 1):
+                sampler = torch.utils.data.DistributedSampler(self.dataset_train, shuffle=shuffle,
+                                                              drop_last=self.drop_last)
+            elif shuffle:
+                sampler = torch.utils.data.RandomSampler(self.dataset_train)
+            loader = LMBatchLoader(self.dataset_train.tokens, seq_len=self.max_length,
+                                   batch_size=self.batch_size, sampler=sampler,
+                                   drop_last=self.drop_last, num_threads=self.native_loader_threads)
+            # The sampler draws from the sequences of dataset_train, the loader only has the full
+            # ones: dataset_train must be an LMDataset with drop_last=True (as built in setup).
+            assert len(self.dataset_train) == loader.total_sequences, \
+                'native_loader needs the LMDataset to be built with drop_last=True'
+            return loader
         return self._data_loader(self.dataset_train, batch_size=self.batch_size,
                                  shuffle=shuffle, sampler=sampler)
 
@@ -0,0 +1,167 @@
+# AdamW with its state (fp32 master weights and moments) in host memory, updated by the native
+# kernel of csrc/fused_optim. Only the low-precision weights and gradients live on the device.
+from itertools import chain
+
+import torch
+from torch.optim.optimizer import Optimizer
+
+try:
+    import fused_optim
+except ImportError:
+    fused_optim = None
+
+
+class CPUAdamW(Optimizer):
+    """AdamW (Adam with L2 regularization if adam_w_mode=False) whose state lives in host memory:
+    fp32 master weights and moments, updated by a multithreaded CPU kernel. The parameters can be
+    fp32, fp16 or bf16, on CPU or GPU: each step reads their gradients and writes back the updated
+    weights in their dtype.
+    For GPU parameters, a step goes through buckets of about bucket_size elements: the gradients
+    of the next bucket are copied to pinned host memory (on a side stream) while the current one
+    is updated, and the updated weights are copied back asynchronously.
+    Use it as the optimizer_class of ZeroRedundancyOptimizer (configs/optimizer/
+    adamw-zero-cpu-offload.yaml): each rank then only keeps the state of its shard, and
+    DDPStrategyZero1 saves / loads the shards (loading them with CPUAdamW.load_state_dict, so that
+    the state never goes through the GPU).
+    """
+
+    def __init__(self, params, lr=1e-3, betas=(0.9, 0.999), eps=1e-8, weight_decay=1e-2,
+                 adam_w_mode=True, bucket_size=16 * 1024 * 1024):
+        assert fused_optim is not None, 'fused_optim is not installed'
+        defaults = dict(lr=lr, betas=betas, eps=eps, weight_decay=weight_decay,
+                        adam_w_mode=adam_w_mode)
+        super().__init__(params, defaults)
+        self.bucket_size = bucket_size
+        # Pinned staging buffers of the 2 buckets in flight, per (device, grad dtype, param dtype)
+        self._staging = {}
+
+    def _get_state(self, p):
+        state = self.state[p]
+        if len(state) == 0:
+            state['step'] = 0
+            state['param'] = p.detach().to(device='cpu', dtype=torch.float32, copy=True)
+            state['exp_avg'] = torch.zeros_like(state['param'])
+            state['exp_avg_sq'] = torch.zeros_like(state['param'])
+        else:
+            # ZeroRedundancyOptimizer.load_state_dict (unlike DDPStrategyZero1) moves the state to
+            # the device of the params
+            for key in ['param', 'exp_avg', 'exp_avg_sq']:
+                state[key] = state[key].to(device='cpu', dtype=torch.float32)
+        return state
+
+    def load_state_dict(self, state_dict):
+        # Optimizer.load_state_dict would cast the state to the dtype and device of the params,
+        # losing the precision of the master weights: it's restored as is.
+        super().load_state_dict({**state_dict, 'state': {}})
+        saved_ids = chain.from_iterable(g['params'] for g in state_dict['param_groups'])
+        params = chain.from_iterable(g['params'] for g in self.param_groups)
+        id_map = dict(zip(saved_ids, params))
+        for k, v in state_dict['state'].items():
+            if k in id_map:
+                self.state[id_map[k]] = {key: (value.to(device='cpu', dtype=torch.float32)
+                                               if torch.is_tensor(value) else value)
+                                         for key, value in v.items()}
+
+    def _update(self, p, group, grad, param_out):
+        state = self._get_state(p)
+        state['step'] += 1
+        beta1, beta2 = group['betas']
+        fused_optim.adam_step(state['param'], state['exp_avg'], state['exp_avg_sq'], grad,
+                              param_out, lr=group['lr'], beta1=beta1, beta2=beta2,
+                              eps=group['eps'], weight_decay=group['weight_decay'],
+                              step=state['step'], adam_w_mode=group['adam_w_mode'])
+
+    def _buckets(self, entries):
+        """Consecutive (param, group) entries, with the same device and dtypes, of about
+        bucket_size elements.
+        """
+        bucket, key, size = [], None, 0
+        for p, group in entries:
+            p_key = (p.device, p.grad.dtype, p.dtype)
+            if bucket and (p_key != key or size + p.numel() > self.bucket_size):
+                yield key, bucket
+                bucket, size = [], 0
+            bucket.append((p, group))
+            key = p_key
+            size += p.numel()
+        if bucket:
+            yield key, bucket
+
+    def _staging_buffers(self, key, slot, numel):
+        device, grad_dtype, param_dtype = key
+        buffers = self._staging.get((key, slot))
+        if buffers is None or buffers[0].numel() < numel:
+            buffers = (torch.empty(numel, dtype=grad_dtype, pin_memory=True),
+                       torch.empty(numel, dtype=param_dtype, pin_memory=True),
+                       torch.cuda.Event())
+            self._staging[(key, slot)] = buffers
+        return buffers
+
+    @torch.no_grad()
+    def step(self, closure=None):
+        loss = None
+        if closure is not None:
+            with torch.enable_grad():
+                loss = closure()
+        entries = [(p, group) for group in self.param_groups for p in group['params']
+                   if p.grad is not None]
+        for p, group in entries:
+            if p.grad.is_sparse:
+                raise RuntimeError('CPUAdamW does not support sparse gradients')
+            assert p.is_contiguous(), 'CPUAdamW needs contiguous parameters'
+        for p, group in entries:
+            if not p.is_cuda:
+                self._update(p, group, p.grad.contiguous(), p.view(-1))
+        buckets = list(self._buckets([(p, group) for p, group in entries if p.is_cuda]))
+        if buckets:
+            self._step_cuda(buckets)
+        return loss
+
+    def _step_cuda(self, buckets):
+        copy_streams = {}
+        for key, _ in buckets:
+            device = key[0]
+            if device not in copy_streams:
+                copy_streams[device] = torch.cuda.Stream(device)
+                # The gradients are produced on the current stream
+                copy_streams[device].wait_stream(torch.cuda.current_stream(device))
+
+        def copy_grads(i):
+            key, bucket = buckets[i]
+            numel = sum(p.numel() for p, _ in bucket)
+            grad_buffer, _, _ = self._staging_buffers(key, i % 2, numel)
+            with torch.cuda.stream(copy_streams[key[0]]):
+                offset = 0
+                for p, _ in bucket:
+                    grad_buffer[offset:offset + p.numel()].copy_(p.grad.reshape(-1),
+                                                                 non_blocking=True)
+                    offset += p.numel()
+                event = torch.cuda.Event()
+                event.record()
+            return event
+
+        grads_ready = copy_grads(0)
+        for i, (key, bucket) in enumerate(buckets):
+            # Queued now, so that it runs during the update of this bucket
+            next_grads_ready = copy_grads(i + 1) if i + 1 < len(buckets) else None
+            grads_ready.synchronize()
+            grad_buffer, out_buffer, params_copied = self._staging_buffers(
+                key, i % 2, sum(p.numel() for p, _ in bucket)
+            )
+            # The weights of the previous bucket of this slot must be copied out of out_buffer
+            params_copied.synchronize()
+            offset = 0
+            for p, group in bucket:
+                n = p.numel()
+                self._update(p, group, grad_buffer[offset:offset + n],
+                             out_buffer[offset:offset + n])
+                offset += n
+            with torch.cuda.stream(copy_streams[key[0]]):
+                offset = 0
+                for p, _ in bucket:
+                    p.view(-1).copy_(out_buffer[offset:offset + p.numel()], non_blocking=True)
+                    offset += p.numel()
+                params_copied.record()
+            grads_ready = next_grads_ready
+        for device, stream in copy_streams.items():
+            torch.cuda.current_stream(device).wait_stream(stream)
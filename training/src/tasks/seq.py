@@ -4,6 +4,7 @@ import inspect
 import torch
 import hydra
 from pytorch_lightning import LightningModule, LightningDataModule
+from pytorch_lightning.strategies import DeepSpeedStrategy
 from torchmetrics import MetricCollection
 
 from einops import rearrange
@@ -13,6 +14,7 @@ from omegaconf import OmegaConf
 from src.utils.utils import get_logger
 from src.optim.param_grouping import group_parameters_for_optimizer
 from src.utils.checkpoint import load_checkpoint
+from src.utils.multi_tensor import clip_grad_norm_
 
 logger = get_logger(__name__)
 
@@ -156,6 +158,19 @@ class SequenceModel(LightningModule):
         else:
             optimizer.zero_grad()
 
+    def configure_gradient_clipping(self, optimizer, optimizer_idx, gradient_clip_val=None,
+                                    gradient_clip_algorithm=None):
+        # Clip by norm with the multi-tensor ops. Optimizers that clip their own (sharded)
+        # gradients (e.g. Apex's DistributedFusedAdam) and DeepSpeed go through Lightning.
+        if (gradient_clip_val and gradient_clip_algorithm in [None, 'norm']
+                and not hasattr(optimizer, 'clip_grad_norm')
+                and not isinstance(self.trainer.strategy, DeepSpeedStrategy)):
+            parameters = [p for group in optimizer.param_groups for p in group['params']]
+            clip_grad_norm_(parameters, gradient_clip_val)
+        else:
+            self.clip_gradients(optimizer, gradient_clip_val=gradient_clip_val,
+                                gradient_clip_algorithm=gradient_clip_algorithm)
+
     def on_save_checkpoint(self, checkpoint):
         # TD [2022-08-07] ['epoch_loop.batch_progress']['total']['completed'] is 1 iteration
         # behind, so we're using the optimizer's progress.
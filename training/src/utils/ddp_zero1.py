@@ -59,6 +59,35 @@ def get_zero_optimizer_state_dict_local(optimizer, global_rank):
     return state_dict
 
 
+# The converse of get_zero_optimizer_state_dict_local: loads the local state dict of this rank into
+# the local optimizer with its own load_state_dict. ZeroRedundancyOptimizer.load_state_dict would
+# copy the state to the device of the params (and also keep a copy in its own state), e.g. putting
+# the state of an optimizer that keeps it in host memory (CPUAdamW) on the GPU.
+def load_zero_optimizer_state_dict_local(optimizer, state_dict, global_rank):
+    optimizer._check_overlap_initialized()
+
+    global_param_groups = optimizer._partition_parameters()[global_rank]
+    assert len(state_dict["param_groups"]) == len(global_param_groups), \
+        "Mismatch between number of saved and global parameter groups"
+    local_state_dict = {"state": {}, "param_groups": []}
+    local_param_index = 0
+    for saved_param_group, global_param_group in zip(state_dict["param_groups"],
+                                                     global_param_groups):
+        # The local optimizer numbers its parameters in the order of its parameter groups
+        local_param_indices = []
+        for global_param in global_param_group["params"]:
+            global_param_index = optimizer._param_to_index[global_param]
+            if global_param_index in state_dict["state"]:
+                local_state_dict["state"][local_param_index] = state_dict["state"][global_param_index]
+            local_param_indices.append(local_param_index)
+            local_param_index += 1
+        local_state_dict["param_groups"].append({**saved_param_group,
+                                                 "params": local_param_indices})
+    optimizer.optim.load_state_dict(local_state_dict)
+    # Expose the restored hyperparameters (e.g. lr) in the `param_groups` of the wrapper
+    optimizer._sync_param_groups(optimizer.optim.param_groups, optimizer.param_groups)
+
+
 class DDPStrategyZero1(DDPStrategy):
     """To use ZeroRedundancyOptimizer, we need to shard the optimizer states when
     saving/loading checkpoints.
@@ -74,6 +103,18 @@ class DDPStrategyZero1(DDPStrategy):
         else:
             return optimizer.state_dict()
 
+    def load_optimizer_state_dict(self, checkpoint: Dict[str, Any]) -> None:
+        optimizers = [optimizer._optimizer if isinstance(optimizer, LightningOptimizer) else optimizer
+                      for optimizer in self.optimizers]
+        if not any(isinstance(optimizer, ZeroRedundancyOptimizer) for optimizer in optimizers):
+            return super().load_optimizer_state_dict(checkpoint)
+        for optimizer, opt_state in zip(optimizers, checkpoint['optimizer_states']):
+            if isinstance(optimizer, ZeroRedundancyOptimizer):
+                load_zero_optimizer_state_dict_local(optimizer, opt_state, self.global_rank)
+            else:
+                # Optimizer.load_state_dict moves the state to the device of the params
+                optimizer.load_state_dict(opt_state)
+
     def save_checkpoint(
         self, checkpoint: Dict[str, Any], filepath: _PATH, storage_options: Optional[Any] = None
     ) -> None:
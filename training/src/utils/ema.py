@@ -9,6 +9,8 @@ import contextlib
 
 import torch
 
+from src.utils.multi_tensor import ema_update_
+
 
 def to_float_maybe(x):
     return x.float() if x.dtype in [torch.float16, torch.bfloat16] else x
@@ -100,8 +102,7 @@ class ExponentialMovingAverage:
             self.to(device=parameters[0].device)
         with torch.no_grad():
             parameters = [p for p in parameters if p.requires_grad]
-            for s_param, param in zip(self.shadow_params, parameters):
-                torch.lerp(s_param, param.to(dtype=s_param.dtype), one_minus_decay, out=s_param)
+            ema_update_(self.shadow_params, parameters, one_minus_decay)
 
     def copy_to(
         self,
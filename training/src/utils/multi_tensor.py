@@ -0,0 +1,86 @@
+# Multi-tensor EMA update, gradient norm and clipping: one pass over a list of tensors instead of
+# one op per tensor. CPU tensors go through the native kernels of csrc/fused_optim (multithreaded
+# over chunks of all the tensors), GPU tensors through the torch._foreach ops.
+import torch
+
+try:
+    import fused_optim
+except ImportError:
+    fused_optim = None
+
+
+def _use_native(tensors):
+    return (fused_optim is not None and len(tensors) > 0
+            and all(not t.is_cuda and t.is_contiguous()
+                    and t.dtype in [torch.float32, torch.float16, torch.bfloat16] for t in tensors))
+
+
+@torch.no_grad()
+def ema_update_(shadow, params, weight):
+    """shadow[i] += weight * (params[i] - shadow[i]) for all i, e.g. the EMA update with
+    weight = 1 - decay. params are cast to the dtype of shadow.
+    """
+    if len(shadow) == 0:
+        return
+    if _use_native(shadow) and _use_native(params) and all(s.dtype == torch.float32 for s in shadow):
+        fused_optim.multi_tensor_ema(shadow, params, weight)
+    else:
+        params = [p.to(dtype=s.dtype) for s, p in zip(shadow, params)]
+        torch._foreach_lerp_(shadow, params, weight)
+
+
+@torch.no_grad()
+def global_norm(tensors, per_tensor=False):
+    """L2 norm of the concatenation of tensors, accumulated in fp32.
+    Returns: (norm () float32, per-tensor norms (len(tensors),) float32 or None,
+    found_inf () bool: whether the tensors have an inf or a nan).
+    """
+    tensors = list(tensors)
+    if len(tensors) == 0:
+        zero = torch.zeros((), dtype=torch.float32)
+        return zero, (torch.zeros(0) if per_tensor else None), torch.zeros((), dtype=torch.bool)
+    if _use_native(tensors):
+        norm, per_tensor_norms, found_inf = fused_optim.multi_tensor_l2norm(tensors, per_tensor)
+        return norm, (per_tensor_norms if per_tensor else None), found_inf
+    device = tensors[0].device
+    # torch._foreach_norm returns the norms in the dtype of the tensors: fp16 / bf16 tensors get
+    # an fp32 norm each instead
+    fp32_idx = [i for i, t in enumerate(tensors) if t.dtype == torch.float32]
+    norms = [None] * len(tensors)
+    if fp32_idx:
+        for i, n in zip(fp32_idx, torch._foreach_norm([tensors[i] for i in fp32_idx])):
+            norms[i] = n
+    for i, t in enumerate(tensors):
+        if norms[i] is None:
+            norms[i] = torch.linalg.vector_norm(t, dtype=torch.float32)
+    norms = torch.stack([n.to(device) for n in norms])
+    norm = norms.norm()
+    # Without syncing with the device. A per-tensor norm is only non-finite with an inf or a nan
+    # (or values beyond 1e19).
+    found_inf = ~torch.isfinite(norms).all()
+    return norm, (norms if per_tensor else None), found_inf
+
+
+@torch.no_grad()
+def clip_grad_norm_(parameters, max_norm, eps=1e-6, error_if_nonfinite=False):
+    """As torch.nn.utils.clip_grad_norm_ (with the L2 norm), in a few multi-tensor passes: the
+    gradients are scaled by min(1, max_norm / (norm + eps)). Returns the norm.
+    """
+    if isinstance(parameters, torch.Tensor):
+        parameters = [parameters]
+    grads = [p.grad for p in parameters if p.grad is not None]
+    norm, _, found_inf = global_norm(grads)
+    if len(grads) == 0:
+        return norm
+    if error_if_nonfinite and found_inf.item():
+        raise RuntimeError('The total norm of the gradients is non-finite, so it cannot be clipped')
+    if _use_native(grads):
+        # The norm is on CPU already: scale only if needed
+        clip_coef = float(max_norm) / (norm.item() + eps)
+        if clip_coef < 1.0 or clip_coef != clip_coef:  # nan propagates, as in torch
+            fused_optim.multi_tensor_scale(grads, clip_coef)
+    else:
+        # No sync with the device: the coefficient stays a tensor
+        clip_coef_clamped = torch.clamp(max_norm / (norm + eps), max=1.0)
+        torch._foreach_mul_(grads, clip_coef_clamped.to(grads[0].device))
+    return norm
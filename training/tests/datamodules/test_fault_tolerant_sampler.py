@@ -0,0 +1,92 @@
+import itertools
+
+import pytest
+import torch
+
+from src.datamodules.fault_tolerant_sampler import RandomFaultTolerantSampler
+from src.datamodules.fault_tolerant_sampler import FaultTolerantDistributedSampler
+from src.datamodules.fault_tolerant_sampler import permutation, _permutation_ref, token_dataset
+
+
+@pytest.mark.parametrize('n', [1, 2, 3, 17, 1000, 65536, 100003])
+def test_permutation(n):
+    perm = permutation(torch.arange(n), n, seed=1234, epoch=3)
+    assert torch.equal(torch.sort(perm).values, torch.arange(n))
+    if token_dataset is not None:
+        assert torch.equal(perm, _permutation_ref(torch.arange(n), n, seed=1234, epoch=3))
+    if n >= 1000:
+        assert not torch.equal(perm, permutation(torch.arange(n), n, seed=1234, epoch=4))
+        assert not torch.equal(perm, permutation(torch.arange(n), n, seed=1235, epoch=3))
+    # Element by element
+    positions = torch.randint(0, n, (100,))
+    assert torch.equal(permutation(positions, n, seed=1234, epoch=3), perm[positions])
+
+
+@pytest.mark.parametrize('n', [1000, 70000])
+def test_random_fault_tolerant_sampler(n):
+    dataset = range(n)
+    sampler = RandomFaultTolerantSampler(dataset, seed=0)
+    epoch0 = list(sampler)
+    assert sorted(epoch0) == list(range(n))
+    epoch1 = list(sampler)
+    assert sorted(epoch1) == list(range(n))
+    assert epoch0 != epoch1
+    # Resuming in the middle of epoch 2
+    sampler_ref = RandomFaultTolerantSampler(dataset, seed=0)
+    sampler_ref.load_state_dict({'seed': 0, 'epoch': 2, 'counter': 0})
+    epoch2 = list(sampler_ref)
+    start = list(itertools.islice(iter(sampler), n // 3))
+    sampler_resumed = RandomFaultTolerantSampler(dataset)
+    sampler_resumed.load_state_dict(sampler.state_dict())
+    assert start + list(sampler_resumed) == epoch2
+    assert sampler_resumed.epoch == 3
+
+    # An epoch that ends early doesn't repeat its order in the next one
+    sampler = RandomFaultTolerantSampler(dataset, seed=0)
+    assert list(itertools.islice(iter(sampler), n // 3)) == epoch0[:n // 3]
+    assert sampler.state_dict() == {'seed': 0, 'epoch': 0, 'counter': n // 3}
+    assert list(sampler) == epoch1
+
+
+def test_random_fault_tolerant_sampler_old_state_dict():
+    dataset = range(1000)
+    sampler = RandomFaultTolerantSampler(dataset, seed=0)
+    epoch0 = list(sampler)
+    sampler_resumed = RandomFaultTolerantSampler(dataset, seed=0)
+    with pytest.warns(UserWarning):
+        sampler_resumed.load_state_dict({'random_state': torch.get_rng_state(), 'counter': 300})
+    assert list(sampler_resumed) == epoch0
+
+
+@pytest.mark.parametrize('drop_last', [False, True])
+@pytest.mark.parametrize('shuffle', [False, True])
+@pytest.mark.parametrize('n', [10, 1003])
+def test_fault_tolerant_distributed_sampler(n, shuffle, drop_last):
+    num_replicas = 4
+    dataset = range(n)
+    samplers = [FaultTolerantDistributedSampler(dataset, num_replicas=num_replicas, rank=rank,
+                                                shuffle=shuffle, seed=7, drop_last=drop_last)
+                for rank in range(num_replicas)]
+    for sampler in samplers:
+        sampler.set_epoch(5)
+    shares = [list(sampler) for sampler in samplers]
+    samplers_ref = [torch.utils.data.DistributedSampler(dataset, num_replicas=num_replicas,
+                                                        rank=rank, shuffle=shuffle,
+                                                        drop_last=drop_last)
+                    for rank in range(num_replicas)]
+    assert [len(share) for share in shares] == [len(list(sampler)) for sampler in samplers_ref]
+    indices = [i for share in shares for i in share]
+    if drop_last:
+        assert len(set(indices)) == len(indices) == (n // num_replicas) * num_replicas
+    else:
+        assert set(indices) == set(range(n))
+    if not shuffle:
+        assert shares == [list(sampler) for sampler in samplers_ref]
+    # Resuming
+    for rank, sampler in enumerate(samplers):
+        start = list(itertools.islice(iter(sampler), 2))
+        sampler_resumed = FaultTolerantDistributedSampler(dataset, num_replicas=num_replicas,
+                                                          rank=rank, shuffle=shuffle, seed=7,
+                                                          drop_last=drop_last)
+        sampler_resumed.load_state_dict(sampler.state_dict())
+        assert start + list(sampler_resumed) == shares[rank]
@@ -0,0 +1,74 @@
+import numpy as np
+import pytest
+import torch
+
+from src.datamodules.datasets.lm_dataset import LMDataset, LMBatchLoader, token_dataset
+from src.datamodules.language_modeling_hf import LMDataModule
+
+
+@pytest.mark.skipif(token_dataset is None, reason='token_dataset is not installed')
+@pytest.mark.parametrize('dtype', [np.uint16, np.int32])
+@pytest.mark.parametrize('drop_last', [False, True])
+@pytest.mark.parametrize('shuffle', [False, True])
+def test_lm_batch_loader(tmp_path, dtype, drop_last, shuffle):
+    seq_len = 64
+    batch_size = 5
+    ntokens = 10007
+    filename = tmp_path / 'tokens.npy'
+    np.save(filename, np.random.randint(0, 50257, size=(ntokens,)).astype(dtype))
+    tokens = np.load(filename, mmap_mode='r')
+    dataset = LMDataset(tokens, seq_len=seq_len)
+    sampler = (torch.utils.data.RandomSampler(dataset, generator=torch.Generator().manual_seed(0))
+               if shuffle else None)
+    loader = LMBatchLoader(tokens, seq_len=seq_len, batch_size=batch_size, sampler=sampler,
+                           drop_last=drop_last, num_threads=3, prefetch=2)
+    if shuffle:
+        sampler_ref = torch.utils.data.RandomSampler(dataset,
+                                                     generator=torch.Generator().manual_seed(0))
+    else:
+        sampler_ref = None
+    loader_ref = torch.utils.data.DataLoader(dataset, batch_size=batch_size, sampler=sampler_ref,
+                                             drop_last=drop_last)
+    assert len(loader) == len(loader_ref)
+    num_batches = 0
+    for (x, y), (x_ref, y_ref) in zip(loader, loader_ref):
+        assert x.dtype == torch.long
+        assert torch.equal(x, x_ref)
+        assert torch.equal(y, y_ref)
+        num_batches += 1
+    assert num_batches == len(loader_ref)
+    # Breaking out of an iteration, then starting a new one
+    next(iter(loader))
+    assert sum(1 for _ in loader) == len(loader_ref)
+
+
+@pytest.mark.skipif(token_dataset is None, reason='token_dataset is not installed')
+@pytest.mark.parametrize('shuffle', [False, True])
+def test_native_loader_ranks_disjoint(tmp_path, monkeypatch, shuffle):
+    """Under DDP without the fault-tolerant sampler, each rank must read its own sequences."""
+    seq_len, batch_size, world_size = 16, 4, 2
+    filename = tmp_path / 'tokens.npy'
+    np.save(filename, np.arange(seq_len * 64 + 1, dtype=np.int32))
+    tokens = np.load(filename, mmap_mode='r')
+    monkeypatch.setattr(torch.distributed, 'is_initialized', lambda: True)
+    monkeypatch.setattr(torch.distributed, 'get_world_size', lambda group=None: world_size)
+    sequences = []
+    for rank in range(world_size):
+        monkeypatch.setattr(torch.distributed, 'get_rank', lambda group=None: rank)
+        datamodule = LMDataModule('dataset', 'gpt2', max_length=seq_len, batch_size=batch_size,
+                                  shuffle=shuffle, use_shmem=False, native_loader=True,
+                                  native_loader_threads=2)
+        datamodule.dataset_train = LMDataset(tokens, seq_len=seq_len)
+        loader = datamodule.train_dataloader()
+        assert isinstance(loader.sampler, torch.utils.data.DistributedSampler)
+        # The first token of each sequence identifies it
+        sequences.append({seq[0].item() for x, _ in loader for seq in x})
+    assert len(sequences[0]) == len(sequences[1]) == 32
+    assert sequences[0].isdisjoint(sequences[1])
+    # Lightning doesn't call set_epoch on the sampler of LMBatchLoader: the loader does, so each
+    # epoch is shuffled differently
+    epochs = [[seq[0].item() for x, _ in loader for seq in x] for _ in range(2)]
+    assert loader.sampler.epoch == 2
+    assert sorted(epochs[0]) == sorted(epochs[1])
+    if shuffle:
+        assert epochs[0] != epochs[1]
@@ -0,0 +1,51 @@
+import numpy as np
+import pytest
+import torch
+
+from src.datamodules.datasets.lm_dataset import LMDataset, LMBatchLoader
+from src.datamodules.datasets.token_corpus import TokenCorpus, write_documents, token_dataset
+
+
+@pytest.mark.skipif(token_dataset is None, reason='token_dataset is not installed')
+@pytest.mark.parametrize('dtype', [np.uint16, np.uint32])
+def test_token_corpus(tmp_path, dtype):
+    rng = np.random.default_rng(0)
+    max_token = np.iinfo(dtype).max
+    documents = [rng.integers(0, max_token, size=rng.integers(0, 300)).tolist()
+                 for _ in range(100)]
+    prefix = tmp_path / 'train'
+    # Shards 0, 1, 2 hold documents [0, 30), [30, 70), [70, 100), written by batches of 8 (in
+    # reverse order of the shards: only the first document of a shard matters)
+    shards = [(2, 70, 100), (1, 30, 70), (0, 0, 30)]
+    for shard, start, end in shards:
+        for batch_start in range(start, end, 8):
+            batch_end = min(batch_start + 8, end)
+            write_documents(prefix, shard, documents[batch_start:batch_end], dtype,
+                            first_document=batch_start)
+    # Resuming: documents already written are skipped, so shard 1 now ends with documents
+    # [70, 75), while a gap or documents before the start of a shard (another sharding) are errors
+    write_documents(prefix, 1, documents[60:75], dtype, first_document=60)
+    with pytest.raises(RuntimeError):
+        write_documents(prefix, 0, documents[40:45], dtype, first_document=40)
+    with pytest.raises(RuntimeError):
+        write_documents(prefix, 2, documents[65:72], dtype, first_document=65)
+    documents = documents[:75] + documents[70:]
+    corpus = TokenCorpus(prefix)
+    tokens_ref = np.array([t for doc in documents for t in doc], dtype=dtype)
+    assert corpus.dtype == np.dtype(dtype)
+    assert len(corpus) == len(tokens_ref)
+    assert corpus.num_documents == len(documents)
+    assert np.array_equal(corpus[:], tokens_ref)
+    for start in range(0, len(tokens_ref), 997):
+        assert np.array_equal(corpus[start:start + 1500], tokens_ref[start:start + 1500])
+    assert np.array_equal(corpus.cu_seqlens(),
+                          np.cumsum([0] + [len(doc) for doc in documents]))
+
+    seq_len = 128
+    dataset = LMDataset(corpus, seq_len=seq_len)
+    loader = LMBatchLoader(corpus, seq_len=seq_len, batch_size=4, num_threads=2)
+    loader_ref = torch.utils.data.DataLoader(dataset, batch_size=4)
+    assert len(loader) == len(loader_ref)
+    for (x, y), (x_ref, y_ref) in zip(loader, loader_ref):
+        assert torch.equal(x, x_ref)
+        assert torch.equal(y, y_ref)
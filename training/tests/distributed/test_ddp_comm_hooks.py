@@ -0,0 +1,121 @@
+# Run test with:
+# torchrun --no_python --nproc_per_node=4 pytest -q -s tests/distributed/test_ddp_comm_hooks.py
+
+import math
+
+import pytest
+import torch
+from torch.nn.parallel import DistributedDataParallel as DDP
+
+import src.distributed.ddp_comm_hooks as ddp_comm_hooks
+from src.distributed.ddp_comm_hooks import (quantize_blockwise, dequantize_blockwise,
+                                            int8_compress_hook, Int8CompressState,
+                                            powersgd_hook, PowerSGDState)
+
+
+def _init():
+    if not torch.distributed.is_initialized():
+        torch.distributed.init_process_group(backend='gloo', init_method='env://')
+    return torch.distributed.group.WORLD
+
+
+@pytest.mark.parametrize('native', [True, False])
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+@pytest.mark.parametrize('numel', [1, 1000, 4096])
+def test_quantize_blockwise(numel, dtype, native, monkeypatch):
+    if native and ddp_comm_hooks.grad_compression is None:
+        pytest.skip('grad_compression is not installed')
+    if not native:
+        monkeypatch.setattr(ddp_comm_hooks, 'grad_compression', None)
+    block_size = 256
+    torch.random.manual_seed(0)
+    x = torch.randn(numel, dtype=dtype) * torch.rand(numel) * 10
+    error = torch.randn(numel) * 0.01
+    value = x.float() + error
+    q, scales = quantize_blockwise(x, block_size, error)
+    assert q.dtype == torch.int8 and q.shape == (numel,)
+    assert scales.shape == (math.ceil(numel / block_size),)
+    out = torch.empty(numel, dtype=torch.float32)
+    dequantize_blockwise(q, scales, block_size, out)
+    # Error feedback: nothing is lost
+    assert torch.allclose(out + error, value, atol=1e-5)
+    assert (error.abs() <= scales.repeat_interleave(block_size)[:numel] * (0.5 + 1e-5)).all()
+    # Sum of rows
+    rows = torch.stack([q, q])
+    dequantize_blockwise(rows, torch.stack([scales, scales * 2]), block_size, out, alpha=0.5)
+    assert torch.allclose(out, (value - error) * 1.5, atol=1e-5)
+    # A block with a nan dequantizes to nan, with a zero error
+    x[0] = float('nan')
+    q, scales = quantize_blockwise(x, block_size, error)
+    out_half = torch.empty(numel, dtype=dtype)
+    dequantize_blockwise(q, scales, block_size, out_half)
+    assert out_half[:block_size].isnan().all() and (error[:block_size] == 0).all()
+    assert not out_half[block_size:].isnan().any()
+
+
+def _make_model(seed=0):
+    torch.random.manual_seed(seed)
+    return torch.nn.Sequential(torch.nn.Linear(96, 64), torch.nn.GELU(), torch.nn.Linear(64, 10))
+
+
+def _exact_mean_grads(x, world_size):
+    """Average of the gradients of all ranks, without DDP."""
+    model = _make_model()
+    for r in range(world_size):
+        model(x[r]).square().sum().backward()
+    return [p.grad / world_size for p in model.parameters()]
+
+
+@pytest.mark.parametrize('hook', ['int8', 'powersgd'])
+def test_comm_hook_error_feedback(hook):
+    """With the same gradients at each iteration, the average of the compressed gradients must
+    converge to the true average: error feedback carries what compression lost to the next
+    iteration.
+    """
+    group = _init()
+    world_size, rank = torch.distributed.get_world_size(), torch.distributed.get_rank()
+    torch.random.manual_seed(0)
+    x = torch.randn(world_size, 32, 96)
+    grads_ref = _exact_mean_grads(x, world_size)
+    model = DDP(_make_model(), process_group=group)
+    if hook == 'int8':
+        state = Int8CompressState(group, block_size=64)
+        model.register_comm_hook(state, int8_compress_hook)
+    else:
+        state = PowerSGDState(group, matrix_approximation_rank=8, start_iter=2)
+        model.register_comm_hook(state, powersgd_hook)
+    num_iters = 100
+    grads_sum = [torch.zeros_like(p) for p in model.parameters()]
+    for i in range(num_iters):
+        model.zero_grad()
+        model(x[rank]).square().sum().backward()
+        for g, p in zip(grads_sum, model.parameters()):
+            g += p.grad
+        if i == 0:
+            # Uncompressed allreduce before start_iter, 8 bits otherwise
+            atol = 1e-5 if hook == 'powersgd' else 0.05
+            for p, g_ref in zip(model.parameters(), grads_ref):
+                assert torch.allclose(p.grad, g_ref, atol=atol * g_ref.abs().max())
+        # The same on all ranks
+        grads = torch.cat([p.grad.flatten() for p in model.parameters()])
+        grads_rank0 = grads.clone()
+        torch.distributed.broadcast(grads_rank0, 0, group=group)
+        assert torch.equal(grads, grads_rank0)
+    # The remaining error decreases as 1 / num_iters, faster for int8 than for low rank
+    rtol = 0.05 if hook == 'int8' else 0.1
+    for g, g_ref in zip(grads_sum, grads_ref):
+        assert (g / num_iters - g_ref).abs().max() <= rtol * g_ref.abs().max()
+    assert state.bytes_sent > 0
+
+
+def test_int8_compress_hook_bytes():
+    group = _init()
+    world_size = torch.distributed.get_world_size()
+    model = DDP(_make_model(), process_group=group)
+    state = Int8CompressState(group, block_size=256)
+    model.register_comm_hook(state, int8_compress_hook)
+    model(torch.randn(8, 96)).sum().backward()
+    numel = sum(p.numel() for p in model.parameters())
+    # About a quarter of the bytes of an fp32 allreduce, up to the padding and the scales
+    fp32_bytes = 2 * (world_size - 1) * numel * 4 / world_size
+    assert state.bytes_sent < 0.3 * fp32_bytes
@@ -0,0 +1,120 @@
+import pytest
+import torch
+from torch.distributed.optim import ZeroRedundancyOptimizer
+
+from src.optim.cpu_adam import CPUAdamW, fused_optim
+from src.utils.ddp_zero1 import (get_zero_optimizer_state_dict_local,
+                                 load_zero_optimizer_state_dict_local)
+
+
+@pytest.mark.skipif(fused_optim is None, reason='fused_optim is not installed')
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize('adam_w_mode', [True, False])
+def test_cpu_adam(adam_w_mode, dtype):
+    torch.manual_seed(0)
+    shapes = [(1000, 37), (37,), (5, 7, 11)]
+    params_ref = [torch.randn(shape, requires_grad=True) for shape in shapes]
+    params = [p.detach().to(dtype).requires_grad_() for p in params_ref]
+    kwargs = dict(lr=1e-2, betas=(0.9, 0.95), eps=1e-8, weight_decay=0.1)
+    optimizer_cls = torch.optim.AdamW if adam_w_mode else torch.optim.Adam
+    optimizer_ref = optimizer_cls(params_ref, **kwargs)
+    optimizer = CPUAdamW(params, adam_w_mode=adam_w_mode, **kwargs)
+    for _ in range(5):
+        for p, p_ref in zip(params, params_ref):
+            p_ref.grad = torch.randn_like(p_ref)
+            p.grad = p_ref.grad.to(dtype)
+        optimizer_ref.step()
+        optimizer.step()
+    atol = 1e-5 if dtype == torch.float32 else 1e-2
+    for p, p_ref in zip(params, params_ref):
+        master = optimizer.state[p]['param']
+        if dtype == torch.float32:
+            assert torch.allclose(master, p_ref, atol=atol)
+        assert torch.allclose(p.float(), p_ref, atol=atol)
+        assert torch.equal(p, master.to(dtype))
+
+    # The state is restored in fp32 in host memory
+    state_dict = optimizer.state_dict()
+    params_loaded = [p.detach().clone().requires_grad_() for p in params]
+    optimizer_loaded = CPUAdamW(params_loaded, adam_w_mode=adam_w_mode, **kwargs)
+    optimizer_loaded.load_state_dict(state_dict)
+    for p, p_loaded in zip(params, params_loaded):
+        for key in ['param', 'exp_avg', 'exp_avg_sq']:
+            assert optimizer_loaded.state[p_loaded][key].dtype == torch.float32
+            assert torch.equal(optimizer_loaded.state[p_loaded][key], optimizer.state[p][key])
+        grad = torch.randn_like(p)
+        p.grad, p_loaded.grad = grad, grad.clone()
+    optimizer.step()
+    optimizer_loaded.step()
+    for p, p_loaded in zip(params, params_loaded):
+        assert torch.equal(p, p_loaded)
+
+
+@pytest.mark.skipif(fused_optim is None, reason='fused_optim is not installed')
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='requires GPU')
+def test_cpu_adam_cuda():
+    """GPU parameters go through buckets of bucket_size elements (each parameter larger than that
+    gets its own), alternating between 2 pinned staging slots that are reallocated when a later
+    bucket is larger.
+    """
+    torch.manual_seed(0)
+    # Buckets: [370 + 37 + 500], [385], [5000], [3000], [7]
+    shapes = [(10, 37), (37,), (500,), (5, 7, 11), (50, 100), (3000,), (7,)]
+    params = [torch.randn(shape, device='cuda', dtype=torch.bfloat16, requires_grad=True)
+              for shape in shapes]
+    params_ref = [p.detach().float().requires_grad_() for p in params]
+    kwargs = dict(lr=1e-2, betas=(0.9, 0.95), eps=1e-8, weight_decay=0.1)
+    optimizer_ref = torch.optim.AdamW(params_ref, **kwargs)
+    optimizer = CPUAdamW(params, bucket_size=1000, **kwargs)
+    for _ in range(5):
+        for p, p_ref in zip(params, params_ref):
+            p.grad = torch.randn_like(p)
+            p_ref.grad = p.grad.float()
+        optimizer_ref.step()
+        optimizer.step()
+    for p, p_ref in zip(params, params_ref):
+        master = optimizer.state[p]['param']
+        assert master.device.type == 'cpu'
+        assert torch.allclose(master, p_ref.cpu(), atol=1e-5)
+        assert torch.equal(p.cpu(), master.to(torch.bfloat16))
+
+
+@pytest.mark.skipif(fused_optim is None, reason='fused_optim is not installed')
+@pytest.mark.parametrize('device', ['cpu', pytest.param('cuda', marks=pytest.mark.skipif(
+    not torch.cuda.is_available(), reason='requires GPU'))])
+def test_cpu_adam_zero_state_dict(tmp_path, device):
+    """Save / load round-trip of the shard of a rank, as DDPStrategyZero1 does: the state must be
+    restored in fp32 in host memory.
+    """
+    if not torch.distributed.is_initialized():
+        torch.distributed.init_process_group(backend='gloo', init_method=f'file://{tmp_path / "pg"}',
+                                             rank=0, world_size=1)
+    torch.manual_seed(0)
+    shapes = [(1000, 37), (37,), (5, 7, 11)]
+    params = [torch.randn(shape, device=device, dtype=torch.bfloat16, requires_grad=True)
+              for shape in shapes]
+    kwargs = dict(lr=1e-2, betas=(0.9, 0.95), eps=1e-8, weight_decay=0.1)
+    optimizer = ZeroRedundancyOptimizer(params, optimizer_class=CPUAdamW, **kwargs)
+    for _ in range(3):
+        for p in params:
+            p.grad = torch.randn_like(p)
+        optimizer.step()
+    torch.save(get_zero_optimizer_state_dict_local(optimizer, 0), tmp_path / 'optim_states.pt')
+
+    params_loaded = [p.detach().clone().requires_grad_() for p in params]
+    optimizer_loaded = ZeroRedundancyOptimizer(params_loaded, optimizer_class=CPUAdamW,
+                                               **{**kwargs, 'lr': 1.0})
+    load_zero_optimizer_state_dict_local(optimizer_loaded, torch.load(tmp_path / 'optim_states.pt'),
+                                         0)
+    assert optimizer_loaded.param_groups[0]['lr'] == kwargs['lr']
+    for p, p_loaded in zip(params, params_loaded):
+        for key in ['param', 'exp_avg', 'exp_avg_sq']:
+            state = optimizer_loaded.optim.state[p_loaded][key]
+            assert state.device.type == 'cpu' and state.dtype == torch.float32
+            assert torch.equal(state, optimizer.optim.state[p][key])
+        grad = torch.randn_like(p)
+        p.grad, p_loaded.grad = grad, grad.clone()
+    optimizer.step()
+    optimizer_loaded.step()
+    for p, p_loaded in zip(params, params_loaded):
+        assert torch.equal(p, p_loaded)
@@ -0,0 +1,52 @@
+import math
+
+import pytest
+import torch
+
+from src.utils.multi_tensor import ema_update_, global_norm, clip_grad_norm_
+
+
+def make_tensors(dtype, seed=0):
+    torch.manual_seed(seed)
+    shapes = [(1,), (300, 257), (7, 3), (100000,), (0,), (2, 3, 4)]
+    return [torch.randn(shape, dtype=dtype) for shape in shapes]
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+def test_ema_update(dtype):
+    params = make_tensors(dtype)
+    shadow = [p.float() + torch.randn_like(p, dtype=torch.float32) for p in params]
+    shadow_ref = [s.clone() for s in shadow]
+    ema_update_(shadow, params, 0.01)
+    for s, s_ref, p in zip(shadow, shadow_ref, params):
+        torch.lerp(s_ref, p.float(), 0.01, out=s_ref)
+        assert torch.allclose(s, s_ref, atol=1e-6)
+
+
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16, torch.bfloat16])
+def test_global_norm(dtype):
+    tensors = make_tensors(dtype)
+    norm, per_tensor_norms, found_inf = global_norm(tensors, per_tensor=True)
+    norms_ref = torch.stack([t.double().norm() for t in tensors])
+    assert norm.dtype == torch.float32
+    assert math.isclose(norm.item(), norms_ref.norm().item(), rel_tol=1e-5)
+    assert torch.allclose(per_tensor_norms.double(), norms_ref, rtol=1e-5)
+    assert not found_inf.item()
+    for bad in [float('inf'), float('nan')]:
+        tensors[3][12345] = bad
+        assert global_norm(tensors)[2].item()
+
+
+@pytest.mark.parametrize('max_norm', [1.0, 1e6])
+@pytest.mark.parametrize('dtype', [torch.float32, torch.bfloat16])
+def test_clip_grad_norm(dtype, max_norm):
+    params = [torch.nn.Parameter(t) for t in make_tensors(dtype)]
+    params_ref = [torch.nn.Parameter(t.clone()) for t in params]
+    for p, p_ref, g in zip(params, params_ref, make_tensors(dtype, seed=1)):
+        p.grad, p_ref.grad = g, g.clone()
+    norm = clip_grad_norm_(params, max_norm)
+    norm_ref = torch.nn.utils.clip_grad_norm_(params_ref, max_norm)
+    assert math.isclose(norm.item(), norm_ref.item(), rel_tol=1e-3)
+    atol = 1e-6 if dtype == torch.float32 else 1e-2
+    for p, p_ref in zip(params, params_ref):
+        assert torch.allclose(p.grad.float(), p_ref.grad.float(), atol=atol)